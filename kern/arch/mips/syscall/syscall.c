@@ -35,8 +35,187 @@
 #include <thread.h>
 #include <current.h>
 #include <syscall.h>
+#include <copyinout.h>
+#include <clock.h>
+#include <sysstats.h>
 
 
+/*
+ * System call handlers.
+ *
+ * Each entry in the dispatch table takes the trapframe and a pointer
+ * to the return value, and returns 0 or an error code, so the small
+ * adapters below just unpack the argument registers for the real
+ * implementation.
+ */
+
+typedef int (*syscall_handler)(struct trapframe *tf, int32_t *retval);
+
+static
+int
+sc_reboot(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_reboot(tf->tf_a0);
+}
+
+static
+int
+sc___time(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys___time((userptr_t)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc___sysstats(struct trapframe *tf, int32_t *retval)
+{
+	return sys___sysstats((userptr_t)tf->tf_a0, (unsigned)tf->tf_a1,
+			      (int)tf->tf_a2, retval);
+}
+
+#ifdef UW
+static
+int
+sc_write(struct trapframe *tf, int32_t *retval)
+{
+	return sys_write((int)tf->tf_a0,
+			 (userptr_t)tf->tf_a1,
+			 (int)tf->tf_a2,
+			 (int *)retval);
+}
+
+static
+int
+sc__exit(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	sys__exit((int)tf->tf_a0);
+	/* sys__exit does not return, execution should not get here */
+	panic("unexpected return from sys__exit");
+	return 0;
+}
+
+static
+int
+sc_getpid(struct trapframe *tf, int32_t *retval)
+{
+	(void)tf;
+	return sys_getpid((pid_t *)retval);
+}
+
+static
+int
+sc_waitpid(struct trapframe *tf, int32_t *retval)
+{
+	return sys_waitpid((pid_t)tf->tf_a0,
+			   (userptr_t)tf->tf_a1,
+			   (int)tf->tf_a2,
+			   (pid_t *)retval);
+}
+
+static
+int
+sc_fork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_fork(tf, (pid_t *)retval);
+}
+
+static
+int
+sc_vfork(struct trapframe *tf, int32_t *retval)
+{
+	return sys_vfork(tf, (pid_t *)retval);
+}
+
+static
+int
+sc_execv(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_execv((const char *)tf->tf_a0, (userptr_t)tf->tf_a1);
+}
+
+static
+int
+sc_sbrk(struct trapframe *tf, int32_t *retval)
+{
+	return sys_sbrk((intptr_t)tf->tf_a0, (vaddr_t *)retval);
+}
+
+static
+int
+sc_mmap(struct trapframe *tf, int32_t *retval)
+{
+	int fd;
+	off_t offset;
+	int result;
+
+	/*
+	 * The fifth and sixth arguments are on the user stack, past
+	 * the space reserved for the four in registers; the 64-bit
+	 * offset is aligned to 8.
+	 */
+	result = copyin((const_userptr_t)(tf->tf_sp + 16), &fd, sizeof(fd));
+	if (result) {
+		return result;
+	}
+	result = copyin((const_userptr_t)(tf->tf_sp + 24), &offset,
+			sizeof(offset));
+	if (result) {
+		return result;
+	}
+	return sys_mmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1,
+			(int)tf->tf_a2, (int)tf->tf_a3, fd, offset,
+			(vaddr_t *)retval);
+}
+
+static
+int
+sc_munmap(struct trapframe *tf, int32_t *retval)
+{
+	(void)retval;
+	return sys_munmap((userptr_t)tf->tf_a0, (size_t)tf->tf_a1);
+}
+#endif // UW
+
+/*
+ * The dispatch table, indexed by call number. Empty slots are calls
+ * we don't implement.
+ */
+static const struct {
+	const char *name;
+	syscall_handler handler;
+} syscalltable[SYSSTAT_NCALLS] = {
+	[SYS_reboot]	= { "reboot",		sc_reboot },
+	[SYS___time]	= { "__time",		sc___time },
+	[SYS___sysstats] = { "__sysstats",	sc___sysstats },
+#ifdef UW
+	[SYS_write]	= { "write",		sc_write },
+	[SYS__exit]	= { "_exit",		sc__exit },
+	[SYS_getpid]	= { "getpid",		sc_getpid },
+	[SYS_waitpid]	= { "waitpid",		sc_waitpid },
+	[SYS_fork]	= { "fork",		sc_fork },
+	[SYS_vfork]	= { "vfork",		sc_vfork },
+	[SYS_execv]	= { "execv",		sc_execv },
+	[SYS_sbrk]	= { "sbrk",		sc_sbrk },
+	[SYS_mmap]	= { "mmap",		sc_mmap },
+	[SYS_munmap]	= { "munmap",		sc_munmap },
+#endif // UW
+
+	/* Add stuff here */
+};
+
+const char *
+syscall_name(unsigned callno)
+{
+	if (callno >= SYSSTAT_NCALLS) {
+		return NULL;
+	}
+	return syscalltable[callno].name;
+}
+
 /*
  * System call dispatcher.
  *
@@ -74,6 +253,9 @@
  * values) further arguments must be fetched from the user-level
  * stack, starting at sp+16 to skip over the slots for the
  * registerized values, with copyin().
+ *
+ * Calls are dispatched through syscalltable above; each one is
+ * counted and timed in the statistics kept by sysstats.c.
  */
 void
 syscall(struct trapframe *tf)
@@ -81,6 +263,9 @@ syscall(struct trapframe *tf)
 	int callno;
 	int32_t retval;
 	int err;
+	syscall_handler handler;
+	time_t s1, s2;
+	uint32_t ns1, ns2;
 
 	KASSERT(curthread != NULL);
 	KASSERT(curthread->t_curspl == 0);
@@ -99,52 +284,28 @@ syscall(struct trapframe *tf)
 
 	retval = 0;
 
-	switch (callno) {
-	    case SYS_reboot:
-		err = sys_reboot(tf->tf_a0);
-		break;
-
-	    case SYS___time:
-		err = sys___time((userptr_t)tf->tf_a0,
-				 (userptr_t)tf->tf_a1);
-		break;
-#ifdef UW
-	case SYS_write:
-	  err = sys_write((int)tf->tf_a0,
-			  (userptr_t)tf->tf_a1,
-			  (int)tf->tf_a2,
-			  (int *)(&retval));
-	  break;
-	case SYS__exit:
-	  sys__exit((int)tf->tf_a0);
-	  /* sys__exit does not return, execution should not get here */
-	  panic("unexpected return from sys__exit");
-	  break;
-	case SYS_getpid:
-	  err = sys_getpid((pid_t *)&retval);
-	  break;
-	case SYS_waitpid:
-	  err = sys_waitpid((pid_t)tf->tf_a0,
-			    (userptr_t)tf->tf_a1,
-			    (int)tf->tf_a2,
-			    (pid_t *)&retval);
-	  break;
-	case SYS_fork:
-	  err = sys_fork(tf, (pid_t *)&retval);
-	  break;
-	case SYS_execv:
-	  err = sys_execv((const char *)tf->tf_a0, (userptr_t)tf->tf_a1);
-	  break;
-#endif // UW
-
-	    /* Add stuff here */
- 
-	default:
-	  kprintf("Unknown syscall %d\n", callno);
-	  err = ENOSYS;
-	  break;
+	handler = NULL;
+	if (callno >= 0 && callno < SYSSTAT_NCALLS) {
+		handler = syscalltable[callno].handler;
 	}
 
+	if (handler == NULL) {
+		kprintf("Unknown syscall %d\n", callno);
+		err = ENOSYS;
+	}
+	else {
+		/*
+		 * Count the call before making it: _exit and a
+		 * successful execv never come back here.
+		 */
+		sysstats_enter(callno);
+		gettime(&s1, &ns1);
+		err = handler(tf, &retval);
+		gettime(&s2, &ns2);
+		getinterval(s1, ns1, s2, ns2, &s2, &ns2);
+		sysstats_leave(callno, err,
+			       (uint64_t)s2 * 1000000000 + ns2);
+	}
 
 	if (err) {
 		/*
@@ -188,6 +349,7 @@ enter_forked_process(void * trap, unsigned long x)
   (void)x;
   struct trapframe * tf = (struct trapframe *)trap;
   struct trapframe childframe = *tf;
+  kfree(tf);  /* heap copy made by sys_fork/sys_vfork */
   childframe.tf_v0 = 0;
   childframe.tf_epc += 4;
   childframe.tf_a3 = 0;
@@ -34,6 +34,9 @@
 #include <spinlock.h>
 #include <proc.h>
 #include <current.h>
+#include <uio.h>
+#include <stat.h>
+#include <vnode.h>
 #include <mips/tlb.h>
 #include <addrspace.h>
 #include <vm.h>
@@ -104,6 +107,232 @@ vm_tlbshootdown(const struct tlbshootdown *ts)
 	panic("dumbvm tried to do tlb shootdown?!\n");
 }
 
+/*
+ * Make sure the heap page table has at least NPAGES slots.
+ */
+static
+int
+as_heap_reserve(struct addrspace *as, unsigned npages)
+{
+	paddr_t *newpages;
+	unsigned newmax;
+
+	if (npages <= as->as_heapmax) {
+		return 0;
+	}
+
+	newmax = as->as_heapmax > 0 ? as->as_heapmax : 16;
+	while (newmax < npages) {
+		newmax *= 2;
+	}
+
+	newpages = kmalloc(newmax * sizeof(paddr_t));
+	if (newpages == NULL) {
+		return ENOMEM;
+	}
+	bzero(newpages, newmax * sizeof(paddr_t));
+	if (as->as_heappages != NULL) {
+		memcpy(newpages, as->as_heappages,
+		       as->as_heapmax * sizeof(paddr_t));
+		kfree(as->as_heappages);
+	}
+	as->as_heappages = newpages;
+	as->as_heapmax = newmax;
+	return 0;
+}
+
+/*
+ * Find the physical page for heap address VADDR, allocating and
+ * zeroing it if this is the first touch. Returns 0 if out of memory.
+ */
+static
+paddr_t
+as_heap_getpage(struct addrspace *as, vaddr_t vaddr)
+{
+	unsigned index;
+	paddr_t paddr;
+
+	index = (vaddr - as->as_heapbase) / PAGE_SIZE;
+	KASSERT(index < as->as_heapmax);
+
+	paddr = as->as_heappages[index];
+	if (paddr == 0) {
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return 0;
+		}
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		as->as_heappages[index] = paddr;
+	}
+	return paddr;
+}
+
+/*
+ * Find the mapping VADDR is in, if any.
+ */
+static
+struct as_mapping *
+as_mapping_find(struct addrspace *as, vaddr_t vaddr)
+{
+	struct as_mapping *am;
+
+	for (am = as->as_mappings; am != NULL; am = am->am_next) {
+		if (vaddr >= am->am_base &&
+		    vaddr < am->am_base + am->am_npages * PAGE_SIZE) {
+			return am;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * The lowest address used by a mapping (or the stack, if there are
+ * none). The heap can't grow past it.
+ */
+static
+vaddr_t
+as_mapping_floor(struct addrspace *as)
+{
+	struct as_mapping *am;
+	vaddr_t floor;
+
+	floor = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	for (am = as->as_mappings; am != NULL; am = am->am_next) {
+		if (am->am_base < floor) {
+			floor = am->am_base;
+		}
+	}
+	return floor;
+}
+
+/*
+ * Find the physical page for VADDR in mapping AM, allocating it and
+ * reading it in from the file if this is the first touch. Sets
+ * *WRITABLE if the TLB entry should allow writes: a page of a shared
+ * file mapping is left read-only until the first write to it, so we
+ * can tell which pages have to be written back.
+ *
+ * Reading the file takes its vnode lock, so this must not happen
+ * while the faulting thread holds it. Filesystems see to that by
+ * calling uio_prefault on user buffers before locking.
+ */
+static
+int
+as_mapping_getpage(struct as_mapping *am, vaddr_t vaddr, int faulttype,
+		   paddr_t *ret, bool *writable)
+{
+	struct iovec iov;
+	struct uio ku;
+	unsigned index;
+	paddr_t paddr;
+	int result;
+
+	if (faulttype != VM_FAULT_READ && !am->am_writable) {
+		return EFAULT;
+	}
+
+	index = (vaddr - am->am_base) / PAGE_SIZE;
+	paddr = am->am_pages[index] & PAGE_FRAME;
+	if (paddr == 0) {
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		bzero((void *)PADDR_TO_KVADDR(paddr), PAGE_SIZE);
+		if (am->am_vnode != NULL) {
+			/* Whatever is past the end of the file stays zero */
+			uio_kinit(&iov, &ku, (void *)PADDR_TO_KVADDR(paddr),
+				  PAGE_SIZE,
+				  am->am_offset + (off_t)index * PAGE_SIZE,
+				  UIO_READ);
+			result = VOP_READ(am->am_vnode, &ku);
+			if (result) {
+				/* The page is lost; we can't free it */
+				return result;
+			}
+		}
+		am->am_pages[index] = paddr;
+	}
+
+	*writable = am->am_writable;
+	if (am->am_shared && am->am_vnode != NULL) {
+		if (faulttype != VM_FAULT_READ) {
+			am->am_pages[index] |= AM_PAGEDIRTY;
+		}
+		else if ((am->am_pages[index] & AM_PAGEDIRTY) == 0) {
+			*writable = false;
+		}
+	}
+	*ret = paddr;
+	return 0;
+}
+
+/*
+ * Write the changed pages of AM, if it's a shared file mapping, back
+ * to the file. The file doesn't grow: any part of a page past its end
+ * is dropped.
+ */
+static
+int
+as_mapping_writeback(struct as_mapping *am)
+{
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	unsigned i;
+	off_t pos;
+	size_t len;
+	int result, ret = 0;
+
+	if (!am->am_shared || am->am_vnode == NULL) {
+		return 0;
+	}
+
+	result = VOP_STAT(am->am_vnode, &st);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<am->am_npages; i++) {
+		pos = am->am_offset + (off_t)i * PAGE_SIZE;
+		if ((am->am_pages[i] & AM_PAGEDIRTY) == 0 ||
+		    pos >= st.st_size) {
+			continue;
+		}
+		len = PAGE_SIZE;
+		if (st.st_size - pos < PAGE_SIZE) {
+			len = st.st_size - pos;
+		}
+		uio_kinit(&iov, &ku,
+			  (void *)PADDR_TO_KVADDR(am->am_pages[i] & PAGE_FRAME),
+			  len, pos, UIO_WRITE);
+		result = VOP_WRITE(am->am_vnode, &ku);
+		if (result) {
+			ret = result;
+		}
+	}
+	return ret;
+}
+
+/*
+ * Write back and throw away mapping AM. (Its pages stay allocated,
+ * as dumbvm can't free anything.)
+ */
+static
+int
+as_mapping_destroy(struct as_mapping *am)
+{
+	int result;
+
+	result = as_mapping_writeback(am);
+	if (am->am_vnode != NULL) {
+		VOP_DECREF(am->am_vnode);
+	}
+	kfree(am->am_pages);
+	kfree(am);
+	return result;
+}
+
 int
 vm_fault(int faulttype, vaddr_t faultaddress)
 {
@@ -112,7 +341,9 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	int i;
 	uint32_t ehi, elo;
 	struct addrspace *as;
-	int spl;
+	struct as_mapping *am;
+	bool writable;
+	int spl, result;
 
 	faultaddress &= PAGE_FRAME;
 
@@ -120,8 +351,6 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 
 	switch (faulttype) {
 	    case VM_FAULT_READONLY:
-		/* We always create pages read-write, so we can't get this */
-		panic("dumbvm: got VM_FAULT_READONLY\n");
 	    case VM_FAULT_READ:
 	    case VM_FAULT_WRITE:
 		break;
@@ -168,7 +397,21 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	stackbase = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
 	stacktop = USERSTACK;
 
-	if (faultaddress >= vbase1 && faultaddress < vtop1) {
+	/* Only mappings have pages that aren't read-write */
+	writable = true;
+	am = as_mapping_find(as, faultaddress);
+	if (faulttype == VM_FAULT_READONLY && am == NULL) {
+		panic("dumbvm: got VM_FAULT_READONLY\n");
+	}
+
+	if (am != NULL) {
+		result = as_mapping_getpage(am, faultaddress, faulttype,
+					    &paddr, &writable);
+		if (result) {
+			return result;
+		}
+	}
+	else if (faultaddress >= vbase1 && faultaddress < vtop1) {
 		paddr = (faultaddress - vbase1) + as->as_pbase1;
 	}
 	else if (faultaddress >= vbase2 && faultaddress < vtop2) {
@@ -177,6 +420,13 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	else if (faultaddress >= stackbase && faultaddress < stacktop) {
 		paddr = (faultaddress - stackbase) + as->as_stackpbase;
 	}
+	else if (faultaddress >= as->as_heapbase &&
+		 faultaddress < ROUNDUP(as->as_heaptop, PAGE_SIZE)) {
+		paddr = as_heap_getpage(as, faultaddress);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+	}
 	else {
 		return EFAULT;
 	}
@@ -187,22 +437,39 @@ vm_fault(int faulttype, vaddr_t faultaddress)
 	/* Disable interrupts on this CPU while frobbing the TLB. */
 	spl = splhigh();
 
+	ehi = faultaddress;
+	elo = paddr | (writable ? TLBLO_DIRTY : 0) | TLBLO_VALID;
+	DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
+
+	/* A write to a read-only page: update the entry it already has */
+	i = tlb_probe(ehi, 0);
+	if (i >= 0) {
+		tlb_write(ehi, elo, i);
+		splx(spl);
+		return 0;
+	}
+
 	for (i=0; i<NUM_TLB; i++) {
-		tlb_read(&ehi, &elo, i);
-		if (elo & TLBLO_VALID) {
+		uint32_t oehi, oelo;
+
+		tlb_read(&oehi, &oelo, i);
+		if (oelo & TLBLO_VALID) {
 			continue;
 		}
-		ehi = faultaddress;
-		elo = paddr | TLBLO_DIRTY | TLBLO_VALID;
-		DEBUG(DB_VM, "dumbvm: 0x%x -> 0x%x\n", faultaddress, paddr);
 		tlb_write(ehi, elo, i);
 		splx(spl);
 		return 0;
 	}
 
-	kprintf("dumbvm: Ran out of TLB entries - cannot handle page fault\n");
+	/*
+	 * Every page can be found again from the address space, so
+	 * when the TLB is full, just replace an entry at random; that
+	 * lets a process touch more pages than the TLB holds (a big
+	 * mapped file, say).
+	 */
+	tlb_random(ehi, elo);
 	splx(spl);
-	return EFAULT;
+	return 0;
 }
 
 struct addrspace *
@@ -220,6 +487,11 @@ as_create(void)
 	as->as_pbase2 = 0;
 	as->as_npages2 = 0;
 	as->as_stackpbase = 0;
+	as->as_heapbase = 0;
+	as->as_heaptop = 0;
+	as->as_heappages = NULL;
+	as->as_heapmax = 0;
+	as->as_mappings = NULL;
 
 	return as;
 }
@@ -227,6 +499,17 @@ as_create(void)
 void
 as_destroy(struct addrspace *as)
 {
+	struct as_mapping *am;
+
+	while (as->as_mappings != NULL) {
+		am = as->as_mappings;
+		as->as_mappings = am->am_next;
+		/* Nobody to report a failed write-back to */
+		(void)as_mapping_destroy(am);
+	}
+	if (as->as_heappages != NULL) {
+		kfree(as->as_heappages);
+	}
 	kfree(as);
 }
 
@@ -338,7 +621,13 @@ as_prepare_load(struct addrspace *as)
 int
 as_complete_load(struct addrspace *as)
 {
-	(void)as;
+	vaddr_t top1, top2;
+
+	/* The heap starts right after whichever region is higher. */
+	top1 = as->as_vbase1 + as->as_npages1 * PAGE_SIZE;
+	top2 = as->as_vbase2 + as->as_npages2 * PAGE_SIZE;
+	as->as_heapbase = top1 > top2 ? top1 : top2;
+	as->as_heaptop = as->as_heapbase;
 	return 0;
 }
 
@@ -351,6 +640,243 @@ as_define_stack(struct addrspace *as, vaddr_t *stackptr)
 	return 0;
 }
 
+/*
+ * Move the break. Growing only reserves slots in the heap page table;
+ * the pages themselves come from vm_fault on first touch.
+ *
+ * dumbvm can't give memory back, so pages cut off by shrinking stay
+ * in the table and are used again if the heap grows back over them.
+ */
+int
+as_sbrk(struct addrspace *as, intptr_t amount, vaddr_t *oldtop)
+{
+	vaddr_t newtop, limit;
+	int result;
+
+	KASSERT(as->as_heapbase != 0);
+	limit = as_mapping_floor(as);
+
+	if (amount < 0) {
+		if ((vaddr_t)0 - (vaddr_t)amount >
+		    as->as_heaptop - as->as_heapbase) {
+			return EINVAL;
+		}
+	}
+	else if ((vaddr_t)amount > limit - as->as_heaptop) {
+		return ENOMEM;
+	}
+	newtop = as->as_heaptop + amount;
+
+	result = as_heap_reserve(as,
+			DIVROUNDUP(newtop - as->as_heapbase, PAGE_SIZE));
+	if (result) {
+		return result;
+	}
+
+	*oldtop = as->as_heaptop;
+	as->as_heaptop = newtop;
+
+	if (ROUNDUP(newtop, PAGE_SIZE) < ROUNDUP(*oldtop, PAGE_SIZE) &&
+	    as == curproc_getas()) {
+		/* Drop any TLB entries for the pages we just cut off. */
+		as_activate();
+	}
+	return 0;
+}
+
+/*
+ * Map LEN bytes of VN (or zeros) in the first gap big enough for it,
+ * searching down from the stack. Nothing is read until it's touched.
+ */
+int
+as_mmap(struct addrspace *as, size_t len, bool writable, bool shared,
+	struct vnode *vn, off_t offset, vaddr_t *ret)
+{
+	struct as_mapping *am, **amp;
+	vaddr_t top, bottom;
+	unsigned npages;
+	size_t size;
+
+	KASSERT(as->as_heapbase != 0);
+	KASSERT(len > 0);
+	KASSERT(offset % PAGE_SIZE == 0);
+
+	if (len > USERSTACK) {
+		return ENOMEM;
+	}
+	npages = DIVROUNDUP(len, PAGE_SIZE);
+	size = npages * PAGE_SIZE;
+
+	/* The new one goes in front of *AMP, ending at TOP */
+	top = USERSTACK - DUMBVM_STACKPAGES * PAGE_SIZE;
+	for (amp = &as->as_mappings; ; amp = &(*amp)->am_next) {
+		if (*amp != NULL) {
+			bottom = (*amp)->am_base + (*amp)->am_npages * PAGE_SIZE;
+		}
+		else {
+			bottom = ROUNDUP(as->as_heaptop, PAGE_SIZE);
+		}
+		if (top - bottom >= size) {
+			break;
+		}
+		if (*amp == NULL) {
+			return ENOMEM;
+		}
+		top = (*amp)->am_base;
+	}
+
+	am = kmalloc(sizeof(*am));
+	if (am == NULL) {
+		return ENOMEM;
+	}
+	am->am_pages = kmalloc(npages * sizeof(paddr_t));
+	if (am->am_pages == NULL) {
+		kfree(am);
+		return ENOMEM;
+	}
+	bzero(am->am_pages, npages * sizeof(paddr_t));
+	am->am_base = top - size;
+	am->am_npages = npages;
+	am->am_writable = writable;
+	am->am_shared = shared;
+	am->am_vnode = vn;
+	am->am_offset = offset;
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+
+	am->am_next = *amp;
+	*amp = am;
+
+	*ret = am->am_base;
+	return 0;
+}
+
+/*
+ * Remove a whole mapping; dumbvm doesn't split them.
+ */
+int
+as_munmap(struct addrspace *as, vaddr_t vaddr, size_t len)
+{
+	struct as_mapping *am, **amp;
+
+	for (amp = &as->as_mappings; *amp != NULL; amp = &(*amp)->am_next) {
+		if ((*amp)->am_base == vaddr) {
+			break;
+		}
+	}
+	am = *amp;
+	if (am == NULL || len == 0 ||
+	    len > am->am_npages * PAGE_SIZE ||
+	    DIVROUNDUP(len, PAGE_SIZE) != am->am_npages) {
+		return EINVAL;
+	}
+	*amp = am->am_next;
+
+	if (as == curproc_getas()) {
+		/* Drop any TLB entries for its pages. */
+		as_activate();
+	}
+
+	return as_mapping_destroy(am);
+}
+
+/*
+ * Copy the touched pages of OLD's heap into NEW.
+ */
+static
+int
+as_copy_heap(struct addrspace *old, struct addrspace *new)
+{
+	unsigned i, npages;
+	paddr_t paddr;
+	int result;
+
+	new->as_heapbase = old->as_heapbase;
+	new->as_heaptop = old->as_heaptop;
+
+	npages = DIVROUNDUP(old->as_heaptop - old->as_heapbase, PAGE_SIZE);
+	result = as_heap_reserve(new, npages);
+	if (result) {
+		return result;
+	}
+
+	for (i=0; i<npages; i++) {
+		if (old->as_heappages[i] == 0) {
+			continue;
+		}
+		paddr = getppages(1);
+		if (paddr == 0) {
+			return ENOMEM;
+		}
+		memmove((void *)PADDR_TO_KVADDR(paddr),
+			(const void *)PADDR_TO_KVADDR(old->as_heappages[i]),
+			PAGE_SIZE);
+		new->as_heappages[i] = paddr;
+	}
+	return 0;
+}
+
+/*
+ * Copy OLD's mappings into NEW. Without shared pages, a MAP_SHARED
+ * mapping can't really be shared with the child: each process gets
+ * its own copy of the pages touched so far, and writes its own
+ * changes back.
+ */
+static
+int
+as_copy_mappings(struct addrspace *old, struct addrspace *new)
+{
+	struct as_mapping *oam, *am, **tail;
+	unsigned i;
+	paddr_t paddr;
+
+	tail = &new->as_mappings;
+	for (oam = old->as_mappings; oam != NULL; oam = oam->am_next) {
+		am = kmalloc(sizeof(*am));
+		if (am == NULL) {
+			return ENOMEM;
+		}
+		am->am_pages = kmalloc(oam->am_npages * sizeof(paddr_t));
+		if (am->am_pages == NULL) {
+			kfree(am);
+			return ENOMEM;
+		}
+		bzero(am->am_pages, oam->am_npages * sizeof(paddr_t));
+		am->am_base = oam->am_base;
+		am->am_npages = oam->am_npages;
+		am->am_writable = oam->am_writable;
+		am->am_shared = oam->am_shared;
+		am->am_vnode = oam->am_vnode;
+		am->am_offset = oam->am_offset;
+		if (am->am_vnode != NULL) {
+			VOP_INCREF(am->am_vnode);
+		}
+
+		/* Link it in now, so as_destroy cleans up if we fail */
+		am->am_next = NULL;
+		*tail = am;
+		tail = &am->am_next;
+
+		for (i=0; i<oam->am_npages; i++) {
+			if (oam->am_pages[i] == 0) {
+				continue;
+			}
+			paddr = getppages(1);
+			if (paddr == 0) {
+				return ENOMEM;
+			}
+			memmove((void *)PADDR_TO_KVADDR(paddr),
+				(const void *)PADDR_TO_KVADDR(oam->am_pages[i]
+							      & PAGE_FRAME),
+				PAGE_SIZE);
+			am->am_pages[i] = paddr |
+				(oam->am_pages[i] & AM_PAGEDIRTY);
+		}
+	}
+	return 0;
+}
+
 int
 as_copy(struct addrspace *old, struct addrspace **ret)
 {
@@ -387,6 +913,16 @@ as_copy(struct addrspace *old, struct addrspace **ret)
 	memmove((void *)PADDR_TO_KVADDR(new->as_stackpbase),
 		(const void *)PADDR_TO_KVADDR(old->as_stackpbase),
 		DUMBVM_STACKPAGES*PAGE_SIZE);
+
+	if (as_copy_heap(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
+
+	if (as_copy_mappings(old, new)) {
+		as_destroy(new);
+		return ENOMEM;
+	}
 	
 	*ret = new;
 	return 0;
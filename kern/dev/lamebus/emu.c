@@ -479,11 +479,18 @@ emufs_reclaim(struct vnode *v)
 	vfs_biglock_acquire();
 	lock_acquire(ef->ef_emu->e_lock);
 
-	if (ev->ev_v.vn_refcount != 1) {
+	/* Someone may have picked it up again since VOP_DECREF looked */
+	spinlock_acquire(&v->vn_countlock);
+	if (v->vn_refcount != 1) {
+		/* consume the reference VOP_DECREF gave us */
+		KASSERT(v->vn_refcount>1);
+		v->vn_refcount--;
+		spinlock_release(&v->vn_countlock);
 		lock_release(ef->ef_emu->e_lock);
 		vfs_biglock_release();
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
 
 	/* emu_close retries on I/O error */
 	result = emu_close(ev->ev_emu, ev->ev_handle);
@@ -836,14 +843,15 @@ emufs_namefile(struct vnode *v, struct uio *uio)
 }
 
 /*
- * VOP_MMAP
+ * VOP_MMAP - files can be mapped; the VM system reads and writes the
+ * pages with emufs_read and emufs_write.
  */
 static
 int
 emufs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 //////////////////////////////
@@ -1295,6 +1303,9 @@ emufs_addtovfs(struct emu_softc *sc, const char *devname)
 	ef->ef_fs.fs_getvolname = emufs_getvolname;
 	ef->ef_fs.fs_getroot = emufs_getroot;
 	ef->ef_fs.fs_unmount = emufs_unmount;
+	ef->ef_fs.fs_readblock = NULL;
+	ef->ef_fs.fs_writeblock = NULL;
+	ef->ef_fs.fs_flushold = NULL;
 	ef->ef_fs.fs_data = ef;
 
 	ef->ef_emu = sc;
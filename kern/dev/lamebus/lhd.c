@@ -35,7 +35,11 @@
 #include <kern/errno.h>
 #include <lib.h>
 #include <uio.h>
+#include <spinlock.h>
 #include <synch.h>
+#include <wchan.h>
+#include <thread.h>
+#include <current.h>
 #include <platform/bus.h>
 #include <vfs.h>
 #include <lamebus/lhd.h>
@@ -95,21 +99,141 @@ int lhd_code_to_errno(struct lhd_softc *lh, int code)
 }
 
 /*
- * Record that an I/O has completed: save the result and poke the
- * completion semaphore.
+ * Start the hardware on the next sector of the current request.
+ * Called with lh_lock held.
  */
 static
 void
-lhd_iodone(struct lhd_softc *lh, int err)
+lhd_startsect(struct lhd_softc *lh)
 {
-	lh->lh_result = err;
-	V(lh->lh_done);
+	uint32_t statval = LHD_WORKING;
+
+	/* If writing, load the sector into the on-card buffer. */
+	if (lh->lh_cur->lr_write) {
+		memcpy(lh->lh_buf, lh->lh_xferptr, LHD_SECTSIZE);
+		statval |= LHD_ISWRITE;
+	}
+
+	/* Tell it what sector we want... */
+	lhd_wreg(lh, LHD_REG_SECT, lh->lh_xfersect);
+
+	/* and start the operation. */
+	lhd_wreg(lh, LHD_REG_STAT, statval);
+}
+
+/*
+ * Make REQ the current request and start its first sector.
+ */
+static
+void
+lhd_startreq(struct lhd_softc *lh, struct lhd_request *req)
+{
+	lh->lh_cur = req;
+	lh->lh_xferptr = req->lr_data;
+	lh->lh_xfersect = req->lr_sector;
+	lh->lh_xferleft = req->lr_nsect;
+	lhd_startsect(lh);
+}
+
+/*
+ * If the device is idle, pick the next run off the queue and start
+ * it. This is C-LOOK: take the lowest-numbered run at or past the
+ * head position, or if there is none, wrap around to the lowest one.
+ */
+static
+void
+lhd_dispatch(struct lhd_softc *lh)
+{
+	struct lhd_request **pp, **choice;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	if (lh->lh_active != NULL || lh->lh_queue == NULL) {
+		return;
+	}
+
+	choice = &lh->lh_queue;
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		if ((*pp)->lr_sector >= lh->lh_headpos) {
+			choice = pp;
+			break;
+		}
+	}
+
+	lh->lh_active = *choice;
+	*choice = lh->lh_active->lr_next;
+	lh->lh_active->lr_next = NULL;
+
+	lhd_startreq(lh, lh->lh_active);
+}
+
+/*
+ * Record that a request has completed: save the result, run the
+ * completion callback if any, and wake up anyone in lhd_wait.
+ */
+static
+void
+lhd_iodone(struct lhd_softc *lh, struct lhd_request *req, int err)
+{
+	req->lr_result = err;
+	req->lr_done = true;
+	if (req->lr_callback != NULL) {
+		req->lr_callback(req, req->lr_cbarg);
+	}
+	wchan_wakeall(lh->lh_wchan);
+}
+
+/*
+ * A sector finished with result ERR. Move its data and start the next
+ * sector: of the same request, of the next request in the run, or of
+ * the next run on the queue. The requesting thread is only woken
+ * when its whole request is done.
+ */
+static
+void
+lhd_sectdone(struct lhd_softc *lh, int err)
+{
+	struct lhd_request *req = lh->lh_cur;
+	struct lhd_request *next;
+
+	if (err == 0) {
+		/* If reading, fetch the sector out of the on-card buffer. */
+		if (!req->lr_write) {
+			memcpy(lh->lh_xferptr, lh->lh_buf, LHD_SECTSIZE);
+		}
+		lh->lh_xferptr += LHD_SECTSIZE;
+		lh->lh_xfersect++;
+		lh->lh_xferleft--;
+		lh->lh_headpos = lh->lh_xfersect;
+
+		if (lh->lh_xferleft > 0) {
+			lhd_startsect(lh);
+			return;
+		}
+	}
+
+	/*
+	 * The request is finished, one way or the other. An error
+	 * only fails this request; the rest of the run goes ahead.
+	 * Get the next one first, as the callback may free REQ.
+	 */
+	next = req->lr_chain;
+	lhd_iodone(lh, req, err);
+
+	if (next != NULL) {
+		lhd_startreq(lh, next);
+		return;
+	}
+
+	lh->lh_active = NULL;
+	lh->lh_cur = NULL;
+	lhd_dispatch(lh);
 }
 
 /*
  * Interrupt handler for lhd.
  * Read the status register; if an operation finished, clear the status
- * register and report completion.
+ * register and move on to the next sector.
  */
 void
 lhd_irq(void *vlh)
@@ -127,7 +251,15 @@ lhd_irq(void *vlh)
 	    case LHD_INVSECT:
 	    case LHD_MEDIA:
 		lhd_wreg(lh, LHD_REG_STAT, 0);
-		lhd_iodone(lh, lhd_code_to_errno(lh, val));
+		spinlock_acquire(&lh->lh_lock);
+		if (lh->lh_cur == NULL) {
+			kprintf("lhd%d: Stray completion interrupt\n",
+				lh->lh_unit);
+		}
+		else {
+			lhd_sectdone(lh, lhd_code_to_errno(lh, val));
+		}
+		spinlock_release(&lh->lh_lock);
 		break;
 	}
 }
@@ -193,8 +325,190 @@ lhd_reset(struct lhd_softc *lh)
 }
 #endif
 
+/*
+ * Can the run headed by REQ go on the end of the run headed by RUN?
+ * (A single request is a run of one.)
+ */
+static
+bool
+lhd_canappend(struct lhd_request *run, struct lhd_request *req)
+{
+	return run->lr_write == req->lr_write &&
+		run->lr_runend == req->lr_sector &&
+		req->lr_runend - run->lr_sector <= LHD_MAXMERGE;
+}
+
+/*
+ * Put the run headed by REQ on the end of the run headed by RUN.
+ */
+static
+void
+lhd_append(struct lhd_request *run, struct lhd_request *req)
+{
+	run->lr_runtail->lr_chain = req;
+	run->lr_runtail = req->lr_runtail;
+	run->lr_runend = req->lr_runend;
+}
+
+/*
+ * Add REQ to the queue, which is kept sorted by starting sector.
+ * Requests for adjacent sectors in the same direction are merged
+ * into one run, which is then transferred without going back to the
+ * scheduler in between.
+ */
+static
+void
+lhd_enqueue(struct lhd_softc *lh, struct lhd_request *req)
+{
+	struct lhd_request **pp, *run;
+
+	KASSERT(spinlock_do_i_hold(&lh->lh_lock));
+
+	req->lr_next = NULL;
+	req->lr_chain = NULL;
+	req->lr_runtail = req;
+	req->lr_runend = req->lr_sector + req->lr_nsect;
+
+	/* Continuing the run in progress is cheapest of all. */
+	if (lh->lh_active != NULL && lhd_canappend(lh->lh_active, req)) {
+		lhd_append(lh->lh_active, req);
+		return;
+	}
+
+	for (pp = &lh->lh_queue; *pp != NULL; pp = &(*pp)->lr_next) {
+		run = *pp;
+		if (lhd_canappend(run, req)) {
+			lhd_append(run, req);
+			/* It may have closed the gap to the next run. */
+			if (run->lr_next != NULL &&
+			    lhd_canappend(run, run->lr_next)) {
+				struct lhd_request *follow = run->lr_next;
+				run->lr_next = follow->lr_next;
+				lhd_append(run, follow);
+			}
+			return;
+		}
+		if (lhd_canappend(req, run)) {
+			req->lr_next = run->lr_next;
+			lhd_append(req, run);
+			*pp = req;
+			return;
+		}
+		if (run->lr_sector > req->lr_sector) {
+			break;
+		}
+	}
+
+	req->lr_next = *pp;
+	*pp = req;
+}
+
+/*
+ * Queue a request. REQ's lr_data, lr_sector, lr_nsect, lr_write,
+ * lr_callback, and lr_cbarg must be set; the rest is filled in here.
+ * REQ must stay valid until it completes.
+ *
+ * Requests are not ordered with respect to each other: a read queued
+ * after a write to the same sector may be done first. Callers that
+ * care (the buffer cache does not, as it never has two requests for
+ * the same block outstanding) must wait in between.
+ */
+int
+lhd_submit(struct lhd_softc *lh, struct lhd_request *req)
+{
+	if (req->lr_nsect == 0 ||
+	    req->lr_sector + req->lr_nsect > lh->lh_dev.d_blocks ||
+	    req->lr_sector + req->lr_nsect < req->lr_sector) {
+		return EINVAL;
+	}
+
+	req->lr_result = 0;
+	req->lr_done = false;
+
+	spinlock_acquire(&lh->lh_lock);
+	lhd_enqueue(lh, req);
+	lhd_dispatch(lh);
+	spinlock_release(&lh->lh_lock);
+
+	return 0;
+}
+
+/*
+ * Wait for REQ to complete and return its result.
+ */
+int
+lhd_wait(struct lhd_softc *lh, struct lhd_request *req)
+{
+	int result;
+
+	/* May not block in an interrupt handler. */
+	KASSERT(curthread->t_in_interrupt == false);
+
+	spinlock_acquire(&lh->lh_lock);
+	while (!req->lr_done) {
+		/* Bridge to the wchan lock, as P() does. */
+		wchan_lock(lh->lh_wchan);
+		spinlock_release(&lh->lh_lock);
+		wchan_sleep(lh->lh_wchan);
+		spinlock_acquire(&lh->lh_lock);
+	}
+	result = req->lr_result;
+	spinlock_release(&lh->lh_lock);
+
+	return result;
+}
+
+/*
+ * Transfer NSECT sectors starting at SECTOR to or from the kernel
+ * buffer PTR, and wait for it to finish.
+ */
+static
+int
+lhd_transfer(struct lhd_softc *lh, char *ptr, uint32_t sector,
+	     uint32_t nsect, bool iswrite)
+{
+	struct lhd_request req;
+	int result;
+
+	req.lr_data = ptr;
+	req.lr_sector = sector;
+	req.lr_nsect = nsect;
+	req.lr_write = iswrite;
+	req.lr_callback = NULL;
+	req.lr_cbarg = NULL;
+
+	result = lhd_submit(lh, &req);
+	if (result) {
+		return result;
+	}
+	return lhd_wait(lh, &req);
+}
+
+/*
+ * Consume LEN bytes of a kernel-space uio whose first iovec the
+ * transfer used directly.
+ */
+static
+void
+lhd_uioskip(struct uio *uio, size_t len)
+{
+	struct iovec *iov = uio->uio_iov;
+
+	KASSERT(iov->iov_len >= len);
+	iov->iov_kbase = (char *)iov->iov_kbase + len;
+	iov->iov_len -= len;
+	uio->uio_resid -= len;
+	uio->uio_offset += len;
+}
+
 /*
  * I/O function (for both reads and writes)
+ *
+ * Each piece of the uio becomes one request. Kernel buffers are
+ * transferred to or from directly; user buffers go through the disk's
+ * bounce buffer, up to LHD_MAXXFER bytes at a time, since user memory
+ * can't be touched from the interrupt handler. Only one thread at a
+ * time can be bouncing; the others wait on lh_bouncelock.
  */
 static
 int
@@ -206,8 +520,9 @@ lhd_io(struct device *d, struct uio *uio)
 	uint32_t sectoff = uio->uio_offset % LHD_SECTSIZE;
 	uint32_t len = uio->uio_resid / LHD_SECTSIZE;
 	uint32_t lenoff = uio->uio_resid % LHD_SECTSIZE;
-	uint32_t i;
-	uint32_t statval = LHD_WORKING;
+	bool iswrite = (uio->uio_rw == UIO_WRITE);
+	bool bouncing = false;
+	size_t amount;
 	int result;
 
 	/* Don't allow I/O that isn't sector-aligned. */
@@ -220,59 +535,68 @@ lhd_io(struct device *d, struct uio *uio)
 		return EINVAL;
 	}
 
-	/* Set up the value to write into the status register. */
-	if (uio->uio_rw==UIO_WRITE) {
-		statval |= LHD_ISWRITE;
-	}
-
-	/* Loop over all the sectors we were asked to do. */
-	for (i=0; i<len; i++) {
-
-		/* Wait until nobody else is using the device. */
-		P(lh->lh_clear);
-
-		/*
-		 * Are we writing? If so, transfer the data to the
-		 * on-card buffer.
-		 */
-		if (uio->uio_rw == UIO_WRITE) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
-			if (result) {
-				V(lh->lh_clear);
-				return result;
+	result = 0;
+	while (uio->uio_resid > 0) {
+		amount = 0;
+		if (uio->uio_segflg == UIO_SYSSPACE) {
+			/* Skip empty iovecs, as uiomove would. */
+			while (uio->uio_iov->iov_len == 0) {
+				KASSERT(uio->uio_iovcnt > 1);
+				uio->uio_iov++;
+				uio->uio_iovcnt--;
+			}
+			amount = uio->uio_iov->iov_len;
+			if (amount > uio->uio_resid) {
+				amount = uio->uio_resid;
 			}
+			amount -= amount % LHD_SECTSIZE;
 		}
 
-		/* Tell it what sector we want... */
-		lhd_wreg(lh, LHD_REG_SECT, sector+i);
-
-		/* and start the operation. */
-		lhd_wreg(lh, LHD_REG_STAT, statval);
-
-		/* Now wait until the interrupt handler tells us we're done. */
-		P(lh->lh_done);
-
-		/* Get the result value saved by the interrupt handler. */
-		result = lh->lh_result;
-
-		/*
-		 * Are we reading? If so, and if we succeeded,
-		 * transfer the data out of the on-card buffer.
-		 */
-		if (result==0 && uio->uio_rw==UIO_READ) {
-			result = uiomove(lh->lh_buf, LHD_SECTSIZE, uio);
+		if (amount > 0) {
+			/* Straight to or from the caller's buffer. */
+			result = lhd_transfer(lh, uio->uio_iov->iov_kbase,
+					      sector, amount / LHD_SECTSIZE,
+					      iswrite);
+			if (result) {
+				break;
+			}
+			lhd_uioskip(uio, amount);
 		}
-
-		/* Tell another thread it's cleared to go ahead. */
-		V(lh->lh_clear);
-
-		/* If we failed, return the error. */
-		if (result) {
-			return result;
+		else {
+			/* Through the bounce buffer. */
+			amount = uio->uio_resid;
+			if (amount > LHD_MAXXFER) {
+				amount = LHD_MAXXFER;
+			}
+			if (!bouncing) {
+				lock_acquire(lh->lh_bouncelock);
+				bouncing = true;
+			}
+			if (iswrite) {
+				result = uiomove(lh->lh_bounce, amount, uio);
+				if (result) {
+					break;
+				}
+			}
+			result = lhd_transfer(lh, lh->lh_bounce, sector,
+					      amount / LHD_SECTSIZE, iswrite);
+			if (result) {
+				break;
+			}
+			if (!iswrite) {
+				result = uiomove(lh->lh_bounce, amount, uio);
+				if (result) {
+					break;
+				}
+			}
 		}
+		sector += amount / LHD_SECTSIZE;
 	}
 
-	return 0;
+	if (bouncing) {
+		lock_release(lh->lh_bouncelock);
+	}
+	return result;
 }
 
 /*
@@ -289,17 +613,32 @@ config_lhd(struct lhd_softc *lh, int lhdno)
 	/* Get a pointer to the on-chip buffer. */
 	lh->lh_buf = bus_map_area(lh->lh_busdata, lh->lh_buspos, LHD_BUFFER);
 
-	/* Create the semaphores. */
-	lh->lh_clear = sem_create("lhd-clear", 1);
-	if (lh->lh_clear == NULL) {
+	/* Set up the request queue. */
+	spinlock_init(&lh->lh_lock);
+	lh->lh_wchan = wchan_create("lhd");
+	if (lh->lh_wchan == NULL) {
+		spinlock_cleanup(&lh->lh_lock);
+		return ENOMEM;
+	}
+
+	/* Get a bounce buffer for transfers to and from user memory. */
+	lh->lh_bounce = kmalloc(LHD_MAXXFER);
+	if (lh->lh_bounce == NULL) {
+		wchan_destroy(lh->lh_wchan);
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
-	lh->lh_done = sem_create("lhd-done", 0);
-	if (lh->lh_done == NULL) {
-		sem_destroy(lh->lh_clear);
-		lh->lh_clear = NULL;
+	lh->lh_bouncelock = lock_create("lhd bounce");
+	if (lh->lh_bouncelock == NULL) {
+		kfree(lh->lh_bounce);
+		wchan_destroy(lh->lh_wchan);
+		spinlock_cleanup(&lh->lh_lock);
 		return ENOMEM;
 	}
+	lh->lh_queue = NULL;
+	lh->lh_active = NULL;
+	lh->lh_cur = NULL;
+	lh->lh_headpos = 0;
 
 	/* Set up the VFS device structure. */
 	lh->lh_dev.d_open = lhd_open;
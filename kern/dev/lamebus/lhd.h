@@ -30,6 +30,7 @@
 #ifndef _LAMEBUS_LHD_H_
 #define _LAMEBUS_LHD_H_
 
+#include <spinlock.h>
 #include <device.h>
 
 /*
@@ -37,6 +38,43 @@
  */
 #define LHD_SECTSIZE  512
 
+/*
+ * Largest transfer staged through a bounce buffer at once. Transfers
+ * to and from kernel memory are not limited.
+ */
+#define LHD_MAXXFER   65536
+
+/*
+ * Largest run of adjacent requests merged together, in sectors.
+ * Bounds how long other requests wait behind a sequential stream.
+ */
+#define LHD_MAXMERGE  256
+
+/*
+ * A disk request, for lhd_submit. The caller fills in the first
+ * group of fields; when the request completes, lr_result and lr_done
+ * are set and lr_callback, if not NULL, is called. The callback runs
+ * in the interrupt handler with the driver's spinlock held, so it
+ * must not sleep or submit more requests.
+ */
+struct lhd_request {
+	char *lr_data;			/* Kernel buffer */
+	uint32_t lr_sector;		/* First sector */
+	uint32_t lr_nsect;		/* Number of sectors */
+	bool lr_write;			/* True if writing */
+	void (*lr_callback)(struct lhd_request *, void *);
+	void *lr_cbarg;			/* Second argument to lr_callback */
+
+	int lr_result;			/* Result, once done */
+	bool lr_done;			/* True when complete */
+
+	/* Private to the driver */
+	struct lhd_request *lr_next;	/* Next run in the queue */
+	struct lhd_request *lr_chain;	/* Next request in this run */
+	struct lhd_request *lr_runtail;	/* Last request in this run */
+	uint32_t lr_runend;		/* Sector after this run */
+};
+
 /*
  * Hardware device data associated with lhd (LAMEbus hard disk)
  */
@@ -51,9 +89,30 @@ struct lhd_softc {
 	 */
 
 	void *lh_buf;			/* Pointer to on-card I/O buffer */
-	int lh_result;			/* Result from I/O operation */
-	struct semaphore *lh_clear;	/* Synchronization */
-	struct semaphore *lh_done;
+	struct spinlock lh_lock;	/* Lock for everything below */
+	struct wchan *lh_wchan;		/* For lhd_wait */
+
+	/*
+	 * Bounce buffer for transfers to and from user memory, which
+	 * can't be touched at interrupt time. LHD_MAXXFER bytes,
+	 * allocated once; users take lh_bouncelock around it.
+	 */
+	char *lh_bounce;
+	struct lock *lh_bouncelock;
+
+	/*
+	 * Pending runs, sorted by starting sector, and the run being
+	 * transferred. The interrupt handler starts each sector as the
+	 * previous one completes, and the next run (chosen C-LOOK
+	 * order) when the current one is done.
+	 */
+	struct lhd_request *lh_queue;	/* Pending runs */
+	struct lhd_request *lh_active;	/* Run in progress, or NULL */
+	struct lhd_request *lh_cur;	/* Request in progress, or NULL */
+	char *lh_xferptr;		/* Data for the current sector */
+	uint32_t lh_xfersect;		/* Current sector number */
+	uint32_t lh_xferleft;		/* Sectors left, including current */
+	uint32_t lh_headpos;		/* Sector after the last one done */
 
 	struct device lh_dev;		/* VFS device structure */
 };
@@ -61,4 +120,8 @@ struct lhd_softc {
 /* Functions called by lower-level drivers */
 void lhd_irq(/*struct lhd_softc*/ void *);	/* Interrupt handler */
 
+/* Asynchronous request interface */
+int lhd_submit(struct lhd_softc *lh, struct lhd_request *req);
+int lhd_wait(struct lhd_softc *lh, struct lhd_request *req);
+
 #endif /* _LAMEBUS_LHD_H_ */
@@ -0,0 +1,274 @@
+/*
+ * Background freeing of truncated blocks for SFS.
+ *
+ * Freeing a big file's blocks means reading every indirect block
+ * under it, which used to happen inside truncate (or the reclaim of
+ * an unlinked file) with the vnode locked. Instead, sfs_itrunc now
+ * detaches any indirect tree that lies wholly past the new end of
+ * file (zeroing the pointer to it in the inode or the parent indirect
+ * block) and hands it to sfs_bgfree_add. A kernel thread of the
+ * filesystem's own then reads the tree and frees its blocks, one
+ * indirect block's worth per journal operation, so no single
+ * operation gets big and nothing waits for it.
+ *
+ * Until then the blocks are still marked in use, so nothing else can
+ * get them; they just aren't free yet. sfs_sync waits for the queue to
+ * empty, so after a sync (and at unmount) everything is free. If we
+ * crash first, the blocks stay allocated until sfsck frees them.
+ *
+ * bf_lock protects the queue; nothing else is taken while holding it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <buf.h>
+#include <sfs.h>
+
+/* A tree of blocks waiting to be freed */
+struct sfs_deadtree {
+	uint32_t dt_block;		/* the indirect block at the top */
+	unsigned dt_levels;		/* 1 for indirect, 2 for double... */
+	struct sfs_deadtree *dt_next;
+};
+
+struct sfs_bgfree {
+	struct lock *bf_lock;		/* protects the rest */
+	struct cv *bf_cv;		/* wait for any change below */
+	struct sfs_deadtree *bf_queue;	/* trees waiting */
+	bool bf_working;		/* the thread is freeing one */
+	bool bf_exit;			/* the thread should exit when idle */
+	bool bf_running;		/* the thread hasn't exited yet */
+};
+
+////////////////////////////////////////////////////////////
+//
+// Freeing
+
+/*
+ * Free the tree of blocks under BLOCK, an indirect block of LEVELS
+ * levels, and BLOCK itself. Bottom-level indirect blocks are freed
+ * together with the blocks they point to, in one journal operation.
+ *
+ * The pointers are read straight from the buffer cache, not copied;
+ * nobody else changes a detached tree. An upper-level block isn't
+ * kept busy while its subtrees are freed, since their journal
+ * operations can wait for a checkpoint that has to write it; it's
+ * looked up again for each pointer instead, which is cheap, as it
+ * stays in the cache.
+ */
+static
+int
+sfs_freetree(struct sfs_fs *sfs, uint32_t block, unsigned levels)
+{
+	uint32_t dbperidb = SFS_DBPERIDB(sfs->sfs_blocksize);
+	struct buf *buf;
+	uint32_t *ptrs;
+	uint32_t i, sub;
+	int result;
+
+	KASSERT(levels >= 1 && levels <= 3);
+
+	if (levels > 1) {
+		for (i=0; i<dbperidb; i++) {
+			result = buffer_read(&sfs->sfs_absfs, block,
+					     sfs->sfs_blocksize, &buf);
+			if (result) {
+				return result;
+			}
+			ptrs = buffer_map(buf);
+			sub = ptrs[i];
+			buffer_release(buf);
+
+			if (sub != 0) {
+				result = sfs_freetree(sfs, sub, levels-1);
+				if (result) {
+					return result;
+				}
+			}
+		}
+	}
+
+	sfs_jbegin(sfs);
+	if (levels == 1) {
+		result = buffer_read(&sfs->sfs_absfs, block,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			sfs_jend(sfs);
+			return result;
+		}
+		ptrs = buffer_map(buf);
+		for (i=0; i<dbperidb; i++) {
+			if (ptrs[i] != 0) {
+				sfs_bfree(sfs, ptrs[i]);
+			}
+		}
+		/* Not busy, or freeing it would wait for us */
+		buffer_release(buf);
+	}
+	sfs_bfree(sfs, block);
+	sfs_jend(sfs);
+
+	return 0;
+}
+
+/*
+ * The thread. Free trees until told to exit with none left.
+ */
+static
+void
+sfs_bgfree_thread(void *data1, unsigned long data2)
+{
+	struct sfs_fs *sfs = data1;
+	struct sfs_bgfree *bf = sfs->sfs_bgfree;
+	struct sfs_deadtree *dt;
+	int result;
+
+	(void)data2;
+
+	lock_acquire(bf->bf_lock);
+	while (1) {
+		while (bf->bf_queue == NULL && !bf->bf_exit) {
+			cv_wait(bf->bf_cv, bf->bf_lock);
+		}
+		if (bf->bf_queue == NULL) {
+			break;
+		}
+		dt = bf->bf_queue;
+		bf->bf_queue = dt->dt_next;
+		bf->bf_working = true;
+		lock_release(bf->bf_lock);
+
+		result = sfs_freetree(sfs, dt->dt_block, dt->dt_levels);
+		if (result) {
+			/* Not fatal, but the rest of the tree is lost */
+			kprintf("sfs: %s: freeing blocks under %u: %s; "
+				"run sfsck\n", sfs->sfs_super.sp_volname,
+				dt->dt_block, strerror(result));
+		}
+		kfree(dt);
+
+		lock_acquire(bf->bf_lock);
+		bf->bf_working = false;
+		cv_broadcast(bf->bf_cv, bf->bf_lock);
+	}
+	bf->bf_running = false;
+	cv_broadcast(bf->bf_cv, bf->bf_lock);
+	lock_release(bf->bf_lock);
+
+	thread_exit();
+}
+
+////////////////////////////////////////////////////////////
+//
+// Interface
+
+/*
+ * Set up, and start the thread. Called at mount.
+ */
+int
+sfs_bgfree_start(struct sfs_fs *sfs)
+{
+	struct sfs_bgfree *bf;
+	int result;
+
+	bf = kmalloc(sizeof(*bf));
+	if (bf == NULL) {
+		return ENOMEM;
+	}
+	bf->bf_lock = lock_create("sfs bgfree");
+	if (bf->bf_lock == NULL) {
+		kfree(bf);
+		return ENOMEM;
+	}
+	bf->bf_cv = cv_create("sfs bgfree");
+	if (bf->bf_cv == NULL) {
+		lock_destroy(bf->bf_lock);
+		kfree(bf);
+		return ENOMEM;
+	}
+	bf->bf_queue = NULL;
+	bf->bf_working = false;
+	bf->bf_exit = false;
+	bf->bf_running = true;
+	sfs->sfs_bgfree = bf;
+
+	result = thread_fork("sfs bgfree", NULL, sfs_bgfree_thread, sfs, 0);
+	if (result) {
+		sfs->sfs_bgfree = NULL;
+		cv_destroy(bf->bf_cv);
+		lock_destroy(bf->bf_lock);
+		kfree(bf);
+		return result;
+	}
+	return 0;
+}
+
+/*
+ * Finish up, wait for the thread to exit, and clean up. Called at
+ * unmount.
+ */
+void
+sfs_bgfree_stop(struct sfs_fs *sfs)
+{
+	struct sfs_bgfree *bf = sfs->sfs_bgfree;
+
+	lock_acquire(bf->bf_lock);
+	bf->bf_exit = true;
+	cv_broadcast(bf->bf_cv, bf->bf_lock);
+	while (bf->bf_running) {
+		cv_wait(bf->bf_cv, bf->bf_lock);
+	}
+	KASSERT(bf->bf_queue == NULL);
+	lock_release(bf->bf_lock);
+
+	sfs->sfs_bgfree = NULL;
+	cv_destroy(bf->bf_cv);
+	lock_destroy(bf->bf_lock);
+	kfree(bf);
+}
+
+/*
+ * Queue the tree under BLOCK, an indirect block of LEVELS levels, to
+ * be freed. The caller has already detached it from its file. Fails
+ * only if out of memory, in which case the caller should free the
+ * blocks itself.
+ */
+int
+sfs_bgfree_add(struct sfs_fs *sfs, uint32_t block, unsigned levels)
+{
+	struct sfs_bgfree *bf = sfs->sfs_bgfree;
+	struct sfs_deadtree *dt;
+
+	dt = kmalloc(sizeof(*dt));
+	if (dt == NULL) {
+		return ENOMEM;
+	}
+	dt->dt_block = block;
+	dt->dt_levels = levels;
+
+	lock_acquire(bf->bf_lock);
+	dt->dt_next = bf->bf_queue;
+	bf->bf_queue = dt;
+	cv_broadcast(bf->bf_cv, bf->bf_lock);
+	lock_release(bf->bf_lock);
+	return 0;
+}
+
+/*
+ * Wait until everything queued so far has been freed. Must not be
+ * called in a journal operation, as the thread needs to start its own.
+ */
+void
+sfs_bgfree_drain(struct sfs_fs *sfs)
+{
+	struct sfs_bgfree *bf = sfs->sfs_bgfree;
+
+	lock_acquire(bf->bf_lock);
+	while (bf->bf_queue != NULL || bf->bf_working) {
+		cv_wait(bf->bf_cv, bf->bf_lock);
+	}
+	lock_release(bf->bf_lock);
+}
@@ -0,0 +1,224 @@
+/*
+ * In-memory name index for SFS directories.
+ *
+ * A hash table from name to (inode number, slot), plus a stack of
+ * slots known to be free. sfs_vnode.c builds one for a directory the
+ * first time it looks a name up, and keeps it in step with the
+ * directory on disk in sfs_dir_link and sfs_dir_unlink; after that,
+ * finding a name or a free slot doesn't read the directory at all.
+ *
+ * The index belongs to its directory vnode and is protected by the
+ * vnode's sv_lock.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <sfs.h>
+
+/* Initial number of hash chains; doubled as the table fills. */
+#define DIRINDEX_MINSIZE  16
+
+struct sfs_dirname {
+	struct sfs_dirname *dn_next;	/* hash chain */
+	uint32_t dn_ino;		/* inode number */
+	int dn_slot;			/* slot in the directory */
+	char dn_name[];			/* the name, null-terminated */
+};
+
+struct sfs_dirindex {
+	struct sfs_dirname **di_table;	/* hash chains */
+	unsigned di_size;		/* number of chains */
+	unsigned di_count;		/* number of names */
+	int *di_free;			/* stack of free slots */
+	unsigned di_nfree;		/* number on the stack */
+	unsigned di_maxfree;		/* space for this many */
+};
+
+static
+unsigned
+sfs_dirindex_hash(const char *name)
+{
+	unsigned h = 5381;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+struct sfs_dirindex *
+sfs_dirindex_create(void)
+{
+	struct sfs_dirindex *di;
+	unsigned i;
+
+	di = kmalloc(sizeof(*di));
+	if (di == NULL) {
+		return NULL;
+	}
+	di->di_table = kmalloc(DIRINDEX_MINSIZE * sizeof(struct sfs_dirname *));
+	if (di->di_table == NULL) {
+		kfree(di);
+		return NULL;
+	}
+	for (i=0; i<DIRINDEX_MINSIZE; i++) {
+		di->di_table[i] = NULL;
+	}
+	di->di_size = DIRINDEX_MINSIZE;
+	di->di_count = 0;
+	di->di_free = NULL;
+	di->di_nfree = 0;
+	di->di_maxfree = 0;
+	return di;
+}
+
+void
+sfs_dirindex_destroy(struct sfs_dirindex *di)
+{
+	struct sfs_dirname *dn;
+	unsigned i;
+
+	for (i=0; i<di->di_size; i++) {
+		while ((dn = di->di_table[i]) != NULL) {
+			di->di_table[i] = dn->dn_next;
+			kfree(dn);
+		}
+	}
+	kfree(di->di_table);
+	if (di->di_free != NULL) {
+		kfree(di->di_free);
+	}
+	kfree(di);
+}
+
+/*
+ * Double the number of hash chains. Failure isn't an error; the
+ * chains just get longer.
+ */
+static
+void
+sfs_dirindex_grow(struct sfs_dirindex *di)
+{
+	struct sfs_dirname **newtable, *dn;
+	unsigned newsize, i, h;
+
+	newsize = di->di_size * 2;
+	newtable = kmalloc(newsize * sizeof(struct sfs_dirname *));
+	if (newtable == NULL) {
+		return;
+	}
+	for (i=0; i<newsize; i++) {
+		newtable[i] = NULL;
+	}
+	for (i=0; i<di->di_size; i++) {
+		while ((dn = di->di_table[i]) != NULL) {
+			di->di_table[i] = dn->dn_next;
+			h = sfs_dirindex_hash(dn->dn_name) % newsize;
+			dn->dn_next = newtable[h];
+			newtable[h] = dn;
+		}
+	}
+	kfree(di->di_table);
+	di->di_table = newtable;
+	di->di_size = newsize;
+}
+
+int
+sfs_dirindex_add(struct sfs_dirindex *di, const char *name,
+		 uint32_t ino, int slot)
+{
+	struct sfs_dirname *dn;
+	size_t len;
+	unsigned h;
+
+	len = strlen(name);
+	dn = kmalloc(sizeof(*dn) + len + 1);
+	if (dn == NULL) {
+		return ENOMEM;
+	}
+	dn->dn_ino = ino;
+	dn->dn_slot = slot;
+	strcpy(dn->dn_name, name);
+
+	if (di->di_count >= di->di_size * 2) {
+		sfs_dirindex_grow(di);
+	}
+
+	h = sfs_dirindex_hash(name) % di->di_size;
+	dn->dn_next = di->di_table[h];
+	di->di_table[h] = dn;
+	di->di_count++;
+	return 0;
+}
+
+int
+sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		  uint32_t *ino, int *slot)
+{
+	struct sfs_dirname *dn;
+
+	for (dn = di->di_table[sfs_dirindex_hash(name) % di->di_size];
+	     dn != NULL; dn = dn->dn_next) {
+		if (!strcmp(dn->dn_name, name)) {
+			if (ino != NULL) {
+				*ino = dn->dn_ino;
+			}
+			if (slot != NULL) {
+				*slot = dn->dn_slot;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+void
+sfs_dirindex_remove(struct sfs_dirindex *di, const char *name)
+{
+	struct sfs_dirname **dnp, *dn;
+
+	for (dnp = &di->di_table[sfs_dirindex_hash(name) % di->di_size];
+	     *dnp != NULL; dnp = &(*dnp)->dn_next) {
+		dn = *dnp;
+		if (!strcmp(dn->dn_name, name)) {
+			*dnp = dn->dn_next;
+			kfree(dn);
+			di->di_count--;
+			return;
+		}
+	}
+	panic("sfs: dirindex: removing %s, which isn't there\n", name);
+}
+
+int
+sfs_dirindex_addfree(struct sfs_dirindex *di, int slot)
+{
+	unsigned newmax;
+	int *newfree;
+
+	if (di->di_nfree == di->di_maxfree) {
+		newmax = di->di_maxfree ? di->di_maxfree * 2 : 8;
+		newfree = kmalloc(newmax * sizeof(int));
+		if (newfree == NULL) {
+			return ENOMEM;
+		}
+		if (di->di_free != NULL) {
+			memcpy(newfree, di->di_free, di->di_nfree * sizeof(int));
+			kfree(di->di_free);
+		}
+		di->di_free = newfree;
+		di->di_maxfree = newmax;
+	}
+	di->di_free[di->di_nfree++] = slot;
+	return 0;
+}
+
+int
+sfs_dirindex_getfree(struct sfs_dirindex *di)
+{
+	if (di->di_nfree == 0) {
+		return -1;
+	}
+	return di->di_free[--di->di_nfree];
+}
@@ -39,27 +39,48 @@
 #include <array.h>
 #include <bitmap.h>
 #include <uio.h>
+#include <synch.h>
+#include <clock.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
 
 /* Shortcuts for the size macros in kern/sfs.h */
-#define SFS_FS_BITMAPSIZE(sfs)  SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks)
-#define SFS_FS_BITBLOCKS(sfs)   SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks)
+#define SFS_FS_BITMAPSIZE(sfs) \
+	SFS_BITMAPSIZE((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+#define SFS_FS_BITBLOCKS(sfs) \
+	SFS_BITBLOCKS((sfs)->sfs_super.sp_nblocks, (sfs)->sfs_blocksize)
+
+/* Count the clear bits in LEN bytes of bitmap data */
+static
+uint32_t
+sfs_mapcount(const unsigned char *data, uint32_t len)
+{
+	uint32_t i, count = 0;
+	unsigned char c;
+
+	for (i=0; i<len; i++) {
+		for (c = ~data[i]; c != 0; c &= c - 1) {
+			count++;
+		}
+	}
+	return count;
+}
 
 /*
  * Routine for doing I/O (reads or writes) on the free block bitmap.
- * We always do the whole bitmap at once; writing individual sectors
- * might or might not be a worthwhile optimization.
+ * Reads load the whole bitmap and count the free blocks in each of
+ * its blocks; writes only write the blocks marked in sfs_mapdirty.
  *
- * The free block bitmap consists of SFS_BITBLOCKS 512-byte sectors of
- * bits, one bit for each sector on the filesystem. The number of
- * blocks in the bitmap is thus rounded up to the nearest multiple of
- * 512*8 = 4096. (This rounded number is SFS_BITMAPSIZE.) This means
- * that the bitmap will (in general) contain space for some number of
- * invalid sectors that are actually beyond the end of the disk
- * device. This is ok. These sectors are supposed to be marked "in
- * use" by mksfs and never get marked "free".
+ * The free block bitmap consists of SFS_BITBLOCKS blocks of bits, one
+ * bit for each block on the filesystem. The number of blocks in the
+ * bitmap is thus rounded up to the nearest multiple of the number of
+ * bits in a block (4096 for 512-byte blocks). (This rounded number is
+ * SFS_BITMAPSIZE.) This means that the bitmap will (in general)
+ * contain space for some number of invalid blocks that are actually
+ * beyond the end of the disk device. This is ok. These blocks are
+ * supposed to be marked "in use" by mksfs and never get marked "free".
  *
  * The sectors used by the superblock and the bitmap itself are
  * likewise marked in use by mksfs.
@@ -83,22 +104,187 @@ sfs_mapio(struct sfs_fs *sfs, enum uio_rw rw)
 	for (j=0; j<mapsize; j++) {
 
 		/* Get a pointer to its data */
-		void *ptr = bitdata + j*SFS_BLOCKSIZE;
+		void *ptr = bitdata + j*sfs->sfs_blocksize;
 
-		/* and read or write it. The bitmap starts at sector 2. */ 
+		/* and read or write it. The bitmap starts at block 2. */
 		if (rw == UIO_READ) {
 			result = sfs_rblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			if (result) {
+				return result;
+			}
+			sfs->sfs_freecount[j] = sfs_mapcount(ptr,
+							     sfs->sfs_blocksize);
+			sfs->sfs_nfree += sfs->sfs_freecount[j];
 		}
-		else {
+		else if (bitmap_isset(sfs->sfs_mapdirty, j)) {
 			result = sfs_wblock(sfs, ptr, SFS_MAP_LOCATION+j);
+			if (result) {
+				return result;
+			}
+			bitmap_unmark(sfs->sfs_mapdirty, j);
+			sfs->sfs_nmapdirty--;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Free block bitmap operations. These keep sfs_freecount and
+ * sfs_mapdirty in step with the bits. The caller holds
+ * sfs_freemaplock.
+ */
+
+/* Bitmap block that holds the bit for BLOCK */
+#define SFS_MAPBLOCK(sfs, block) ((block) / SFS_BLOCKBITS((sfs)->sfs_blocksize))
+
+static
+void
+sfs_mapchanged(struct sfs_fs *sfs, uint32_t block)
+{
+	uint32_t mapblock = SFS_MAPBLOCK(sfs, block);
+
+	if (!bitmap_isset(sfs->sfs_mapdirty, mapblock)) {
+		bitmap_mark(sfs->sfs_mapdirty, mapblock);
+		sfs->sfs_nmapdirty++;
+	}
+	sfs->sfs_freemapdirty = true;
+}
+
+/*
+ * Allocate the first free block at or after GOAL, wrapping around.
+ * Bitmap blocks with no free blocks are skipped without looking at
+ * their bits. Blocks promised to delayed allocations (sfs_dareserved)
+ * aren't handed out; sfs_daflush takes back its promise before it
+ * allocates.
+ */
+int
+sfs_freemap_alloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *block)
+{
+	uint32_t bits = SFS_BLOCKBITS(sfs->sfs_blocksize);
+	uint32_t mapsize = SFS_FS_BITBLOCKS(sfs);
+	uint32_t mapblock, start, end, n;
+	unsigned index;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+
+	if (sfs->sfs_nfree <= sfs->sfs_dareserved) {
+		return ENOSPC;
+	}
+
+	if (goal >= sfs->sfs_super.sp_nblocks) {
+		goal = 0;
+	}
+
+	/*
+	 * Start in GOAL's bitmap block, at GOAL; go round the others;
+	 * finish with the part of GOAL's block before GOAL.
+	 */
+	for (n=0; n<=mapsize; n++) {
+		mapblock = (SFS_MAPBLOCK(sfs, goal) + n) % mapsize;
+		if (sfs->sfs_freecount[mapblock] == 0) {
+			continue;
+		}
+		start = n == 0 ? goal : mapblock * bits;
+		end = n == mapsize ? goal : (mapblock + 1) * bits;
+		if (bitmap_alloc_range(sfs->sfs_freemap, start, end,
+				       &index) == 0) {
+			sfs->sfs_freecount[mapblock]--;
+			sfs->sfs_nfree--;
+			sfs_mapchanged(sfs, index);
+			*block = index;
+			return 0;
+		}
+	}
+	return ENOSPC;
+}
+
+void
+sfs_freemap_mark(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_mark(sfs->sfs_freemap, block);
+	sfs->sfs_freecount[SFS_MAPBLOCK(sfs, block)]--;
+	sfs->sfs_nfree--;
+	sfs_mapchanged(sfs, block);
+}
+
+void
+sfs_freemap_unmark(struct sfs_fs *sfs, uint32_t block)
+{
+	KASSERT(lock_do_i_hold(sfs->sfs_freemaplock));
+	bitmap_unmark(sfs->sfs_freemap, block);
+	sfs->sfs_freecount[SFS_MAPBLOCK(sfs, block)]++;
+	sfs->sfs_nfree++;
+	sfs_mapchanged(sfs, block);
+}
+
+/*
+ * Write out everything that's dirty: write the file data, commit the
+ * journal's running transaction, then write all of it home, then mark
+ * it finished. Operations are kept out until it's done.
+ *
+ * The data goes first (ordered mode) so that once the commit block is
+ * on disk, the inodes and indirect blocks it makes durable never point
+ * at blocks still holding some deleted file's old contents.
+ */
+int
+sfs_checkpoint(struct sfs_fs *sfs)
+{
+	int result;
+
+	sfs_jquiesce(sfs);
+
+	/* File data: the metadata buffers are pinned, so this skips them */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		goto out;
+	}
+
+	result = sfs_jcommit(sfs);
+	if (result) {
+		goto out;
+	}
+
+	/* Now the metadata sfs_jcommit unpinned (and anything else). */
+	result = buffer_sync_fs(&sfs->sfs_absfs);
+	if (result) {
+		goto out;
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+
+	/* If the free block map needs to be written, write it. */
+	if (sfs->sfs_freemapdirty) {
+		result = sfs_mapio(sfs, UIO_WRITE);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			goto out;
 		}
+		sfs->sfs_freemapdirty = false;
+	}
 
-		/* If we failed, stop. */
+	/* If the superblock needs to be written, write it. */
+	if (sfs->sfs_superdirty) {
+		result = sfs_wsuper(sfs);
 		if (result) {
-			return result;
+			lock_release(sfs->sfs_freemaplock);
+			goto out;
 		}
+		sfs->sfs_superdirty = false;
 	}
-	return 0;
+
+	lock_release(sfs->sfs_freemaplock);
+
+	result = sfs_jdone(sfs);
+	if (result == 0) {
+		uint32_t nsecs;
+
+		gettime(&sfs->sfs_lastcheckpoint, &nsecs);
+	}
+
+ out:
+	sfs_jresume(sfs);
+	return result;
 }
 
 /*
@@ -111,10 +297,9 @@ int
 sfs_sync(struct fs *fs)
 {
 	struct sfs_fs *sfs; 
-	unsigned i, num;
-	int result;
-
-	vfs_biglock_acquire();
+	struct vnode **vns;
+	struct sfs_vnode *sv;
+	unsigned i, h, n, num;
 
 	/*
 	 * Get the sfs_fs from the generic abstract fs.
@@ -148,35 +333,117 @@ sfs_sync(struct fs *fs)
 
 	sfs = fs->fs_data;
 
-	/* Go over the array of loaded vnodes, syncing as we go. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	for (i=0; i<num; i++) {
-		struct vnode *v = vnodearray_get(sfs->sfs_vnodes, i);
-		VOP_FSYNC(v);
-	}
+	/* Let blocks being freed in the background finish first */
+	sfs_bgfree_drain(sfs);
 
-	/* If the free block map needs to be written, write it. */
-	if (sfs->sfs_freemapdirty) {
-		result = sfs_mapio(sfs, UIO_WRITE);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	/*
+	 * Take a reference to each loaded vnode with something to write
+	 * back, so none can be reclaimed under us, and flush them with
+	 * the table unlocked; sfs_flushvnode takes the vnode's own lock,
+	 * which comes first. (sv_dirty and sv_nda are read without that
+	 * lock, but anything an operation dirties it writes into the
+	 * buffer cache itself before finishing.) The inodes only go as
+	 * far as the buffer cache here; the checkpoint then writes their
+	 * blocks in disk order, adjacent ones in one transfer.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = sfs->sfs_nvnodes;
+	vns = NULL;
+	if (num > 0) {
+		vns = kmalloc(num * sizeof(struct vnode *));
+		if (vns == NULL) {
+			lock_release(sfs->sfs_vnlock);
+			return ENOMEM;
+		}
+	}
+	n = 0;
+	for (h=0; h<SFS_VNHASHSIZE; h++) {
+		for (sv = sfs->sfs_vntable[h]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			KASSERT(n < num);
+			if (!sv->sv_dirty && sv->sv_nda == 0) {
+				continue;
+			}
+			vns[n++] = &sv->sv_v;
+			VOP_INCREF(&sv->sv_v);
 		}
-		sfs->sfs_freemapdirty = false;
 	}
+	lock_release(sfs->sfs_vnlock);
 
-	/* If the superblock needs to be written, write it. */
-	if (sfs->sfs_superdirty) {
-		result = sfs_wblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
-		if (result) {
-			vfs_biglock_release();
-			return result;
+	for (i=0; i<n; i++) {
+		/*result =*/ sfs_flushvnode(vns[i]->vn_data);
+		VOP_DECREF(vns[i]);
+	}
+	if (vns != NULL) {
+		kfree(vns);
+	}
+
+	return sfs_checkpoint(sfs);
+}
+
+/*
+ * Most vnodes or buffers sfs_flushold writes back per call.
+ */
+#define SFS_FLUSHBATCH 16
+
+/*
+ * Syncer entry point: write back some of what has been dirty since
+ * BEFORE or earlier. First give old delayed-allocation data its disk
+ * blocks, then write a batch of old buffers, then, if metadata is
+ * still waiting on the journal or the free block map and the last
+ * checkpoint is older than BEFORE, do a checkpoint. Everything but
+ * that last step is bounded by SFS_FLUSHBATCH.
+ */
+static
+int
+sfs_flushold(struct fs *fs, time_t before)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct vnode *vns[SFS_FLUSHBATCH];
+	struct sfs_vnode *sv;
+	unsigned i, h, num;
+	bool pending;
+	int result;
+
+	/*
+	 * Pick vnodes with old waiting data. We look at sv_nda and
+	 * sv_datime without their sv_lock; that's only a hint, and
+	 * sfs_flushvnode does the real work under the lock.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	num = 0;
+	for (h=0; h<SFS_VNHASHSIZE && num < SFS_FLUSHBATCH; h++) {
+		for (sv = sfs->sfs_vntable[h];
+		     sv != NULL && num < SFS_FLUSHBATCH;
+		     sv = sv->sv_hashnext) {
+			if (sv->sv_nda > 0 && sv->sv_datime <= before) {
+				vns[num++] = &sv->sv_v;
+				VOP_INCREF(&sv->sv_v);
+			}
 		}
-		sfs->sfs_superdirty = false;
 	}
+	lock_release(sfs->sfs_vnlock);
 
-	vfs_biglock_release();
-	return 0;
+	for (i=0; i<num; i++) {
+		/*result =*/ sfs_flushvnode(vns[i]->vn_data);
+		VOP_DECREF(vns[i]);
+	}
+
+	result = buffer_flush_old(fs, before, SFS_FLUSHBATCH);
+	if (result) {
+		return result;
+	}
+
+	if (sfs->sfs_lastcheckpoint > before) {
+		return 0;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	pending = sfs->sfs_freemapdirty || sfs->sfs_superdirty;
+	lock_release(sfs->sfs_freemaplock);
+	if (!pending && !sfs_jpending(sfs)) {
+		return 0;
+	}
+	return sfs_checkpoint(sfs);
 }
 
 /*
@@ -189,13 +456,9 @@ const char *
 sfs_getvolname(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
-	const char *ret;
 
-	vfs_biglock_acquire();
-	ret = sfs->sfs_super.sp_volname;
-	vfs_biglock_release();
-
-	return ret;
+	/* Set at mount time and never changed, so no lock is needed. */
+	return sfs->sfs_super.sp_volname;
 }
 
 /*
@@ -209,21 +472,34 @@ sfs_unmount(struct fs *fs)
 {
 	struct sfs_fs *sfs = fs->fs_data;
 
-	vfs_biglock_acquire();
-	
-	/* Do we have any files open? If so, can't unmount. */
-	if (vnodearray_num(sfs->sfs_vnodes) > 0) {
-		vfs_biglock_release();
+	/*
+	 * Do we have any files open? If so, can't unmount. Loading a
+	 * vnode requires a reference to one we already have (or
+	 * vfs_biglock, for getroot, which vfs_unmount holds), so once
+	 * the table is empty it stays empty.
+	 */
+	lock_acquire(sfs->sfs_vnlock);
+	if (sfs->sfs_nvnodes > 0) {
+		lock_release(sfs->sfs_vnlock);
 		return EBUSY;
 	}
+	lock_release(sfs->sfs_vnlock);
 
 	/* We should have just had sfs_sync called. */
 	KASSERT(sfs->sfs_superdirty == false);
 	KASSERT(sfs->sfs_freemapdirty == false);
+	KASSERT(sfs->sfs_dareserved == 0);
 
 	/* Once we start nuking stuff we can't fail. */
-	vnodearray_destroy(sfs->sfs_vnodes);
+	sfs_bgfree_stop(sfs);
+	buffer_drop_fs(fs);
+	sfs_junload(sfs);
+	kfree(sfs->sfs_vntable);
 	bitmap_destroy(sfs->sfs_freemap);
+	bitmap_destroy(sfs->sfs_mapdirty);
+	kfree(sfs->sfs_freecount);
+	lock_destroy(sfs->sfs_vnlock);
+	lock_destroy(sfs->sfs_freemaplock);
 	
 	/* The vfs layer takes care of the device for us */
 	(void)sfs->sfs_device;
@@ -232,7 +508,6 @@ sfs_unmount(struct fs *fs)
 	kfree(sfs);
 
 	/* nothing else to do */
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -255,10 +530,9 @@ int
 sfs_domount(void *options, struct device *dev, struct fs **ret)
 {
 	int result;
+	unsigned i;
 	struct sfs_fs *sfs;
 
-	vfs_biglock_acquire();
-
 	/* We don't pass any options through mount */
 	(void)options;
 
@@ -270,43 +544,52 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	KASSERT(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 
 	/*
-	 * We can't mount on devices with the wrong sector size.
-	 *
-	 * (Note: for all intents and purposes here, "sector" and
-	 * "block" are interchangeable terms. Technically a filesystem
-	 * block may be composed of several hardware sectors, but we
-	 * don't do that in sfs.)
+	 * We can't mount on devices whose sectors are bigger than our
+	 * smallest block. (A filesystem block may be made of several
+	 * sectors; we check the volume's block size below, once we've
+	 * read the superblock.)
 	 */
-	if (dev->d_blocksize != SFS_BLOCKSIZE) {
-		vfs_biglock_release();
+	if (SFS_BLOCKSIZE % dev->d_blocksize != 0) {
 		return ENXIO;
 	}
 
 	/* Allocate object */
 	sfs = kmalloc(sizeof(struct sfs_fs));
 	if (sfs==NULL) {
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Allocate array */
-	sfs->sfs_vnodes = vnodearray_create();
-	if (sfs->sfs_vnodes == NULL) {
+	/* Allocate locks */
+	sfs->sfs_vnlock = lock_create("sfs vnodes");
+	if (sfs->sfs_vnlock == NULL) {
+		kfree(sfs);
+		return ENOMEM;
+	}
+	sfs->sfs_freemaplock = lock_create("sfs freemap");
+	if (sfs->sfs_freemaplock == NULL) {
+		lock_destroy(sfs->sfs_vnlock);
 		kfree(sfs);
-		vfs_biglock_release();
 		return ENOMEM;
 	}
 
-	/* Set the device so we can use sfs_rblock() */
+	/* Allocate vnode table */
+	sfs->sfs_vntable = kmalloc(SFS_VNHASHSIZE * sizeof(struct sfs_vnode *));
+	if (sfs->sfs_vntable == NULL) {
+		goto fail_locks;
+	}
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		sfs->sfs_vntable[i] = NULL;
+	}
+	sfs->sfs_nvnodes = 0;
+
+	/* Set the device so we can use sfs_rsuper() */
 	sfs->sfs_device = dev;
+	sfs->sfs_blocksize = SFS_BLOCKSIZE;
 
 	/* Load superblock */
-	result = sfs_rblock(sfs, &sfs->sfs_super, SFS_SB_LOCATION);
+	result = sfs_rsuper(sfs);
 	if (result) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+		goto fail_vntable;
 	}
 
 	/* Make some simple sanity checks */
@@ -316,42 +599,78 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 			"(0x%x, should be 0x%x)\n", 
 			sfs->sfs_super.sp_magic,
 			SFS_MAGIC);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return EINVAL;
+		result = EINVAL;
+		goto fail_vntable;
 	}
 	
-	if (sfs->sfs_super.sp_nblocks > dev->d_blocks) {
-		kprintf("sfs: warning - fs has %u blocks, device has %u\n",
-			sfs->sfs_super.sp_nblocks, dev->d_blocks);
+	if (sfs->sfs_super.sp_blocksize != 0) {
+		sfs->sfs_blocksize = sfs->sfs_super.sp_blocksize;
+	}
+	if (sfs->sfs_blocksize < SFS_BLOCKSIZE ||
+	    sfs->sfs_blocksize > SFS_MAXBLOCKSIZE ||
+	    (sfs->sfs_blocksize & (sfs->sfs_blocksize - 1)) != 0) {
+		kprintf("sfs: Bad block size %u in superblock\n",
+			sfs->sfs_blocksize);
+		result = EINVAL;
+		goto fail_vntable;
+	}
+
+	if ((uint64_t)sfs->sfs_super.sp_nblocks * sfs->sfs_blocksize >
+	    (uint64_t)dev->d_blocks * dev->d_blocksize) {
+		kprintf("sfs: warning - fs has %u %u-byte blocks, "
+			"device has %u %u-byte blocks\n",
+			sfs->sfs_super.sp_nblocks, sfs->sfs_blocksize,
+			dev->d_blocks, dev->d_blocksize);
 	}
 
 	/* Ensure null termination of the volume name */
 	sfs->sfs_super.sp_volname[sizeof(sfs->sfs_super.sp_volname)-1] = 0;
 
+	/* Set up the journal, replaying it if needed */
+	result = sfs_jload(sfs);
+	if (result) {
+		goto fail_vntable;
+	}
+
 	/* Load free space bitmap */
 	sfs->sfs_freemap = bitmap_create(SFS_FS_BITMAPSIZE(sfs));
 	if (sfs->sfs_freemap == NULL) {
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return ENOMEM;
+		result = ENOMEM;
+		goto fail_journal;
+	}
+	sfs->sfs_mapdirty = bitmap_create(SFS_FS_BITBLOCKS(sfs));
+	sfs->sfs_nmapdirty = 0;
+	sfs->sfs_nfree = 0;
+	sfs->sfs_dareserved = 0;
+	sfs->sfs_lastcheckpoint = 0;
+	if (sfs->sfs_mapdirty == NULL) {
+		result = ENOMEM;
+		goto fail_freemap;
+	}
+	sfs->sfs_freecount = kmalloc(SFS_FS_BITBLOCKS(sfs) * sizeof(uint32_t));
+	if (sfs->sfs_freecount == NULL) {
+		result = ENOMEM;
+		goto fail_mapdirty;
 	}
 	result = sfs_mapio(sfs, UIO_READ);
 	if (result) {
-		bitmap_destroy(sfs->sfs_freemap);
-		vnodearray_destroy(sfs->sfs_vnodes);
-		kfree(sfs);
-		vfs_biglock_release();
-		return result;
+		goto fail_freecount;
+	}
+
+	/* Start freeing truncated blocks in the background */
+	result = sfs_bgfree_start(sfs);
+	if (result) {
+		goto fail_freecount;
 	}
 
 	/* Set up abstract fs calls */
 	sfs->sfs_absfs.fs_sync = sfs_sync;
+	sfs->sfs_absfs.fs_flushold = sfs_flushold;
 	sfs->sfs_absfs.fs_getvolname = sfs_getvolname;
 	sfs->sfs_absfs.fs_getroot = sfs_getroot;
 	sfs->sfs_absfs.fs_unmount = sfs_unmount;
+	sfs->sfs_absfs.fs_readblock = sfs_readblock;
+	sfs->sfs_absfs.fs_writeblock = sfs_writeblock;
 	sfs->sfs_absfs.fs_data = sfs;
 
 	/* the other fields */
@@ -361,8 +680,43 @@ sfs_domount(void *options, struct device *dev, struct fs **ret)
 	/* Hand back the abstract fs */
 	*ret = &sfs->sfs_absfs;
 
-	vfs_biglock_release();
 	return 0;
+
+ fail_freecount:
+	kfree(sfs->sfs_freecount);
+ fail_mapdirty:
+	bitmap_destroy(sfs->sfs_mapdirty);
+ fail_freemap:
+	bitmap_destroy(sfs->sfs_freemap);
+ fail_journal:
+	sfs_junload(sfs);
+ fail_vntable:
+	kfree(sfs->sfs_vntable);
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	kfree(sfs);
+	return result;
+
+ fail_locks:
+	lock_destroy(sfs->sfs_freemaplock);
+	lock_destroy(sfs->sfs_vnlock);
+	kfree(sfs);
+	return ENOMEM;
+}
+
+/*
+ * Set up what all sfs mounts share. Anything of a page or more from
+ * kmalloc is never given back under dumbvm, so it's allocated here
+ * once rather than per mount.
+ */
+void
+sfs_bootstrap(void)
+{
+	/* Every block size has to fit in the buffer cache */
+	COMPILE_ASSERT(SFS_MAXBLOCKSIZE <= BUFFER_MAXSIZE);
+
+	sfs_dabootstrap();
+	sfs_jbootstrap();
 }
 
 /*
@@ -50,11 +50,9 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 	int result;
 	int tries=0;
 
-	KASSERT(vfs_biglock_do_i_hold());
-
 	DEBUG(DB_SFS, "sfs: %s %llu\n", 
 	      uio->uio_rw == UIO_READ ? "read" : "write",
-	      uio->uio_offset / SFS_BLOCKSIZE);
+	      uio->uio_offset / sfs->sfs_blocksize);
 
  retry:
 	result = sfs->sfs_device->d_io(sfs->sfs_device, uio);
@@ -70,7 +68,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		if (tries == 0) {
 			tries++;
 			kprintf("sfs: block %llu I/O error, retrying\n",
-				uio->uio_offset / SFS_BLOCKSIZE);
+				uio->uio_offset / sfs->sfs_blocksize);
 			goto retry;
 		}
 		else if (tries < 10) {
@@ -80,7 +78,7 @@ sfs_rwblock(struct sfs_fs *sfs, struct uio *uio)
 		else {
 			kprintf("sfs: block %llu I/O error, giving up after "
 				"%d retries\n",
-				uio->uio_offset / SFS_BLOCKSIZE, tries);
+				uio->uio_offset / sfs->sfs_blocksize, tries);
 		}
 	}
 	return result;
@@ -92,7 +90,7 @@ sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block)
 	struct iovec iov;
 	struct uio ku;
 
-	SFSUIO(&iov, &ku, data, block, UIO_READ);
+	SFSUIO(sfs, &iov, &ku, data, block, UIO_READ);
 	return sfs_rwblock(sfs, &ku);
 }
 
@@ -102,6 +100,62 @@ sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block)
 	struct iovec iov;
 	struct uio ku;
 
-	SFSUIO(&iov, &ku, data, block, UIO_WRITE);
+	SFSUIO(sfs, &iov, &ku, data, block, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * The superblock is the first sizeof(struct sfs_super) bytes of
+ * block 0, whatever the block size, so these move just that much.
+ */
+
+int
+sfs_rsuper(struct sfs_fs *sfs)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, &sfs->sfs_super, sizeof(sfs->sfs_super),
+		  (off_t)SFS_SB_LOCATION * sfs->sfs_blocksize, UIO_READ);
+	return sfs_rwblock(sfs, &ku);
+}
+
+int
+sfs_wsuper(struct sfs_fs *sfs)
+{
+	struct iovec iov;
+	struct uio ku;
+
+	uio_kinit(&iov, &ku, &sfs->sfs_super, sizeof(sfs->sfs_super),
+		  (off_t)SFS_SB_LOCATION * sfs->sfs_blocksize, UIO_WRITE);
+	return sfs_rwblock(sfs, &ku);
+}
+
+/*
+ * Block I/O entry points for the buffer cache (fs_readblock and
+ * fs_writeblock). Everything except the superblock and the free
+ * block bitmap goes through the cache. Writes may cover several
+ * consecutive blocks when the cache gathers them.
+ */
+
+int
+sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+
+	KASSERT(len == sfs->sfs_blocksize);
+	return sfs_rblock(sfs, data, block);
+}
+
+int
+sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len)
+{
+	struct sfs_fs *sfs = fs->fs_data;
+	struct iovec iov;
+	struct uio ku;
+
+	KASSERT(len > 0 && len % sfs->sfs_blocksize == 0);
+	uio_kinit(&iov, &ku, data, len, (off_t)block * sfs->sfs_blocksize,
+		  UIO_WRITE);
 	return sfs_rwblock(sfs, &ku);
 }
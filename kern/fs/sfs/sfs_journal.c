@@ -0,0 +1,802 @@
+/*
+ * Metadata journal for SFS.
+ *
+ * Changes to metadata (inodes, indirect blocks, directory blocks, the
+ * free block bitmap, and the superblock) are collected into one
+ * running transaction. Operations that change metadata bracket
+ * themselves with sfs_jbegin and sfs_jend, and mark the metadata
+ * buffers they change with sfs_jdirty instead of buffer_mark_dirty.
+ * sfs_jdirty pins the buffer in the buffer cache, so none of the
+ * transaction reaches its home location on disk before it commits.
+ *
+ * sfs_checkpoint (in sfs_fs.c) commits the transaction. sfs_jquiesce
+ * waits for the operations in progress to finish and keeps new ones
+ * out; the dirty file data is written; sfs_jcommit writes copies of
+ * all the changed blocks into the journal, then the commit block, and
+ * unpins them; everything is written home; and sfs_jdone marks the
+ * transaction finished in the journal header. If we crash after the
+ * commit block is written but before sfs_jdone, sfs_jload replays the
+ * transaction at the next mount by writing the copies home again. If
+ * we crash before the commit block, none of the transaction is on
+ * disk. Either way the metadata is consistent after reading no more
+ * than the journal.
+ *
+ * Writing the data before the commit block (ordered mode) means that
+ * metadata the journal makes durable only points at blocks whose new
+ * contents are already on disk. Newly allocated data blocks aren't
+ * zeroed first (see SFS_BMAP_FILL), so without this a crash could
+ * leave a file showing another, deleted file's old data. Data written
+ * since the last checkpoint may still be lost in a crash, along with
+ * the metadata that would have pointed at it.
+ *
+ * Since operations write their inodes to the buffer cache before
+ * sfs_jend, a transaction always holds whole operations. Many
+ * operations go into each transaction (it commits on sync, or in
+ * sfs_jbegin when it gets big), which keeps the journal writes down.
+ *
+ * Blocks freed by the running transaction stay marked in use until it
+ * commits, so nothing else can be put in them while the metadata on
+ * disk may still point at them.
+ *
+ * File data isn't journaled. Blocks reserved ahead of growing files
+ * (see sfs_ballocfile), blocks truncated away but not yet freed (see
+ * sfs_bgfree.c), and files unlinked while still open are in use on
+ * disk, so after a crash they stay allocated until sfsck frees them.
+ *
+ * If a transaction gets too big for the journal, or would pin too many
+ * buffers, its metadata is written home without the journal; the
+ * journal header says so until the next checkpoint finishes, and if we
+ * crash in the meantime, mounting says to run sfsck.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <bitmap.h>
+#include <buf.h>
+#include <sfs.h>
+
+/* Most buffers one transaction may pin */
+#define SFS_JMAXPIN  32
+
+struct sfs_journal {
+	struct lock *j_lock;		/* protects the rest */
+	struct cv *j_cv;		/* wait for j_active or j_closed */
+	unsigned j_active;		/* operations in progress */
+	bool j_closed;			/* a checkpoint is keeping them out */
+	uint32_t j_start;		/* first block of the journal */
+	uint32_t j_max;			/* most blocks in one transaction */
+	uint32_t j_seq;			/* running transaction's number */
+	bool j_committed;		/* it's in the journal */
+	bool j_unsafe;			/* metadata went out unjournaled */
+	bool j_needfsck;		/* that happened before a crash */
+	uint32_t j_blocks[SFS_JMAXPIN];	/* buffers it has pinned */
+	unsigned j_nblocks;
+	uint32_t *j_frees;		/* blocks it frees */
+	unsigned j_nfrees;
+	unsigned j_maxfrees;
+};
+
+/*
+ * Memory for journal I/O: a block for copies, headers and commit
+ * blocks, and the descriptor block. There's one pair for all mounts,
+ * allocated at boot (anything a page or bigger from kmalloc is never
+ * given back under dumbvm), and it's used under sfs_jiolock. That
+ * lock comes after j_lock and before sfs_freemaplock.
+ */
+static void *sfs_jbuf;
+static void *sfs_jdesc;
+static struct lock *sfs_jiolock;
+
+/* Where things are in the journal */
+#define SFS_JHEADER(j)   ((j)->j_start)
+#define SFS_JDESC(j)     ((j)->j_start + 1)
+#define SFS_JCOPY(j, i)  ((j)->j_start + 2 + (i))
+
+/* The list of home locations in the descriptor block */
+#define SFS_JHOMES()     ((uint32_t *)((struct sfs_jdesc *)sfs_jdesc + 1))
+
+////////////////////////////////////////////////////////////
+//
+// Journal I/O
+
+static
+uint32_t
+sfs_jchecksum(uint32_t sum, const void *data, size_t len)
+{
+	const unsigned char *p = data;
+
+	while (len-- > 0) {
+		sum = sum * 33 + *p++;
+	}
+	return sum;
+}
+
+/*
+ * Write the journal header: j_seq is the transaction to replay, and
+ * whether sfsck is wanted after a crash.
+ */
+static
+int
+sfs_jwheader(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jheader *jh = sfs_jbuf;
+	int result;
+
+	lock_acquire(sfs_jiolock);
+	bzero(sfs_jbuf, sfs->sfs_blocksize);
+	jh->jh_magic = SFS_JMAGIC_HEADER;
+	jh->jh_seq = j->j_seq;
+	jh->jh_flags = (j->j_unsafe || j->j_needfsck) ? SFS_JF_UNSAFE : 0;
+	result = sfs_wblock(sfs, sfs_jbuf, SFS_JHEADER(j));
+	lock_release(sfs_jiolock);
+	return result;
+}
+
+/*
+ * From now until the next checkpoint finishes, metadata may reach the
+ * disk without going through the journal. Say so on disk first.
+ */
+static
+void
+sfs_jsetunsafe(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	KASSERT(lock_do_i_hold(j->j_lock));
+	if (j->j_unsafe) {
+		return;
+	}
+	j->j_unsafe = true;
+	result = sfs_jwheader(sfs);
+	if (result) {
+		kprintf("sfs: %s: Writing journal header: %s\n",
+			sfs->sfs_super.sp_volname, strerror(result));
+	}
+}
+
+/*
+ * Write j_buf into the journal as the next copy, number *K, which
+ * belongs at block HOME; add it to the checksum *SUM.
+ */
+static
+int
+sfs_jwcopy(struct sfs_fs *sfs, uint32_t *k, uint32_t *sum, uint32_t home)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result;
+
+	KASSERT(lock_do_i_hold(sfs_jiolock));
+	KASSERT(*k < j->j_max);
+	result = sfs_wblock(sfs, sfs_jbuf, SFS_JCOPY(j, *k));
+	if (result) {
+		return result;
+	}
+	SFS_JHOMES()[*k] = home;
+	*sum = sfs_jchecksum(*sum, sfs_jbuf, sfs->sfs_blocksize);
+	(*k)++;
+	return 0;
+}
+
+/*
+ * Write the running transaction into the journal: the pinned buffers,
+ * the changed freemap blocks, and the superblock if it changed; then
+ * the descriptor; then the commit block. Called with sfs_jiolock
+ * held.
+ */
+static
+int
+sfs_jwrite(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t bs = sfs->sfs_blocksize;
+	struct sfs_jdesc *jd = sfs_jdesc;
+	struct sfs_jcommit *jc = sfs_jbuf;
+	struct buf *buf;
+	char *mapdata;
+	uint32_t i, k, mapblocks, sum;
+	int result;
+
+	bzero(sfs_jdesc, bs);
+	sum = j->j_seq;
+	k = 0;
+
+	for (i=0; i<j->j_nblocks; i++) {
+		/* Pinned, so still cached */
+		result = buffer_read(&sfs->sfs_absfs, j->j_blocks[i], bs, &buf);
+		if (result) {
+			return result;
+		}
+		memcpy(sfs_jbuf, buffer_map(buf), bs);
+		buffer_release(buf);
+
+		result = sfs_jwcopy(sfs, &k, &sum, j->j_blocks[i]);
+		if (result) {
+			return result;
+		}
+	}
+
+	lock_acquire(sfs->sfs_freemaplock);
+	mapdata = bitmap_getdata(sfs->sfs_freemap);
+	mapblocks = SFS_BITBLOCKS(sfs->sfs_super.sp_nblocks, bs);
+	for (i=0; i<mapblocks; i++) {
+		if (!bitmap_isset(sfs->sfs_mapdirty, i)) {
+			continue;
+		}
+		memcpy(sfs_jbuf, mapdata + i*bs, bs);
+		result = sfs_jwcopy(sfs, &k, &sum, SFS_MAP_LOCATION + i);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+	if (sfs->sfs_superdirty) {
+		bzero(sfs_jbuf, bs);
+		memcpy(sfs_jbuf, &sfs->sfs_super, sizeof(sfs->sfs_super));
+		result = sfs_jwcopy(sfs, &k, &sum, SFS_SB_LOCATION);
+		if (result) {
+			lock_release(sfs->sfs_freemaplock);
+			return result;
+		}
+	}
+	lock_release(sfs->sfs_freemaplock);
+
+	jd->jd_magic = SFS_JMAGIC_DESC;
+	jd->jd_seq = j->j_seq;
+	jd->jd_nblocks = k;
+	result = sfs_wblock(sfs, sfs_jdesc, SFS_JDESC(j));
+	if (result) {
+		return result;
+	}
+
+	/* This is the write that commits it. */
+	bzero(sfs_jbuf, bs);
+	jc->jc_magic = SFS_JMAGIC_COMMIT;
+	jc->jc_seq = j->j_seq;
+	jc->jc_nblocks = k;
+	jc->jc_checksum = sum;
+	return sfs_wblock(sfs, sfs_jbuf, SFS_JCOPY(j, k));
+}
+
+/*
+ * If the journal holds transaction j_seq, committed, write its blocks
+ * home and set *REPLAYED. Called with sfs_jiolock held.
+ */
+static
+int
+sfs_jreplay(struct sfs_fs *sfs, bool *replayed)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	struct sfs_jdesc *jd = sfs_jdesc;
+	struct sfs_jcommit *jc = sfs_jbuf;
+	uint32_t *homes = SFS_JHOMES();
+	uint32_t i, n, sum, check;
+	int result;
+
+	*replayed = false;
+
+	result = sfs_rblock(sfs, sfs_jdesc, SFS_JDESC(j));
+	if (result) {
+		return result;
+	}
+	if (jd->jd_magic != SFS_JMAGIC_DESC || jd->jd_seq != j->j_seq ||
+	    jd->jd_nblocks > j->j_max) {
+		/* Nothing since the last checkpoint */
+		return 0;
+	}
+	n = jd->jd_nblocks;
+
+	result = sfs_rblock(sfs, sfs_jbuf, SFS_JCOPY(j, n));
+	if (result) {
+		return result;
+	}
+	if (jc->jc_magic != SFS_JMAGIC_COMMIT || jc->jc_seq != j->j_seq ||
+	    jc->jc_nblocks != n) {
+		/* Crashed before it committed */
+		return 0;
+	}
+	sum = jc->jc_checksum;
+
+	/* Check all the copies before writing any of them */
+	check = j->j_seq;
+	for (i=0; i<n; i++) {
+		if (homes[i] >= sfs->sfs_super.sp_nblocks) {
+			kprintf("sfs: %s: Journal names block %u, "
+				"past the end; not replaying\n",
+				sfs->sfs_super.sp_volname, homes[i]);
+			return 0;
+		}
+		result = sfs_rblock(sfs, sfs_jbuf, SFS_JCOPY(j, i));
+		if (result) {
+			return result;
+		}
+		check = sfs_jchecksum(check, sfs_jbuf, sfs->sfs_blocksize);
+	}
+	if (check != sum) {
+		kprintf("sfs: %s: Journal checksum is wrong; not replaying\n",
+			sfs->sfs_super.sp_volname);
+		return 0;
+	}
+
+	for (i=0; i<n; i++) {
+		result = sfs_rblock(sfs, sfs_jbuf, SFS_JCOPY(j, i));
+		if (result) {
+			return result;
+		}
+		result = sfs_wblock(sfs, sfs_jbuf, homes[i]);
+		if (result) {
+			return result;
+		}
+	}
+	*replayed = true;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Mount and unmount
+
+/*
+ * Allocate the memory for journal I/O. Called once at boot.
+ */
+void
+sfs_jbootstrap(void)
+{
+	sfs_jbuf = kmalloc(SFS_MAXBLOCKSIZE);
+	sfs_jdesc = kmalloc(SFS_MAXBLOCKSIZE);
+	if (sfs_jbuf == NULL || sfs_jdesc == NULL) {
+		panic("sfs_jbootstrap: Out of memory\n");
+	}
+	sfs_jiolock = lock_create("sfs journal io");
+	if (sfs_jiolock == NULL) {
+		panic("sfs_jbootstrap: Could not create lock\n");
+	}
+}
+
+static
+void
+sfs_jdestroy(struct sfs_journal *j)
+{
+	if (j->j_frees != NULL) {
+		kfree(j->j_frees);
+	}
+	cv_destroy(j->j_cv);
+	lock_destroy(j->j_lock);
+	kfree(j);
+}
+
+/*
+ * Set up the journal at mount time, replaying the last transaction if
+ * it committed but wasn't finished. Called after the superblock is
+ * read and before the free block bitmap is.
+ */
+int
+sfs_jload(struct sfs_fs *sfs)
+{
+	struct sfs_super *sp = &sfs->sfs_super;
+	struct sfs_journal *j;
+	struct sfs_jheader *jh;
+	uint32_t flags;
+	bool replayed;
+	int result;
+
+	sfs->sfs_journal = NULL;
+	if (sp->sp_jblocks == 0) {
+		/* No journal */
+		return 0;
+	}
+	if (sp->sp_jblocks < SFS_JMINBLOCKS ||
+	    sp->sp_jstart < SFS_MAP_LOCATION +
+	    SFS_BITBLOCKS(sp->sp_nblocks, sfs->sfs_blocksize) ||
+	    sp->sp_jstart >= sp->sp_nblocks ||
+	    sp->sp_jblocks > sp->sp_nblocks - sp->sp_jstart) {
+		kprintf("sfs: %s: Bad journal location (%u blocks at %u)\n",
+			sp->sp_volname, sp->sp_jblocks, sp->sp_jstart);
+		return EINVAL;
+	}
+
+	j = kmalloc(sizeof(*j));
+	if (j == NULL) {
+		return ENOMEM;
+	}
+	j->j_lock = lock_create("sfs journal");
+	if (j->j_lock == NULL) {
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_cv = cv_create("sfs journal");
+	if (j->j_cv == NULL) {
+		lock_destroy(j->j_lock);
+		kfree(j);
+		return ENOMEM;
+	}
+	j->j_active = 0;
+	j->j_closed = false;
+	j->j_start = sp->sp_jstart;
+	j->j_max = sp->sp_jblocks - 3;
+	if (j->j_max > SFS_JDESCMAX(sfs->sfs_blocksize)) {
+		j->j_max = SFS_JDESCMAX(sfs->sfs_blocksize);
+	}
+	j->j_committed = false;
+	j->j_unsafe = false;
+	j->j_needfsck = false;
+	j->j_nblocks = 0;
+	j->j_frees = NULL;
+	j->j_nfrees = 0;
+	j->j_maxfrees = 0;
+	sfs->sfs_journal = j;
+
+	lock_acquire(sfs_jiolock);
+	result = sfs_rblock(sfs, sfs_jbuf, SFS_JHEADER(j));
+	if (result) {
+		lock_release(sfs_jiolock);
+		goto fail;
+	}
+	jh = sfs_jbuf;
+	if (jh->jh_magic != SFS_JMAGIC_HEADER) {
+		lock_release(sfs_jiolock);
+		kprintf("sfs: %s: Bad journal header\n", sp->sp_volname);
+		result = EINVAL;
+		goto fail;
+	}
+	j->j_seq = jh->jh_seq;
+	flags = jh->jh_flags;
+	lock_release(sfs_jiolock);
+
+	lock_acquire(sfs_jiolock);
+	result = sfs_jreplay(sfs, &replayed);
+	lock_release(sfs_jiolock);
+	if (result) {
+		goto fail;
+	}
+
+	if (replayed) {
+		kprintf("sfs: %s: Replayed transaction %u from the journal\n",
+			sp->sp_volname, j->j_seq);
+		j->j_seq++;
+
+		/* It may have had the superblock in it */
+		result = sfs_rsuper(sfs);
+		if (result) {
+			goto fail;
+		}
+		sp->sp_volname[sizeof(sp->sp_volname)-1] = 0;
+	}
+	else if (flags & SFS_JF_UNSAFE) {
+		kprintf("sfs: %s: Metadata was written outside the journal "
+			"before a crash; run sfsck\n", sp->sp_volname);
+		j->j_needfsck = true;
+	}
+
+	if (replayed) {
+		result = sfs_jwheader(sfs);
+		if (result) {
+			goto fail;
+		}
+	}
+	return 0;
+
+ fail:
+	sfs->sfs_journal = NULL;
+	sfs_jdestroy(j);
+	return result;
+}
+
+/*
+ * Get rid of the journal at unmount time, after the last checkpoint.
+ */
+void
+sfs_junload(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+	KASSERT(j->j_active == 0);
+	KASSERT(j->j_nblocks == 0);
+	KASSERT(j->j_nfrees == 0);
+	sfs->sfs_journal = NULL;
+	sfs_jdestroy(j);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Operations
+
+/*
+ * Is the running transaction big enough to commit? sfs_nmapdirty is
+ * looked at without its lock, as it's only a hint.
+ */
+static
+bool
+sfs_jfull(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	return j->j_nblocks >= SFS_JMAXPIN / 2 ||
+		j->j_nblocks + sfs->sfs_nmapdirty + 1 >= j->j_max / 2;
+}
+
+/*
+ * Start an operation that changes metadata. Called before taking any
+ * vnode locks. Waits while a checkpoint is in progress, and starts one
+ * if the running transaction is big.
+ */
+void
+sfs_jbegin(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool tried = false;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (1) {
+		while (j->j_closed) {
+			cv_wait(j->j_cv, j->j_lock);
+		}
+		if (tried || !sfs_jfull(sfs)) {
+			break;
+		}
+
+		/*
+		 * Commit it before it gets too big. If that fails,
+		 * carry on; the transaction just gets bigger, and
+		 * the next sync reports the error.
+		 */
+		lock_release(j->j_lock);
+		(void)sfs_checkpoint(sfs);
+		lock_acquire(j->j_lock);
+		tried = true;
+	}
+	j->j_active++;
+	lock_release(j->j_lock);
+}
+
+/*
+ * Finish an operation. Called after releasing its vnode locks.
+ */
+void
+sfs_jend(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	j->j_active--;
+	if (j->j_active == 0) {
+		cv_broadcast(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Mark BUF, which holds metadata block BLOCK and which the caller has
+ * busy, dirty as part of the running transaction.
+ */
+void
+sfs_jdirty(struct sfs_fs *sfs, struct buf *buf, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		buffer_mark_dirty(buf);
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_active > 0);
+	if (buffer_is_pinned(buf)) {
+		/* Already in the transaction */
+	}
+	else if (j->j_nblocks < SFS_JMAXPIN) {
+		buffer_pin(buf);
+		j->j_blocks[j->j_nblocks++] = block;
+	}
+	else {
+		/* Can't hold back any more; let it go out as it is */
+		sfs_jsetunsafe(sfs);
+		buffer_mark_dirty(buf);
+	}
+	lock_release(j->j_lock);
+}
+
+/*
+ * Free BLOCK when the running transaction commits. The caller has
+ * already dropped any cached copy.
+ */
+void
+sfs_jfree(struct sfs_fs *sfs, uint32_t block)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	uint32_t *newfrees;
+	unsigned i, newmax;
+
+	KASSERT(j != NULL);
+
+	lock_acquire(j->j_lock);
+
+	/* It's no longer part of the transaction */
+	for (i=0; i<j->j_nblocks; i++) {
+		if (j->j_blocks[i] == block) {
+			j->j_blocks[i] = j->j_blocks[--j->j_nblocks];
+			break;
+		}
+	}
+
+	if (j->j_nfrees == j->j_maxfrees) {
+		newmax = j->j_maxfrees ? j->j_maxfrees * 2 : 64;
+		newfrees = kmalloc(newmax * sizeof(uint32_t));
+		if (newfrees == NULL) {
+			/* Free it now, and risk its being reused early */
+			sfs_jsetunsafe(sfs);
+			lock_acquire(sfs->sfs_freemaplock);
+			sfs_freemap_unmark(sfs, block);
+			lock_release(sfs->sfs_freemaplock);
+			lock_release(j->j_lock);
+			return;
+		}
+		if (j->j_frees != NULL) {
+			memcpy(newfrees, j->j_frees,
+			       j->j_nfrees * sizeof(uint32_t));
+			kfree(j->j_frees);
+		}
+		j->j_frees = newfrees;
+		j->j_maxfrees = newmax;
+	}
+	j->j_frees[j->j_nfrees++] = block;
+
+	lock_release(j->j_lock);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Checkpoints
+
+/*
+ * Wait for the operations in progress to finish, and keep new ones
+ * out until sfs_jresume.
+ */
+void
+sfs_jquiesce(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	while (j->j_closed) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	j->j_closed = true;
+	while (j->j_active > 0) {
+		cv_wait(j->j_cv, j->j_lock);
+	}
+	lock_release(j->j_lock);
+}
+
+void
+sfs_jresume(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+
+	if (j == NULL) {
+		return;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_closed);
+	j->j_closed = false;
+	cv_broadcast(j->j_cv, j->j_lock);
+	lock_release(j->j_lock);
+}
+
+/*
+ * Check if the running transaction has anything in it, i.e., whether
+ * there are pinned buffers only a checkpoint will let out.
+ */
+bool
+sfs_jpending(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	bool ret;
+
+	if (j == NULL) {
+		return false;
+	}
+
+	lock_acquire(j->j_lock);
+	ret = j->j_nblocks > 0 || j->j_nfrees > 0;
+	lock_release(j->j_lock);
+	return ret;
+}
+
+/*
+ * Commit the running transaction: write it into the journal, and let
+ * its blocks go home. Called between sfs_jquiesce and sfs_jresume.
+ */
+int
+sfs_jcommit(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	unsigned i;
+	uint32_t n;
+	int result;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_closed && j->j_active == 0);
+
+	/* Blocks it freed go back in the freemap, as part of it */
+	lock_acquire(sfs->sfs_freemaplock);
+	for (i=0; i<j->j_nfrees; i++) {
+		sfs_freemap_unmark(sfs, j->j_frees[i]);
+	}
+	j->j_nfrees = 0;
+	n = j->j_nblocks + sfs->sfs_nmapdirty + (sfs->sfs_superdirty ? 1 : 0);
+	lock_release(sfs->sfs_freemaplock);
+
+	if (n > j->j_max) {
+		/* Too big for the journal */
+		sfs_jsetunsafe(sfs);
+	}
+	if (n > 0 && !j->j_unsafe) {
+		lock_acquire(sfs_jiolock);
+		result = sfs_jwrite(sfs);
+		lock_release(sfs_jiolock);
+		if (result) {
+			lock_release(j->j_lock);
+			return result;
+		}
+		j->j_committed = true;
+	}
+
+	buffer_unpin_fs(&sfs->sfs_absfs);
+	j->j_nblocks = 0;
+
+	lock_release(j->j_lock);
+	return 0;
+}
+
+/*
+ * Everything sfs_jcommit let go has been written home; the transaction
+ * is finished, and no longer needs replaying.
+ */
+int
+sfs_jdone(struct sfs_fs *sfs)
+{
+	struct sfs_journal *j = sfs->sfs_journal;
+	int result = 0;
+
+	if (j == NULL) {
+		return 0;
+	}
+
+	lock_acquire(j->j_lock);
+	KASSERT(j->j_closed && j->j_active == 0);
+	if (j->j_committed || j->j_unsafe) {
+		if (j->j_committed) {
+			j->j_seq++;
+		}
+		j->j_committed = false;
+		j->j_unsafe = false;
+		result = sfs_jwheader(sfs);
+	}
+	lock_release(j->j_lock);
+	return result;
+}
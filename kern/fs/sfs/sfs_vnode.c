@@ -41,39 +41,103 @@
 #include <bitmap.h>
 #include <uio.h>
 #include <synch.h>
+#include <clock.h>
 #include <vfs.h>
 #include <device.h>
+#include <buf.h>
 #include <sfs.h>
+#include "opt-sfscheck.h"
 
 /* At bottom of file */
 static int sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int type,
 			 struct sfs_vnode **ret);
 
+/* Below sfs_truncate */
+static int sfs_itrunc(struct sfs_vnode *sv, off_t len);
+
+/* Read-ahead window limits, in blocks (see sfs_readahead) */
+#define SFS_RAMIN 2
+#define SFS_RAMAX 16
+
+/* Blocks reserved ahead of a growing file (see sfs_ballocfile) */
+#define SFS_RESERVE 8
+
+/* Values for sfs_bmap's DOALLOC argument */
+#define SFS_BMAP_NOALLOC  0	/* just look up */
+#define SFS_BMAP_ALLOC    1	/* allocate missing blocks, zeroed */
+#define SFS_BMAP_FILL     2	/* same, but the caller will fill the
+				   data block, so don't zero it */
+
+/* Most blocks written in one journal operation (see sfs_write) */
+#define SFS_WRITECHUNK 64
+
+/*
+ * Largest file: sfi_size is 32 bits. With big blocks the indirect
+ * blocks reach much further than this, so sfs_bmap doesn't enforce it.
+ */
+#define SFS_MAXFILESIZE ((off_t)0xffffffff)
+
+/*
+ * Free blocks kept back from delayed allocation (see sfs_dadelay) for
+ * the indirect blocks it may need.
+ */
+#define SFS_DASLACK 32
+
 ////////////////////////////////////////////////////////////
 //
 // Simple stuff
 
-/* Zero out a disk block. */
+/*
+ * Zero out a disk block. This only zeroes the block's buffer; the
+ * zeros reach the disk when the buffer is written back.
+ */
 static
 int
 sfs_clearblock(struct sfs_fs *sfs, uint32_t block)
 {
-	/* static -> automatically initialized to zero */
-	static char zeros[SFS_BLOCKSIZE];
-	return sfs_wblock(sfs, zeros, block);
+	struct buf *buf;
+	int result;
+
+	result = buffer_get(&sfs->sfs_absfs, block, sfs->sfs_blocksize, &buf);
+	if (result) {
+		return result;
+	}
+	bzero(buffer_map(buf), sfs->sfs_blocksize);
+	buffer_mark_valid(buf);
+	buffer_mark_dirty(buf);
+	buffer_release(buf);
+	return 0;
 }
 
-/* Write an on-disk inode structure back out to disk. */
+/*
+ * Write an on-disk inode structure back out. It goes to the buffer
+ * cache, as part of the journal's running transaction, and from there
+ * to disk at the next checkpoint.
+ */
 static
 int
 sfs_sync_inode(struct sfs_vnode *sv)
 {
+	struct buf *buf;
+	int result;
+
 	if (sv->sv_dirty) {
 		struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-		int result = sfs_wblock(sfs, &sv->sv_i, sv->sv_ino);
+		char *data;
+
+		result = buffer_get(&sfs->sfs_absfs, sv->sv_ino,
+				    sfs->sfs_blocksize, &buf);
 		if (result) {
 			return result;
 		}
+		/* The rest of the inode's block is zero */
+		data = buffer_map(buf);
+		memcpy(data, &sv->sv_i, sizeof(sv->sv_i));
+		bzero(data + sizeof(sv->sv_i),
+		      sfs->sfs_blocksize - sizeof(sv->sv_i));
+		buffer_mark_valid(buf);
+		sfs_jdirty(sfs, buf, sv->sv_ino);
+		buffer_release(buf);
 		sv->sv_dirty = false;
 	}
 	return 0;
@@ -84,37 +148,51 @@ sfs_sync_inode(struct sfs_vnode *sv)
 // Space allocation
 
 /*
- * Allocate a block.
+ * Allocate a block, the first free one at or after GOAL if possible.
+ * If ZERO is false the caller is going to overwrite the whole block,
+ * so we leave it alone.
  */
 static
 int
-sfs_balloc(struct sfs_fs *sfs, uint32_t *diskblock)
+sfs_balloc(struct sfs_fs *sfs, uint32_t goal, bool zero, uint32_t *diskblock)
 {
 	int result;
 
-	result = bitmap_alloc(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	result = sfs_freemap_alloc(sfs, goal, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 	if (result) {
 		return result;
 	}
-	sfs->sfs_freemapdirty = true;
 
 	if (*diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: balloc: invalid block %u\n", *diskblock);
 	}
 
+	if (!zero) {
+		return 0;
+	}
+
 	/* Clear block before returning it */
 	return sfs_clearblock(sfs, *diskblock);
 }
 
 /*
- * Free a block.
+ * Free a block. Any cached copy is thrown away, so the caller must
+ * not be holding its buffer. With a journal, the block stays in use
+ * until the running transaction commits.
  */
-static
 void
 sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock)
 {
-	bitmap_unmark(sfs->sfs_freemap, diskblock);
-	sfs->sfs_freemapdirty = true;
+	buffer_drop(&sfs->sfs_absfs, diskblock);
+	if (sfs->sfs_journal != NULL) {
+		sfs_jfree(sfs, diskblock);
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	sfs_freemap_unmark(sfs, diskblock);
+	lock_release(sfs->sfs_freemaplock);
 }
 
 /*
@@ -124,11 +202,103 @@ static
 int
 sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
 {
+	int ret;
+
 	if (diskblock >= sfs->sfs_super.sp_nblocks) {
 		panic("sfs: sfs_bused called on out of range block %u\n", 
 		      diskblock);
 	}
-	return bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_acquire(sfs->sfs_freemaplock);
+	ret = bitmap_isset(sfs->sfs_freemap, diskblock);
+	lock_release(sfs->sfs_freemaplock);
+	return ret;
+}
+
+/*
+ * Give back the blocks reserved for SV that it hasn't used. Called
+ * with sv_lock held.
+ */
+static
+void
+sfs_unreserve(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_resleft == 0) {
+		return;
+	}
+	lock_acquire(sfs->sfs_freemaplock);
+	while (sv->sv_resleft > 0) {
+		sfs_freemap_unmark(sfs, sv->sv_resnext);
+		sv->sv_resnext++;
+		sv->sv_resleft--;
+	}
+	lock_release(sfs->sfs_freemaplock);
+}
+
+/*
+ * Allocate a block (data or indirect) for the file SV, zeroed if ZERO
+ * is set. Called with sv_lock held.
+ *
+ * So that a file being written sequentially ends up laid out
+ * sequentially, we aim for the block after the last one we gave it
+ * (or, the first time, the block after its inode). And so that two
+ * files growing at once don't interleave their blocks, the first
+ * allocation in a new place also reserves up to SFS_RESERVE-1 free
+ * blocks straight after it for the file's next allocations. The
+ * reservation is marked in the freemap; unused blocks are given back
+ * on truncate and when the vnode is reclaimed. (If we crash with some
+ * still reserved, sfsck finds them and frees them.)
+ */
+static
+int
+sfs_ballocfile(struct sfs_vnode *sv, bool zero, uint32_t *diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t goal, block;
+	int result;
+
+	goal = sv->sv_lastalloc != 0 ? sv->sv_lastalloc + 1 : sv->sv_ino + 1;
+
+	if (sv->sv_resleft > 0 && sv->sv_resnext == goal) {
+		/* Take the next reserved block */
+		block = sv->sv_resnext++;
+		sv->sv_resleft--;
+		if (zero) {
+			result = sfs_clearblock(sfs, block);
+			if (result) {
+				sfs_bfree(sfs, block);
+				return result;
+			}
+		}
+	}
+	else {
+		/* Not where we were reserving; start over */
+		sfs_unreserve(sv);
+
+		result = sfs_balloc(sfs, goal, zero, &block);
+		if (result) {
+			return result;
+		}
+
+		lock_acquire(sfs->sfs_freemaplock);
+		sv->sv_resnext = block + 1;
+		/* Don't take blocks promised to delayed allocations */
+		while (sv->sv_resleft < SFS_RESERVE - 1 &&
+		       sfs->sfs_nfree > sfs->sfs_dareserved + SFS_DASLACK &&
+		       sv->sv_resnext + sv->sv_resleft <
+		       sfs->sfs_super.sp_nblocks &&
+		       !bitmap_isset(sfs->sfs_freemap,
+				     sv->sv_resnext + sv->sv_resleft)) {
+			sfs_freemap_mark(sfs, sv->sv_resnext + sv->sv_resleft);
+			sv->sv_resleft++;
+		}
+		lock_release(sfs->sfs_freemaplock);
+	}
+
+	sv->sv_lastalloc = block;
+	*diskblock = block;
+	return 0;
 }
 
 ////////////////////////////////////////////////////////////
@@ -139,29 +309,27 @@ sfs_bused(struct sfs_fs *sfs, uint32_t diskblock)
  * Look up the disk block number (from 0 up to the number of blocks on
  * the disk) given a file and the logical block number within that
  * file. If DOALLOC is set, and no such block exists, one will be
- * allocated.
+ * allocated: zeroed for SFS_BMAP_ALLOC, or left as it is for
+ * SFS_BMAP_FILL, which is for a caller about to write the whole data
+ * block. (Indirect blocks are always zeroed.)
  */
 static
 int
 sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	 uint32_t *diskblock)
 {
-	/*
-	 * I/O buffer for handling indirect blocks.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
-	uint32_t block;
-	uint32_t idblock;
-	uint32_t idnum, idoff;
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t block, idblock;
+	uint32_t *idptr;
+	uint32_t idoff, dbperidb;
+	uint64_t span;
+	uint32_t origblock = fileblock;
+	int levels, i;
 	int result;
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	dbperidb = SFS_DBPERIDB(sfs->sfs_blocksize);
 
 	/*
 	 * If the block we want is one of the direct blocks...
@@ -176,7 +344,8 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		 * Do we need to allocate?
 		 */
 		if (block==0 && doalloc) {
-			result = sfs_balloc(sfs, &block);
+			result = sfs_ballocfile(sv, doalloc != SFS_BMAP_FILL,
+						&block);
 			if (result) {
 				return result;
 			}
@@ -198,29 +367,33 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 	}
 
 	/*
-	 * It's not a direct block; it must be in the indirect block.
-	 * Subtract off the number of direct blocks, so FILEBLOCK is
-	 * now the offset into the indirect block space.
+	 * It's not a direct block; it must be under one of the indirect
+	 * blocks. Subtract off the blocks each level covers (SPAN) until
+	 * we find the one it's in; FILEBLOCK is then the offset into
+	 * that level's block space.
 	 */
-
 	fileblock -= SFS_NDIRECT;
-
-	/* Get the indirect block number and offset w/i that indirect block */
-	idnum = fileblock / SFS_DBPERIDB;
-	idoff = fileblock % SFS_DBPERIDB;
-
-	/*
-	 * We only have one indirect block. If the offset we were asked for
-	 * is too large, we can't handle it, so fail.
-	 */
-	if (idnum > 0) {
+	span = dbperidb;
+	for (levels=1; levels<=3; levels++) {
+		if (fileblock < span) {
+			break;
+		}
+		fileblock -= span;
+		span *= dbperidb;
+	}
+	switch (levels) {
+	    case 1: idptr = &sv->sv_i.sfi_indirect; break;
+	    case 2: idptr = &sv->sv_i.sfi_dindirect; break;
+	    case 3: idptr = &sv->sv_i.sfi_tindirect; break;
+	    default:
+		/* Past the end of the triple indirect block */
 		return EFBIG;
 	}
 
-	/* Get the disk block number of the indirect block. */
-	idblock = sv->sv_i.sfi_indirect;
+	/* Get the disk block number of the top indirect block. */
+	block = *idptr;
 
-	if (idblock==0 && !doalloc) {
+	if (block==0 && !doalloc) {
 		/*
 		 * There's no indirect block allocated. We weren't
 		 * asked to allocate anything, so pretend the indirect
@@ -229,70 +402,410 @@ sfs_bmap(struct sfs_vnode *sv, uint32_t fileblock, int doalloc,
 		*diskblock = 0;
 		return 0;
 	}
-	else if (idblock==0) {
+	else if (block==0) {
 		/*
 		 * There's no indirect block allocated, but we need to
-		 * allocate a block whose number needs to be stored in
-		 * the indirect block. Thus, we need to allocate an
-		 * indirect block.
+		 * allocate a block whose number needs to be stored
+		 * under it. Thus, we need to allocate one.
 		 */
-		result = sfs_balloc(sfs, &idblock);
+		result = sfs_ballocfile(sv, true, &block);
 		if (result) {
 			return result;
 		}
 
 		/* Remember the block we just allocated */
-		sv->sv_i.sfi_indirect = idblock;
+		*idptr = block;
 
 		/* Mark the inode dirty */
 		sv->sv_dirty = true;
-
-		/* Clear the indirect block buffer */
-		bzero(idbuf, sizeof(idbuf));
 	}
-	else {
+
+	/*
+	 * Walk down through the indirect blocks. At each level, each
+	 * entry covers SPAN blocks of the file.
+	 */
+	for (i=0; i<levels; i++) {
+		span /= dbperidb;
+		idoff = (fileblock / span) % dbperidb;
+
 		/*
-		 * We already have an indirect block allocated; load it.
+		 * Get the indirect block from the buffer cache. (If we
+		 * just allocated it, sfs_balloc left it there, zeroed.)
 		 */
-		result = sfs_rblock(sfs, idbuf, idblock);
+		idblock = block;
+		result = buffer_read(&sfs->sfs_absfs, idblock,
+				     sfs->sfs_blocksize, &idbuffer);
 		if (result) {
 			return result;
 		}
+		idbuf = buffer_map(idbuffer);
+
+		/* Get the next block out of the indirect block buffer */
+		block = idbuf[idoff];
+
+		/* If there's no block there, allocate one */
+		if (block==0 && doalloc) {
+			/* The last level down is the data block */
+			result = sfs_ballocfile(sv, i < levels - 1 ||
+						doalloc != SFS_BMAP_FILL, &block);
+			if (result) {
+				buffer_release(idbuffer);
+				return result;
+			}
+
+			/* Remember the block we allocated */
+			idbuf[idoff] = block;
+
+			/* The indirect block is now dirty */
+			sfs_jdirty(sfs, idbuffer, idblock);
+		}
+		buffer_release(idbuffer);
+
+		if (block==0) {
+			/* A hole; nothing further down */
+			break;
+		}
 	}
 
-	/* Get the block out of the indirect block buffer */
-	block = idbuf[idoff];
+	/* Hand back the result and return. */
+	if (block != 0 && !sfs_bused(sfs, block)) {
+		panic("sfs: Data block %u (block %u of file %u) marked free\n",
+		      block, origblock, sv->sv_ino);
+	}
+	*diskblock = block;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Delayed allocation
+//
+// New file data isn't given disk blocks as it's written. Instead it
+// waits in memory (sv_da) until the file has SFS_DAMAX such blocks,
+// or is synced or reclaimed; then sfs_daflush allocates all of them
+// at once, in file order, so they come out contiguous, and writes
+// each contiguous run with a single transfer. Many small appends
+// thus become one allocation pass and one big write.
+//
+// Blocks for the waiting data are promised (sfs_dareserved) when it
+// is first written, so the flush can't run out of space. The data
+// itself goes in a pool allocated once at boot and shared by all
+// mounts; we don't allocate memory per block or per mount, since
+// under dumbvm anything of a page or more is never given back. The
+// pool is kept in SFS_BLOCKSIZE units, and a block of a bigger size
+// takes an aligned run of them. When it's full, writes just allocate
+// disk blocks as usual. Directories are metadata and aren't delayed.
+
+#define SFS_DAUNITS (SFS_DAMAXBYTES / SFS_BLOCKSIZE)
+
+static char *sfs_dapool;		/* the memory */
+static struct bitmap *sfs_dapoolmap;	/* units in use */
+static struct lock *sfs_dapoollock;	/* lock for sfs_dapoolmap */
+
+/*
+ * Allocate the pool.
+ */
+void
+sfs_dabootstrap(void)
+{
+	sfs_dapool = kmalloc(SFS_DAMAXBYTES);
+	if (sfs_dapool == NULL) {
+		panic("sfs_dabootstrap: Out of memory\n");
+	}
+	sfs_dapoolmap = bitmap_create(SFS_DAUNITS);
+	if (sfs_dapoolmap == NULL) {
+		panic("sfs_dabootstrap: Out of memory\n");
+	}
+	sfs_dapoollock = lock_create("sfs dapool");
+	if (sfs_dapoollock == NULL) {
+		panic("sfs_dabootstrap: Could not create lock\n");
+	}
+}
+
+/*
+ * Find the waiting data for block FILEBLOCK of SV, if any.
+ */
+static
+char *
+sfs_dafind(struct sfs_vnode *sv, uint32_t fileblock)
+{
+	unsigned i;
+
+	for (i=0; i<sv->sv_nda; i++) {
+		if (sv->sv_da[i].db_fileblock == fileblock) {
+			return sv->sv_da[i].db_data;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take a free block of SFS's block size from the pool, or return
+ * NULL if there isn't one.
+ */
+static
+char *
+sfs_dagetblock(struct sfs_fs *sfs)
+{
+	unsigned n = sfs->sfs_blocksize / SFS_BLOCKSIZE;
+	unsigned slot, i;
+
+	lock_acquire(sfs_dapoollock);
+	for (slot = 0; slot < SFS_DAUNITS; slot += n) {
+		for (i=0; i<n; i++) {
+			if (bitmap_isset(sfs_dapoolmap, slot + i)) {
+				break;
+			}
+		}
+		if (i == n) {
+			for (i=0; i<n; i++) {
+				bitmap_mark(sfs_dapoolmap, slot + i);
+			}
+			lock_release(sfs_dapoollock);
+			return sfs_dapool + slot * SFS_BLOCKSIZE;
+		}
+	}
+	lock_release(sfs_dapoollock);
+	return NULL;
+}
+
+/*
+ * Give back a pool block, DATA, taken by sfs_dagetblock.
+ */
+static
+void
+sfs_daputblock(struct sfs_fs *sfs, char *data)
+{
+	unsigned n = sfs->sfs_blocksize / SFS_BLOCKSIZE;
+	unsigned slot, i;
 
-	/* If there's no block there, allocate one */
-	if (block==0 && doalloc) {
-		result = sfs_balloc(sfs, &block);
+	slot = (data - sfs_dapool) / SFS_BLOCKSIZE;
+	lock_acquire(sfs_dapoollock);
+	for (i=0; i<n; i++) {
+		bitmap_unmark(sfs_dapoolmap, slot + i);
+	}
+	lock_release(sfs_dapoollock);
+}
+
+/*
+ * Write the waiting blocks FIRST through FIRST+N-1 of SV, which have
+ * been given the consecutive disk blocks starting at DISKBLOCK. If
+ * they sit in a row in the pool, as they do after a run of appends,
+ * they go to the disk in one transfer; otherwise (or if that fails)
+ * through the buffer cache, whose writeback gathers them again.
+ */
+static
+int
+sfs_dawrite(struct sfs_vnode *sv, unsigned first, unsigned n,
+	    uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t bs = sfs->sfs_blocksize;
+	struct iovec iov;
+	struct uio ku;
+	struct buf *buf;
+	char *data = sv->sv_da[first].db_data;
+	unsigned i;
+	int result;
+
+	for (i=1; i<n; i++) {
+		if (sv->sv_da[first+i].db_data != data + i*bs) {
+			break;
+		}
+	}
+	if (i == n) {
+		uio_kinit(&iov, &ku, data, n * bs, (off_t)diskblock * bs,
+			  UIO_WRITE);
+		result = sfs_rwblock(sfs, &ku);
+		if (result == 0) {
+			return 0;
+		}
+	}
+
+	for (i=0; i<n; i++) {
+		result = buffer_get(&sfs->sfs_absfs, diskblock + i, bs, &buf);
 		if (result) {
 			return result;
 		}
+		memcpy(buffer_map(buf), sv->sv_da[first+i].db_data, bs);
+		buffer_mark_valid(buf);
+		buffer_mark_dirty(buf);
+		buffer_release(buf);
+	}
+	return 0;
+}
 
-		/* Remember the block we allocated */
-		idbuf[idoff] = block;
+/*
+ * Give all of SV's waiting data disk blocks and write it out. Called
+ * with sv_lock held, in a journal operation.
+ */
+static
+int
+sfs_daflush(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	uint32_t diskblocks[SFS_DAMAX];
+	unsigned i, j, n;
+	int result = 0, result2;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
+
+	/* Allocate in file order, so the blocks come out in a row */
+	for (n=0; n<sv->sv_nda; n++) {
+		lock_acquire(sfs->sfs_freemaplock);
+		KASSERT(sfs->sfs_dareserved > 0);
+		sfs->sfs_dareserved--;
+		lock_release(sfs->sfs_freemaplock);
 
-		/* The indirect block is now dirty; write it back */
-		result = sfs_wblock(sfs, idbuf, idblock);
+		result = sfs_bmap(sv, sv->sv_da[n].db_fileblock,
+				  SFS_BMAP_FILL, &diskblocks[n]);
+		if (result) {
+			lock_acquire(sfs->sfs_freemaplock);
+			sfs->sfs_dareserved++;
+			lock_release(sfs->sfs_freemaplock);
+			break;
+		}
+	}
+
+	/* Write each run of consecutive disk blocks at once */
+	for (i=0; i<n; i=j) {
+		for (j=i+1; j<n && diskblocks[j] == diskblocks[j-1]+1; j++) {
+			/* nothing */
+		}
+		result2 = sfs_dawrite(sv, i, j-i, diskblocks[i]);
+		if (result2 && result == 0) {
+			result = result2;
+		}
+	}
+
+	/* Forget the ones that have blocks now */
+	for (i=0; i<n; i++) {
+		sfs_daputblock(sfs, sv->sv_da[i].db_data);
+	}
+	for (i=n; i<sv->sv_nda; i++) {
+		sv->sv_da[i-n] = sv->sv_da[i];
+	}
+	sv->sv_nda -= n;
+
+	return result;
+}
+
+/*
+ * Called when writing block FILEBLOCK of SV, which has no disk block.
+ * Sets *DATA to a zeroed block of memory to write into instead, or to
+ * NULL if the caller should allocate a disk block as usual (the file
+ * is a directory, or memory or space is short).
+ */
+static
+int
+sfs_dadelay(struct sfs_vnode *sv, uint32_t fileblock, char **data)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	char *block;
+	bool ok;
+	unsigned i;
+	int result;
+
+	*data = NULL;
+
+	if (sv->sv_i.sfi_type != SFS_TYPE_FILE) {
+		return 0;
+	}
+
+	if (sv->sv_nda == SFS_DAMAX) {
+		result = sfs_daflush(sv);
 		if (result) {
 			return result;
 		}
 	}
 
-	/* Hand back the result and return. */
-	if (block != 0 && !sfs_bused(sfs, block)) {
-		panic("sfs: Data block %u (block %u of file %u) marked free\n",
-		      block, fileblock, sv->sv_ino);
+	/* Take a pool block, then promise a disk block for it */
+	block = sfs_dagetblock(sfs);
+	if (block == NULL) {
+		return 0;
 	}
-	*diskblock = block;
+
+	/* Keep some back for indirect blocks */
+	lock_acquire(sfs->sfs_freemaplock);
+	ok = sfs->sfs_nfree > sfs->sfs_dareserved + SFS_DASLACK;
+	if (ok) {
+		sfs->sfs_dareserved++;
+	}
+	lock_release(sfs->sfs_freemaplock);
+	if (!ok) {
+		sfs_daputblock(sfs, block);
+		return 0;
+	}
+
+	bzero(block, sfs->sfs_blocksize);
+
+	if (sv->sv_nda == 0) {
+		uint32_t nsecs;
+
+		gettime(&sv->sv_datime, &nsecs);
+	}
+
+	/* Keep them in file order */
+	for (i=sv->sv_nda; i>0 && sv->sv_da[i-1].db_fileblock > fileblock;
+	     i--) {
+		sv->sv_da[i] = sv->sv_da[i-1];
+	}
+	sv->sv_da[i].db_fileblock = fileblock;
+	sv->sv_da[i].db_data = block;
+	sv->sv_nda++;
+
+	*data = block;
 	return 0;
 }
 
+/*
+ * Throw away SV's waiting data at or past file block BLOCKLEN.
+ */
+static
+void
+sfs_datrunc(struct sfs_vnode *sv, uint32_t blocklen)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dablock *db;
+
+	while (sv->sv_nda > 0) {
+		db = &sv->sv_da[sv->sv_nda - 1];
+		if (db->db_fileblock < blocklen) {
+			break;
+		}
+		sfs_daputblock(sfs, db->db_data);
+		sv->sv_nda--;
+
+		lock_acquire(sfs->sfs_freemaplock);
+		KASSERT(sfs->sfs_dareserved > 0);
+		sfs->sfs_dareserved--;
+		lock_release(sfs->sfs_freemaplock);
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // File-level I/O
 
+/*
+ * Mark a buffer holding block DISKBLOCK of SV dirty. Directory
+ * contents are metadata, so they go in the journal; file data
+ * doesn't.
+ */
+static
+void
+sfs_dirtyblock(struct sfs_vnode *sv, struct buf *buf, uint32_t diskblock)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+
+	if (sv->sv_i.sfi_type == SFS_TYPE_DIR) {
+		sfs_jdirty(sfs, buf, diskblock);
+	}
+	else {
+		buffer_mark_dirty(buf);
+	}
+}
+
 /*
  * Do I/O to a block of a file that doesn't cover the whole block.  We
  * need to read in the original block first, even if we're writing, so
@@ -308,71 +821,83 @@ int
 sfs_partialio(struct sfs_vnode *sv, struct uio *uio,
 	      uint32_t skipstart, uint32_t len)
 {
-	/*
-	 * I/O buffer for handling partial sectors.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static char iobuf[SFS_BLOCKSIZE];
-
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
+	char *iobuf;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	char *dadata;
 	int result;
-	
-	/* Allocate missing blocks if and only if we're writing */
-	int doalloc = (uio->uio_rw==UIO_WRITE);
 
-	KASSERT(skipstart + len <= SFS_BLOCKSIZE);
+	KASSERT(skipstart + len <= sfs->sfs_blocksize);
 
 	/* Compute the block offset of this block in the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	/* New data still waiting for a disk block is in memory */
+	dadata = sfs_dafind(sv, fileblock);
+	if (dadata != NULL) {
+		return uiomove(dadata + skipstart, len, uio);
+	}
 
 	/* Get the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	/*
+	 * If writing where there's no block, keep the data in memory
+	 * for now if we can, and allocate a block if we can't.
+	 */
+	if (diskblock == 0 && uio->uio_rw == UIO_WRITE) {
+		result = sfs_dadelay(sv, fileblock, &dadata);
+		if (result) {
+			return result;
+		}
+		if (dadata != NULL) {
+			return uiomove(dadata + skipstart, len, uio);
+		}
+		result = sfs_bmap(sv, fileblock, SFS_BMAP_ALLOC, &diskblock);
+		if (result) {
+			return result;
+		}
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * There was no block mapped at this point in the file.
-		 * Zero the buffer.
+		 * Hand back zeros.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		bzero(iobuf, sizeof(iobuf));
-	}
-	else {
-		/*
-		 * Read the block.
-		 */
-		result = sfs_rblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		return uiomovezeros(len, uio);
 	}
 
 	/*
-	 * Now perform the requested operation into/out of the buffer.
+	 * Get the block from the buffer cache.
 	 */
-	result = uiomove(iobuf+skipstart, len, uio);
+	result = buffer_read(&sfs->sfs_absfs, diskblock, sfs->sfs_blocksize,
+			     &iobuffer);
 	if (result) {
 		return result;
 	}
+	iobuf = buffer_map(iobuffer);
+
+	/*
+	 * Now perform the requested operation into/out of the buffer.
+	 */
+	result = uiomove(iobuf+skipstart, len, uio);
 
 	/*
-	 * If it was a write, write back the modified block.
+	 * If it was a write, the buffer is now dirty (even if the
+	 * uiomove only got partway).
 	 */
 	if (uio->uio_rw == UIO_WRITE) {
-		result = sfs_wblock(sfs, iobuf, diskblock);
-		if (result) {
-			return result;
-		}
+		sfs_dirtyblock(sv, iobuffer, diskblock);
 	}
+	buffer_release(iobuffer);
 
-	return 0;
+	return result;
 }
 
 /*
@@ -383,24 +908,48 @@ int
 sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 {
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct buf *iobuffer;
 	uint32_t diskblock;
 	uint32_t fileblock;
+	char *dadata;
+	bool newblock = false;
 	int result;
-	int doalloc = (uio->uio_rw==UIO_WRITE);
-	off_t saveoff;
-	off_t diskoff;
-	off_t saveres;
-	off_t diskres;
 
 	/* Get the block number within the file */
-	fileblock = uio->uio_offset / SFS_BLOCKSIZE;
+	fileblock = uio->uio_offset / sfs->sfs_blocksize;
+
+	/* New data still waiting for a disk block is in memory */
+	dadata = sfs_dafind(sv, fileblock);
+	if (dadata != NULL) {
+		return uiomove(dadata, sfs->sfs_blocksize, uio);
+	}
 
 	/* Look up the disk block number */
-	result = sfs_bmap(sv, fileblock, doalloc, &diskblock);
+	result = sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC, &diskblock);
 	if (result) {
 		return result;
 	}
 
+	/*
+	 * If writing where there's no block, keep the data in memory
+	 * for now if we can; otherwise allocate one. We are about to
+	 * fill it, so it isn't zeroed first.
+	 */
+	if (diskblock == 0 && uio->uio_rw == UIO_WRITE) {
+		result = sfs_dadelay(sv, fileblock, &dadata);
+		if (result) {
+			return result;
+		}
+		if (dadata != NULL) {
+			return uiomove(dadata, sfs->sfs_blocksize, uio);
+		}
+		result = sfs_bmap(sv, fileblock, SFS_BMAP_FILL, &diskblock);
+		if (result) {
+			return result;
+		}
+		newblock = true;
+	}
+
 	if (diskblock == 0) {
 		/*
 		 * No block - fill with zeros.
@@ -409,33 +958,50 @@ sfs_blockio(struct sfs_vnode *sv, struct uio *uio)
 		 * allocated a block for us.
 		 */
 		KASSERT(uio->uio_rw == UIO_READ);
-		return uiomovezeros(SFS_BLOCKSIZE, uio);
+		return uiomovezeros(sfs->sfs_blocksize, uio);
 	}
 
 	/*
-	 * Do the I/O directly to the uio region. Save the uio_offset,
-	 * and substitute one that makes sense to the device.
+	 * Go through the buffer cache. When writing we are about to
+	 * replace the whole block, so there's no need to read it in
+	 * first.
 	 */
-	saveoff = uio->uio_offset;
-	diskoff = diskblock * SFS_BLOCKSIZE;
-	uio->uio_offset = diskoff;
+	KASSERT(uio->uio_resid >= sfs->sfs_blocksize);
+	if (uio->uio_rw == UIO_READ) {
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     sfs->sfs_blocksize, &iobuffer);
+	}
+	else {
+		result = buffer_get(&sfs->sfs_absfs, diskblock,
+				    sfs->sfs_blocksize, &iobuffer);
+	}
+	if (result) {
+		return result;
+	}
 
-	/*
-	 * Temporarily set the residue to be one block size.
-	 */
-	KASSERT(uio->uio_resid >= SFS_BLOCKSIZE);
-	saveres = uio->uio_resid;
-	diskres = SFS_BLOCKSIZE;
-	uio->uio_resid = diskres;
-	
-	result = sfs_rwblock(sfs, uio);
+	result = uiomove(buffer_map(iobuffer), sfs->sfs_blocksize, uio);
 
-	/*
-	 * Now, restore the original uio_offset and uio_resid and update 
-	 * them by the amount of I/O done.
-	 */
-	uio->uio_offset = (uio->uio_offset - diskoff) + saveoff;
-	uio->uio_resid = (uio->uio_resid - diskres) + saveres;
+	if (uio->uio_rw == UIO_WRITE) {
+		if (result == 0) {
+			buffer_mark_valid(iobuffer);
+		}
+		else if (newblock && !buffer_is_valid(iobuffer)) {
+			/*
+			 * The uiomove failed partway through a block we
+			 * just allocated and didn't zero. It's in the
+			 * file now, so it mustn't be left holding
+			 * whatever was on the disk: zero it.
+			 */
+			bzero(buffer_map(iobuffer), sfs->sfs_blocksize);
+			buffer_mark_valid(iobuffer);
+		}
+		if (buffer_is_valid(iobuffer)) {
+			/* (If the uiomove failed partway through a block
+			 * we didn't have, the release discards it.) */
+			sfs_dirtyblock(sv, iobuffer, diskblock);
+		}
+	}
+	buffer_release(iobuffer);
 
 	return result;
 }
@@ -447,11 +1013,18 @@ static
 int
 sfs_io(struct sfs_vnode *sv, struct uio *uio)
 {
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 	uint32_t blkoff;
 	uint32_t nblocks, i;
 	int result = 0;
 	uint32_t extraresid = 0;
 
+	/* Don't let the size wrap around */
+	if (uio->uio_rw == UIO_WRITE &&
+	    uio->uio_offset + uio->uio_resid > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
 	/*
 	 * If reading, check for EOF. If we can read a partial area,
 	 * remember how much extra there was in EXTRARESID so we can
@@ -476,13 +1049,13 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * First, do any leading partial block.
 	 */
-	blkoff = uio->uio_offset % SFS_BLOCKSIZE;
+	blkoff = uio->uio_offset % sfs->sfs_blocksize;
 	if (blkoff != 0) {
 		/* Number of bytes at beginning of block to skip */
 		uint32_t skip = blkoff;
 
 		/* Number of bytes to read/write after that point */
-		uint32_t len = SFS_BLOCKSIZE - blkoff;
+		uint32_t len = sfs->sfs_blocksize - blkoff;
 
 		/* ...which might be less than the rest of the block */
 		if (len > uio->uio_resid) {
@@ -504,8 +1077,8 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now we should be block-aligned. Do the remaining whole blocks.
 	 */
-	KASSERT(uio->uio_offset % SFS_BLOCKSIZE == 0);
-	nblocks = uio->uio_resid / SFS_BLOCKSIZE;
+	KASSERT(uio->uio_offset % sfs->sfs_blocksize == 0);
+	nblocks = uio->uio_resid / sfs->sfs_blocksize;
 	for (i=0; i<nblocks; i++) {
 		result = sfs_blockio(sv, uio);
 		if (result) {
@@ -516,7 +1089,7 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	/*
 	 * Now do any remaining partial block at the end.
 	 */
-	KASSERT(uio->uio_resid < SFS_BLOCKSIZE);
+	KASSERT(uio->uio_resid < sfs->sfs_blocksize);
 
 	if (uio->uio_resid > 0) {
 		result = sfs_partialio(sv, uio, 0, uio->uio_resid);
@@ -541,6 +1114,78 @@ sfs_io(struct sfs_vnode *sv, struct uio *uio)
 	return result;
 }
 
+/*
+ * Read-ahead. Called from sfs_read, with sv_lock held, before doing
+ * the read described by UIO.
+ *
+ * A read that starts where the last one left off is sequential. The
+ * first sequential read opens a window of SFS_RAMIN blocks past the
+ * end of the read, and each further one doubles it, up to SFS_RAMAX;
+ * any other read closes it again. Blocks in the window that haven't
+ * been asked for yet are handed to the buffer cache's read-ahead
+ * thread, so the disk fetches them while the caller is still busy
+ * with the ones it has.
+ */
+static
+void
+sfs_readahead(struct sfs_vnode *sv, struct uio *uio)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	off_t size = sv->sv_i.sfi_size;
+	off_t endpos;
+	uint32_t fileblock, endblock, nblocks, diskblock;
+
+	if (uio->uio_offset >= size || uio->uio_resid == 0) {
+		return;
+	}
+
+	endpos = uio->uio_offset + uio->uio_resid;
+	if (endpos > size) {
+		endpos = size;
+	}
+
+	if (uio->uio_offset != sv->sv_ranext) {
+		/* Not sequential */
+		sv->sv_ranext = endpos;
+		sv->sv_rablock = 0;
+		sv->sv_rawindow = 0;
+		return;
+	}
+	sv->sv_ranext = endpos;
+
+	if (sv->sv_rawindow == 0) {
+		sv->sv_rawindow = SFS_RAMIN;
+	}
+	else if (sv->sv_rawindow < SFS_RAMAX) {
+		sv->sv_rawindow *= 2;
+	}
+
+	/* Blocks from the one after this read to the end of the window */
+	fileblock = DIVROUNDUP(endpos, sfs->sfs_blocksize);
+	endblock = fileblock + sv->sv_rawindow;
+	nblocks = DIVROUNDUP(size, sfs->sfs_blocksize);
+	if (endblock > nblocks) {
+		endblock = nblocks;
+	}
+	if (fileblock < sv->sv_rablock) {
+		fileblock = sv->sv_rablock;
+	}
+
+	for (; fileblock < endblock; fileblock++) {
+		if (sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC, &diskblock)) {
+			break;
+		}
+		/* Holes read as zeros without touching the disk */
+		if (diskblock != 0) {
+			buffer_readahead(&sfs->sfs_absfs, diskblock,
+					 sfs->sfs_blocksize);
+		}
+	}
+	if (fileblock > sv->sv_rablock) {
+		sv->sv_rablock = fileblock;
+	}
+}
+
 ////////////////////////////////////////////////////////////
 //
 // Directory I/O
@@ -592,60 +1237,170 @@ sfs_writedir(struct sfs_vnode *sv, struct sfs_dir *sd, int slot)
 	off_t actualpos;
 	int result;
 
-	/* Compute the actual position in the directory. */
-	KASSERT(slot>=0);
-	actualpos = slot * sizeof(struct sfs_dir);
+	/* Compute the actual position in the directory. */
+	KASSERT(slot>=0);
+	actualpos = slot * sizeof(struct sfs_dir);
+
+	/* Set up a uio to do the write */ 
+	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+
+	/* do it */
+	result = sfs_io(sv, &ku);
+	if (result) {
+		return result;
+	}
+
+	/* Should not end up with a partial entry! */
+	if (ku.uio_resid > 0) {
+		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+	}
+
+	/* Done */
+	return 0;
+}
+
+/*
+ * Compute the number of entries in a directory.
+ * This actually computes the number of existing slots, and does not
+ * account for empty slots.
+ */
+static
+int
+sfs_dir_nentries(struct sfs_vnode *sv)
+{
+	off_t size;
+
+	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
+
+	size = sv->sv_i.sfi_size;
+	if (size % sizeof(struct sfs_dir) != 0) {
+		panic("sfs: directory %u: Invalid size %llu\n",
+		      sv->sv_ino, size);
+	}
+
+	return size / sizeof(struct sfs_dir);
+}
+
+/*
+ * Build the name index for a directory (see sfs_dirindex.c) by
+ * reading the whole directory, a block at a time, straight out of the
+ * buffer cache. (Directories never have delayed data.)
+ */
+static
+int
+sfs_dir_buildindex(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	struct sfs_dirindex *di;
+	const struct sfs_dir *sds;
+	struct buf *buf;
+	char name[sizeof(sds->sfd_name)];
+	uint32_t fileblock, diskblock;
+	int perblock = sfs->sfs_blocksize / sizeof(struct sfs_dir);
+	int nentries = sfs_dir_nentries(sv);
+	int i, j, n, result;
+
+	KASSERT(sv->sv_dirindex == NULL);
+
+	di = sfs_dirindex_create();
+	if (di == NULL) {
+		return ENOMEM;
+	}
+
+	result = 0;
+	for (i=0; i<nentries && result==0; i+=n) {
+		n = nentries - i;
+		if (n > perblock) {
+			n = perblock;
+		}
+		fileblock = i / perblock;
+		result = sfs_bmap(sv, fileblock, SFS_BMAP_NOALLOC, &diskblock);
+		if (result) {
+			break;
+		}
+
+		if (diskblock == 0) {
+			/* A hole reads as zeros: all empty slots */
+			for (j=0; j<n && result==0; j++) {
+				result = sfs_dirindex_addfree(di, i+j);
+			}
+			continue;
+		}
+
+		result = buffer_read(&sfs->sfs_absfs, diskblock,
+				     sfs->sfs_blocksize, &buf);
+		if (result) {
+			break;
+		}
+		sds = buffer_map(buf);
+
+		for (j=0; j<n && result==0; j++) {
+			if (sds[j].sfd_ino == SFS_NOINO) {
+				result = sfs_dirindex_addfree(di, i+j);
+				continue;
+			}
+			/* Ensure null termination, just in case */
+			memcpy(name, sds[j].sfd_name, sizeof(name));
+			name[sizeof(name)-1] = 0;
+
+			/* Each name may legally appear only once... */
+			KASSERT(sfs_dirindex_find(di, name,
+						  NULL, NULL) == ENOENT);
 
-	/* Set up a uio to do the write */ 
-	uio_kinit(&iov, &ku, sd, sizeof(struct sfs_dir), actualpos, UIO_WRITE);
+			result = sfs_dirindex_add(di, name,
+						  sds[j].sfd_ino, i+j);
+		}
+		buffer_release(buf);
+	}
 
-	/* do it */
-	result = sfs_io(sv, &ku);
 	if (result) {
+		sfs_dirindex_destroy(di);
 		return result;
 	}
+	sv->sv_dirindex = di;
+	return 0;
+}
 
-	/* Should not end up with a partial entry! */
-	if (ku.uio_resid > 0) {
-		panic("sfs: writedir: Short write (ino %u)\n", sv->sv_ino);
+/*
+ * Get rid of a directory's name index, if it has one, because it
+ * couldn't be kept up to date. It will be rebuilt when next needed.
+ */
+static
+void
+sfs_dir_dropindex(struct sfs_vnode *sv)
+{
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_destroy(sv->sv_dirindex);
+		sv->sv_dirindex = NULL;
 	}
-
-	/* Done */
-	return 0;
 }
 
 /*
- * Compute the number of entries in a directory.
- * This actually computes the number of existing slots, and does not
- * account for empty slots.
+ * Make sure a directory has its name index. Returns ENOMEM if there
+ * isn't memory for one, in which case the caller should fall back
+ * to scanning the directory.
  */
 static
 int
-sfs_dir_nentries(struct sfs_vnode *sv)
+sfs_dir_getindex(struct sfs_vnode *sv)
 {
-	off_t size;
-
-	KASSERT(sv->sv_i.sfi_type == SFS_TYPE_DIR);
-
-	size = sv->sv_i.sfi_size;
-	if (size % sizeof(struct sfs_dir) != 0) {
-		panic("sfs: directory %u: Invalid size %llu\n",
-		      sv->sv_ino, size);
+	if (sv->sv_dirindex != NULL) {
+		return 0;
 	}
-
-	return size / sizeof(struct sfs_dir);
+	return sfs_dir_buildindex(sv);
 }
 
 /*
  * Search a directory for a particular filename in a directory, and
  * return its inode number, its slot, and/or the slot number of an
- * empty directory slot if one is found.
+ * empty directory slot if one is found, by reading every entry. Only
+ * used when there's no name index.
  */
 
 static
 int
-sfs_dir_findname(struct sfs_vnode *sv, const char *name,
-		    uint32_t *ino, int *slot, int *emptyslot)
+sfs_dir_scan(struct sfs_vnode *sv, const char *name,
+	     uint32_t *ino, int *slot, int *emptyslot)
 {
 	struct sfs_dir tsd;
 	int found = 0;
@@ -688,6 +1443,27 @@ sfs_dir_findname(struct sfs_vnode *sv, const char *name,
 	return found ? 0 : ENOENT;
 }
 
+/*
+ * Search a directory for a particular filename in a directory, and
+ * return its inode number and/or its slot.
+ */
+static
+int
+sfs_dir_findname(struct sfs_vnode *sv, const char *name,
+		 uint32_t *ino, int *slot)
+{
+	int result;
+
+	result = sfs_dir_getindex(sv);
+	if (result == ENOMEM) {
+		return sfs_dir_scan(sv, name, ino, slot, NULL);
+	}
+	if (result) {
+		return result;
+	}
+	return sfs_dirindex_find(sv->sv_dirindex, name, ino, slot);
+}
+
 /*
  * Create a link in a directory to the specified inode by number, with
  * the specified name, and optionally hand back the slot.
@@ -701,7 +1477,13 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	struct sfs_dir sd;
 
 	/* Look up the name. We want to make sure it *doesn't* exist. */
-	result = sfs_dir_findname(sv, name, NULL, NULL, &emptyslot);
+	result = sfs_dir_getindex(sv);
+	if (result == 0) {
+		result = sfs_dirindex_find(sv->sv_dirindex, name, NULL, NULL);
+	}
+	else if (result == ENOMEM) {
+		result = sfs_dir_scan(sv, name, NULL, NULL, &emptyslot);
+	}
 	if (result!=0 && result!=ENOENT) {
 		return result;
 	}
@@ -713,7 +1495,12 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 		return ENAMETOOLONG;
 	}
 
-	/* If we didn't get an empty slot, add the entry at the end. */
+	/* Reuse a free slot if we know of one... */
+	if (sv->sv_dirindex != NULL) {
+		emptyslot = sfs_dirindex_getfree(sv->sv_dirindex);
+	}
+
+	/* ...otherwise add the entry at the end. */
 	if (emptyslot < 0) {
 		emptyslot = sfs_dir_nentries(sv);
 	}
@@ -729,25 +1516,50 @@ sfs_dir_link(struct sfs_vnode *sv, const char *name, uint32_t ino, int *slot)
 	}
 
 	/* Write the entry. */
-	return sfs_writedir(sv, &sd, emptyslot);
-	
+	result = sfs_writedir(sv, &sd, emptyslot);
+	if (result) {
+		/* Don't know what made it to disk; start over next time */
+		sfs_dir_dropindex(sv);
+		return result;
+	}
+
+	/* And keep the index up to date. */
+	if (sv->sv_dirindex != NULL &&
+	    sfs_dirindex_add(sv->sv_dirindex, name, ino, emptyslot)) {
+		sfs_dir_dropindex(sv);
+	}
+	return 0;
 }
 
 /*
- * Unlink a name in a directory, by slot number.
+ * Unlink a name in a directory, by slot number. NAME must be the name
+ * in that slot.
  */
 static
 int
-sfs_dir_unlink(struct sfs_vnode *sv, int slot)
+sfs_dir_unlink(struct sfs_vnode *sv, const char *name, int slot)
 {
 	struct sfs_dir sd;
+	int result;
 
 	/* Initialize a suitable directory entry... */ 
 	bzero(&sd, sizeof(sd));
 	sd.sfd_ino = SFS_NOINO;
 
 	/* ... and write it */
-	return sfs_writedir(sv, &sd, slot);
+	result = sfs_writedir(sv, &sd, slot);
+	if (result) {
+		sfs_dir_dropindex(sv);
+		return result;
+	}
+
+	if (sv->sv_dirindex != NULL) {
+		sfs_dirindex_remove(sv->sv_dirindex, name);
+		if (sfs_dirindex_addfree(sv->sv_dirindex, slot)) {
+			sfs_dir_dropindex(sv);
+		}
+	}
+	return 0;
 }
 
 /*
@@ -764,7 +1576,7 @@ sfs_lookonce(struct sfs_vnode *sv, const char *name,
 	uint32_t ino;
 	int result;
 
-	result = sfs_dir_findname(sv, name, &ino, slot, NULL);
+	result = sfs_dir_findname(sv, name, &ino, slot);
 	if (result) {
 		return result;
 	}
@@ -801,7 +1613,7 @@ sfs_makeobj(struct sfs_fs *sfs, int type, struct sfs_vnode **ret)
 	 * number is the block number, so just get a block.)
 	 */
 
-	result = sfs_balloc(sfs, &ino);
+	result = sfs_balloc(sfs, 0, true, &ino);
 	if (result) {
 		return result;
 	}
@@ -890,39 +1702,63 @@ sfs_reclaim(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
 	struct sfs_fs *sfs = v->vn_fs->fs_data;
-	unsigned ix, i, num;
+	struct sfs_vnode **svp;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(sfs->sfs_vnlock);
 
 	/*
 	 * Make sure someone else hasn't picked up the vnode since the
-	 * decision was made to reclaim it. (You must also synchronize
-	 * this with sfs_loadvnode.)
+	 * decision was made to reclaim it. Holding sfs_vnlock keeps
+	 * sfs_loadvnode from handing out a new reference while we work.
 	 */
+	spinlock_acquire(&v->vn_countlock);
 	if (v->vn_refcount != 1) {
 
 		/* consume the reference VOP_DECREF gave us */
 		KASSERT(v->vn_refcount>1);
 		v->vn_refcount--;
 
-		vfs_biglock_release();
+		spinlock_release(&v->vn_countlock);
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EBUSY;
 	}
+	spinlock_release(&v->vn_countlock);
+
+	/* Give back any blocks we were holding for it */
+	sfs_unreserve(sv);
 
 	/* If there are no on-disk references to the file either, erase it. */
 	if (sv->sv_i.sfi_linkcount==0) {
-		result = VOP_TRUNCATE(&sv->sv_v, 0);
+		result = sfs_itrunc(sv, 0);
 		if (result) {
-			vfs_biglock_release();
+			lock_release(sfs->sfs_vnlock);
+			lock_release(sv->sv_lock);
+			sfs_jend(sfs);
 			return result;
 		}
 	}
 
+	/* Write out data still waiting for disk blocks */
+	result = sfs_daflush(sv);
+	if (result) {
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		return result;
+	}
+	KASSERT(sv->sv_nda == 0);
+
 	/* Sync the inode to disk */
 	result = sfs_sync_inode(sv);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sfs->sfs_vnlock);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -932,25 +1768,25 @@ sfs_reclaim(struct vnode *v)
 	}
 
 	/* Remove the vnode structure from the table in the struct sfs_fs. */
-	num = vnodearray_num(sfs->sfs_vnodes);
-	ix = num;
-	for (i=0; i<num; i++) {
-		struct vnode *v2 = vnodearray_get(sfs->sfs_vnodes, i);
-		struct sfs_vnode *sv2 = v2->vn_data;
-		if (sv2 == sv) {
-			ix = i;
-			break;
+	for (svp = &sfs->sfs_vntable[SFS_VNHASH(sv->sv_ino)]; *svp != sv;
+	     svp = &(*svp)->sv_hashnext) {
+		if (*svp == NULL) {
+			panic("sfs: reclaim vnode %u not in vnode pool\n",
+			      sv->sv_ino);
 		}
 	}
-	if (ix == num) {
-		panic("sfs: reclaim vnode %u not in vnode pool\n",
-		      sv->sv_ino);
-	}
-	vnodearray_remove(sfs->sfs_vnodes, ix);
+	*svp = sv->sv_hashnext;
+	sfs->sfs_nvnodes--;
+	lock_release(sfs->sfs_vnlock);
 
-	VOP_CLEANUP(&sv->sv_v);
+	/* Nobody else can find it now. */
+	lock_release(sv->sv_lock);
+	lock_destroy(sv->sv_lock);
+	sfs_jend(sfs);
+
+	sfs_dir_dropindex(sv);
 
-	vfs_biglock_release();
+	VOP_CLEANUP(&sv->sv_v);
 
 	/* Release the storage for the vnode structure itself. */
 	kfree(sv);
@@ -971,28 +1807,72 @@ sfs_read(struct vnode *v, struct uio *uio)
 
 	KASSERT(uio->uio_rw==UIO_READ);
 
-	vfs_biglock_acquire();
+	/* Not with sv_lock held: the buffer may map this file */
+	result = uio_prefault(uio);
+	if (result) {
+		return result;
+	}
+
+	lock_acquire(sv->sv_lock);
+	sfs_readahead(sv, uio);
 	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	lock_release(sv->sv_lock);
 
 	return result;
 }
 
 /*
- * Called for write(). sfs_io() does the work.
+ * Called for write(). sfs_io() does the work, SFS_WRITECHUNK blocks
+ * at a time; each piece is a journal operation of its own, so a big
+ * write can't make a transaction too big for the journal.
  */
 static
 int
 sfs_write(struct vnode *v, struct uio *uio)
 {
 	struct sfs_vnode *sv = v->vn_data;
-	int result;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	size_t chunk, extraresid;
+	int result = 0, result2;
 
 	KASSERT(uio->uio_rw==UIO_WRITE);
 
-	vfs_biglock_acquire();
-	result = sfs_io(sv, uio);
-	vfs_biglock_release();
+	/* Check the whole write, so none of it happens if it's too big */
+	if (uio->uio_offset + uio->uio_resid > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	/* Not with sv_lock held: the buffer may map this file */
+	result = uio_prefault(uio);
+	if (result) {
+		return result;
+	}
+
+	chunk = SFS_WRITECHUNK * sfs->sfs_blocksize;
+	while (uio->uio_resid > 0) {
+		/* Hide the rest of the write from sfs_io for now */
+		extraresid = 0;
+		if (uio->uio_resid > chunk) {
+			extraresid = uio->uio_resid - chunk;
+			uio->uio_resid = chunk;
+		}
+
+		sfs_jbegin(sfs);
+		lock_acquire(sv->sv_lock);
+		result = sfs_io(sv, uio);
+		/* Even a failed write may have changed the inode */
+		result2 = sfs_sync_inode(sv);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+
+		uio->uio_resid += extraresid;
+		if (result == 0) {
+			result = result2;
+		}
+		if (result) {
+			break;
+		}
+	}
 
 	return result;
 }
@@ -1023,6 +1903,7 @@ int
 sfs_stat(struct vnode *v, struct stat *statbuf)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
 	/* Fill in the stat structure */
@@ -1033,7 +1914,11 @@ sfs_stat(struct vnode *v, struct stat *statbuf)
 		return result;
 	}
 
+	lock_acquire(sv->sv_lock);
 	statbuf->st_size = sv->sv_i.sfi_size;
+	lock_release(sv->sv_lock);
+
+	statbuf->st_blksize = sfs->sfs_blocksize;
 
 	/* We don't support these yet; you get to implement them */
 	statbuf->st_nlink = 0;
@@ -1053,16 +1938,13 @@ sfs_gettype(struct vnode *v, uint32_t *ret)
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes once the vnode is loaded; no lock needed */
 	switch (sv->sv_i.sfi_type) {
 	case SFS_TYPE_FILE:
 		*ret = S_IFREG;
-		vfs_biglock_release();
 		return 0;
 	case SFS_TYPE_DIR:
 		*ret = S_IFDIR;
-		vfs_biglock_release();
 		return 0;
 	}
 	panic("sfs: gettype: Invalid inode type (inode %u, type %u)\n",
@@ -1092,64 +1974,179 @@ sfs_tryseek(struct vnode *v, off_t pos)
 }
 
 /*
- * Called for fsync(), and also on filesystem unmount, global sync(),
- * and some other cases.
+ * Give SV's waiting data disk blocks and write its inode into the
+ * buffer cache. Used by fsync, sync, and the syncer (sfs_flushold).
+ */
+int
+sfs_flushvnode(struct sfs_vnode *sv)
+{
+	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
+	int result;
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_daflush(sv);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
+	return result;
+}
+
+/*
+ * Called for fsync(), and also on filesystem unmount and some other
+ * cases.
  */
 static
 int
 sfs_fsync(struct vnode *v)
 {
 	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
 	int result;
 
-	vfs_biglock_acquire();
-	result = sfs_sync_inode(sv);
-	vfs_biglock_release();
+	result = sfs_flushvnode(sv);
+	if (result == 0) {
+		/* Push the inode and everything else out of the cache */
+		result = sfs_checkpoint(sfs);
+	}
 
 	return result;
 }
 
 /*
- * Called for mmap().
+ * Called for mmap(). Any regular file can be mapped; the pages come
+ * and go through sfs_read and sfs_write. (Directories use ISDIR.)
  */
 static
 int
-sfs_mmap(struct vnode *v   /* add stuff as needed */)
+sfs_mmap(struct vnode *v)
 {
 	(void)v;
-	return EUNIMP;
+	return 0;
 }
 
 /*
- * Called for ftruncate() and from sfs_reclaim.
+ * Discard the blocks past file block BLOCKLEN under the indirect block
+ * IDBLOCK, which has LEVELS levels of indirection below it (1 for a
+ * plain indirect block) and whose first entry maps file block
+ * BASEBLOCK. Sets *EMPTY if nothing is left in it, in which case the
+ * caller should free it. Subtrees wholly past BLOCKLEN are detached
+ * and left to sfs_bgfree.c.
  */
 static
 int
-sfs_truncate(struct vnode *v, off_t len)
+sfs_itrunc_indirect(struct sfs_fs *sfs, uint32_t idblock, int levels,
+		    uint64_t baseblock, uint32_t blocklen, bool *empty)
 {
-	/*
-	 * I/O buffer for handling the indirect block.
-	 *
-	 * Note: in real life (and when you've done the fs assignment)
-	 * you would get space from the disk buffer cache for this,
-	 * not use a static area.
-	 */
-	static uint32_t idbuf[SFS_DBPERIDB];
+	struct buf *idbuffer;
+	uint32_t *idbuf;
+	uint32_t j, dbperidb;
+	uint64_t span, entrybase;
+	int i, result;
+	bool hasnonzero, iddirty, subempty;
 
-	struct sfs_vnode *sv = v->vn_data;
+	dbperidb = SFS_DBPERIDB(sfs->sfs_blocksize);
+
+	/* Number of file blocks each entry covers */
+	span = 1;
+	for (i=1; i<levels; i++) {
+		span *= dbperidb;
+	}
+
+	/* Read the indirect block */
+	result = buffer_read(&sfs->sfs_absfs, idblock, sfs->sfs_blocksize,
+			     &idbuffer);
+	if (result) {
+		return result;
+	}
+	idbuf = buffer_map(idbuffer);
+
+	hasnonzero = false;
+	iddirty = false;
+	for (j=0; j<dbperidb; j++) {
+		entrybase = baseblock + j*span;
+		if (idbuf[j] != 0 && blocklen < entrybase + span) {
+			/* Some or all of this entry is past the new EOF */
+			if (levels > 1 && blocklen <= entrybase &&
+			    sfs_bgfree_add(sfs, idbuf[j], levels-1) == 0) {
+				/* All of it; it's freed in the background */
+				idbuf[j] = 0;
+				iddirty = true;
+				subempty = false;
+			}
+			else if (levels > 1) {
+				result = sfs_itrunc_indirect(sfs, idbuf[j],
+							     levels-1,
+							     entrybase,
+							     blocklen,
+							     &subempty);
+				if (result) {
+					if (iddirty) {
+						sfs_jdirty(sfs, idbuffer,
+							   idblock);
+					}
+					buffer_release(idbuffer);
+					return result;
+				}
+			}
+			else {
+				subempty = true;
+			}
+			if (idbuf[j] != 0 && subempty) {
+				sfs_bfree(sfs, idbuf[j]);
+				idbuf[j] = 0;
+				iddirty = true;
+			}
+		}
+		/* Remember if we see any nonzero blocks in here */
+		if (idbuf[j] != 0) {
+			hasnonzero = true;
+		}
+	}
+
+	if (!hasnonzero) {
+		/* The whole indirect block is empty now */
+		buffer_invalidate(idbuffer);
+	}
+	else if (iddirty) {
+		sfs_jdirty(sfs, idbuffer, idblock);
+	}
+	buffer_release(idbuffer);
+
+	*empty = !hasnonzero;
+	return 0;
+}
+
+/*
+ * Discard the blocks of SV past LEN and set its size to LEN. Called
+ * from sfs_truncate and sfs_reclaim; the caller holds sv_lock.
+ */
+static
+int
+sfs_itrunc(struct sfs_vnode *sv, off_t len)
+{
 	struct sfs_fs *sfs = sv->sv_v.vn_fs->fs_data;
 
 	/* Length in blocks (divide rounding up) */
-	uint32_t blocklen = DIVROUNDUP(len, SFS_BLOCKSIZE);
+	uint32_t blocklen = DIVROUNDUP(len, sfs->sfs_blocksize);
 
-	uint32_t i, j, block;
-	uint32_t idblock, baseblock, highblock;
+	uint32_t *idptrs[3];
+	uint32_t i, block;
+	uint64_t baseblock, span;
 	int result;
-	int hasnonzero, iddirty;
+	bool empty;
+
+	KASSERT(lock_do_i_hold(sv->sv_lock));
 
-	KASSERT(sizeof(idbuf)==SFS_BLOCKSIZE);
+	/* Drop the reservation; the file's end is moving */
+	sfs_unreserve(sv);
+	sv->sv_lastalloc = 0;
 
-	vfs_biglock_acquire();
+	/* Data past the end that was waiting for blocks needn't wait */
+	sfs_datrunc(sv, blocklen);
 
 	/*
 	 * Go through the direct blocks. Discard any that are
@@ -1164,54 +2161,42 @@ sfs_truncate(struct vnode *v, off_t len)
 		}
 	}
 
-	/* Indirect block number */
-	idblock = sv->sv_i.sfi_indirect;
+	/*
+	 * Then the indirect, double indirect, and triple indirect
+	 * blocks, in that order. BASEBLOCK is the first file block
+	 * each one maps and SPAN the number it maps. A tree that's
+	 * wholly past the new EOF is just detached, and freed in the
+	 * background; that's what keeps truncating or removing a big
+	 * file from reading all its indirect blocks here.
+	 */
+	idptrs[0] = &sv->sv_i.sfi_indirect;
+	idptrs[1] = &sv->sv_i.sfi_dindirect;
+	idptrs[2] = &sv->sv_i.sfi_tindirect;
 
-	/* The lowest block in the indirect block */
 	baseblock = SFS_NDIRECT;
-
-	/* The highest block in the indirect block */
-	highblock = baseblock + SFS_DBPERIDB - 1;
-
-	if (blocklen < highblock && idblock != 0) {
-		/* We're past the proposed EOF; may need to free stuff */
-
-		/* Read the indirect block */
-		result = sfs_rblock(sfs, idbuf, idblock);
-		if (result) {
-			vfs_biglock_release();
-			return result;
-		}
-		
-		hasnonzero = 0;
-		iddirty = 0;
-		for (j=0; j<SFS_DBPERIDB; j++) {
-			/* Discard any blocks that are past the new EOF */
-			if (blocklen < baseblock+j && idbuf[j] != 0) {
-				sfs_bfree(sfs, idbuf[j]);
-				idbuf[j] = 0;
-				iddirty = 1;
-			}
-			/* Remember if we see any nonzero blocks in here */
-			if (idbuf[j]!=0) {
-				hasnonzero=1;
-			}
-		}
-
-		if (!hasnonzero) {
-			/* The whole indirect block is empty now; free it */
-			sfs_bfree(sfs, idblock);
-			sv->sv_i.sfi_indirect = 0;
+	span = SFS_DBPERIDB(sfs->sfs_blocksize);
+	for (i=0; i<3; i++) {
+		if (*idptrs[i] != 0 && blocklen <= baseblock &&
+		    sfs_bgfree_add(sfs, *idptrs[i], i+1) == 0) {
+			*idptrs[i] = 0;
 			sv->sv_dirty = true;
 		}
-		else if (iddirty) {
-			/* The indirect block is dirty; write it back */
-			result = sfs_wblock(sfs, idbuf, idblock);
+		else if (*idptrs[i] != 0 && blocklen < baseblock + span) {
+			/* We're past the proposed EOF; may need to free stuff */
+			result = sfs_itrunc_indirect(sfs, *idptrs[i], i+1,
+						     baseblock, blocklen,
+						     &empty);
 			if (result) {
-				vfs_biglock_release();
 				return result;
 			}
+			if (empty) {
+				sfs_bfree(sfs, *idptrs[i]);
+				*idptrs[i] = 0;
+				sv->sv_dirty = true;
+			}
 		}
+		baseblock += span;
+		span *= SFS_DBPERIDB(sfs->sfs_blocksize);
 	}
 
 	/* Set the file size */
@@ -1220,10 +2205,36 @@ sfs_truncate(struct vnode *v, off_t len)
 	/* Mark the inode dirty */
 	sv->sv_dirty = true;
 
-	vfs_biglock_release();
 	return 0;
 }
 
+/*
+ * Called for ftruncate().
+ */
+static
+int
+sfs_truncate(struct vnode *v, off_t len)
+{
+	struct sfs_vnode *sv = v->vn_data;
+	struct sfs_fs *sfs = v->vn_fs->fs_data;
+	int result, result2;
+
+	if (len > SFS_MAXFILESIZE) {
+		return EFBIG;
+	}
+
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	result = sfs_itrunc(sv, len);
+	result2 = sfs_sync_inode(sv);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	if (result == 0) {
+		result = result2;
+	}
+	return result;
+}
+
 /*
  * Get the full pathname for a file. This only needs to work on directories.
  * Since we don't support subdirectories, assume it's the root directory
@@ -1259,37 +2270,41 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	uint32_t ino;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look up the name */
-	result = sfs_dir_findname(sv, name, &ino, NULL, NULL);
+	result = sfs_dir_findname(sv, name, &ino, NULL);
 	if (result!=0 && result!=ENOENT) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* If it exists and we didn't want it to, fail */
 	if (result==0 && excl) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return EEXIST;
 	}
 
 	if (result==0) {
 		/* We got a file; load its vnode and return */
 		result = sfs_loadvnode(sfs, ino, SFS_TYPE_INVAL, &newguy);
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		if (result) {
-			vfs_biglock_release();
 			return result;
 		}
 		*ret = &newguy->sv_v;
-		vfs_biglock_release();
 		return 0;
 	}
 
 	/* Didn't exist - create it */
 	result = sfs_makeobj(sfs, SFS_TYPE_FILE, &newguy);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
@@ -1299,20 +2314,28 @@ sfs_creat(struct vnode *v, const char *name, bool excl, mode_t mode,
 	/* Link it into the directory */
 	result = sfs_dir_link(sv, name, newguy->sv_ino, NULL);
 	if (result) {
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		VOP_DECREF(&newguy->sv_v);
-		vfs_biglock_release();
 		return result;
 	}
 
 	/* Update the linkcount of the new file */
+	lock_acquire(newguy->sv_lock);
 	newguy->sv_i.sfi_linkcount++;
 
 	/* and consequently mark it dirty. */
 	newguy->sv_dirty = true;
 
+	/* If these fail, the inodes stay dirty and go out later */
+	(void)sfs_sync_inode(newguy);
+	lock_release(newguy->sv_lock);
+	(void)sfs_sync_inode(sv);
+
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	*ret = &newguy->sv_v;
-	
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1325,27 +2348,39 @@ static
 int
 sfs_link(struct vnode *dir, const char *name, struct vnode *file)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *f = file->vn_data;
 	int result;
 
 	KASSERT(file->vn_fs == dir->vn_fs);
 
-	vfs_biglock_acquire();
+	/* Hard links to directories aren't allowed. */
+	if (f->sv_i.sfi_type == SFS_TYPE_DIR) {
+		return EINVAL;
+	}
+
+	/* Directory first, then file (see sfs.h) */
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+	lock_acquire(f->sv_lock);
 
 	/* Just create a link */
 	result = sfs_dir_link(sv, name, f->sv_ino, NULL);
-	if (result) {
-		vfs_biglock_release();
-		return result;
+	if (result == 0) {
+		/* and update the link count, marking the inode dirty */
+		f->sv_i.sfi_linkcount++;
+		f->sv_dirty = true;
+		result = sfs_sync_inode(f);
+	}
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
 	}
 
-	/* and update the link count, marking the inode dirty */
-	f->sv_i.sfi_linkcount++;
-	f->sv_dirty = true;
-
-	vfs_biglock_release();
-	return 0;
+	lock_release(f->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+	return result;
 }
 
 /*
@@ -1355,33 +2390,50 @@ static
 int
 sfs_remove(struct vnode *dir, const char *name)
 {
+	struct sfs_fs *sfs = dir->vn_fs->fs_data;
 	struct sfs_vnode *sv = dir->vn_data;
 	struct sfs_vnode *victim;
 	int slot;
 	int result;
 
-	vfs_biglock_acquire();
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
 
 	/* Look for the file and fetch a vnode for it. */
 	result = sfs_lookonce(sv, name, &victim, &slot);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
+	if (victim == sv) {
+		/* "." - can't lock it twice, and can't remove it anyway */
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
+		VOP_DECREF(&victim->sv_v);
+		return EINVAL;
+	}
+
+	lock_acquire(victim->sv_lock);
+
 	/* Erase its directory entry. */
-	result = sfs_dir_unlink(sv, slot);
+	result = sfs_dir_unlink(sv, name, slot);
 	if (result==0) {
 		/* If we succeeded, decrement the link count. */
 		KASSERT(victim->sv_i.sfi_linkcount > 0);
 		victim->sv_i.sfi_linkcount--;
 		victim->sv_dirty = true;
+		result = sfs_sync_inode(victim);
 	}
 
+	lock_release(victim->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
+
 	/* Discard the reference that sfs_lookonce got us */
 	VOP_DECREF(&victim->sv_v);
 
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1396,26 +2448,31 @@ int
 sfs_rename(struct vnode *d1, const char *n1, 
 	   struct vnode *d2, const char *n2)
 {
+	struct sfs_fs *sfs = d1->vn_fs->fs_data;
 	struct sfs_vnode *sv = d1->vn_data;
 	struct sfs_vnode *g1;
 	int slot1, slot2;
 	int result, result2;
 
-	vfs_biglock_acquire();
-
 	KASSERT(d1==d2);
 	KASSERT(sv->sv_ino == SFS_ROOT_LOCATION);
 
+	sfs_jbegin(sfs);
+	lock_acquire(sv->sv_lock);
+
 	/* Look up the old name of the file and get its inode and slot number*/
 	result = sfs_lookonce(sv, n1, &g1, &slot1);
 	if (result) {
-		vfs_biglock_release();
+		lock_release(sv->sv_lock);
+		sfs_jend(sfs);
 		return result;
 	}
 
 	/* We don't support subdirectories */
 	KASSERT(g1->sv_i.sfi_type == SFS_TYPE_FILE);
 
+	lock_acquire(g1->sv_lock);
+
 	/*
 	 * Link it under the new name.
 	 *
@@ -1434,7 +2491,7 @@ sfs_rename(struct vnode *d1, const char *n1,
 	g1->sv_dirty = true;
 
 	/* Unlink the old slot */
-	result = sfs_dir_unlink(sv, slot1);
+	result = sfs_dir_unlink(sv, n1, slot1);
 	if (result) {
 		goto puke_harder;
 	}
@@ -1446,18 +2503,25 @@ sfs_rename(struct vnode *d1, const char *n1,
 	KASSERT(g1->sv_i.sfi_linkcount>0);
 	g1->sv_i.sfi_linkcount--;
 	g1->sv_dirty = true;
+	result = sfs_sync_inode(g1);
+	if (result == 0) {
+		result = sfs_sync_inode(sv);
+	}
+
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
 
-	vfs_biglock_release();
-	return 0;
+	return result;
 
  puke_harder:
 	/*
 	 * Error recovery: try to undo what we already did
 	 */
-	result2 = sfs_dir_unlink(sv, slot2);
+	result2 = sfs_dir_unlink(sv, n2, slot2);
 	if (result2) {
 		kprintf("sfs: rename: %s\n", strerror(result));
 		kprintf("sfs: rename: while cleaning up: %s\n", 
@@ -1466,9 +2530,11 @@ sfs_rename(struct vnode *d1, const char *n1,
 	}
 	g1->sv_i.sfi_linkcount--;
  puke:
+	lock_release(g1->sv_lock);
+	lock_release(sv->sv_lock);
+	sfs_jend(sfs);
 	/* Let go of the reference to g1 */
 	VOP_DECREF(&g1->sv_v);
-	vfs_biglock_release();
 	return result;
 }
 
@@ -1486,15 +2552,12 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 {
 	struct sfs_vnode *sv = v->vn_data;
 
-	vfs_biglock_acquire();
-
+	/* The type never changes, so no lock is needed here. */
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
 
 	if (strlen(path)+1 > buflen) {
-		vfs_biglock_release();
 		return ENAMETOOLONG;
 	}
 	strcpy(buf, path);
@@ -1502,7 +2565,6 @@ sfs_lookparent(struct vnode *v, char *path, struct vnode **ret,
 	VOP_INCREF(&sv->sv_v);
 	*ret = &sv->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1520,22 +2582,19 @@ sfs_lookup(struct vnode *v, char *path, struct vnode **ret)
 	struct sfs_vnode *final;
 	int result;
 
-	vfs_biglock_acquire();
-
 	if (sv->sv_i.sfi_type != SFS_TYPE_DIR) {
-		vfs_biglock_release();
 		return ENOTDIR;
 	}
-	
+
+	lock_acquire(sv->sv_lock);
 	result = sfs_lookonce(sv, path, &final, NULL);
+	lock_release(sv->sv_lock);
 	if (result) {
-		vfs_biglock_release();
 		return result;
 	}
 
 	*ret = &final->sv_v;
 
-	vfs_biglock_release();
 	return 0;
 }
 
@@ -1642,6 +2701,42 @@ static const struct vnode_ops sfs_dirops = {
 	sfs_lookparent,
 };
 
+#if OPT_SFSCHECK
+/*
+ * Consistency check of the table of loaded vnodes: every inode in
+ * memory must be in an allocated block and in the right hash chain.
+ * Walks the whole table, so it's only done when debugging.
+ */
+static
+void
+sfs_checkvnodes(struct sfs_fs *sfs)
+{
+	struct sfs_vnode *sv;
+	unsigned i, num = 0;
+
+	KASSERT(lock_do_i_hold(sfs->sfs_vnlock));
+
+	for (i=0; i<SFS_VNHASHSIZE; i++) {
+		for (sv = sfs->sfs_vntable[i]; sv != NULL;
+		     sv = sv->sv_hashnext) {
+			if (!sfs_bused(sfs, sv->sv_ino)) {
+				panic("sfs: Found inode %u in unallocated "
+				      "block\n", sv->sv_ino);
+			}
+			if (SFS_VNHASH(sv->sv_ino) != i) {
+				panic("sfs: Inode %u in wrong hash chain\n",
+				      sv->sv_ino);
+			}
+			num++;
+		}
+	}
+	if (num != sfs->sfs_nvnodes) {
+		panic("sfs: %u vnodes in table, count says %u\n",
+		      num, sfs->sfs_nvnodes);
+	}
+}
+#endif /* OPT_SFSCHECK */
+
 /*
  * Function to load a inode into memory as a vnode, or dig up one
  * that's already resident.
@@ -1651,26 +2746,20 @@ int
 sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 		 struct sfs_vnode **ret)
 {
-	struct vnode *v;
 	struct sfs_vnode *sv;
+	struct buf *buf;
 	const struct vnode_ops *ops = NULL;
-	unsigned i, num;
 	int result;
 
-	/* Look in the vnodes table */
-	num = vnodearray_num(sfs->sfs_vnodes);
-
-	/* Linear search. Is this too slow? You decide. */
-	for (i=0; i<num; i++) {
-		v = vnodearray_get(sfs->sfs_vnodes, i);
-		sv = v->vn_data;
+	lock_acquire(sfs->sfs_vnlock);
 
-		/* Every inode in memory must be in an allocated block */
-		if (!sfs_bused(sfs, sv->sv_ino)) {
-			panic("sfs: Found inode %u in unallocated block\n",
-			      sv->sv_ino);
-		}
+#if OPT_SFSCHECK
+	sfs_checkvnodes(sfs);
+#endif
 
+	/* Look in the vnodes table */
+	for (sv = sfs->sfs_vntable[SFS_VNHASH(ino)]; sv != NULL;
+	     sv = sv->sv_hashnext) {
 		if (sv->sv_ino==ino) {
 			/* Found */
 
@@ -1678,6 +2767,7 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 			KASSERT(forcetype==SFS_TYPE_INVAL);
 
 			VOP_INCREF(&sv->sv_v);
+			lock_release(sfs->sfs_vnlock);
 			*ret = sv;
 			return 0;
 		}
@@ -1687,6 +2777,14 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 
 	sv = kmalloc(sizeof(struct sfs_vnode));
 	if (sv==NULL) {
+		lock_release(sfs->sfs_vnlock);
+		return ENOMEM;
+	}
+
+	sv->sv_lock = lock_create("sfs vnode");
+	if (sv->sv_lock == NULL) {
+		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return ENOMEM;
 	}
 
@@ -1697,15 +2795,34 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	}
 
 	/* Read the block the inode is in */
-	result = sfs_rblock(sfs, &sv->sv_i, ino);
+	result = buffer_read(&sfs->sfs_absfs, ino, sfs->sfs_blocksize, &buf);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
+	memcpy(&sv->sv_i, buffer_map(buf), sizeof(sv->sv_i));
+	buffer_release(buf);
 
 	/* Not dirty yet */
 	sv->sv_dirty = false;
 
+	/* No name index until it's needed */
+	sv->sv_dirindex = NULL;
+
+	/* No reads yet */
+	sv->sv_ranext = 0;
+	sv->sv_rablock = 0;
+	sv->sv_rawindow = 0;
+
+	/* No allocations yet */
+	sv->sv_lastalloc = 0;
+	sv->sv_resnext = 0;
+	sv->sv_resleft = 0;
+	sv->sv_nda = 0;
+	sv->sv_datime = 0;
+
 	/*
 	 * FORCETYPE is set if we're creating a new file, because the
 	 * block on disk will have been zeroed out and thus the type
@@ -1736,7 +2853,9 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	/* Call the common vnode initializer */
 	result = VOP_INIT(&sv->sv_v, ops, &sfs->sfs_absfs, sv);
 	if (result) {
+		lock_destroy(sv->sv_lock);
 		kfree(sv);
+		lock_release(sfs->sfs_vnlock);
 		return result;
 	}
 
@@ -1744,12 +2863,11 @@ sfs_loadvnode(struct sfs_fs *sfs, uint32_t ino, int forcetype,
 	sv->sv_ino = ino;
 
 	/* Add it to our table */
-	result = vnodearray_add(sfs->sfs_vnodes, &sv->sv_v, NULL);
-	if (result) {
-		VOP_CLEANUP(&sv->sv_v);
-		kfree(sv);
-		return result;
-	}
+	sv->sv_hashnext = sfs->sfs_vntable[SFS_VNHASH(ino)];
+	sfs->sfs_vntable[SFS_VNHASH(ino)] = sv;
+	sfs->sfs_nvnodes++;
+
+	lock_release(sfs->sfs_vnlock);
 
 	/* Hand it back */
 	*ret = sv;
@@ -1767,14 +2885,10 @@ sfs_getroot(struct fs *fs)
 	struct sfs_vnode *sv;
 	int result;
 
-	vfs_biglock_acquire();
-
 	result = sfs_loadvnode(sfs, SFS_ROOT_LOCATION, SFS_TYPE_INVAL, &sv);
 	if (result) {
 		panic("sfs: getroot: Cannot load root vnode\n");
 	}
 
-	vfs_biglock_release();
-
 	return &sv->sv_v;
 }
@@ -39,6 +39,26 @@
 
 struct vnode;
 
+/*
+ * A region made by as_mmap. Like the heap's, its pages are allocated
+ * on first touch; they're filled from the file, if there is one.
+ * am_pages[i] is the physical page for the i'th page, or 0 if it
+ * hasn't been touched yet. In a shared mapping, AM_PAGEDIRTY is or'ed
+ * into the entry once the page has been written to, so we know which
+ * pages to write back.
+ */
+struct as_mapping {
+  vaddr_t am_base;
+  unsigned am_npages;
+  paddr_t *am_pages;
+  bool am_writable;           /* PROT_WRITE */
+  bool am_shared;             /* MAP_SHARED: changes go to the file */
+  struct vnode *am_vnode;     /* file mapped, or NULL for zeros */
+  off_t am_offset;            /* file offset of the first page */
+  struct as_mapping *am_next;
+};
+#define AM_PAGEDIRTY  0x1
+
 
 /* 
  * Address space - data structure associated with the virtual memory
@@ -55,6 +75,21 @@ struct addrspace {
   paddr_t as_pbase2;
   size_t as_npages2;
   paddr_t as_stackpbase;
+  /*
+   * The heap starts on the page after the highest region and ends at
+   * the break, as_heaptop. Its pages are allocated on first touch;
+   * as_heappages[i] is the physical page for the i'th heap page, or 0
+   * if it hasn't been touched yet.
+   */
+  vaddr_t as_heapbase;
+  vaddr_t as_heaptop;
+  paddr_t *as_heappages;
+  unsigned as_heapmax;        /* number of slots in as_heappages */
+  /*
+   * Mappings are placed below the stack, working down; the heap can
+   * grow up to the lowest one. The list is sorted highest first.
+   */
+  struct as_mapping *as_mappings;
 };
 
 /*
@@ -91,6 +126,17 @@ struct addrspace {
  *    as_define_stack - set up the stack region in the address space.
  *                (Normally called *after* as_complete_load().) Hands
  *                back the initial stack pointer for the new process.
+ *
+ *    as_sbrk   - move the end of the heap by AMOUNT bytes. Hands back
+ *                the old end of the heap.
+ *
+ *    as_mmap   - map LEN bytes of file VN, starting at OFFSET (page
+ *                aligned), into the address space, or zeros if VN is
+ *                NULL. Takes a reference to VN. Hands back the
+ *                address chosen.
+ *
+ *    as_munmap - remove the mapping at VADDR, which must be LEN bytes
+ *                long, writing back the changed pages if it's shared.
  */
 
 struct addrspace *as_create(void);
@@ -107,6 +153,14 @@ int               as_define_region(struct addrspace *as,
 int               as_prepare_load(struct addrspace *as);
 int               as_complete_load(struct addrspace *as);
 int               as_define_stack(struct addrspace *as, vaddr_t *initstackptr);
+int               as_sbrk(struct addrspace *as, intptr_t amount,
+                          vaddr_t *oldtop);
+int               as_mmap(struct addrspace *as, size_t len,
+                          bool writable, bool shared,
+                          struct vnode *vn, off_t offset,
+                          vaddr_t *ret);
+int               as_munmap(struct addrspace *as, vaddr_t vaddr,
+                          size_t len);
 
 
 /*
@@ -0,0 +1,87 @@
+#ifndef _BUF_H_
+#define _BUF_H_
+
+/*
+ * File system buffer cache.
+ *
+ * Caches disk blocks of mounted file systems, keyed by (fs, block
+ * number). Buffers are write-back: modified buffers are only written
+ * when they are evicted or when the file system is synced.
+ *
+ * The file system supplies the actual I/O through the fs_readblock
+ * and fs_writeblock operations in struct fs.
+ *
+ * Blocks can be any size up to BUFFER_MAXSIZE, and file systems with
+ * different block sizes can share the cache: every buffer has room
+ * for the largest block, so a buffer can be reused for any of them.
+ *
+ * Usage: get a buffer with buffer_read (contents loaded from disk) or
+ * buffer_get (contents undefined unless already cached, for callers
+ * about to overwrite the whole block). The buffer is then busy, i.e.
+ * owned by the caller, until buffer_release. While holding it, use
+ * buffer_map to get at the data, and buffer_mark_dirty after changing
+ * it. A buffer obtained with buffer_get that the caller has completely
+ * filled in should be marked valid with buffer_mark_valid.
+ *
+ * buffer_invalidate discards a busy buffer's contents (including
+ * unwritten changes); use it when the block has been freed, or when
+ * buffer_get was used and the caller failed to fill the buffer.
+ *
+ * buffer_drop discards the cached copy of a block, if any; use it
+ * when freeing a block that isn't currently held.
+ *
+ * buffer_pin marks a busy buffer dirty, and also keeps it from being
+ * written back (by eviction or buffer_sync_fs) until buffer_unpin_fs
+ * is called for its file system. A file system with a journal uses
+ * this to hold back metadata until the journal has a copy. Pinned
+ * buffers can't be reused, so a file system must keep the number it
+ * pins well below the size of the cache.
+ *
+ * buffer_readahead asks for a block to be read into the cache in the
+ * background, if it isn't cached already. It doesn't wait, and the
+ * request may be dropped if too many are already pending.
+ *
+ * buffer_sync_fs writes out all dirty buffers belonging to FS, except
+ * pinned ones, in block order; adjacent dirty blocks are gathered into
+ * one fs_writeblock call.
+ * buffer_flush_old writes out at most MAX of FS's buffers that have
+ * been dirty since time BEFORE or earlier, skipping any that are busy
+ * or pinned. It's for the syncer (see fs_flushold in fs.h).
+ * buffer_drop_fs discards all of FS's buffers, and must be called
+ * (after syncing) when unmounting.
+ */
+
+#include <fs.h>
+
+/* Largest block size the cache handles */
+#define BUFFER_MAXSIZE 8192
+
+struct buf;	/* Opaque */
+
+void buffer_bootstrap(void);
+
+int buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+int buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret);
+void buffer_release(struct buf *b);
+
+void *buffer_map(struct buf *b);
+bool buffer_is_valid(struct buf *b);
+void buffer_mark_valid(struct buf *b);
+void buffer_mark_dirty(struct buf *b);
+void buffer_invalidate(struct buf *b);
+void buffer_pin(struct buf *b);
+bool buffer_is_pinned(struct buf *b);
+void buffer_unpin_fs(struct fs *fs);
+
+void buffer_drop(struct fs *fs, daddr_t block);
+
+void buffer_readahead(struct fs *fs, daddr_t block, size_t size);
+
+int buffer_sync_fs(struct fs *fs);
+int buffer_flush_old(struct fs *fs, time_t before, unsigned max);
+void buffer_drop_fs(struct fs *fs);
+
+/* Print hit/miss statistics (the "bc" menu command). */
+void buffer_printstats(void);
+
+#endif /* _BUF_H_ */
@@ -40,6 +40,10 @@
  *      fs_getvolname - Return volume name of filesystem.
  *      fs_getroot    - Return root vnode of filesystem.
  *      fs_unmount    - Attempt unmount of filesystem.
+ *      fs_readblock  - Read one block from the underlying device.
+ *      fs_writeblock - Write one block to the underlying device.
+ *      fs_flushold   - Write back some of what has been dirty since
+ *                      the given time or earlier.
  *
  * fs_getvolname may return NULL on filesystem types that don't
  * support the concept of a volume name. The string returned is
@@ -58,6 +62,17 @@
  * however, the filesystem object and all storage associated with the
  * filesystem should have been discarded/released.
  *
+ * fs_readblock and fs_writeblock are called by the buffer cache
+ * (see buf.h) to fill and write back buffers; they may be NULL in
+ * filesystems that don't use it. fs_writeblock may be handed several
+ * consecutive blocks at once, with LEN a multiple of the block size.
+ *
+ * fs_flushold is called every second or so by the syncer thread (see
+ * vfslist.c), with vfs_biglock held. It should do a bounded amount of
+ * work, so that nothing dirty stays that way much longer than the
+ * syncer's age limit without any one call taking long. It may be NULL
+ * in filesystems that don't cache anything.
+ *
  * fs_data is a pointer to filesystem-specific data.
  */
 
@@ -66,6 +81,9 @@ struct fs {
 	const char   *(*fs_getvolname)(struct fs *);
 	struct vnode *(*fs_getroot)(struct fs *);
 	int           (*fs_unmount)(struct fs *);
+	int           (*fs_readblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fs_writeblock)(struct fs *, daddr_t, void *, size_t);
+	int           (*fs_flushold)(struct fs *, time_t);
 
 	void *fs_data;
 };
@@ -77,6 +95,11 @@ struct fs {
 #define FSOP_GETVOLNAME(fs)  ((fs)->fs_getvolname(fs))
 #define FSOP_GETROOT(fs)     ((fs)->fs_getroot(fs))
 #define FSOP_UNMOUNT(fs)     ((fs)->fs_unmount(fs))
+#define FSOP_READBLOCK(fs, block, data, len) \
+	((fs)->fs_readblock(fs, block, data, len))
+#define FSOP_WRITEBLOCK(fs, block, data, len) \
+	((fs)->fs_writeblock(fs, block, data, len))
+#define FSOP_FLUSHOLD(fs, before) ((fs)->fs_flushold(fs, before))
 
 
 #endif /* _FS_H_ */
@@ -0,0 +1,25 @@
+#ifndef _KERN_MMAN_H_
+#define _KERN_MMAN_H_
+
+/*
+ * Flags for mmap(), shared between the kernel and <sys/mman.h>.
+ */
+
+/* Protection: what the mapping may be used for */
+#define PROT_NONE     0
+#define PROT_READ     1
+#define PROT_WRITE    2
+#define PROT_EXEC     4
+
+/* Exactly one of these */
+#define MAP_SHARED    0x01   /* changes go back to the file */
+#define MAP_PRIVATE   0x02   /* changes are ours alone */
+
+/* Optionally */
+#define MAP_FIXED     0x10   /* place it exactly at ADDR (unsupported) */
+#define MAP_ANON      0x20   /* zero-filled memory, not a file */
+
+/* What mmap() returns on error */
+#define MAP_FAILED    ((void *)-1)
+
+#endif /* _KERN_MMAN_H_ */
@@ -37,27 +37,42 @@
  */
 
 #define SFS_MAGIC         0xabadf001    /* magic number identifying us */
-#define SFS_BLOCKSIZE     512           /* size of our blocks */
+#define SFS_BLOCKSIZE     512           /* default and smallest block size */
+#define SFS_MAXBLOCKSIZE  8192          /* largest block size */
 #define SFS_VOLNAME_SIZE  32            /* max length of volume name */
 #define SFS_NDIRECT       15            /* # of direct blocks in inode */
-#define SFS_DBPERIDB      128           /* # direct blks per indirect blk */
 #define SFS_NAMELEN       60            /* max length of filename */
 #define SFS_SB_LOCATION    0            /* block the superblock lives in */
 #define SFS_ROOT_LOCATION  1            /* loc'n of the root dir inode */
 #define SFS_MAP_LOCATION   2            /* 1st block of the freemap */
 #define SFS_NOINO          0            /* inode # for free dir entry */
 
+/*
+ * The block size is chosen by mksfs and recorded in the superblock;
+ * it is a power of two from SFS_BLOCKSIZE to SFS_MAXBLOCKSIZE. The
+ * superblock and each inode take up a whole block, with the structure
+ * below at the start of it and zeros after. Volumes from before the
+ * block size was recorded have 0 in sp_blocksize and SFS_BLOCKSIZE
+ * blocks.
+ *
+ * The macros below take the block size BS.
+ */
+
+/* # direct blks per indirect blk */
+#define SFS_DBPERIDB(bs)  ((bs) / sizeof(uint32_t))
+
 /* Number of bits in a block */
-#define SFS_BLOCKBITS (SFS_BLOCKSIZE * CHAR_BIT)
+#define SFS_BLOCKBITS(bs) ((bs) * CHAR_BIT)
 
 /* Utility macro */
-#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*b)
+#define SFS_ROUNDUP(a,b)       ((((a)+(b)-1)/(b))*(b))
 
 /* Size of bitmap (in bits) */
-#define SFS_BITMAPSIZE(nblocks) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS)
+#define SFS_BITMAPSIZE(nblocks, bs) SFS_ROUNDUP(nblocks, SFS_BLOCKBITS(bs))
 
 /* Size of bitmap (in blocks) */
-#define SFS_BITBLOCKS(nblocks)  (SFS_BITMAPSIZE(nblocks)/SFS_BLOCKBITS)
+#define SFS_BITBLOCKS(nblocks, bs) \
+	(SFS_BITMAPSIZE(nblocks, bs)/SFS_BLOCKBITS(bs))
 
 /* File types for sfi_type */
 #define SFS_TYPE_INVAL    0       /* Should not appear on disk */
@@ -71,11 +86,19 @@ struct sfs_super {
 	uint32_t sp_magic;		/* Magic number, should be SFS_MAGIC */
 	uint32_t sp_nblocks;			/* Number of blocks in fs */
 	char sp_volname[SFS_VOLNAME_SIZE];	/* Name of this volume */
-	uint32_t reserved[118];
+	uint32_t sp_blocksize;			/* Block size; 0 means 512 */
+	uint32_t sp_jstart;			/* First block of journal */
+	uint32_t sp_jblocks;			/* Journal size; 0 for none */
+	uint32_t reserved[115];
 };
 
 /*
  * On-disk inode
+ *
+ * Blocks past the direct blocks are found through the indirect block,
+ * then the doubly-indirect block (which holds indirect blocks), then
+ * the triply-indirect block. The last two were carved out of space
+ * that used to be unused and zero, so older volumes read correctly.
  */
 struct sfs_inode {
 	uint32_t sfi_size;			/* Size of this file (bytes) */
@@ -83,7 +106,60 @@ struct sfs_inode {
 	uint16_t sfi_linkcount;			/* # hard links to this file */
 	uint32_t sfi_direct[SFS_NDIRECT];	/* Direct blocks */
 	uint32_t sfi_indirect;			/* Indirect block */
-	uint32_t sfi_waste[128-3-SFS_NDIRECT];	/* unused space, set to 0 */
+	uint32_t sfi_dindirect;			/* Double indirect block */
+	uint32_t sfi_tindirect;			/* Triple indirect block */
+	uint32_t sfi_waste[128-5-SFS_NDIRECT];	/* unused space, set to 0 */
+};
+
+/* The inode has the fields above (sfsck checks for these) */
+#define HAS_DIDIRECT
+#define HAS_TIDIRECT
+
+/*
+ * Metadata journal.
+ *
+ * The journal is sp_jblocks blocks starting at sp_jstart, placed by
+ * mksfs after the freemap and marked in use there. Volumes with
+ * sp_jblocks 0 have no journal. The first block holds the header. A
+ * committed transaction is a descriptor block listing where each of
+ * its blocks belongs, then copies of those blocks, then a commit
+ * block. It is replayed (the copies written to where they belong) if
+ * the descriptor and commit block both have the header's sequence
+ * number and the copies match the checksum: starting from the
+ * sequence number, sum = sum * 33 + byte, over each byte of the
+ * copies in order.
+ */
+#define SFS_JMAGIC_HEADER  0x4a686472	/* "Jhdr" */
+#define SFS_JMAGIC_DESC    0x4a647363	/* "Jdsc" */
+#define SFS_JMAGIC_COMMIT  0x4a636d74	/* "Jcmt" */
+#define SFS_JDEFBLOCKS     64		/* mksfs's default journal size */
+#define SFS_JMINBLOCKS     8		/* smallest usable journal */
+
+/* Block numbers that fit in a descriptor block */
+#define SFS_JDESCMAX(bs)   ((bs) / sizeof(uint32_t) - 3)
+
+/* Journal header flags */
+#define SFS_JF_UNSAFE      1	/* metadata written without the journal;
+				   after a crash, run sfsck */
+
+struct sfs_jheader {
+	uint32_t jh_magic;		/* SFS_JMAGIC_HEADER */
+	uint32_t jh_seq;		/* Transaction to replay, if committed */
+	uint32_t jh_flags;		/* SFS_JF_* */
+};
+
+/* Followed in the block by jd_nblocks block numbers */
+struct sfs_jdesc {
+	uint32_t jd_magic;		/* SFS_JMAGIC_DESC */
+	uint32_t jd_seq;		/* Transaction sequence number */
+	uint32_t jd_nblocks;		/* Number of blocks in it */
+};
+
+struct sfs_jcommit {
+	uint32_t jc_magic;		/* SFS_JMAGIC_COMMIT */
+	uint32_t jc_seq;		/* Transaction sequence number */
+	uint32_t jc_nblocks;		/* Number of blocks in it */
+	uint32_t jc_checksum;		/* Checksum of the copies */
 };
 
 /*
@@ -196,6 +196,7 @@
 #define SYS_sync         118
 #define SYS_reboot       119
 //#define SYS___sysctl   120
+#define SYS___sysstats   121
 
 /*CALLEND*/
 
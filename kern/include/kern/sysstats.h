@@ -0,0 +1,26 @@
+#ifndef _KERN_SYSSTATS_H_
+#define _KERN_SYSSTATS_H_
+
+/*
+ * Per-system-call statistics, as returned by __sysstats().
+ *
+ * Entry N of the array describes system call number N from
+ * <kern/syscall.h>. Times are in nanoseconds, measured with the
+ * real-time clock from trap entry until the call returns to the
+ * dispatcher; calls that never return (_exit, a successful execv)
+ * are counted but not timed.
+ */
+struct sysstat {
+	__u64 ss_totnsecs;	/* total time spent in the call */
+	__u64 ss_maxnsecs;	/* longest single call */
+	__u32 ss_calls;		/* number of times called */
+	__u32 ss_errors;	/* number of error returns */
+};
+
+/* One more than the largest call number in <kern/syscall.h>. */
+#define SYSSTAT_NCALLS 122
+
+/* Flag for __sysstats(): zero the counters after reading them. */
+#define SYSSTAT_RESET 1
+
+#endif /* _KERN_SYSSTATS_H_ */
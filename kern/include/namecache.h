@@ -0,0 +1,47 @@
+#ifndef _NAMECACHE_H_
+#define _NAMECACHE_H_
+
+/*
+ * VFS name cache.
+ *
+ * Remembers the results of VOP_LOOKUP, keyed by (starting directory
+ * vnode, path handed to VOP_LOOKUP), so vfs_lookup can skip the
+ * filesystem for names it has resolved recently. Failed lookups
+ * (ENOENT) are remembered too, as negative entries. The cache holds
+ * a reference to every vnode in it.
+ *
+ * namecache_lookup returns true on a hit, handing back a referenced
+ * vnode in *RET, or NULL for a negative entry.
+ *
+ * namecache_enter adds an entry; VN is NULL for a negative one. GEN
+ * must be the value namecache_generation returned before the lookup
+ * was started: if any purge has happened since, the result may
+ * already be stale and is not entered.
+ *
+ * Anything that changes the namespace must purge what it affects
+ * after doing so: namecache_purge_name for a name created or removed
+ * in a directory of FS, namecache_purge_fs for operations (rename,
+ * mkdir, rmdir) that can change names below a directory, and before
+ * unmounting FS.
+ */
+
+#include <types.h>
+
+struct fs;
+struct vnode;
+
+void namecache_bootstrap(void);
+
+unsigned namecache_generation(void);
+bool namecache_lookup(struct vnode *dir, const char *path,
+		      struct vnode **ret);
+void namecache_enter(struct vnode *dir, const char *path,
+		     struct vnode *vn, unsigned gen);
+
+void namecache_purge_name(struct fs *fs, const char *name);
+void namecache_purge_fs(struct fs *fs);
+
+/* Print hit/miss statistics (the "nc" menu command). */
+void namecache_printstats(void);
+
+#endif /* _NAMECACHE_H_ */
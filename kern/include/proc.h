@@ -38,14 +38,11 @@
 
 #include <spinlock.h>
 #include <thread.h> /* required for struct threadarray */
-#include <myarray.h>
 #include <limits.h>
 
 struct addrspace;
 struct vnode;
-#ifdef UW
 struct semaphore;
-#endif // UW
 
 /*
  * Process structure.
@@ -55,11 +52,19 @@ struct proc {
 
 	pid_t pid;
 	struct proc *parent;
-	int exitcode;             //if exited->exitcode; if running-> -1
-	struct myArray *children_pids;   //an array of children pids
+	int exitcode;             //encoded wait status, valid once exited is set
+	bool exited;              //true once the process has called _exit
+
+	/* family, all protected by pmanager_lock */
+	struct proc *children;    //live children
+	struct proc *zombies;     //exited children not yet reaped by waitpid
+	struct proc *sib_next;    //links in the parent's children or zombies list
+	struct proc *sib_prev;
   
-  struct cv *proc_cv;        // parent proc waits on this CV
-  struct lock *proc_lock;   // lock for the proc_cv
+  struct cv *proc_cv;        // this proc waits here (with pmanager_lock) for a child to exit
+
+  struct semaphore *vfork_sem;  // parent sleeps on this after vfork()
+  bool vfork_borrowed;          // true while a vfork child runs in its parent's address space
   
 	struct spinlock p_lock;		/* Lock for this structure */
 	struct threadarray p_threads;	/* Threads in this process */
@@ -110,6 +115,10 @@ struct proc *proc_create_runprogram(const char *name);
 // get and return a pid for the process
 int generate_pid(struct proc * proc);
 
+/* Add to / remove from a children or zombies list. Caller holds pmanager_lock. */
+void proc_list_add(struct proc **head, struct proc *p);
+void proc_list_remove(struct proc **head, struct proc *p);
+
 /* Destroy a process. */
 void proc_destroy(struct proc *proc);
 
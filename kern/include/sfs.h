@@ -48,21 +48,112 @@
  */
 #include <kern/sfs.h>
 
+/*
+ * Locking.
+ *
+ * sv_lock protects a vnode's inode (sv_i, sv_dirty) and the file's
+ * contents, including a directory's entries and data still waiting
+ * for disk blocks (sv_da). sfs_vnlock protects the table of loaded
+ * vnodes; sfs_freemaplock protects the free block bitmap, the free
+ * block counts, and the superblock. Block buffers have their own
+ * locking inside the buffer cache.
+ *
+ * Lock order, first to last:
+ *    1. sv_lock of directories, then sv_lock of files; two vnodes of
+ *       the same kind in increasing inode number order
+ *    2. sfs_vnlock
+ *    3. sfs_freemaplock
+ *    4. the buffer cache
+ *    5. vn_countlock
+ *
+ * The VFS layer still calls into SFS with vfs_biglock held for path
+ * lookups and mount-level operations; it comes before all of these.
+ *
+ * Never drop the last reference to a vnode (VOP_DECREF) while holding
+ * its sv_lock or sfs_vnlock, as that may reclaim it.
+ *
+ * Operations that change metadata are journal operations: they call
+ * sfs_jbegin before taking any of the locks above and sfs_jend after
+ * releasing them, and mustn't drop the last reference to a vnode in
+ * between (reclaiming is an operation of its own). The journal's own
+ * lock comes after sv_lock and sfs_vnlock and before sfs_freemaplock.
+ * Operations also take it with a buffer busy; that's safe because the
+ * only code that holds it while getting buffers (sfs_jcommit) runs
+ * when no operations are. The lock on the memory for journal I/O,
+ * which all mounts share, comes right after the journal's lock, and
+ * the same goes for it: the only buffers sfs_jcommit gets are its own
+ * filesystem's. See sfs_journal.c.
+ *
+ * The queue of blocks waiting to be freed in the background has a
+ * lock of its own, under which nothing else is taken (sfs_bgfree.c).
+ * So does the delayed allocation pool, which all mounts share
+ * (sfs_vnode.c).
+ */
+
+struct sfs_dirindex;	/* Opaque; in sfs_dirindex.c */
+struct sfs_journal;	/* Opaque; in sfs_journal.c */
+struct sfs_bgfree;	/* Opaque; in sfs_bgfree.c */
+struct buf;		/* from buf.h */
+
+/*
+ * New file data that hasn't been given a disk block yet (delayed
+ * allocation; see sfs_dadelay). Each file keeps up to SFS_DAMAX of
+ * these, in file block order. The contents live in a pool shared by
+ * all mounts, SFS_DAMAXBYTES in all.
+ */
+struct sfs_dablock {
+	uint32_t db_fileblock;          /* block number within the file */
+	char *db_data;                  /* contents, one block */
+};
+#define SFS_DAMAX 16
+#define SFS_DAMAXBYTES (256*1024)
+
 struct sfs_vnode {
 	struct vnode sv_v;              /* abstract vnode structure */
 	struct sfs_inode sv_i;		/* on-disk inode */
 	uint32_t sv_ino;                /* inode number */
 	bool sv_dirty;                  /* true if sv_i modified */
+	struct lock *sv_lock;           /* lock for inode and contents */
+	off_t sv_ranext;                /* read-ahead: end of last read */
+	uint32_t sv_rablock;            /* read-ahead: next block to fetch */
+	uint32_t sv_rawindow;           /* read-ahead: window, in blocks */
+	struct sfs_vnode *sv_hashnext;  /* chain in sfs_vntable */
+	struct sfs_dirindex *sv_dirindex; /* name index (dirs), or NULL */
+	uint32_t sv_lastalloc;          /* last block allocated, or 0 */
+	uint32_t sv_resnext;            /* first block reserved for us */
+	uint32_t sv_resleft;            /* number of blocks reserved */
+	struct sfs_dablock sv_da[SFS_DAMAX]; /* data awaiting disk blocks */
+	unsigned sv_nda;                /* number of them */
+	time_t sv_datime;               /* when the oldest of them came */
 };
 
+/*
+ * The loaded vnodes of a filesystem are kept in a hash table on
+ * inode number.
+ */
+#define SFS_VNHASHSIZE  509
+#define SFS_VNHASH(ino) ((ino) % SFS_VNHASHSIZE)
+
 struct sfs_fs {
 	struct fs sfs_absfs;            /* abstract filesystem structure */
 	struct sfs_super sfs_super;	/* on-disk superblock */
 	bool sfs_superdirty;            /* true if superblock modified */
+	uint32_t sfs_blocksize;         /* block size (from sfs_super) */
 	struct device *sfs_device;      /* device mounted on */
-	struct vnodearray *sfs_vnodes;  /* vnodes loaded into memory */
+	struct sfs_vnode **sfs_vntable; /* vnodes loaded into memory */
+	unsigned sfs_nvnodes;           /* number of them */
 	struct bitmap *sfs_freemap;     /* blocks in use are marked 1 */
-	bool sfs_freemapdirty;          /* true if freemap modified */
+	uint32_t *sfs_freecount;        /* free blocks in each freemap block */
+	struct bitmap *sfs_mapdirty;    /* freemap blocks modified */
+	bool sfs_freemapdirty;          /* true if any freemap block modified */
+	unsigned sfs_nmapdirty;         /* number of them */
+	uint32_t sfs_nfree;             /* number of free blocks */
+	uint32_t sfs_dareserved;        /* of those, promised to sv_da */
+	struct sfs_journal *sfs_journal; /* metadata journal, or NULL */
+	struct sfs_bgfree *sfs_bgfree;  /* blocks waiting to be freed */
+	struct lock *sfs_vnlock;        /* lock for sfs_vntable */
+	struct lock *sfs_freemaplock;   /* lock for freemap and superblock */
+	time_t sfs_lastcheckpoint;      /* when sfs_checkpoint last finished */
 };
 
 /*
@@ -70,22 +161,84 @@ struct sfs_fs {
  */
 int sfs_mount(const char *device);
 
+/*
+ * Set up state shared by all sfs mounts; called once at boot.
+ */
+void sfs_bootstrap(void);
+
 
 /*
  * Internal functions
  */
 
 /* Initialize uio structure */
-#define SFSUIO(iov, uio, ptr, block, rw) \
-    uio_kinit(iov, uio, ptr, SFS_BLOCKSIZE, ((off_t)(block))*SFS_BLOCKSIZE, rw)
+#define SFSUIO(sfs, iov, uio, ptr, block, rw) \
+    uio_kinit(iov, uio, ptr, (sfs)->sfs_blocksize, \
+	      ((off_t)(block))*(sfs)->sfs_blocksize, rw)
 
 /* Convenience functions for block I/O */
 int sfs_rwblock(struct sfs_fs *sfs, struct uio *uio);
 int sfs_rblock(struct sfs_fs *sfs, void *data, uint32_t block);
 int sfs_wblock(struct sfs_fs *sfs, void *data, uint32_t block);
 
+/* Superblock I/O; works before sfs_blocksize is known */
+int sfs_rsuper(struct sfs_fs *sfs);
+int sfs_wsuper(struct sfs_fs *sfs);
+
+/* Free block bitmap; caller holds sfs_freemaplock */
+int sfs_freemap_alloc(struct sfs_fs *sfs, uint32_t goal, uint32_t *block);
+void sfs_freemap_mark(struct sfs_fs *sfs, uint32_t block);
+void sfs_freemap_unmark(struct sfs_fs *sfs, uint32_t block);
+
+/* Free a block, in a journal operation (sfs_vnode.c) */
+void sfs_bfree(struct sfs_fs *sfs, uint32_t diskblock);
+
+/* Write out everything, through the journal if there is one */
+int sfs_checkpoint(struct sfs_fs *sfs);
+
+/* Give SV's waiting data disk blocks and write back its inode */
+int sfs_flushvnode(struct sfs_vnode *sv);
+
+/* Allocate the delayed allocation pool (sfs_vnode.c) */
+void sfs_dabootstrap(void);
+
+/* Metadata journal (sfs_journal.c) */
+void sfs_jbootstrap(void);
+int sfs_jload(struct sfs_fs *sfs);
+void sfs_junload(struct sfs_fs *sfs);
+void sfs_jbegin(struct sfs_fs *sfs);
+void sfs_jend(struct sfs_fs *sfs);
+void sfs_jdirty(struct sfs_fs *sfs, struct buf *buf, uint32_t block);
+void sfs_jfree(struct sfs_fs *sfs, uint32_t block);
+void sfs_jquiesce(struct sfs_fs *sfs);
+void sfs_jresume(struct sfs_fs *sfs);
+bool sfs_jpending(struct sfs_fs *sfs);
+int sfs_jcommit(struct sfs_fs *sfs);
+int sfs_jdone(struct sfs_fs *sfs);
+
+/* Background freeing of truncated blocks (sfs_bgfree.c) */
+int sfs_bgfree_start(struct sfs_fs *sfs);
+void sfs_bgfree_stop(struct sfs_fs *sfs);
+int sfs_bgfree_add(struct sfs_fs *sfs, uint32_t block, unsigned levels);
+void sfs_bgfree_drain(struct sfs_fs *sfs);
+
+/* Block I/O for the buffer cache */
+int sfs_readblock(struct fs *fs, daddr_t block, void *data, size_t len);
+int sfs_writeblock(struct fs *fs, daddr_t block, void *data, size_t len);
+
 /* Get root vnode */
 struct vnode *sfs_getroot(struct fs *fs);
 
+/* Directory name index (sfs_dirindex.c); caller holds the dir's sv_lock */
+struct sfs_dirindex *sfs_dirindex_create(void);
+void sfs_dirindex_destroy(struct sfs_dirindex *di);
+int sfs_dirindex_add(struct sfs_dirindex *di, const char *name,
+		     uint32_t ino, int slot);
+int sfs_dirindex_find(struct sfs_dirindex *di, const char *name,
+		      uint32_t *ino, int *slot);
+void sfs_dirindex_remove(struct sfs_dirindex *di, const char *name);
+int sfs_dirindex_addfree(struct sfs_dirindex *di, int slot);
+int sfs_dirindex_getfree(struct sfs_dirindex *di);
+
 
 #endif /* _SFS_H_ */
@@ -50,6 +50,9 @@ void enter_forked_process(void * trap, unsigned long x);
 void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 		       vaddr_t entrypoint);
 
+/* Set up the buffer execv and runprogram pass arguments through. */
+void argblock_bootstrap(void);
+
 
 /*
  * Prototypes for IN-KERNEL entry points for system call implementations.
@@ -57,6 +60,8 @@ void enter_new_process(int argc, userptr_t argv, vaddr_t stackptr,
 
 int sys_reboot(int code);
 int sys___time(userptr_t user_seconds, userptr_t user_nanoseconds);
+int sys___sysstats(userptr_t buf, unsigned nentries, int flags,
+		   int32_t *retval);
 
 #ifdef UW
 int sys_write(int fdesc,userptr_t ubuf,unsigned int nbytes,int *retval);
@@ -64,7 +69,12 @@ void sys__exit(int exitcode);
 int sys_getpid(pid_t *ret_val);
 int sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *ret_val);
 int sys_fork(struct trapframe *tf, pid_t *ret_val);
+int sys_vfork(struct trapframe *tf, pid_t *ret_val);
 int sys_execv(const char *progname, userptr_t args);
+int sys_sbrk(intptr_t amount, vaddr_t *retval);
+int sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	     off_t offset, vaddr_t *retval);
+int sys_munmap(userptr_t addr, size_t len);
 int copyin_args(int arg_count, char ** kern_args, userptr_t *user_args, vaddr_t *stack_ptr);
 
 
@@ -0,0 +1,26 @@
+#ifndef _SYSSTATS_H_
+#define _SYSSTATS_H_
+
+/*
+ * System call statistics, kept by the dispatcher in syscall().
+ *
+ * sysstats_enter is called before a call is dispatched, so that calls
+ * which never return are still counted; sysstats_leave is called
+ * afterwards with the error code and the elapsed time.
+ *
+ * sysstats_print dumps the table to the console (the "ss" menu
+ * command); sysstats_reset zeroes it.
+ */
+
+#include <kern/sysstats.h>
+
+void sysstats_enter(unsigned callno);
+void sysstats_leave(unsigned callno, int err, uint64_t nsecs);
+
+void sysstats_print(void);
+void sysstats_reset(void);
+
+/* Name of a system call, or NULL if the dispatcher doesn't know it. */
+const char *syscall_name(unsigned callno);
+
+#endif /* _SYSSTATS_H_ */
@@ -104,6 +104,16 @@ int uiomove(void *kbuffer, size_t len, struct uio *uio);
  */
 int uiomovezeros(size_t len, struct uio *uio);
 
+/*
+ * Touch every page of a user-space uio, so uiomove won't fault them
+ * in later. A filesystem calls this before taking its vnode locks:
+ * faulting in a page of a mapped file reads the file, which would
+ * need those locks again. (dumbvm never takes a page back once it's
+ * been filled, so touching it once is enough.) Does nothing for a
+ * kernel-space uio.
+ */
+int uio_prefault(struct uio *uio);
+
 /*
  * Initialize a uio suitable for I/O from a kernel buffer.
  *
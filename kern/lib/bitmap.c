@@ -120,6 +120,40 @@ bitmap_alloc(struct bitmap *b, unsigned *index)
         return ENOSPC;
 }
 
+/*
+ * Like bitmap_alloc, but only take a clear bit with index in the
+ * range [START, END).
+ */
+int
+bitmap_alloc_range(struct bitmap *b, unsigned start, unsigned end,
+                   unsigned *index)
+{
+        unsigned bit;
+
+        if (end > b->nbits) {
+                end = b->nbits;
+        }
+
+        bit = start;
+        while (bit < end) {
+                unsigned ix = bit / BITS_PER_WORD;
+                WORD_TYPE mask = ((WORD_TYPE)1) << (bit % BITS_PER_WORD);
+
+                /* Skip full words whole */
+                if (mask == 1 && b->v[ix] == WORD_ALLBITS) {
+                        bit += BITS_PER_WORD;
+                        continue;
+                }
+                if ((b->v[ix] & mask)==0) {
+                        b->v[ix] |= mask;
+                        *index = bit;
+                        return 0;
+                }
+                bit++;
+        }
+        return ENOSPC;
+}
+
 static
 inline
 void
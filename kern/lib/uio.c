@@ -33,6 +33,7 @@
 #include <proc.h>
 #include <current.h>
 #include <copyinout.h>
+#include <vm.h>
 
 /*
  * See uio.h for a description.
@@ -119,6 +120,43 @@ uiomove(void *ptr, size_t n, struct uio *uio)
 	return 0;
 }
 
+int
+uio_prefault(struct uio *uio)
+{
+	struct iovec *iov;
+	unsigned i;
+	size_t left, len;
+	vaddr_t va, end;
+	char c;
+	int result;
+
+	if (uio->uio_segflg == UIO_SYSSPACE) {
+		return 0;
+	}
+	KASSERT(uio->uio_space == curproc_getas());
+
+	left = uio->uio_resid;
+	for (i=0; i<uio->uio_iovcnt && left > 0; i++) {
+		iov = &uio->uio_iov[i];
+		len = iov->iov_len;
+		if (len > left) {
+			len = left;
+		}
+		va = (vaddr_t)iov->iov_ubase;
+		end = va + len;
+		while (va < end) {
+			/* A read touch will do: it brings the page in */
+			result = copyin((const_userptr_t)va, &c, 1);
+			if (result) {
+				return result;
+			}
+			va = (va & PAGE_FRAME) + PAGE_SIZE;
+		}
+		left -= len;
+	}
+	return 0;
+}
+
 int
 uiomovezeros(size_t n, struct uio *uio)
 {
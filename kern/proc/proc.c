@@ -100,13 +100,19 @@ proc_create(const char *name)
 	proc->pid = -1;
 	proc->parent = NULL;
 	proc->exitcode = -1;
-	proc->children_pids = myarray_create();
-	if (!(proc->children_pids)) {
+	proc->exited = false;
+	proc->children = NULL;
+	proc->zombies = NULL;
+	proc->sib_next = NULL;
+	proc->sib_prev = NULL;
+	proc->proc_cv = cv_create("proc_cv");
+	if (proc->proc_cv == NULL) {
+		kfree(proc->p_name);
 		kfree(proc);
 		return NULL;
 	}
-	proc->proc_lock = lock_create("proc_lock");
-	proc->proc_cv = cv_create("proc_cv");
+	proc->vfork_sem = NULL;
+	proc->vfork_borrowed = false;
 
 	threadarray_init(&proc->p_threads);
 	spinlock_init(&proc->p_lock);
@@ -153,6 +159,42 @@ int generate_pid(struct proc *proc) {
 }
 
 
+/*
+ * Doubly-linked family lists (a parent's live children and its zombies).
+ * Both operations are O(1); the caller must hold pmanager_lock.
+ */
+void
+proc_list_add(struct proc **head, struct proc *p)
+{
+	KASSERT(lock_do_i_hold(pmanager_lock));
+	KASSERT(p->sib_next == NULL && p->sib_prev == NULL);
+
+	p->sib_next = *head;
+	if (*head != NULL) {
+		(*head)->sib_prev = p;
+	}
+	*head = p;
+}
+
+void
+proc_list_remove(struct proc **head, struct proc *p)
+{
+	KASSERT(lock_do_i_hold(pmanager_lock));
+
+	if (p->sib_prev != NULL) {
+		p->sib_prev->sib_next = p->sib_next;
+	}
+	else {
+		KASSERT(*head == p);
+		*head = p->sib_next;
+	}
+	if (p->sib_next != NULL) {
+		p->sib_next->sib_prev = p->sib_prev;
+	}
+	p->sib_next = NULL;
+	p->sib_prev = NULL;
+}
+
 /*
  * Destroy a proc structure.
  */
@@ -214,11 +256,17 @@ proc_destroy(struct proc *proc)
 	threadarray_cleanup(&proc->p_threads);
 	spinlock_cleanup(&proc->p_lock);
 
-	lock_acquire(pmanager_lock);
-	pmanager->procs[proc->pid] = NULL;  //mark the pid to available
-	lock_release(pmanager_lock);
-  lock_destroy(proc->proc_lock);
+	if (proc->pid >= PID_MIN) {
+		lock_acquire(pmanager_lock);
+		pmanager->procs[proc->pid] = NULL;  //mark the pid to available
+		lock_release(pmanager_lock);
+	}
+	KASSERT(proc->children == NULL);
+	KASSERT(proc->zombies == NULL);
   cv_destroy(proc->proc_cv);
+	if (proc->vfork_sem) {
+		sem_destroy(proc->vfork_sem);
+	}
 	kfree(proc->p_name);
 	kfree(proc);
 	
@@ -337,9 +385,8 @@ proc_create_runprogram(const char *name)
 
   int temp_pid = generate_pid(proc);
   if (temp_pid == -1) {
-    as_destroy(proc->p_addrspace);
     proc_destroy(proc);
-    return (void *)ENPROC;
+    return NULL;
   }
   proc->pid = temp_pid;
 
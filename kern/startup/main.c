@@ -48,8 +48,10 @@
 #include <device.h>
 #include <syscall.h>
 #include <test.h>
+#include <sfs.h>
 #include <version.h>
 #include "autoconf.h"  // for pseudoconfig
+#include "opt-sfs.h"
 
 
 /*
@@ -108,9 +110,13 @@ boot(void)
 	/* Early initialization. */
 	ram_bootstrap();
 	proc_bootstrap();
+	argblock_bootstrap();
 	thread_bootstrap();
 	hardclock_bootstrap();
 	vfs_bootstrap();
+#if OPT_SFS
+	sfs_bootstrap();
+#endif
 
 	/* Probe and initialize devices. Interrupts should come on. */
 	kprintf("Device probe...\n");
@@ -40,7 +40,10 @@
 #include <synch.h>
 #include <vfs.h>
 #include <sfs.h>
+#include <buf.h>
+#include <namecache.h>
 #include <syscall.h>
+#include <sysstats.h>
 #include <test.h>
 #include "opt-synchprobs.h"
 #include "opt-sfs.h"
@@ -255,6 +258,25 @@ cmd_sync(int nargs, char **args)
 	return 0;
 }
 
+/*
+ * Command for showing or setting the syncer's age limit.
+ */
+static
+int
+cmd_syncage(int nargs, char **args)
+{
+	if (nargs > 2) {
+		kprintf("Usage: syncage [seconds]\n");
+		return EINVAL;
+	}
+	if (nargs == 2) {
+		vfs_syncer_age = atoi(args[1]);
+	}
+	kprintf("Syncer age: %u seconds%s\n", vfs_syncer_age,
+		vfs_syncer_age == 0 ? " (off)" : "");
+	return 0;
+}
+
 /*
  * Command for doing an intentional panic.
  */
@@ -392,6 +414,48 @@ cmd_kheapstats(int nargs, char **args)
 	return 0;
 }
 
+static
+int
+cmd_bufstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	buffer_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_ncstats(int nargs, char **args)
+{
+	(void)nargs;
+	(void)args;
+
+	namecache_printstats();
+
+	return 0;
+}
+
+static
+int
+cmd_syscallstats(int nargs, char **args)
+{
+	if (nargs == 2 && !strcmp(args[1], "reset")) {
+		sysstats_reset();
+		return 0;
+	}
+	if (nargs != 1) {
+		kprintf("Usage: ss [reset]\n");
+		return EINVAL;
+	}
+
+	sysstats_print();
+
+	return 0;
+}
+
 /*
  * Command for running dth.
  */
@@ -445,6 +509,7 @@ static const char *opsmenu[] = {
 	"[cd]      Change directory          ",
 	"[pwd]     Print current directory   ",
 	"[sync]    Sync filesystems          ",
+	"[syncage] Show/set syncer age       ",
 	"[panic]   Intentional panic         ",
 	"[q]       Quit and shut down        ",
   "[dth]     Enable DB_THREADS debugging msgs",
@@ -485,6 +550,8 @@ static const char *testmenu[] = {
 	"[fs3] FS write stress       (4)     ",
 	"[fs4] FS write stress 2     (4)     ",
 	"[fs5] FS create stress      (4)     ",
+	"[db]  Raw disk read benchmark       ",
+	"[mm1] Mmap test                     ",
 	NULL
 };
 
@@ -516,6 +583,9 @@ static const char *mainmenu[] = {
 #endif /* UW */
 #endif
 	"[kh] Kernel heap stats              ",
+	"[ss] Syscall stats                  ",
+	"[bc] Buffer cache stats             ",
+	"[nc] Name cache stats               ",
 	"[q] Quit and shut down              ",
 	NULL
 };
@@ -556,6 +626,7 @@ static struct {
 	{ "cd",		cmd_chdir },
 	{ "pwd",	cmd_pwd },
 	{ "sync",	cmd_sync },
+	{ "syncage",	cmd_syncage },
 	{ "panic",	cmd_panic },
 	{ "q",		cmd_quit },
 	{ "exit",	cmd_quit },
@@ -573,6 +644,9 @@ static struct {
 
 	/* stats */
 	{ "kh",         cmd_kheapstats },
+	{ "ss",         cmd_syscallstats },
+	{ "bc",         cmd_bufstats },
+	{ "nc",         cmd_ncstats },
 
 	/* base system tests */
 	{ "at",		arraytest },
@@ -601,6 +675,8 @@ static struct {
 	{ "fs3",	writestress },
 	{ "fs4",	writestress2 },
 	{ "fs5",	createstress },
+	{ "db",		diskbench },
+	{ "mm1",	mmaptest },
 
 	{ NULL, NULL }
 };
@@ -15,52 +15,60 @@
 #include <vfs.h>
 #include <kern/fcntl.h>
 
-//using self define myarray for  children_pids, using a builtin C array for pmanager procs array!!!!!!
+//pmanager->procs maps a pid to its proc; each parent keeps its live children and its
+//unreaped zombies on two linked lists, so exit and reap cost O(1) per child.
 
 
 static volatile pid_t pid_counter = PID_MIN;
 
-  /* this implementation of sys__exit does not do anything with the exit code */
-  /* this needs to be fixed to get exit() and waitpid() working properly */
+/*
+ * Hand a borrowed address space back to the vfork() parent and let it run.
+ * Called by the child once it no longer needs the parent's memory, i.e. on
+ * a successful execv or on _exit.
+ */
+static void vfork_release(struct proc *p) {
+  KASSERT(p->vfork_borrowed);
+  p->vfork_borrowed = false;
+  V(p->vfork_sem);
+}
+
+/*
+ * Make CHILD a live child of the current process. Undone with
+ * unlink_child if the child never gets to run.
+ */
+static void link_child(struct proc *child) {
+  lock_acquire(pmanager_lock);
+  child->parent = curproc;
+  proc_list_add(&curproc->children, child);
+  lock_release(pmanager_lock);
+}
+
+static void unlink_child(struct proc *child) {
+  lock_acquire(pmanager_lock);
+  proc_list_remove(&curproc->children, child);
+  child->parent = NULL;
+  lock_release(pmanager_lock);
+}
 
 void sys__exit(int exitcode) {
-  // im a child -> if parent is dead, kill myself
-  //            -> if parent is not dead, delete everything else but keep pid,exitcode, parent and children
-  // im a parent -> if child is dead, kill the child
-  //             -> if child is not dead, tell him that im dying
+  // im a parent -> live children become orphans and clean up after themselves,
+  //                zombie children nobody reaped get destroyed now
+  // im a child  -> parent still around: move myself to its zombie list and wake it up
+  //             -> no parent (or kernel): destroy myself
   
   struct addrspace *as;
   struct proc *p = curproc;
-  p->exitcode = _MKWAIT_EXIT(exitcode);
-  
-  
+  struct proc *child, *reap;
+  bool orphan;
+
   DEBUG(DB_SYSCALL,"Syscall: _exit(%d)\n",exitcode);
-  KASSERT(curproc->p_addrspace != NULL);
-  
-  lock_acquire(pmanager_lock);
-  for (int i = 0; i < p->children_pids->len; ++i) {
-    int temp_pid = p->children_pids->arr[i];
-
-    //look up the child process in the pmanager array
-    struct proc * cur_child = pmanager->procs[temp_pid];
-    if (cur_child == NULL) {
-      //child is already dead, do nothing and continue
-      continue;
-    } else {
-      //if the child still exists, set parent reference to null cuz im killing myself
-      cur_child->parent = NULL;
-      if (cur_child->exitcode >= 0) {
-        //the child has exited, just kill it all
-        lock_release(pmanager_lock);   // release the pmanager_lock here because proc_destroy needs this lock
-        proc_destroy(cur_child);
-        lock_acquire(pmanager_lock);
-      }
-    }
+
+  //a vfork child gives the address space back before anything else
+  if (p->vfork_borrowed) {
+    as_deactivate();
+    curproc_setas(NULL);
+    vfork_release(p);
   }
-  lock_release(pmanager_lock);
-  //no longer need this array of child PIDs
-  myarray_delete(p->children_pids);
-  
   
   as_deactivate();
   /*
@@ -71,26 +79,52 @@ void sys__exit(int exitcode) {
    * messily fatal.
    */
   as = curproc_setas(NULL);
-  as_destroy(as);
+  if (as != NULL) {
+    as_destroy(as);
+  }
+
+  lock_acquire(pmanager_lock);
+  //orphan the live children; each touches only its own entry
+  for (child = p->children; child != NULL; child = child->sib_next) {
+    child->parent = NULL;
+  }
+  //take the whole zombie list; destroyed below without the lock (proc_destroy needs it)
+  reap = p->zombies;
+  p->zombies = NULL;
+  while (p->children != NULL) {
+    proc_list_remove(&p->children, p->children);
+  }
+  lock_release(pmanager_lock);
+
+  while (reap != NULL) {
+    child = reap;
+    reap = child->sib_next;
+    child->sib_next = NULL;
+    child->sib_prev = NULL;
+    proc_destroy(child);
+  }
 
   /* detach this thread from its process */
   /* note: curproc cannot be used after this call */
   proc_remthread(curthread);
 
-  threadarray_cleanup(&p->p_threads);
-  spinlock_cleanup(&p->p_lock);
-  
-  lock_acquire(p->proc_lock);
-  cv_broadcast(p->proc_cv, p->proc_lock);
-  lock_release(p->proc_lock);
-  
-  //if parent is dead, or parent has exited or parent is the kernel i'll just kill myself :)
-  if (!(p->parent) || p->parent->exitcode >= 0 || p->parent == kproc) {
-    proc_destroy(p);
+  //only now, with nothing left running in it, may the proc be seen as a zombie
+  lock_acquire(pmanager_lock);
+  p->exitcode = _MKWAIT_EXIT(exitcode);
+  p->exited = true;
+  orphan = (p->parent == NULL || p->parent == kproc);
+  if (!orphan) {
+    proc_list_remove(&p->parent->children, p);
+    proc_list_add(&p->parent->zombies, p);
+    cv_broadcast(p->parent->proc_cv, pmanager_lock);
   }
+  lock_release(pmanager_lock);
+  
   /* if this is the last user process in the system, proc_destroy()
      will wake up the kernel menu thread */
-  //proc_destroy(p);
+  if (orphan) {
+    proc_destroy(p);
+  }
   
   thread_exit();
   /* thread_exit() does not return, so we should never get here */
@@ -112,63 +146,83 @@ sys_getpid(pid_t *ret_val)
 
 
 
-/* stub handler for waitpid() system call                */
+/*
+ * waitpid: PID is a specific child or WAIT_ANY (-1) for any child.
+ * With WNOHANG, returns 0 instead of sleeping if no matching child has
+ * exited yet.
+ */
 
 int
 sys_waitpid(pid_t pid, userptr_t status, int options, pid_t *ret_val) {
+  struct proc *target_child;
   int exitstatus;
   int result;
-  (void)status;
 
-  /* this is just a stub implementation that always reports an
-     exit status of 0, regardless of the actual exit status of
-     the specified process.
-     In fact, this will return 0 even if the specified process
-     is still running, and even if it never existed in the first place.
-
-     Fix this!
-  */
-
-  if (options != 0) {
+  if (options & ~WNOHANG) {
     return(EINVAL);
   }
   
-  //check if the pid is valid -> between PID_MIN and PID_MAX
-  if (pid < PID_MIN || pid > PID_MAX) {
+  //check if the pid is valid -> between PID_MIN and PID_MAX, or WAIT_ANY
+  if (pid != WAIT_ANY && (pid < PID_MIN || pid > PID_MAX)) {
    return ESRCH; //search error
   }
-  //try to grab the child from the pmanager array using PID
-  struct proc * target_child = pmanager->procs[pid];
-  //check if the child retrieved is a valid child
-  if (!(target_child)) return ECHILD; //not a child
-  if (target_child->exitcode < 0) {
-    //if the retrieved child has not exited, we wait for it
-    lock_acquire(target_child->proc_lock);
-    cv_wait(target_child->proc_cv, target_child->proc_lock);
-    lock_release(target_child->proc_lock);
+
+  lock_acquire(pmanager_lock);
+  while (1) {
+    if (pid == WAIT_ANY) {
+      if (curproc->children == NULL && curproc->zombies == NULL) {
+        lock_release(pmanager_lock);
+        return ECHILD;
+      }
+      //any zombie will do; take the first one
+      target_child = curproc->zombies;
+    }
+    else {
+      target_child = pmanager->procs[pid];
+      if (target_child == NULL) {
+        lock_release(pmanager_lock);
+        return ESRCH;
+      }
+      if (target_child->parent != curproc) {
+        lock_release(pmanager_lock);
+        return ECHILD; //not our child
+      }
+      if (!target_child->exited) {
+        target_child = NULL;
+      }
+    }
+
+    if (target_child != NULL) {
+      break;
+    }
+    if (options & WNOHANG) {
+      lock_release(pmanager_lock);
+      *ret_val = 0;
+      return 0;
+    }
+    cv_wait(curproc->proc_cv, pmanager_lock);
   }
-  
+
+  proc_list_remove(&curproc->zombies, target_child);
+  lock_release(pmanager_lock);
+
   exitstatus = target_child->exitcode;
-  *ret_val = target_child->exitcode;
-  result = copyout((void *)&exitstatus, status, sizeof(int));
-  
-  if (result) {
-    return(result);
-  }
+  *ret_val = target_child->pid;
   proc_destroy(target_child);
+
+  if (status != NULL) {
+    result = copyout((void *)&exitstatus, status, sizeof(int));
+    if (result) {
+      return(result);
+    }
+  }
   return 0;
-  // /* for now, just pretend the exitstatus is 0 */
-  // exitstatus = 0;
-  // result = copyout((void *)&exitstatus,status,sizeof(int));
-  
-  // *retval = pid;
-  // return(0);
 }
 
 
 int sys_fork(struct trapframe *tf, pid_t *ret_val) {
 
-  //CREATE process structure for child process
+  //CREATE process structure for child process (this also assigns its PID)
   struct proc *child_proc = proc_create_runprogram(curproc->p_name); // create the process structure
   //check if child process is created
   if (child_proc == NULL) return ENOMEM;
@@ -178,145 +232,223 @@ int sys_fork(struct trapframe *tf, pid_t *ret_val) {
   //check if address space is copied successfully
   if(as_copy_err) {
     proc_destroy(child_proc);
+    return as_copy_err;
   }
-  
-  //Assign PID to child process
-  int temp_pid = generate_pid(child_proc);
-  if (temp_pid == -1) {
+
+  //CREATE trapframe
+  struct trapframe *new_tf = kmalloc(sizeof(struct trapframe));
+  if (new_tf == NULL) {
     as_destroy(child_proc->p_addrspace);
     proc_destroy(child_proc);
-    return ENPROC;
+    return ENOMEM;
+  }
+  // memcpy(new_tf, tf, sizeof(struct trapframe));
+  *new_tf = *tf;
+
+  //CREATE the parent & child relationship (before the child can run and exit)
+  link_child(child_proc);
+
+  //CREATE thread for child process
+  int thread_fork_err = thread_fork("child_proc", child_proc, enter_forked_process, new_tf, 0);
+  if (thread_fork_err) {
+    unlink_child(child_proc);
+    kfree(new_tf);
+    as_destroy(child_proc->p_addrspace);
+    proc_destroy(child_proc);
+    return thread_fork_err;
   }
-  child_proc->pid = temp_pid;
 
-  //CREATE the parent & child relationship
-  child_proc->parent = curproc;
-  myarray_insert(curproc->children_pids, child_proc->pid);//add child pid to array of all children pids
+  *ret_val = child_proc->pid;
+  return 0;
+}
+
+
+
+/*
+ * vfork: like fork, but the child runs in the parent's address space instead
+ * of a copy, and the parent sleeps until the child calls execv or _exit.
+ * Launching a program this way costs the same no matter how big the parent is.
+ */
+int sys_vfork(struct trapframe *tf, pid_t *ret_val) {
+
+  //CREATE process structure for child process (this also assigns its PID)
+  struct proc *child_proc = proc_create_runprogram(curproc->p_name);
+  if (child_proc == NULL) return ENOMEM;
+
+  child_proc->vfork_sem = sem_create("vfork_sem", 0);
+  if (child_proc->vfork_sem == NULL) {
+    proc_destroy(child_proc);
+    return ENOMEM;
+  }
+
+  //SHARE the parent's address space instead of copying it
+  child_proc->p_addrspace = curproc_getas();
+  child_proc->vfork_borrowed = true;
 
   //CREATE trapframe
   struct trapframe *new_tf = kmalloc(sizeof(struct trapframe));
   if (new_tf == NULL) {
-    as_destroy(child_proc->p_addrspace);
+    child_proc->p_addrspace = NULL;
     proc_destroy(child_proc);
     return ENOMEM;
   }
-  // memcpy(new_tf, tf, sizeof(struct trapframe));
   *new_tf = *tf;
 
+  link_child(child_proc);
+
   //CREATE thread for child process
   int thread_fork_err = thread_fork("child_proc", child_proc, enter_forked_process, new_tf, 0);
   if (thread_fork_err) {
-    // as_destroy(child_proc->p_addrspace);
-    // proc_destroy(child_proc);
+    unlink_child(child_proc);
+    kfree(new_tf);
+    child_proc->p_addrspace = NULL;
+    proc_destroy(child_proc);
     return thread_fork_err;
   }
 
-  if (child_proc == curproc) {
-    *ret_val = 0;
-  } else {
-    *ret_val = child_proc->pid;
+  //WAIT until the child is done with our address space
+  P(child_proc->vfork_sem);
+
+  *ret_val = child_proc->pid;
+  return 0;
+}
+
+
+/*
+ * Argument block used to marshal argv for execv and runprogram.
+ *
+ * The strings are packed end to end into one kernel buffer while they are
+ * collected. Once the new address space exists, the buffer is rearranged in
+ * place into the exact image that goes on the user stack (the argv pointer
+ * array followed by the strings) and moved out with a single copyout. The
+ * buffer is ARG_MAX bytes, which also bounds the total size of the
+ * arguments. There is just one, allocated at boot, since anything over a
+ * couple of pages from kmalloc could never be given back. execv loads the
+ * new program first and holds argblock_lock only while moving the arguments
+ * across: it switches back to the old address space to collect them, then
+ * to the new one to copy them out.
+ */
+struct argblock {
+  char *buf;
+  size_t size;    // bytes in buf
+  size_t used;    // bytes of packed strings, including their terminators
+  int argc;
+};
+
+#define ARGPTR_SIZE sizeof(userptr_t)
+
+static char *argblock_buf;
+static struct lock *argblock_lock;
+
+void argblock_bootstrap(void) {
+  argblock_buf = kmalloc(ARG_MAX);
+  if (argblock_buf == NULL) {
+    panic("argblock_bootstrap: Out of memory\n");
+  }
+  argblock_lock = lock_create("argblock");
+  if (argblock_lock == NULL) {
+    panic("argblock_bootstrap: Could not create lock\n");
   }
+}
+
+static void argblock_init(struct argblock *ab) {
+  lock_acquire(argblock_lock);
+  ab->buf = argblock_buf;
+  ab->size = ARG_MAX;
+  ab->used = 0;
+  ab->argc = 0;
+}
+
+static void argblock_cleanup(struct argblock *ab) {
+  ab->buf = NULL;
+  lock_release(argblock_lock);
+}
+
+// bytes still free for strings once room for argv[] (one more arg plus the NULL) is kept back
+static size_t argblock_room(struct argblock *ab) {
+  size_t reserve = ab->used + (ab->argc + 2) * ARGPTR_SIZE;
+  return reserve < ab->size ? ab->size - reserve : 0;
+}
+
+// append a user-space string
+static int argblock_add_user(struct argblock *ab, const_userptr_t ustr) {
+  size_t room = argblock_room(ab);
+  size_t got;
+  int result;
 
+  if (room == 0) return E2BIG;
+  result = copyinstr(ustr, ab->buf + ab->used, room, &got);
+  if (result == ENAMETOOLONG) return E2BIG;
+  if (result) return result;
+
+  ab->used += got;
+  ab->argc++;
   return 0;
 }
 
+// append a kernel string
+static int argblock_add_kern(struct argblock *ab, const char *str) {
+  size_t len = strlen(str) + 1;
+
+  if (argblock_room(ab) < len) return E2BIG;
+
+  memcpy(ab->buf + ab->used, str, len);
+  ab->used += len;
+  ab->argc++;
+  return 0;
+}
 
+/*
+ * Turn the packed strings into the user stack image and copy it out below
+ * *stack_ptr in one go. Hands back the user argv and the new stack pointer.
+ */
+static int argblock_copyout(struct argblock *ab, userptr_t *user_args, vaddr_t *stack_ptr) {
+  size_t ptrbytes = (ab->argc + 1) * ARGPTR_SIZE;
+  size_t total = ptrbytes + ab->used;
+  userptr_t *argv = (userptr_t *)ab->buf;
+  vaddr_t base;
+  size_t off = 0;
+  int result;
 
+  KASSERT(total <= ab->size);
 
-static void free_args(char **args, int len) {
-  for (int i = 0; i <= len; ++i) {
-    kfree(args[i]);
+  //strings go right after the pointer array; keep the stack 8-byte aligned
+  base = (*stack_ptr - total) & ~(vaddr_t)7;
+  memmove(ab->buf + ptrbytes, ab->buf, ab->used);
+
+  for (int i = 0; i < ab->argc; ++i) {
+    argv[i] = (userptr_t)(base + ptrbytes + off);
+    off += strlen(ab->buf + ptrbytes + off) + 1;
   }
+  argv[ab->argc] = NULL;
+  KASSERT(off == ab->used);
+
+  result = copyout(ab->buf, (userptr_t)base, total);
+  if (result) return result;
+
+  *stack_ptr = base;
+  *user_args = (userptr_t)base;   // this is the argv parameter
+  return 0;
 }
 
 
 int copyin_args(int arg_count, char ** kern_args, userptr_t *user_args, vaddr_t *stack_ptr) {
-  //idea: write a loop that puts all the args(the strings themselves) onto the user stack at index x
-  //      and at the same time, at each step after placing the arg onto the stack, we get the pointer
-  //      that points to the arg on the stack and place the ptr on user stack at index (x+ size of all arg strings)
-  //      size of all arg strings will be calculated at the beginning using a loop (which is shit but idgf)
-  //      note: everything is in reverse order
-  
-  // //////////////
-  // int result = 0;
-  // vaddr_t stack = *stack_ptr;
-  // vaddr_t split_location = stack;
-  // char ** string_locations = kmalloc(arg_count * sizeof(char *));
-  // for (int i = 0; i < arg_count; ++i) {
-  //   split_location -= ROUNDUP(strlen(*(kern_args+i)) + 1, 8);
-  //   result = copyoutstr(*(kern_args + arg_count - i - 1), (userptr_t)split_location, strlen(*(kern_args+i)) + 1, NULL);
-  //   if (result) {
-  //     kfree(string_locations);
-  //     return result;
-  //   }
-    
-  //   string_locations[i] = (char *)split_location;
-  // }
-  // //split_location -= sizeof(void *);
-  
-  // *(string_locations + arg_count) = NULL;
-  // //set NULL
-  // //copyout(NULL, (userptr_t)split_location, sizeof(void *));
-  
-  // for (int i = arg_count - 1; i > -1; --i) {
-  //   int temp_len = strlen(kern_args[i]) + 1;
-  //   //copyoutstr(kern_args[i], (userptr_t)(stack - ROUNDUP(temp_len, 8)), temp_len, NULL);
-  //   split_location -= sizeof(void *);
-  //   kprintf("shit %p\n", *(string_locations+i));
-  //   result = copyout(string_locations + i, (userptr_t)split_location, sizeof(char *));
-  //   if (result) {
-  //     kfree(string_locations);
-  //     return result;
-  //   }
-  //   stack -= ROUNDUP(temp_len, 8);
-  // }
-  // stack = split_location;
-  // *user_args = (userptr_t)stack; //modify user_args to contain the actual cur stackptr
-  // if (stack % 8 == 0) stack -= 8;
-  // else stack -= 4;  //idk wtf this is, but its on hint page
-  // //kprintf("shit: %p\n", user_args);
-  // *stack_ptr = stack;  //update the stack ptr
-  // kfree(string_locations);
-  // kprintf("getting here %d\n", result);
-  // return result;
-  // ////////////////
-  
-  
-  // THE above implementation is having weird memory errors too hard to debug.....
-  // trying 2nd approach:
-  //                have one for loop that adds the strings onto the stack in reverse order, at the same time
-  //                store each corresponding address into an array. Add a NULL after adding all the strings onto
-  //                the stack. Then have a second for loop that adds the array of addresses onto the stack.
-  int result = 0;
-  vaddr_t user_stack = *stack_ptr;
-  char ** string_locations = kmalloc((arg_count + 1) * sizeof(char *));
-  
-  *(string_locations + arg_count) = NULL;  //in between all strinngs and all addresses
-  
-  for (int i = arg_count-1; i > -1; --i) {
-    int arg_len = strlen(*(kern_args + (arg_count - i -1))) + 1;
-    user_stack -= ROUNDUP(arg_len, 8);
-    result = copyoutstr(*(kern_args + (arg_count - i - 1)), (userptr_t)user_stack, arg_len, NULL);
-    if (result) {
-      kfree(string_locations);
-      return result;
-    }
-    *(string_locations + (arg_count - i -1)) = (char *)user_stack;
-  }
-  
-  for (int j = arg_count; j > -1; --j) {
-    user_stack -= sizeof(char *);
-    result = copyout(string_locations + j, (userptr_t)user_stack, sizeof(char *));
+  //put kernel-resident args (from the menu via runprogram) on the user stack
+  struct argblock ab;
+  int result;
+
+  argblock_init(&ab);
+
+  for (int i = 0; i < arg_count; ++i) {
+    result = argblock_add_kern(&ab, kern_args[i]);
     if (result) {
-      kfree(string_locations);
+      argblock_cleanup(&ab);
       return result;
     }
   }
-  
-  *stack_ptr = user_stack;
-  *user_args = (userptr_t)user_stack;   // this is the argv parameter
-  kfree(string_locations);
-  
+
+  result = argblock_copyout(&ab, user_args, stack_ptr);
+  argblock_cleanup(&ab);
   return result;
 }
   
@@ -325,93 +457,34 @@ int sys_execv(const char *progname, userptr_t args2) {
   
 	struct addrspace *new_as;
 	struct addrspace *old_as = curproc_getas();
+	struct argblock ab;
 	int result;
-  char **args = (char **)args2;
-  
-  //count the number of arguments
-  int arg_count = 0;
-  while(args[arg_count] != NULL) {
-    if (strlen(args[arg_count]) > 1024) {
-      return E2BIG;
-    }
-    arg_count++;
-  }
-  if (arg_count > 32) {
-    return E2BIG;
-  }
-
-  //copy the arguments into the kernel
-  char **kern_args = kmalloc((arg_count + 1) * sizeof(char *)); // malloc space for kernel args
-  if (!kern_args) return ENOMEM;
-  
-  for (int i = 0; i < arg_count; ++i) {
-    size_t arg_len = strlen(args[i]) + 1;
-    kern_args[i] = kmalloc(sizeof(char *) * arg_len);
-    if (!kern_args[i]) {
-      free_args(kern_args, i);
-      kfree(kern_args);
-      return ENOMEM;
-    }
-    //kprintf("target: %s\n", args[i]);
-    
-    result = copyinstr((userptr_t)args[i], kern_args[i], arg_len, NULL);
-    if (result) {
-      free_args(kern_args, i);
-      kfree(kern_args);
-      return result;
-    }
-  }
-  kern_args[arg_count] = NULL;
-  
-  // kprintf("I'm printing the array of args snake a\n");
-  // for (int x = 0; x < arg_count; ++x) {
-  //   kprintf("I'm printing the length of the args %d\n", strlen(kern_args[x]));
-  //   kprintf("I'm printing the actual arg: %s; \n", kern_args[x]);
-  // }
-  
-  
-// Copy the program path into the kernel (program path is the parameter "program"
 
-	// allocate space for program_path
-	char *new_prog = kmalloc((strlen(progname) + 1) * sizeof(char));
+	// Copy the program path into the kernel (program path is the parameter "program")
+	char *new_prog = kmalloc(PATH_MAX);
 	if (!new_prog) {
-	   free_args(kern_args, arg_count - 1);
-	   kfree(kern_args);
-	   return ENOMEM;
+	  return ENOMEM;
  	}
-
-	//copy the program path into the allocated kernel space
-	result = copyinstr((const_userptr_t)progname, new_prog, strlen(progname) + 1, NULL);
+	result = copyinstr((const_userptr_t)progname, new_prog, PATH_MAX, NULL);
 	if (result) {
-	  //if there is an error
-	  free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
 	  kfree(new_prog);
 	  return result;
 	}
 	
 	struct vnode *v;
 	vaddr_t entrypoint;
-	//int result;
 
 	/* Open the file. */
 	result = vfs_open(new_prog, O_RDONLY, 0, &v);
+	kfree(new_prog);
 	if (result) {
-	  free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
-	  kfree(new_prog);
 		return result;
 	}
 
-	/* We should be a new process. */
-	//KASSERT(curproc_getas() == NULL);
 	/* Create a new address space. */
 	new_as = as_create();
 	if (new_as == NULL) {
 		vfs_close(v);
-		free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
-	  kfree(new_prog);
 		return ENOMEM;
 	}
 
@@ -423,50 +496,67 @@ int sys_execv(const char *progname, userptr_t args2) {
 	/* Load the executable. */
 	result = load_elf(v, &entrypoint);
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
+		/* go back to the old space so the caller (maybe a vfork child) can still run */
 		vfs_close(v);
-		free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
-	  kfree(new_prog);
+	  curproc_setas(old_as);
+	  as_activate();
+	  as_destroy(new_as);
 		return result;
 	}
 
 	/* Done with the file now. */
 	vfs_close(v);
 
-
 	/* Define the user STACK in the address space */
 	vaddr_t user_stack;
 	result = as_define_stack(new_as, &user_stack);   //this puts the newly defined user stack into the user address space
 	if (result) {
-		/* p_addrspace will go away when curproc is destroyed */
-		free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
-	  kfree(new_prog);
+	  curproc_setas(old_as);
+	  as_activate();
+	  as_destroy(new_as);
 		return result;
 	}
+
+  //the arguments are still in the old space; only hold the shared argument buffer while moving them across
+  curproc_setas(old_as);
+  as_activate();
+  argblock_init(&ab);
+
+	for (int i = 0; ; ++i) {
+	  userptr_t uarg;
+	  result = copyin(args2 + i * ARGPTR_SIZE, &uarg, sizeof(uarg));
+	  if (result) break;
+	  if (uarg == NULL) break;
+
+	  result = argblock_add_user(&ab, uarg);
+	  if (result) break;
+	}
+	if (result) {
+	  argblock_cleanup(&ab);
+	  as_destroy(new_as);
+	  return result;
+	}
+
+  curproc_setas(new_as);
+  as_activate();
   
-  //copy the arguments into the new address space -> copy the args onto the user stack
-  userptr_t user_args;  // trying to give the args to user
-  result = copyin_args(arg_count, kern_args, &user_args, &user_stack);
-                                                                       //arg_count is the number of args trying to give to user   (this 	kprintf("printing user_args: %p\n", user_args); will be argc)
-                                                                       //kern_args is an array of pointers pointing to strings(args) that are on the kernel heap
-                                                                       //user_args will be an array of(pointer) pointers pointing to strings(args) that are on the user stack (this will be argv)
-                                                                       //user_stack is a pointer pointing to the top of the user_stack
-  //kprintf("my life is a lie: %d\n", result);
+  //copy the arguments onto the new user stack (argc is ab.argc, user_args becomes argv)
+  userptr_t user_args;
+  int arg_count = ab.argc;
+  result = argblock_copyout(&ab, &user_args, &user_stack);
+  argblock_cleanup(&ab);
   if (result) {
-    free_args(kern_args, arg_count - 1);
-	  kfree(kern_args);
-	  kfree(new_prog);
 	  curproc_setas(old_as);//if failed -> need to set the current process to the old one
+	  as_activate();
 	  as_destroy(new_as);
 		return result;
   }
-  //destroy the stuff at the end
-  as_destroy(old_as);
-  kfree(new_prog);
-  free_args(kern_args, arg_count - 1);
-  kfree(kern_args);
+  //destroy the stuff at the end; a vfork child gives the old space back to its parent instead
+  if (curproc->vfork_borrowed) {
+    vfork_release(curproc);
+  } else {
+    as_destroy(old_as);
+  }
 	/* Warp to user mode. */
 	enter_new_process(arg_count, user_args, user_stack, entrypoint);
 
@@ -0,0 +1,146 @@
+/*
+ * System call statistics.
+ *
+ * One struct sysstat per call number, updated by the dispatcher in
+ * syscall() on every trap. The table is small and updates are a few
+ * adds, so a single spinlock covers all of it.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <spinlock.h>
+#include <copyinout.h>
+#include <sysstats.h>
+#include <syscall.h>
+
+static struct sysstat sysstats[SYSSTAT_NCALLS];
+static struct spinlock sysstats_lock = SPINLOCK_INITIALIZER;
+
+void
+sysstats_enter(unsigned callno)
+{
+	if (callno >= SYSSTAT_NCALLS) {
+		return;
+	}
+	spinlock_acquire(&sysstats_lock);
+	sysstats[callno].ss_calls++;
+	spinlock_release(&sysstats_lock);
+}
+
+void
+sysstats_leave(unsigned callno, int err, uint64_t nsecs)
+{
+	struct sysstat *ss;
+
+	if (callno >= SYSSTAT_NCALLS) {
+		return;
+	}
+	ss = &sysstats[callno];
+
+	spinlock_acquire(&sysstats_lock);
+	if (err) {
+		ss->ss_errors++;
+	}
+	ss->ss_totnsecs += nsecs;
+	if (nsecs > ss->ss_maxnsecs) {
+		ss->ss_maxnsecs = nsecs;
+	}
+	spinlock_release(&sysstats_lock);
+}
+
+/*
+ * Copy entry I out from under the lock, optionally zeroing it. The
+ * table is read an entry at a time rather than copied whole: it's
+ * big enough that a kmalloc'd copy would take a page, which dumbvm
+ * never gives back.
+ */
+static
+void
+sysstats_get(unsigned i, struct sysstat *copy, bool reset)
+{
+	spinlock_acquire(&sysstats_lock);
+	if (copy != NULL) {
+		*copy = sysstats[i];
+	}
+	if (reset) {
+		bzero(&sysstats[i], sizeof(sysstats[i]));
+	}
+	spinlock_release(&sysstats_lock);
+}
+
+void
+sysstats_reset(void)
+{
+	unsigned i;
+
+	for (i=0; i<SYSSTAT_NCALLS; i++) {
+		sysstats_get(i, NULL, true);
+	}
+}
+
+/*
+ * kprintf may sleep, so print each entry from a copy rather than
+ * holding the spinlock.
+ */
+void
+sysstats_print(void)
+{
+	struct sysstat copy;
+	const char *name;
+	unsigned i;
+	uint32_t avg;
+
+	kprintf("SYSSTATS: %4s %-12s %10s %8s %10s %10s\n",
+		"#", "call", "calls", "errors", "avg usec", "max usec");
+	for (i=0; i<SYSSTAT_NCALLS; i++) {
+		sysstats_get(i, &copy, false);
+		if (copy.ss_calls == 0) {
+			continue;
+		}
+		name = syscall_name(i);
+		avg = copy.ss_totnsecs / copy.ss_calls / 1000;
+		kprintf("SYSSTATS: %4u %-12s %10u %8u %10u %10u\n",
+			i, name != NULL ? name : "?",
+			copy.ss_calls, copy.ss_errors, avg,
+			(uint32_t)(copy.ss_maxnsecs / 1000));
+	}
+}
+
+/*
+ * __sysstats: copy up to NENTRIES entries of the table to BUF and
+ * return how many were copied. With SYSSTAT_RESET in FLAGS the
+ * table is zeroed as it's read (the entries not asked for too).
+ */
+int
+sys___sysstats(userptr_t buf, unsigned nentries, int flags, int32_t *retval)
+{
+	struct sysstat copy;
+	bool reset = (flags & SYSSTAT_RESET) != 0;
+	unsigned i;
+	int result;
+
+	if ((flags & ~SYSSTAT_RESET) != 0) {
+		return EINVAL;
+	}
+	if (nentries > SYSSTAT_NCALLS) {
+		nentries = SYSSTAT_NCALLS;
+	}
+
+	for (i=0; i<nentries; i++) {
+		sysstats_get(i, &copy, reset);
+		result = copyout(&copy, (userptr_t)((struct sysstat *)buf + i),
+				 sizeof(copy));
+		if (result) {
+			return result;
+		}
+	}
+	if (reset) {
+		for (; i<SYSSTAT_NCALLS; i++) {
+			sysstats_get(i, NULL, true);
+		}
+	}
+
+	*retval = nentries;
+	return 0;
+}
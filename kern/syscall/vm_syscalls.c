@@ -0,0 +1,130 @@
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/mman.h>
+#include <kern/unistd.h>
+#include <lib.h>
+#include <syscall.h>
+#include <current.h>
+#include <proc.h>
+#include <vnode.h>
+#include <addrspace.h>
+
+/* handler for sbrk() system call                  */
+/*
+ * Moves the end of the heap by amount bytes and returns the old end,
+ * which is what malloc wants. The pages themselves are handed out by
+ * the VM system when they are first touched.
+ */
+
+int
+sys_sbrk(intptr_t amount, vaddr_t *retval)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: sbrk(%d)\n",(int)amount);
+
+  as = curproc_getas();
+  KASSERT(as != NULL);
+
+  return as_sbrk(as, amount, retval);
+}
+
+/*
+ * Find the file open on descriptor FD, for mmap. There's no file
+ * table yet: the only descriptors a process has are the console's
+ * (see sys_write), and the console can't be mapped. Once there is
+ * one, this is the only part of mmap that has to change. Until then,
+ * the mm1 menu test covers file mappings by calling as_mmap itself.
+ */
+static
+int
+mmap_getfile(int fd, struct vnode **ret)
+{
+  struct vnode *vn;
+  int result;
+
+  if (fd < STDIN_FILENO || fd > STDERR_FILENO) {
+    return EBADF;
+  }
+  KASSERT(curproc->console != NULL);
+  vn = curproc->console;
+
+  result = VOP_MMAP(vn);
+  if (result) {
+    return result;
+  }
+  *ret = vn;
+  return 0;
+}
+
+/* handler for mmap() system call                  */
+/*
+ * Maps a file, or zeros with MAP_ANON, and returns the address.
+ * ADDR is only a hint, and we don't take hints, so MAP_FIXED isn't
+ * supported. Pages are read in from the file when first touched.
+ */
+
+int
+sys_mmap(userptr_t addr, size_t len, int prot, int flags, int fd,
+	 off_t offset, vaddr_t *retval)
+{
+  struct addrspace *as;
+  struct vnode *vn;
+  bool shared;
+  int result;
+
+  DEBUG(DB_SYSCALL,"Syscall: mmap(%x,%u,%d,%d,%d)\n",
+        (unsigned int)addr,(unsigned int)len,prot,flags,fd);
+
+  (void)addr;
+
+  switch (flags & (MAP_SHARED|MAP_PRIVATE)) {
+  case MAP_SHARED:
+    shared = true;
+    break;
+  case MAP_PRIVATE:
+    shared = false;
+    break;
+  default:
+    return EINVAL;
+  }
+  if ((flags & ~(MAP_SHARED|MAP_PRIVATE|MAP_ANON)) != 0) {
+    return EINVAL;
+  }
+  if (len == 0 || offset < 0 || offset % PAGE_SIZE != 0) {
+    return EINVAL;
+  }
+
+  vn = NULL;
+  if ((flags & MAP_ANON) == 0) {
+    result = mmap_getfile(fd, &vn);
+    if (result) {
+      return result;
+    }
+  }
+
+  as = curproc_getas();
+  KASSERT(as != NULL);
+
+  return as_mmap(as, len, (prot & PROT_WRITE) != 0, shared, vn, offset,
+                 retval);
+}
+
+/* handler for munmap() system call                  */
+/*
+ * Removes a mapping made by mmap. It has to be the whole mapping.
+ */
+
+int
+sys_munmap(userptr_t addr, size_t len)
+{
+  struct addrspace *as;
+
+  DEBUG(DB_SYSCALL,"Syscall: munmap(%x,%u)\n",
+        (unsigned int)addr,(unsigned int)len);
+
+  as = curproc_getas();
+  KASSERT(as != NULL);
+
+  return as_munmap(as, (vaddr_t)addr, len);
+}
@@ -0,0 +1,130 @@
+/*
+ * diskbench - raw disk read throughput.
+ *
+ * Reads the start of a raw disk device sequentially with several
+ * transfer sizes and reports the bandwidth for each. Only reads, so
+ * it is safe to run on a disk with a mounted filesystem.
+ *
+ * Usage: db [device [kbytes]]
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <lib.h>
+#include <uio.h>
+#include <clock.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define DEFAULT_DEVICE "lhd0raw:"
+#define DEFAULT_KBYTES 1024
+
+#define MAXXFERSIZE 65536
+static const size_t xfersizes[] = { 512, 4096, 16384, MAXXFERSIZE };
+#define NXFERSIZES (sizeof(xfersizes) / sizeof(xfersizes[0]))
+
+/*
+ * The transfer buffer. Static rather than kmalloc'd per run, since
+ * under dumbvm a 64K kmalloc is never given back. Only ever read
+ * into, so runs at the same time don't hurt each other.
+ */
+static char diskbench_buf[MAXXFERSIZE];
+
+/*
+ * Read TOTAL bytes from V in transfers of XFERSIZE, timing the whole
+ * thing.
+ */
+static
+int
+diskbench_run(struct vnode *v, char *buf, size_t xfersize, size_t total)
+{
+	struct iovec iov;
+	struct uio ku;
+	time_t beforesecs, aftersecs, secs;
+	uint32_t beforensecs, afternsecs, nsecs;
+	uint64_t usecs;
+	off_t pos;
+	int result;
+
+	gettime(&beforesecs, &beforensecs);
+	for (pos = 0; pos < (off_t)total; pos += xfersize) {
+		uio_kinit(&iov, &ku, buf, xfersize, pos, UIO_READ);
+		result = VOP_READ(v, &ku);
+		if (result) {
+			kprintf("diskbench: read at %llu: %s\n",
+				(unsigned long long)pos, strerror(result));
+			return result;
+		}
+	}
+	gettime(&aftersecs, &afternsecs);
+	getinterval(beforesecs, beforensecs, aftersecs, afternsecs,
+		    &secs, &nsecs);
+
+	usecs = (uint64_t)secs * 1000000 + nsecs / 1000;
+	if (usecs == 0) {
+		usecs = 1;
+	}
+	kprintf("diskbench: %6u byte reads: %lu.%09lu s, %u KB/s\n",
+		(unsigned)xfersize, (unsigned long)secs, (unsigned long)nsecs,
+		(unsigned)((uint64_t)total * 1000000 / 1024 / usecs));
+	return 0;
+}
+
+int
+diskbench(int nargs, char **args)
+{
+	char device[32];
+	const char *name;
+	struct vnode *v;
+	size_t total, maxsize;
+	unsigned i;
+	int result;
+
+	if (nargs > 3) {
+		kprintf("Usage: db [device [kbytes]]\n");
+		return EINVAL;
+	}
+
+	name = nargs > 1 ? args[1] : DEFAULT_DEVICE;
+	if (strlen(name) >= sizeof(device)) {
+		return ENAMETOOLONG;
+	}
+	/* vfs_open destroys the string it's passed; make a copy */
+	strcpy(device, name);
+	total = DEFAULT_KBYTES * 1024;
+	if (nargs > 2) {
+		if (atoi(args[2]) <= 0) {
+			kprintf("Usage: db [device [kbytes]]\n");
+			return EINVAL;
+		}
+		total = atoi(args[2]) * 1024;
+	}
+
+	maxsize = xfersizes[NXFERSIZES - 1];
+	total -= total % maxsize;
+	if (total == 0) {
+		kprintf("diskbench: need at least %u KB\n",
+			(unsigned)(maxsize / 1024));
+		return EINVAL;
+	}
+
+	result = vfs_open(device, O_RDONLY, 0, &v);
+	if (result) {
+		kprintf("diskbench: %s: %s\n", name, strerror(result));
+		return result;
+	}
+
+	kprintf("diskbench: reading %u KB\n", (unsigned)(total / 1024));
+	for (i=0; i<NXFERSIZES; i++) {
+		result = diskbench_run(v, diskbench_buf, xfersizes[i],
+				       total);
+		if (result) {
+			break;
+		}
+	}
+
+	vfs_close(v);
+	return result;
+}
@@ -0,0 +1,375 @@
+/*
+ * mmaptest - file-backed memory mappings.
+ *
+ * Writes a file on the given filesystem, maps it shared in a
+ * scratch address space, checks that pages read in right, reads and
+ * writes the file through the mapping itself (which must not fault
+ * back into the filesystem with the vnode locked), dirties some
+ * pages, unmaps it, and checks that the file has the changes and
+ * nothing else.
+ *
+ * Usage: mm1 filesystem
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <kern/fcntl.h>
+#include <stat.h>
+#include <lib.h>
+#include <uio.h>
+#include <copyinout.h>
+#include <proc.h>
+#include <current.h>
+#include <addrspace.h>
+#include <vm.h>
+#include <vfs.h>
+#include <vnode.h>
+#include <test.h>
+
+#define FILENAME "mmaptest.tmp"
+
+/* The file is a bit short of this many pages, so the last is partial */
+#define NPAGES 5
+#define FILESIZE (NPAGES * PAGE_SIZE - 100)
+
+/* Small, so the test itself doesn't take pages it can't give back */
+#define CHUNK 128
+
+/* What's at POS in the file to start with, and after being dirtied */
+#define ORIGBYTE(pos) ((char)((pos) % 251))
+#define NEWBYTE(pos) ((char)~ORIGBYTE(pos))
+
+/* The pages the test writes to through the mapping */
+#define DIRTIED(page) ((page) % 2 == 0)
+
+/*
+ * Fill BUF with LEN bytes of the original or changed contents,
+ * starting at file position POS.
+ */
+static
+void
+mmaptest_fill(char *buf, size_t len, off_t pos, bool new)
+{
+	size_t i;
+
+	for (i=0; i<len; i++) {
+		buf[i] = new ? NEWBYTE(pos + i) : ORIGBYTE(pos + i);
+	}
+}
+
+/*
+ * Check LEN bytes at BUF against what should be at POS.
+ */
+static
+int
+mmaptest_check(const char *buf, size_t len, off_t pos, bool new,
+	       const char *what)
+{
+	size_t i;
+	char want;
+
+	for (i=0; i<len; i++) {
+		want = new ? NEWBYTE(pos + i) : ORIGBYTE(pos + i);
+		if (pos + i >= FILESIZE) {
+			want = 0;
+		}
+		if (buf[i] != want) {
+			kprintf("mmaptest: %s: byte %llu is %d, not %d\n",
+				what, (unsigned long long)(pos + i),
+				buf[i], want);
+			return EINVAL;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Set up a uio for user address UADDR in AS.
+ */
+static
+void
+mmaptest_uinit(struct iovec *iov, struct uio *u, struct addrspace *as,
+	       vaddr_t uaddr, size_t len, off_t pos, enum uio_rw rw)
+{
+	iov->iov_ubase = (userptr_t)uaddr;
+	iov->iov_len = len;
+	u->uio_iov = iov;
+	u->uio_iovcnt = 1;
+	u->uio_offset = pos;
+	u->uio_resid = len;
+	u->uio_segflg = UIO_USERSPACE;
+	u->uio_rw = rw;
+	u->uio_space = as;
+}
+
+/*
+ * Create the file and write the original contents.
+ */
+static
+int
+mmaptest_create(struct vnode *vn)
+{
+	char buf[CHUNK];
+	struct iovec iov;
+	struct uio ku;
+	off_t pos;
+	size_t len;
+	int result;
+
+	for (pos = 0; pos < FILESIZE; pos += len) {
+		len = CHUNK;
+		if (FILESIZE - pos < CHUNK) {
+			len = FILESIZE - pos;
+		}
+		mmaptest_fill(buf, len, pos, false);
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_WRITE);
+		result = VOP_WRITE(vn, &ku);
+		if (result) {
+			kprintf("mmaptest: write: %s\n", strerror(result));
+			return result;
+		}
+	}
+	return 0;
+}
+
+/*
+ * Make an address space that vm_fault will take, and switch to it.
+ */
+static
+int
+mmaptest_makeas(struct addrspace **ret)
+{
+	struct addrspace *as;
+	vaddr_t stackptr;
+	int result;
+
+	as = as_create();
+	if (as == NULL) {
+		return ENOMEM;
+	}
+	result = as_define_region(as, 0x400000, PAGE_SIZE, 1, 0, 1);
+	if (!result) {
+		result = as_define_region(as, 0x10000000, PAGE_SIZE,
+					  1, 1, 0);
+	}
+	if (!result) {
+		result = as_prepare_load(as);
+	}
+	if (!result) {
+		result = as_complete_load(as);
+	}
+	if (!result) {
+		result = as_define_stack(as, &stackptr);
+	}
+	if (result) {
+		as_destroy(as);
+		return result;
+	}
+
+	KASSERT(curproc_getas() == NULL);
+	curproc_setas(as);
+	as_activate();
+	*ret = as;
+	return 0;
+}
+
+/*
+ * The part that runs in the scratch address space: map VN, go
+ * through it, and unmap it.
+ */
+static
+int
+mmaptest_map(struct addrspace *as, struct vnode *vn)
+{
+	char buf[CHUNK];
+	struct iovec iov;
+	struct uio u;
+	vaddr_t base, va;
+	unsigned page;
+	size_t off;
+	int result, result2;
+
+	result = as_mmap(as, NPAGES * PAGE_SIZE, true, true, vn, 0, &base);
+	if (result) {
+		kprintf("mmaptest: as_mmap: %s\n", strerror(result));
+		return result;
+	}
+
+	/*
+	 * Page 1 is first touched by a write of the file from itself,
+	 * and page 3 by a read of the file into itself. Both leave the
+	 * contents as they were, but fault with the vnode locked
+	 * unless the filesystem prefaults the buffer.
+	 */
+	mmaptest_uinit(&iov, &u, as, base + PAGE_SIZE, PAGE_SIZE,
+		       PAGE_SIZE, UIO_WRITE);
+	result = VOP_WRITE(vn, &u);
+	if (result) {
+		kprintf("mmaptest: write from mapping: %s\n",
+			strerror(result));
+		goto out;
+	}
+	mmaptest_uinit(&iov, &u, as, base + 3 * PAGE_SIZE, PAGE_SIZE,
+		       3 * PAGE_SIZE, UIO_READ);
+	result = VOP_READ(vn, &u);
+	if (result) {
+		kprintf("mmaptest: read into mapping: %s\n",
+			strerror(result));
+		goto out;
+	}
+
+	/* Every page should have read in right, zeros past the end */
+	for (page = 0; page < NPAGES; page++) {
+		for (off = 0; off < PAGE_SIZE; off += CHUNK) {
+			va = base + page * PAGE_SIZE + off;
+			result = copyin((const_userptr_t)va, buf, CHUNK);
+			if (result) {
+				kprintf("mmaptest: copyin: %s\n",
+					strerror(result));
+				goto out;
+			}
+			result = mmaptest_check(buf, CHUNK,
+						page * PAGE_SIZE + off,
+						false, "mapping");
+			if (result) {
+				goto out;
+			}
+		}
+	}
+
+	/* Change the dirtied pages, including past the end of the file */
+	for (page = 0; page < NPAGES; page++) {
+		if (!DIRTIED(page)) {
+			continue;
+		}
+		for (off = 0; off < PAGE_SIZE; off += CHUNK) {
+			va = base + page * PAGE_SIZE + off;
+			mmaptest_fill(buf, CHUNK, page * PAGE_SIZE + off,
+				      true);
+			result = copyout(buf, (userptr_t)va, CHUNK);
+			if (result) {
+				kprintf("mmaptest: copyout: %s\n",
+					strerror(result));
+				goto out;
+			}
+		}
+	}
+
+ out:
+	/* Writes the dirty pages back */
+	result2 = as_munmap(as, base, NPAGES * PAGE_SIZE);
+	if (result2) {
+		kprintf("mmaptest: as_munmap: %s\n", strerror(result2));
+		if (!result) {
+			result = result2;
+		}
+	}
+	return result;
+}
+
+/*
+ * Read the file back: the dirtied pages should have the new
+ * contents, the rest the old, and the size shouldn't have changed.
+ */
+static
+int
+mmaptest_verify(struct vnode *vn)
+{
+	char buf[CHUNK];
+	struct iovec iov;
+	struct uio ku;
+	struct stat st;
+	off_t pos;
+	size_t len;
+	int result;
+
+	result = VOP_STAT(vn, &st);
+	if (result) {
+		kprintf("mmaptest: stat: %s\n", strerror(result));
+		return result;
+	}
+	if (st.st_size != FILESIZE) {
+		kprintf("mmaptest: file is %llu bytes, not %llu\n",
+			(unsigned long long)st.st_size,
+			(unsigned long long)FILESIZE);
+		return EINVAL;
+	}
+
+	for (pos = 0; pos < FILESIZE; pos += len) {
+		len = CHUNK;
+		if (FILESIZE - pos < CHUNK) {
+			len = FILESIZE - pos;
+		}
+		uio_kinit(&iov, &ku, buf, len, pos, UIO_READ);
+		result = VOP_READ(vn, &ku);
+		if (result) {
+			kprintf("mmaptest: read: %s\n", strerror(result));
+			return result;
+		}
+		if (ku.uio_resid != 0) {
+			kprintf("mmaptest: short read at %llu\n",
+				(unsigned long long)pos);
+			return EINVAL;
+		}
+		result = mmaptest_check(buf, len, pos,
+					DIRTIED(pos / PAGE_SIZE), "file");
+		if (result) {
+			return result;
+		}
+	}
+	return 0;
+}
+
+int
+mmaptest(int nargs, char **args)
+{
+	char name[32], buf[32];
+	struct addrspace *as;
+	struct vnode *vn;
+	int result, result2;
+
+	if (nargs != 2) {
+		kprintf("Usage: mm1 filesystem\n");
+		return EINVAL;
+	}
+	snprintf(name, sizeof(name), "%s:%s", args[1], FILENAME);
+
+	/* vfs_open destroys the string it's passed */
+	strcpy(buf, name);
+	result = vfs_open(buf, O_RDWR|O_CREAT|O_TRUNC, 0664, &vn);
+	if (result) {
+		kprintf("mmaptest: %s: %s\n", name, strerror(result));
+		return result;
+	}
+
+	result = mmaptest_create(vn);
+	if (result) {
+		goto done;
+	}
+
+	result = mmaptest_makeas(&as);
+	if (result) {
+		kprintf("mmaptest: address space: %s\n", strerror(result));
+		goto done;
+	}
+	result = mmaptest_map(as, vn);
+	as_deactivate();
+	as = curproc_setas(NULL);
+	as_destroy(as);
+	if (result) {
+		goto done;
+	}
+
+	result = mmaptest_verify(vn);
+
+ done:
+	vfs_close(vn);
+	strcpy(buf, name);
+	result2 = vfs_remove(buf);
+	if (result2) {
+		kprintf("mmaptest: remove %s: %s\n", name, strerror(result2));
+	}
+
+	kprintf("mmaptest: %s\n", result ? "FAILED" : "passed");
+	return result;
+}
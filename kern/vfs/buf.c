@@ -0,0 +1,960 @@
+/*
+ * File system buffer cache.
+ *
+ * A fixed-size pool of block buffers shared by all mounted file
+ * systems. Buffers holding a block are found through a hash table on
+ * (fs, block). All buffers are also on one LRU list, least recently
+ * used at the head; new buffers are allocated until the pool is full,
+ * and after that the least recently used buffer that isn't busy is
+ * reused, writing it back first if it is dirty.
+ *
+ * buffer_lock protects the hash table, the LRU list, the stats, and
+ * the flags in each buffer. A buffer is busy while a caller holds it
+ * (between buffer_get/buffer_read and buffer_release) and while the
+ * cache itself is doing I/O on it; the data is only touched by whoever
+ * has it busy, so disk I/O is done without holding buffer_lock.
+ * Threads that want a busy buffer wait on buffer_cv.
+ *
+ * Read-ahead requests go on a small queue and are read in by a kernel
+ * thread of their own, so the thread that asked doesn't wait for
+ * them. The queue is a hint: if it's full, requests are dropped.
+ *
+ * Each dirty buffer remembers when it became dirty, so the syncer
+ * (through fs_flushold) can write back the ones that have been dirty
+ * too long a few at a time instead of all at once.
+ */
+
+#include <types.h>
+#include <kern/errno.h>
+#include <lib.h>
+#include <synch.h>
+#include <thread.h>
+#include <clock.h>
+#include <fs.h>
+#include <buf.h>
+
+/* Maximum number of buffers in the pool. */
+#define BUFFER_MAXBUFS   128
+#define BUFFER_MAXGATHER 16	/* most blocks written in one transfer */
+#define BUFFER_GATHERSIZE (BUFFER_MAXGATHER * BUFFER_MAXSIZE)	/* ...and bytes */
+
+/* Number of hash chains. */
+#define BUFFER_HASHSIZE  61
+
+/* Maximum number of queued read-ahead requests. */
+#define BUFFER_RAQUEUE   32
+
+struct buf {
+	struct fs *b_fs;		/* fs the block belongs to, or NULL */
+	daddr_t b_block;		/* block number */
+	size_t b_size;			/* size of the block */
+	void *b_data;			/* its contents; BUFFER_MAXSIZE bytes */
+	bool b_valid;			/* b_data holds the block */
+	bool b_dirty;			/* b_data is newer than the disk */
+	bool b_busy;			/* someone is using this buffer */
+	bool b_readahead;		/* read ahead and not yet used */
+	bool b_pinned;			/* dirty, but not to be written yet */
+	time_t b_dirtytime;		/* when it became dirty */
+	struct buf *b_hashnext;		/* hash chain */
+	struct buf *b_lruprev;		/* LRU list */
+	struct buf *b_lrunext;
+};
+
+static struct lock *buffer_lock;
+static struct cv *buffer_cv;
+
+/*
+ * Where runs of blocks are gathered to be written in one transfer.
+ * Allocated once, since under dumbvm freeing multi-page allocations
+ * leaks them. Protected by buffer_gatherlock, which is taken without
+ * buffer_lock and held across the write.
+ */
+static char *buffer_gather;
+static struct lock *buffer_gatherlock;
+
+static struct buf *buffer_hash[BUFFER_HASHSIZE];
+static struct buf *buffer_lruhead, *buffer_lrutail;
+static unsigned buffer_count;
+
+/* Read-ahead queue (a ring), also under buffer_lock */
+static struct {
+	struct fs *fs;
+	daddr_t block;
+	size_t size;
+} buffer_raqueue[BUFFER_RAQUEUE];
+static unsigned buffer_rahead, buffer_ranum;
+static struct cv *buffer_racv;		/* read-ahead thread waits here */
+static struct fs *buffer_rafs;		/* fs it is reading for, or NULL */
+
+/* Statistics */
+static struct {
+	uint32_t lookups;	/* calls to buffer_read/buffer_get */
+	uint32_t hits;		/* ...that found a valid buffer */
+	uint32_t reads;		/* blocks read from disk */
+	uint32_t writes;	/* blocks written to disk */
+	uint32_t evictions;	/* buffers reused for a different block */
+	uint32_t raqueued;	/* read-ahead requests queued */
+	uint32_t radropped;	/* ...dropped because the queue was full */
+	uint32_t rareads;	/* blocks read from disk by read-ahead */
+	uint32_t rahits;	/* ...that were later looked up */
+} buffer_stats;
+
+static void buffer_rathread(void *, unsigned long);
+
+void
+buffer_bootstrap(void)
+{
+	int result;
+
+	buffer_lock = lock_create("buffer cache");
+	if (buffer_lock == NULL) {
+		panic("buffer_bootstrap: Could not create lock\n");
+	}
+	buffer_cv = cv_create("buffer cache");
+	if (buffer_cv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_racv = cv_create("buffer readahead");
+	if (buffer_racv == NULL) {
+		panic("buffer_bootstrap: Could not create cv\n");
+	}
+	buffer_gatherlock = lock_create("buffer gather");
+	if (buffer_gatherlock == NULL) {
+		panic("buffer_bootstrap: Could not create lock\n");
+	}
+	buffer_gather = kmalloc(BUFFER_GATHERSIZE);
+	if (buffer_gather == NULL) {
+		panic("buffer_bootstrap: Out of memory\n");
+	}
+	result = thread_fork("readahead", NULL, buffer_rathread, NULL, 0);
+	if (result) {
+		panic("buffer_bootstrap: thread_fork: %s\n",
+		      strerror(result));
+	}
+}
+
+////////////////////////////////////////////////////////////
+// Hash table and LRU list (buffer_lock held)
+
+static
+unsigned
+buffer_hashfunc(struct fs *fs, daddr_t block)
+{
+	return ((uintptr_t)fs / sizeof(void *) + block) % BUFFER_HASHSIZE;
+}
+
+static
+struct buf *
+buffer_lookup(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	for (b = buffer_hash[buffer_hashfunc(fs, block)]; b != NULL;
+	     b = b->b_hashnext) {
+		if (b->b_fs == fs && b->b_block == block) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+static
+void
+buffer_attach(struct buf *b, struct fs *fs, daddr_t block)
+{
+	unsigned h;
+
+	KASSERT(b->b_fs == NULL);
+	h = buffer_hashfunc(fs, block);
+	b->b_fs = fs;
+	b->b_block = block;
+	b->b_hashnext = buffer_hash[h];
+	buffer_hash[h] = b;
+}
+
+static
+void
+buffer_detach(struct buf *b)
+{
+	struct buf **bp;
+
+	if (b->b_fs == NULL) {
+		return;
+	}
+	for (bp = &buffer_hash[buffer_hashfunc(b->b_fs, b->b_block)];
+	     *bp != b; bp = &(*bp)->b_hashnext) {
+		KASSERT(*bp != NULL);
+	}
+	*bp = b->b_hashnext;
+	b->b_hashnext = NULL;
+	b->b_fs = NULL;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_readahead = false;
+	b->b_pinned = false;
+}
+
+static
+void
+buffer_lru_remove(struct buf *b)
+{
+	if (b->b_lruprev != NULL) {
+		b->b_lruprev->b_lrunext = b->b_lrunext;
+	}
+	else {
+		buffer_lruhead = b->b_lrunext;
+	}
+	if (b->b_lrunext != NULL) {
+		b->b_lrunext->b_lruprev = b->b_lruprev;
+	}
+	else {
+		buffer_lrutail = b->b_lruprev;
+	}
+	b->b_lruprev = b->b_lrunext = NULL;
+}
+
+/* Put B at the head (the end that gets reused first). */
+static
+void
+buffer_lru_addhead(struct buf *b)
+{
+	b->b_lruprev = NULL;
+	b->b_lrunext = buffer_lruhead;
+	if (buffer_lruhead != NULL) {
+		buffer_lruhead->b_lruprev = b;
+	}
+	else {
+		buffer_lrutail = b;
+	}
+	buffer_lruhead = b;
+}
+
+/* Put B at the tail (most recently used). */
+static
+void
+buffer_lru_addtail(struct buf *b)
+{
+	b->b_lrunext = NULL;
+	b->b_lruprev = buffer_lrutail;
+	if (buffer_lrutail != NULL) {
+		buffer_lrutail->b_lrunext = b;
+	}
+	else {
+		buffer_lruhead = b;
+	}
+	buffer_lrutail = b;
+}
+
+////////////////////////////////////////////////////////////
+// Allocation and replacement (buffer_lock held)
+
+/*
+ * Make a new buffer. Its memory is big enough for any block size and
+ * is never given back, since under dumbvm freeing it would leak it;
+ * a buffer reused for a block of another size just changes b_size.
+ */
+static
+struct buf *
+buffer_create(size_t size)
+{
+	struct buf *b;
+
+	b = kmalloc(sizeof(struct buf));
+	if (b == NULL) {
+		return NULL;
+	}
+	b->b_data = kmalloc(BUFFER_MAXSIZE);
+	if (b->b_data == NULL) {
+		kfree(b);
+		return NULL;
+	}
+	b->b_fs = NULL;
+	b->b_block = 0;
+	b->b_size = size;
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_busy = false;
+	b->b_readahead = false;
+	b->b_pinned = false;
+	b->b_dirtytime = 0;
+	b->b_hashnext = NULL;
+	buffer_lru_addhead(b);
+	buffer_count++;
+	return b;
+}
+
+/*
+ * Find a buffer to reuse: the least recently used one nobody is
+ * using and that isn't pinned. Returns NULL if there isn't one.
+ */
+static
+struct buf *
+buffer_victim(void)
+{
+	struct buf *b;
+
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (!b->b_busy && !b->b_pinned) {
+			return b;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Write a busy buffer out. Called without buffer_lock.
+ */
+static
+int
+buffer_writeout(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	return FSOP_WRITEBLOCK(b->b_fs, b->b_block, b->b_data, b->b_size);
+}
+
+/*
+ * Write back dirty buffer B (which is not busy) so it can be reused.
+ * Drops and retakes buffer_lock, so the caller must look everything
+ * up again afterwards.
+ */
+static
+int
+buffer_clean(struct buf *b)
+{
+	int result;
+
+	KASSERT(!b->b_busy);
+	KASSERT(b->b_dirty);
+
+	b->b_busy = true;
+	lock_release(buffer_lock);
+	result = buffer_writeout(b);
+	lock_acquire(buffer_lock);
+	b->b_busy = false;
+	if (result == 0) {
+		b->b_dirty = false;
+		buffer_stats.writes++;
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	return result;
+}
+
+/*
+ * Common code for buffer_read, buffer_get, and the read-ahead thread:
+ * find the buffer for BLOCK, or set one up (not valid) if it isn't
+ * cached, and mark it busy. READAHEAD keeps the read-ahead thread's
+ * lookups out of the stats.
+ */
+static
+int
+buffer_find(struct fs *fs, daddr_t block, size_t size, bool readahead,
+	    struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	KASSERT(fs->fs_readblock != NULL && fs->fs_writeblock != NULL);
+	KASSERT(size > 0 && size <= BUFFER_MAXSIZE);
+
+	lock_acquire(buffer_lock);
+	if (!readahead) {
+		buffer_stats.lookups++;
+	}
+	while (1) {
+		b = buffer_lookup(fs, block);
+		if (b != NULL) {
+			if (b->b_busy) {
+				cv_wait(buffer_cv, buffer_lock);
+				continue;
+			}
+			KASSERT(b->b_size == size);
+			if (b->b_valid && !readahead) {
+				buffer_stats.hits++;
+				if (b->b_readahead) {
+					buffer_stats.rahits++;
+					b->b_readahead = false;
+				}
+			}
+			break;
+		}
+
+		b = NULL;
+		if (buffer_count < BUFFER_MAXBUFS) {
+			b = buffer_create(size);
+		}
+		if (b == NULL) {
+			b = buffer_victim();
+		}
+		if (b == NULL) {
+			/* Everything is in use; wait for a release */
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		if (b->b_dirty) {
+			result = buffer_clean(b);
+			if (result) {
+				lock_release(buffer_lock);
+				return result;
+			}
+			/* Things may have changed while we slept */
+			continue;
+		}
+
+		if (b->b_fs != NULL) {
+			buffer_stats.evictions++;
+		}
+		buffer_detach(b);
+		b->b_size = size;
+		buffer_attach(b, fs, block);
+		break;
+	}
+
+	b->b_busy = true;
+	buffer_lru_remove(b);
+	buffer_lru_addtail(b);
+	lock_release(buffer_lock);
+
+	*ret = b;
+	return 0;
+}
+
+////////////////////////////////////////////////////////////
+// Interface
+
+int
+buffer_get(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	return buffer_find(fs, block, size, false, ret);
+}
+
+int
+buffer_read(struct fs *fs, daddr_t block, size_t size, struct buf **ret)
+{
+	struct buf *b;
+	int result;
+
+	result = buffer_find(fs, block, size, false, &b);
+	if (result) {
+		return result;
+	}
+
+	if (!b->b_valid) {
+		result = FSOP_READBLOCK(fs, block, b->b_data, size);
+		if (result) {
+			buffer_invalidate(b);
+			buffer_release(b);
+			return result;
+		}
+		lock_acquire(buffer_lock);
+		b->b_valid = true;
+		buffer_stats.reads++;
+		lock_release(buffer_lock);
+	}
+
+	*ret = b;
+	return 0;
+}
+
+void
+buffer_release(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_busy = false;
+	if (!b->b_valid) {
+		/* Nothing worth keeping; reuse it first */
+		buffer_detach(b);
+		buffer_lru_remove(b);
+		buffer_lru_addhead(b);
+	}
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+void *
+buffer_map(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_data;
+}
+
+bool
+buffer_is_valid(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_valid;
+}
+
+void
+buffer_mark_valid(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_valid = true;
+	lock_release(buffer_lock);
+}
+
+/*
+ * Mark B dirty, noting the time if it wasn't already.
+ */
+static
+void
+buffer_dirty(struct buf *b)
+{
+	uint32_t nsecs;
+
+	KASSERT(lock_do_i_hold(buffer_lock));
+	if (!b->b_dirty) {
+		gettime(&b->b_dirtytime, &nsecs);
+		b->b_dirty = true;
+	}
+}
+
+void
+buffer_mark_dirty(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	buffer_dirty(b);
+	lock_release(buffer_lock);
+}
+
+void
+buffer_invalidate(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	b->b_valid = false;
+	b->b_dirty = false;
+	b->b_pinned = false;
+	lock_release(buffer_lock);
+}
+
+void
+buffer_pin(struct buf *b)
+{
+	lock_acquire(buffer_lock);
+	KASSERT(b->b_busy);
+	KASSERT(b->b_valid);
+	buffer_dirty(b);
+	b->b_pinned = true;
+	lock_release(buffer_lock);
+}
+
+bool
+buffer_is_pinned(struct buf *b)
+{
+	KASSERT(b->b_busy);
+	return b->b_pinned;
+}
+
+void
+buffer_unpin_fs(struct fs *fs)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_fs == fs) {
+			b->b_pinned = false;
+		}
+	}
+	/* Anyone waiting for a buffer to reuse may find one now */
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * Remove queued read-ahead requests for FS, and for BLOCK if BLOCK
+ * isn't -1. Called with buffer_lock held.
+ */
+static
+void
+buffer_ra_cancel(struct fs *fs, daddr_t block)
+{
+	unsigned i, n, from, to;
+
+	n = buffer_ranum;
+	to = buffer_rahead;
+	for (i=0; i<n; i++) {
+		from = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raqueue[from].fs == fs &&
+		    (block == (daddr_t)-1 ||
+		     buffer_raqueue[from].block == block)) {
+			buffer_ranum--;
+			continue;
+		}
+		buffer_raqueue[to] = buffer_raqueue[from];
+		to = (to + 1) % BUFFER_RAQUEUE;
+	}
+}
+
+void
+buffer_drop(struct fs *fs, daddr_t block)
+{
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	buffer_ra_cancel(fs, block);
+	while ((b = buffer_lookup(fs, block)) != NULL && b->b_busy) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+	if (b != NULL) {
+		buffer_detach(b);
+		buffer_lru_remove(b);
+		buffer_lru_addhead(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Sort buffers by block number, so sync writes go out in disk order.
+ * There are never more than BUFFER_MAXBUFS of them.
+ */
+static
+void
+buffer_sort(struct buf **bufs, unsigned num)
+{
+	unsigned i, j;
+	struct buf *b;
+
+	for (i=1; i<num; i++) {
+		b = bufs[i];
+		for (j=i; j>0 && bufs[j-1]->b_block > b->b_block; j--) {
+			bufs[j] = bufs[j-1];
+		}
+		bufs[j] = b;
+	}
+}
+
+/*
+ * Write out the N buffers starting at BUFS, which hold consecutive
+ * blocks, in one transfer through buffer_gather. The caller keeps N
+ * blocks within BUFFER_GATHERSIZE.
+ */
+static
+int
+buffer_writerun(struct buf **bufs, unsigned n)
+{
+	size_t size = bufs[0]->b_size;
+	unsigned i;
+	int result;
+
+	KASSERT(n * size <= BUFFER_GATHERSIZE);
+
+	lock_acquire(buffer_gatherlock);
+	for (i=0; i<n; i++) {
+		KASSERT(bufs[i]->b_busy);
+		KASSERT(bufs[i]->b_valid);
+		memcpy(buffer_gather + i*size, bufs[i]->b_data, size);
+	}
+	result = FSOP_WRITEBLOCK(bufs[0]->b_fs, bufs[0]->b_block,
+				 buffer_gather, n * size);
+	lock_release(buffer_gatherlock);
+	return result;
+}
+
+/*
+ * Write out the NUM buffers in BUFS, which the caller has marked busy,
+ * in block order, and unbusy them. Runs of consecutive blocks go out
+ * in one transfer each. Called without buffer_lock.
+ */
+static
+int
+buffer_writebufs(struct buf **bufs, unsigned num)
+{
+	unsigned i, j, n, max;
+	int result, ret = 0;
+
+	buffer_sort(bufs, num);
+	for (i=0; i<num; i+=n) {
+		max = BUFFER_GATHERSIZE / bufs[i]->b_size;
+		if (max > BUFFER_MAXGATHER) {
+			max = BUFFER_MAXGATHER;
+		}
+
+		/* How many buffers after this one continue it? */
+		for (n=1; i+n < num && n < max; n++) {
+			if (bufs[i+n]->b_fs != bufs[i]->b_fs ||
+			    bufs[i+n]->b_size != bufs[i]->b_size ||
+			    bufs[i+n]->b_block != bufs[i]->b_block + n) {
+				break;
+			}
+		}
+		if (n > 1) {
+			result = buffer_writerun(&bufs[i], n);
+		}
+		else {
+			result = buffer_writeout(bufs[i]);
+		}
+		if (result) {
+			ret = result;
+		}
+		lock_acquire(buffer_lock);
+		for (j=i; j<i+n; j++) {
+			if (result == 0) {
+				bufs[j]->b_dirty = false;
+				buffer_stats.writes++;
+			}
+			bufs[j]->b_busy = false;
+		}
+		lock_release(buffer_lock);
+	}
+
+	lock_acquire(buffer_lock);
+	cv_broadcast(buffer_cv, buffer_lock);
+	lock_release(buffer_lock);
+	return ret;
+}
+
+int
+buffer_sync_fs(struct fs *fs)
+{
+	struct buf **bufs;
+	struct buf *b;
+	unsigned num;
+	bool waitbusy;
+	int ret = 0;
+
+	bufs = kmalloc(BUFFER_MAXBUFS * sizeof(struct buf *));
+	if (bufs == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		/* Collect (and take) every dirty buffer of ours */
+		num = 0;
+		waitbusy = false;
+		for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+			if (b->b_fs != fs || !b->b_dirty || b->b_pinned) {
+				continue;
+			}
+			if (b->b_busy) {
+				waitbusy = true;
+				continue;
+			}
+			KASSERT(num < BUFFER_MAXBUFS);
+			b->b_busy = true;
+			bufs[num++] = b;
+		}
+		if (num == 0) {
+			if (!waitbusy) {
+				break;
+			}
+			cv_wait(buffer_cv, buffer_lock);
+			continue;
+		}
+		lock_release(buffer_lock);
+
+		ret = buffer_writebufs(bufs, num);
+
+		lock_acquire(buffer_lock);
+		if (ret) {
+			break;
+		}
+	}
+	lock_release(buffer_lock);
+
+	kfree(bufs);
+	return ret;
+}
+
+/*
+ * Write out up to MAX of FS's buffers that have been dirty since
+ * BEFORE or earlier, least recently used first. Buffers that are busy
+ * or pinned are left for next time.
+ */
+int
+buffer_flush_old(struct fs *fs, time_t before, unsigned max)
+{
+	struct buf **bufs;
+	struct buf *b;
+	unsigned num;
+	int result;
+
+	if (max > BUFFER_MAXBUFS) {
+		max = BUFFER_MAXBUFS;
+	}
+	bufs = kmalloc(max * sizeof(struct buf *));
+	if (bufs == NULL) {
+		return ENOMEM;
+	}
+
+	lock_acquire(buffer_lock);
+	num = 0;
+	for (b = buffer_lruhead; b != NULL && num < max; b = b->b_lrunext) {
+		if (b->b_fs != fs || !b->b_dirty || b->b_pinned ||
+		    b->b_busy || b->b_dirtytime > before) {
+			continue;
+		}
+		b->b_busy = true;
+		bufs[num++] = b;
+	}
+	lock_release(buffer_lock);
+
+	if (num == 0) {
+		kfree(bufs);
+		return 0;
+	}
+	result = buffer_writebufs(bufs, num);
+	kfree(bufs);
+	return result;
+}
+
+void
+buffer_drop_fs(struct fs *fs)
+{
+	struct buf *b, *next;
+
+	lock_acquire(buffer_lock);
+
+	/* Make sure the read-ahead thread is done with FS */
+	buffer_ra_cancel(fs, (daddr_t)-1);
+	while (buffer_rafs == fs) {
+		cv_wait(buffer_cv, buffer_lock);
+	}
+
+	for (b = buffer_lruhead; b != NULL; b = next) {
+		next = b->b_lrunext;
+		if (b->b_fs != fs) {
+			continue;
+		}
+		KASSERT(!b->b_busy);
+		KASSERT(!b->b_dirty);
+		buffer_detach(b);
+		buffer_lru_remove(b);
+		buffer_lru_addhead(b);
+	}
+	lock_release(buffer_lock);
+}
+
+/*
+ * Queue BLOCK to be read into the cache, if it isn't there already.
+ */
+void
+buffer_readahead(struct fs *fs, daddr_t block, size_t size)
+{
+	unsigned i, slot;
+
+	lock_acquire(buffer_lock);
+	if (buffer_lookup(fs, block) != NULL) {
+		lock_release(buffer_lock);
+		return;
+	}
+	for (i=0; i<buffer_ranum; i++) {
+		slot = (buffer_rahead + i) % BUFFER_RAQUEUE;
+		if (buffer_raqueue[slot].fs == fs &&
+		    buffer_raqueue[slot].block == block) {
+			lock_release(buffer_lock);
+			return;
+		}
+	}
+	if (buffer_ranum == BUFFER_RAQUEUE) {
+		buffer_stats.radropped++;
+		lock_release(buffer_lock);
+		return;
+	}
+	slot = (buffer_rahead + buffer_ranum) % BUFFER_RAQUEUE;
+	buffer_raqueue[slot].fs = fs;
+	buffer_raqueue[slot].block = block;
+	buffer_raqueue[slot].size = size;
+	buffer_ranum++;
+	buffer_stats.raqueued++;
+	cv_signal(buffer_racv, buffer_lock);
+	lock_release(buffer_lock);
+}
+
+/*
+ * The read-ahead thread. Takes requests off the queue one at a time
+ * and reads them in. buffer_rafs tells buffer_drop_fs that the fs is
+ * still in use. Errors are ignored; whoever reads the block for real
+ * will get them.
+ */
+static
+void
+buffer_rathread(void *unused1, unsigned long unused2)
+{
+	struct fs *fs;
+	daddr_t block;
+	size_t size;
+	struct buf *b;
+	int result;
+
+	(void)unused1;
+	(void)unused2;
+
+	lock_acquire(buffer_lock);
+	while (1) {
+		while (buffer_ranum == 0) {
+			cv_wait(buffer_racv, buffer_lock);
+		}
+		fs = buffer_raqueue[buffer_rahead].fs;
+		block = buffer_raqueue[buffer_rahead].block;
+		size = buffer_raqueue[buffer_rahead].size;
+		buffer_rahead = (buffer_rahead + 1) % BUFFER_RAQUEUE;
+		buffer_ranum--;
+		buffer_rafs = fs;
+		lock_release(buffer_lock);
+
+		result = buffer_find(fs, block, size, true, &b);
+		if (result == 0) {
+			if (!b->b_valid) {
+				result = FSOP_READBLOCK(fs, block, b->b_data,
+						       size);
+				lock_acquire(buffer_lock);
+				if (result == 0) {
+					b->b_valid = true;
+					b->b_readahead = true;
+					buffer_stats.reads++;
+					buffer_stats.rareads++;
+				}
+				lock_release(buffer_lock);
+			}
+			buffer_release(b);
+		}
+
+		lock_acquire(buffer_lock);
+		buffer_rafs = NULL;
+		cv_broadcast(buffer_cv, buffer_lock);
+	}
+}
+
+void
+buffer_printstats(void)
+{
+	uint32_t lookups, hits, reads, writes, evictions;
+	uint32_t raqueued, radropped, rareads, rahits;
+	unsigned count, ndirty;
+	struct buf *b;
+
+	lock_acquire(buffer_lock);
+	lookups = buffer_stats.lookups;
+	hits = buffer_stats.hits;
+	reads = buffer_stats.reads;
+	writes = buffer_stats.writes;
+	evictions = buffer_stats.evictions;
+	raqueued = buffer_stats.raqueued;
+	radropped = buffer_stats.radropped;
+	rareads = buffer_stats.rareads;
+	rahits = buffer_stats.rahits;
+	count = buffer_count;
+	ndirty = 0;
+	for (b = buffer_lruhead; b != NULL; b = b->b_lrunext) {
+		if (b->b_dirty) {
+			ndirty++;
+		}
+	}
+	lock_release(buffer_lock);
+
+	kprintf("Buffer cache: %u of %u buffers in use, %u dirty\n",
+		count, BUFFER_MAXBUFS, ndirty);
+	kprintf("    %u lookups, %u hits (%u%%)\n", lookups, hits,
+		lookups ? (uint32_t)((uint64_t)hits * 100 / lookups) : 0);
+	kprintf("    %u disk reads, %u disk writes, %u evictions\n",
+		reads, writes, evictions);
+	kprintf("    read-ahead: %u queued, %u dropped, %u read, %u used\n",
+		raqueued, radropped, rareads, rahits);
+}
@@ -0,0 +1,369 @@
+/*
+ * VFS name cache.
+ *
+ * A small fixed pool of entries, each mapping (directory vnode, path
+ * passed to VOP_LOOKUP) to the vnode the lookup produced, or to
+ * nothing for a lookup that failed with ENOENT. Entries are found
+ * through hash chains and recycled in least-recently-used order.
+ *
+ * In this VFS, VOP_LOOKUP is handed the whole rest of the path at
+ * once rather than a component at a time, so that is what the cache
+ * is keyed on. Removal purges entries by their last component;
+ * anything that can move or remove a directory purges the whole
+ * filesystem.
+ *
+ * Each entry holds a reference to its directory and to its result.
+ * References are dropped only after nc_lock is released, because
+ * dropping the last one can call VOP_RECLAIM, which may want
+ * vfs_biglock; vfs_lookup holds vfs_biglock when it calls in here,
+ * so the lock order is vfs_biglock, then nc_lock.
+ */
+
+#include <types.h>
+#include <lib.h>
+#include <synch.h>
+#include <vnode.h>
+#include <namecache.h>
+
+/* Number of entries. */
+#define NC_NENTRIES   64
+
+/* Number of hash chains. */
+#define NC_HASHSIZE   61
+
+/* Longest path cached (including the terminating null). */
+#define NC_NAMELEN    64
+
+struct nc_entry {
+	struct nc_entry *nc_hashnext;	/* hash chain */
+	struct nc_entry *nc_lrunext;	/* LRU list, most recent first */
+	struct nc_entry *nc_lruprev;
+	struct vnode *nc_dir;		/* directory; NULL if entry unused */
+	struct vnode *nc_vn;		/* result; NULL if negative */
+	unsigned nc_hash;		/* hash of (nc_dir, nc_name) */
+	char nc_name[NC_NAMELEN];	/* path looked up in nc_dir */
+};
+
+static struct nc_entry nc_entries[NC_NENTRIES];
+static struct nc_entry *nc_table[NC_HASHSIZE];
+static struct nc_entry *nc_lruhead, *nc_lrutail;
+static struct lock *nc_lock;
+static unsigned nc_generation;
+
+/* Statistics. */
+static unsigned nc_hits, nc_neghits, nc_misses, nc_enters, nc_purges;
+
+static
+unsigned
+nc_hash(struct vnode *dir, const char *name)
+{
+	unsigned h = 5381 ^ (unsigned)(uintptr_t)dir;
+
+	while (*name) {
+		h = h * 33 + (unsigned char)*name++;
+	}
+	return h;
+}
+
+/*
+ * Return the last component of PATH.
+ */
+static
+const char *
+nc_lastname(const char *path)
+{
+	const char *s;
+
+	s = strrchr(path, '/');
+	return s != NULL ? s+1 : path;
+}
+
+static
+void
+nc_lru_unlink(struct nc_entry *nc)
+{
+	if (nc->nc_lruprev != NULL) {
+		nc->nc_lruprev->nc_lrunext = nc->nc_lrunext;
+	}
+	else {
+		nc_lruhead = nc->nc_lrunext;
+	}
+	if (nc->nc_lrunext != NULL) {
+		nc->nc_lrunext->nc_lruprev = nc->nc_lruprev;
+	}
+	else {
+		nc_lrutail = nc->nc_lruprev;
+	}
+}
+
+static
+void
+nc_lru_addhead(struct nc_entry *nc)
+{
+	nc->nc_lruprev = NULL;
+	nc->nc_lrunext = nc_lruhead;
+	if (nc_lruhead != NULL) {
+		nc_lruhead->nc_lruprev = nc;
+	}
+	else {
+		nc_lrutail = nc;
+	}
+	nc_lruhead = nc;
+}
+
+static
+void
+nc_lru_addtail(struct nc_entry *nc)
+{
+	nc->nc_lrunext = NULL;
+	nc->nc_lruprev = nc_lrutail;
+	if (nc_lrutail != NULL) {
+		nc_lrutail->nc_lrunext = nc;
+	}
+	else {
+		nc_lruhead = nc;
+	}
+	nc_lrutail = nc;
+}
+
+/*
+ * Find the entry for (DIR, NAME). Call with nc_lock held.
+ */
+static
+struct nc_entry *
+nc_find(struct vnode *dir, const char *name, unsigned hash)
+{
+	struct nc_entry *nc;
+
+	for (nc = nc_table[hash % NC_HASHSIZE]; nc != NULL;
+	     nc = nc->nc_hashnext) {
+		if (nc->nc_hash == hash && nc->nc_dir == dir &&
+		    !strcmp(nc->nc_name, name)) {
+			return nc;
+		}
+	}
+	return NULL;
+}
+
+/*
+ * Take NC out of its hash chain and move it to the tail of the LRU
+ * list for reuse. Hands back the references it held, which the
+ * caller must drop after releasing nc_lock. Call with nc_lock held.
+ */
+static
+void
+nc_remove(struct nc_entry *nc, struct vnode **dir, struct vnode **vn)
+{
+	struct nc_entry **ncp;
+
+	KASSERT(nc->nc_dir != NULL);
+
+	for (ncp = &nc_table[nc->nc_hash % NC_HASHSIZE]; *ncp != nc;
+	     ncp = &(*ncp)->nc_hashnext) {
+		KASSERT(*ncp != NULL);
+	}
+	*ncp = nc->nc_hashnext;
+	nc->nc_hashnext = NULL;
+
+	*dir = nc->nc_dir;
+	*vn = nc->nc_vn;
+	nc->nc_dir = NULL;
+	nc->nc_vn = NULL;
+
+	nc_lru_unlink(nc);
+	nc_lru_addtail(nc);
+}
+
+static
+void
+nc_release(struct vnode *dir, struct vnode *vn)
+{
+	if (dir != NULL) {
+		VOP_DECREF(dir);
+	}
+	if (vn != NULL) {
+		VOP_DECREF(vn);
+	}
+}
+
+void
+namecache_bootstrap(void)
+{
+	unsigned i;
+
+	nc_lock = lock_create("namecache");
+	if (nc_lock == NULL) {
+		panic("namecache_bootstrap: out of memory\n");
+	}
+	for (i=0; i<NC_HASHSIZE; i++) {
+		nc_table[i] = NULL;
+	}
+	nc_lruhead = nc_lrutail = NULL;
+	for (i=0; i<NC_NENTRIES; i++) {
+		nc_entries[i].nc_hashnext = NULL;
+		nc_entries[i].nc_dir = NULL;
+		nc_entries[i].nc_vn = NULL;
+		nc_lru_addtail(&nc_entries[i]);
+	}
+	nc_generation = 0;
+}
+
+unsigned
+namecache_generation(void)
+{
+	unsigned gen;
+
+	lock_acquire(nc_lock);
+	gen = nc_generation;
+	lock_release(nc_lock);
+	return gen;
+}
+
+bool
+namecache_lookup(struct vnode *dir, const char *path, struct vnode **ret)
+{
+	struct nc_entry *nc;
+	unsigned hash;
+
+	if (strlen(path) >= NC_NAMELEN) {
+		return false;
+	}
+	hash = nc_hash(dir, path);
+
+	lock_acquire(nc_lock);
+	nc = nc_find(dir, path, hash);
+	if (nc == NULL) {
+		nc_misses++;
+		lock_release(nc_lock);
+		return false;
+	}
+
+	nc_lru_unlink(nc);
+	nc_lru_addhead(nc);
+	if (nc->nc_vn != NULL) {
+		VOP_INCREF(nc->nc_vn);
+		nc_hits++;
+	}
+	else {
+		nc_neghits++;
+	}
+	*ret = nc->nc_vn;
+	lock_release(nc_lock);
+	return true;
+}
+
+void
+namecache_enter(struct vnode *dir, const char *path, struct vnode *vn,
+		unsigned gen)
+{
+	struct nc_entry *nc;
+	struct vnode *olddir = NULL, *oldvn = NULL;
+	size_t len;
+	unsigned hash;
+
+	len = strlen(path);
+	if (len == 0 || len >= NC_NAMELEN || path[len-1] == '/' ||
+	    dir->vn_fs == NULL) {
+		return;
+	}
+	hash = nc_hash(dir, path);
+
+	lock_acquire(nc_lock);
+	if (gen != nc_generation || nc_find(dir, path, hash) != NULL) {
+		/* Purged since the lookup started, or someone beat us */
+		lock_release(nc_lock);
+		return;
+	}
+
+	/* Recycle the least recently used entry. */
+	nc = nc_lrutail;
+	KASSERT(nc != NULL);
+	if (nc->nc_dir != NULL) {
+		nc_remove(nc, &olddir, &oldvn);
+	}
+
+	VOP_INCREF(dir);
+	if (vn != NULL) {
+		VOP_INCREF(vn);
+	}
+	nc->nc_dir = dir;
+	nc->nc_vn = vn;
+	nc->nc_hash = hash;
+	strcpy(nc->nc_name, path);
+	nc->nc_hashnext = nc_table[hash % NC_HASHSIZE];
+	nc_table[hash % NC_HASHSIZE] = nc;
+	nc_lru_unlink(nc);
+	nc_lru_addhead(nc);
+	nc_enters++;
+	lock_release(nc_lock);
+
+	nc_release(olddir, oldvn);
+}
+
+/*
+ * Remove every entry on FS whose last path component is NAME, or
+ * every entry on FS if NAME is NULL.
+ */
+static
+void
+nc_purge(struct fs *fs, const char *name)
+{
+	struct nc_entry *nc;
+	struct vnode *dir, *vn;
+	unsigned i;
+
+	lock_acquire(nc_lock);
+	nc_generation++;
+	nc_purges++;
+ again:
+	for (i=0; i<NC_NENTRIES; i++) {
+		nc = &nc_entries[i];
+		if (nc->nc_dir == NULL || nc->nc_dir->vn_fs != fs) {
+			continue;
+		}
+		if (name != NULL && strcmp(nc_lastname(nc->nc_name), name)) {
+			continue;
+		}
+		nc_remove(nc, &dir, &vn);
+		lock_release(nc_lock);
+		nc_release(dir, vn);
+		lock_acquire(nc_lock);
+		goto again;
+	}
+	lock_release(nc_lock);
+}
+
+void
+namecache_purge_name(struct fs *fs, const char *name)
+{
+	nc_purge(fs, nc_lastname(name));
+}
+
+void
+namecache_purge_fs(struct fs *fs)
+{
+	nc_purge(fs, NULL);
+}
+
+void
+namecache_printstats(void)
+{
+	unsigned i, used = 0, negative = 0;
+
+	lock_acquire(nc_lock);
+	for (i=0; i<NC_NENTRIES; i++) {
+		if (nc_entries[i].nc_dir != NULL) {
+			used++;
+			if (nc_entries[i].nc_vn == NULL) {
+				negative++;
+			}
+		}
+	}
+	kprintf("namecache: %u of %u entries in use (%u negative)\n",
+		used, NC_NENTRIES, negative);
+	kprintf("namecache: %u hits, %u negative hits, %u misses\n",
+		nc_hits, nc_neghits, nc_misses);
+	kprintf("namecache: %u entries made, %u purges\n",
+		nc_enters, nc_purges);
+	lock_release(nc_lock);
+}
@@ -39,10 +39,14 @@
 #include <lib.h>
 #include <array.h>
 #include <synch.h>
+#include <thread.h>
+#include <clock.h>
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
 #include <device.h>
+#include <buf.h>
+#include <namecache.h>
 
 /*
  * Structure for a single named device.
@@ -91,6 +95,14 @@ static struct knowndevarray *knowndevs;
 static struct lock *vfs_biglock;
 static unsigned vfs_biglock_depth;
 
+/*
+ * The syncer writes back data that's been dirty for more than
+ * vfs_syncer_age seconds (0: never), a little at a time.
+ */
+unsigned vfs_syncer_age = 5;
+
+static void vfs_syncer(void *, unsigned long);
+
 
 /*
  * Setup function
@@ -98,6 +110,8 @@ static unsigned vfs_biglock_depth;
 void
 vfs_bootstrap(void)
 {
+	int result;
+
 	knowndevs = knowndevarray_create();
 	if (knowndevs==NULL) {
 		panic("vfs: Could not create knowndevs array\n");
@@ -109,7 +123,15 @@ vfs_bootstrap(void)
 	}
 	vfs_biglock_depth = 0;
 
+	buffer_bootstrap();
+	namecache_bootstrap();
+
 	devnull_create();
+
+	result = thread_fork("syncer", NULL, vfs_syncer, NULL, 0);
+	if (result) {
+		panic("vfs: thread_fork: %s\n", strerror(result));
+	}
 }
 
 /*
@@ -169,6 +191,45 @@ vfs_sync(void)
 	return 0;
 }
 
+/*
+ * The syncer thread. Once a second, ask each filesystem to write back
+ * some of what's been dirty longer than vfs_syncer_age. Filesystems
+ * keep this bounded, so it never holds vfs_biglock for long.
+ */
+static
+void
+vfs_syncer(void *data1, unsigned long data2)
+{
+	struct knowndev *dev;
+	unsigned i, num, age;
+	time_t now;
+	uint32_t nsecs;
+
+	(void)data1;
+	(void)data2;
+
+	while (1) {
+		clocksleep(1);
+
+		age = vfs_syncer_age;
+		if (age == 0) {
+			continue;
+		}
+		gettime(&now, &nsecs);
+
+		vfs_biglock_acquire();
+		num = knowndevarray_num(knowndevs);
+		for (i=0; i<num; i++) {
+			dev = knowndevarray_get(knowndevs, i);
+			if (dev->kd_fs != NULL &&
+			    dev->kd_fs->fs_flushold != NULL) {
+				/*result =*/ FSOP_FLUSHOLD(dev->kd_fs, now - age);
+			}
+		}
+		vfs_biglock_release();
+	}
+}
+
 /*
  * Given a device name (lhd0, emu0, somevolname, null, etc.), hand
  * back an appropriate vnode.
@@ -571,6 +632,9 @@ vfs_unmount(const char *devname)
 	KASSERT(kd->kd_rawname != NULL);
 	KASSERT(kd->kd_device != NULL);
 
+	/* Let go of the name cache's references into the fs. */
+	namecache_purge_fs(kd->kd_fs);
+
 	result = FSOP_SYNC(kd->kd_fs);
 	if (result) {
 		goto fail;
@@ -619,6 +683,8 @@ vfs_unmountall(void)
 
 		kprintf("vfs: Unmounting %s:\n", dev->kd_name);
 
+		namecache_purge_fs(dev->kd_fs);
+
 		result = FSOP_SYNC(dev->kd_fs);
 		if (result) {
 			kprintf("vfs: Warning: sync failed for %s: %s, trying "
@@ -39,6 +39,7 @@
 #include <vfs.h>
 #include <fs.h>
 #include <vnode.h>
+#include <namecache.h>
 
 static struct vnode *bootfs_vnode = NULL;
 
@@ -226,6 +227,10 @@ getdevice(char *path, char **subpath, struct vnode **startvn)
 /*
  * Name-to-vnode translation.
  * (In BSD, both of these are subsumed by namei().)
+ *
+ * vfs_lookup goes through the name cache (namecache.c). vfs_lookparent
+ * doesn't: it is only used ahead of operations that change the
+ * directory, which purge the cache anyway.
  */
 
 int
@@ -265,6 +270,8 @@ int
 vfs_lookup(char *path, struct vnode **retval)
 {
 	struct vnode *startvn;
+	char name[NAME_MAX+1];
+	unsigned gen;
 	int result;
 
 	vfs_biglock_acquire();
@@ -281,7 +288,29 @@ vfs_lookup(char *path, struct vnode **retval)
 		return 0;
 	}
 
-	result = VOP_LOOKUP(startvn, path, retval);
+	if (namecache_lookup(startvn, path, retval)) {
+		result = *retval == NULL ? ENOENT : 0;
+	}
+	else {
+		/* VOP_LOOKUP may scribble on the path; keep a copy. */
+		if (strlen(path) < sizeof(name)) {
+			strcpy(name, path);
+		}
+		else {
+			name[0] = 0;
+		}
+		gen = namecache_generation();
+
+		result = VOP_LOOKUP(startvn, path, retval);
+		if (name[0] != 0) {
+			if (result == 0) {
+				namecache_enter(startvn, name, *retval, gen);
+			}
+			else if (result == ENOENT) {
+				namecache_enter(startvn, name, NULL, gen);
+			}
+		}
+	}
 
 	VOP_DECREF(startvn);
 	vfs_biglock_release();
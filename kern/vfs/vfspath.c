@@ -38,6 +38,7 @@
 #include <lib.h>
 #include <vfs.h>
 #include <vnode.h>
+#include <namecache.h>
 
 
 /* Does most of the work for open(). */
@@ -74,6 +75,9 @@ vfs_open(char *path, int openflags, mode_t mode, struct vnode **ret)
 		}
 
 		result = VOP_CREAT(dir, name, excl, mode, &vn);
+		if (result == 0) {
+			namecache_purge_name(dir->vn_fs, name);
+		}
 
 		VOP_DECREF(dir);
 	}
@@ -150,6 +154,9 @@ vfs_remove(char *path)
 	}
 
 	result = VOP_REMOVE(dir, name);
+	if (result == 0) {
+		namecache_purge_name(dir->vn_fs, name);
+	}
 	VOP_DECREF(dir);
 
 	return result;
@@ -183,6 +190,9 @@ vfs_rename(char *oldpath, char *newpath)
 	}
 
 	result = VOP_RENAME(olddir, oldname, newdir, newname);
+	if (result == 0) {
+		namecache_purge_fs(olddir->vn_fs);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(olddir);
@@ -217,6 +227,9 @@ vfs_link(char *oldpath, char *newpath)
 	}
 
 	result = VOP_LINK(newdir, newname, oldfile);
+	if (result == 0) {
+		namecache_purge_name(newdir->vn_fs, newname);
+	}
 
 	VOP_DECREF(newdir);
 	VOP_DECREF(oldfile);
@@ -244,6 +257,9 @@ vfs_symlink(const char *contents, char *path)
 	}
 
 	result = VOP_SYMLINK(newdir, newname, contents);
+	if (result == 0) {
+		namecache_purge_name(newdir->vn_fs, newname);
+	}
 	VOP_DECREF(newdir);
 
 	return result;
@@ -290,6 +306,9 @@ vfs_mkdir(char *path, mode_t mode)
 	}
 
 	result = VOP_MKDIR(parent, name, mode);
+	if (result == 0) {
+		namecache_purge_fs(parent->vn_fs);
+	}
 
 	VOP_DECREF(parent);
 
@@ -312,6 +331,9 @@ vfs_rmdir(char *path)
 	}
 
 	result = VOP_RMDIR(parent, name);
+	if (result == 0) {
+		namecache_purge_fs(parent->vn_fs);
+	}
 
 	VOP_DECREF(parent);
 
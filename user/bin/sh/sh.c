@@ -354,11 +354,15 @@ docommand(char *buf)
 		__time(&startsecs, &startnsecs);
 	}
 
-	pid = fork();
+	/*
+	 * The child only execs, so use vfork and skip copying the
+	 * shell's address space.
+	 */
+	pid = vfork();
 	switch (pid) {
 		case -1:
 			/* error */
-			warn("fork");
+			warn("vfork");
 			return _MKWAIT_EXIT(255);
 		case 0:
 			/* child */
@@ -0,0 +1,22 @@
+#ifndef _SYS_MMAN_H_
+#define _SYS_MMAN_H_
+
+#include <sys/types.h>
+
+/*
+ * Get the PROT_* and MAP_* flags from the kernel.
+ */
+#include <kern/mman.h>
+
+/*
+ * Map LEN bytes of the file open on FD, starting at OFFSET (a multiple
+ * of the page size), into memory, or with MAP_ANON, LEN bytes of zeros.
+ * ADDR is only a hint. Returns the address, or MAP_FAILED.
+ *
+ * munmap removes a whole mapping made by mmap, writing back changes
+ * to a MAP_SHARED one.
+ */
+void *mmap(void *addr, size_t len, int prot, int flags, int fd, off_t offset);
+int munmap(void *addr, size_t len);
+
+#endif /* _SYS_MMAN_H_ */
@@ -0,0 +1,17 @@
+#ifndef _SYS_SYSSTATS_H_
+#define _SYS_SYSSTATS_H_
+
+/*
+ * Get struct sysstat and the flags from the kernel.
+ */
+#include <kern/sysstats.h>
+
+/*
+ * Copy the kernel's per-system-call statistics into BUF, which has
+ * room for NENTRIES entries indexed by call number. Returns the number
+ * of entries filled in. With SYSSTAT_RESET the counters are zeroed
+ * after they are read.
+ */
+int __sysstats(struct sysstat *buf, unsigned nentries, int flags);
+
+#endif /* _SYS_SYSSTATS_H_ */
@@ -146,6 +146,7 @@ int link(const char *oldfile, const char *newfile);
 int chdir(const char *path);
 
 /* Optional. */
+pid_t vfork(void);
 void *sbrk(int change);
 int getdirentry(int filehandle, char *buf, size_t buflen);
 int symlink(const char *target, const char *linkname);
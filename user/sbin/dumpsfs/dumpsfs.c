@@ -56,18 +56,47 @@
 
 #include "disk.h"
 
+/* Block size of the volume, from the superblock */
+static uint32_t blocksize;
+
 static
 uint32_t
 dumpsb(void)
 {
 	struct sfs_super sp;
-	diskread(&sp, SFS_SB_LOCATION);
+	diskreadpart(&sp, SFS_SB_LOCATION, sizeof(sp));
 	if (SWAPL(sp.sp_magic) != SFS_MAGIC) {
 		errx(1, "Not an sfs filesystem");
 	}
+	blocksize = SWAPL(sp.sp_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize-1)) != 0) {
+		errx(1, "Bad block size %u in superblock", blocksize);
+	}
+	disksetblocksize(blocksize);
+
 	sp.sp_volname[sizeof(sp.sp_volname)-1] = 0;
-	printf("Volume name: %-40s  %u blocks\n", sp.sp_volname, 
-	       SWAPL(sp.sp_nblocks));
+	printf("Volume name: %-40s  %u blocks of %u bytes\n", sp.sp_volname,
+	       SWAPL(sp.sp_nblocks), blocksize);
+
+	if (sp.sp_jblocks == 0) {
+		printf("Journal: none\n");
+	}
+	else {
+		struct sfs_jheader jh;
+
+		diskreadpart(&jh, SWAPL(sp.sp_jstart), sizeof(jh));
+		printf("Journal: %u blocks at %u; next transaction %u%s%s\n",
+		       SWAPL(sp.sp_jblocks), SWAPL(sp.sp_jstart),
+		       SWAPL(jh.jh_seq),
+		       SWAPL(jh.jh_magic) != SFS_JMAGIC_HEADER ?
+		       " (bad header)" : "",
+		       SWAPL(jh.jh_flags) & SFS_JF_UNSAFE ?
+		       " (needs sfsck)" : "");
+	}
 
 	return SWAPL(sp.sp_nblocks);
 }
@@ -76,8 +105,8 @@ static
 void
 dodirblock(uint32_t block)
 {
-	struct sfs_dir sds[SFS_BLOCKSIZE/sizeof(struct sfs_dir)];
-	int nsds = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	int nsds = blocksize/sizeof(struct sfs_dir);
 	int i;
 
 	diskread(&sds, block);
@@ -95,16 +124,42 @@ dodirblock(uint32_t block)
 	}
 }
 
+/*
+ * Dump the directory blocks under indirect block IBLOCK, which has
+ * LEVELS levels of indirection below it.
+ */
+static
+void
+dodirindirect(uint32_t iblock, int levels, uint32_t *nblocks)
+{
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t block, i;
+
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			dodirindirect(block, levels-1, nblocks);
+		}
+		else {
+			dodirblock(block);
+			(*nblocks)++;
+		}
+	}
+}
+
 static
 void
 dumpdir(uint32_t ino)
 {
 	struct sfs_inode sfi;
-	uint32_t ib[SFS_DBPERIDB];
 	int nentries, i;
 	uint32_t block, nblocks=0;
 
-	diskread(&sfi, ino);
+	diskreadpart(&sfi, ino, sizeof(sfi));
 
 	nentries = SWAPL(sfi.sfi_size) / sizeof(struct sfs_dir);
 	if (SWAPL(sfi.sfi_size) % sizeof(struct sfs_dir) != 0) {
@@ -120,14 +175,13 @@ dumpdir(uint32_t ino)
 		}
 	}
 	if (SWAPL(sfi.sfi_indirect)) {
-		diskread(&ib, SWAPL(sfi.sfi_indirect));
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			block = SWAPL(ib[i]);
-			if (block) {
-				dodirblock(block);
-				nblocks++;
-			}
-		}
+		dodirindirect(SWAPL(sfi.sfi_indirect), 1, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_dindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_dindirect), 2, &nblocks);
+	}
+	if (SWAPL(sfi.sfi_tindirect)) {
+		dodirindirect(SWAPL(sfi.sfi_tindirect), 3, &nblocks);
 	}
 	printf("    %u blocks in directory\n", nblocks);
 }
@@ -136,15 +190,17 @@ static
 void
 dumpbits(uint32_t fsblocks)
 {
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	uint32_t i, j;
-	char data[SFS_BLOCKSIZE];
+	char data[SFS_MAXBLOCKSIZE];
 
-	printf("Freemap: %u blocks (%u %u %u)\n", nblocks, SFS_BITMAPSIZE(fsblocks), fsblocks, SFS_BLOCKBITS);
+	printf("Freemap: %u blocks (%u %u %u)\n", nblocks,
+	       SFS_BITMAPSIZE(fsblocks, blocksize), fsblocks,
+	       SFS_BLOCKBITS(blocksize));
 
 	for (i=0; i<nblocks; i++) {
 		diskread(data, SFS_MAP_LOCATION+i);
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
+		for (j=0; j<blocksize; j++) {
 			printf("%02x", (unsigned char)data[j]);
 			if (j%32==31) {
 				printf("\n");
@@ -154,6 +210,212 @@ dumpbits(uint32_t fsblocks)
 	printf("\n");
 }
 
+////////////////////////////////////////////////////////////
+// Fragmentation report
+
+/*
+ * Call FN on each block of a file in order: the indirect blocks just
+ * before the blocks under them. ISDATA is false for indirect blocks.
+ */
+typedef void (*blockfn)(uint32_t block, int isdata, void *arg);
+
+static
+void
+walkindirect(uint32_t iblock, int levels, blockfn fn, void *arg)
+{
+	uint32_t ib[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t block, i;
+
+	fn(iblock, 0, arg);
+	diskread(&ib, iblock);
+	for (i=0; i<SFS_DBPERIDB(blocksize); i++) {
+		block = SWAPL(ib[i]);
+		if (block == 0) {
+			continue;
+		}
+		if (levels > 1) {
+			walkindirect(block, levels-1, fn, arg);
+		}
+		else {
+			fn(block, 1, arg);
+		}
+	}
+}
+
+static
+void
+walkfile(const struct sfs_inode *sfi, blockfn fn, void *arg)
+{
+	uint32_t block;
+	int i;
+
+	for (i=0; i<SFS_NDIRECT; i++) {
+		block = SWAPL(sfi->sfi_direct[i]);
+		if (block) {
+			fn(block, 1, arg);
+		}
+	}
+	if (SWAPL(sfi->sfi_indirect)) {
+		walkindirect(SWAPL(sfi->sfi_indirect), 1, fn, arg);
+	}
+	if (SWAPL(sfi->sfi_dindirect)) {
+		walkindirect(SWAPL(sfi->sfi_dindirect), 2, fn, arg);
+	}
+	if (SWAPL(sfi->sfi_tindirect)) {
+		walkindirect(SWAPL(sfi->sfi_tindirect), 3, fn, arg);
+	}
+}
+
+/*
+ * An extent is a run of a file's blocks (counting its indirect
+ * blocks) that are consecutive on disk, so can be read without a
+ * seek.
+ */
+struct fragcount {
+	uint32_t blocks;	/* blocks in the file */
+	uint32_t extents;	/* number of extents */
+	uint32_t last;		/* last block seen */
+};
+
+static struct {
+	uint32_t files;		/* files and directories looked at */
+	uint32_t fragmented;	/* ...that have more than one extent */
+	uint32_t blocks;	/* their blocks */
+	uint32_t extents;	/* their extents */
+} fragtotals;
+
+static
+void
+fragblock(uint32_t block, int isdata, void *arg)
+{
+	struct fragcount *fc = arg;
+
+	(void)isdata;
+	if (fc->blocks == 0 || block != fc->last + 1) {
+		fc->extents++;
+	}
+	fc->blocks++;
+	fc->last = block;
+}
+
+static void fragdir(uint32_t ino, const char *path);
+
+static
+void
+fragfile(uint32_t ino, const char *path)
+{
+	struct sfs_inode sfi;
+	struct fragcount fc;
+
+	diskreadpart(&sfi, ino, sizeof(sfi));
+
+	fc.blocks = fc.extents = fc.last = 0;
+	walkfile(&sfi, fragblock, &fc);
+
+	fragtotals.files++;
+	fragtotals.blocks += fc.blocks;
+	fragtotals.extents += fc.extents;
+	if (fc.extents > 1) {
+		fragtotals.fragmented++;
+		printf("    /%s: %u blocks in %u extents\n",
+		       path, fc.blocks, fc.extents);
+	}
+
+	if (SWAPS(sfi.sfi_type) == SFS_TYPE_DIR) {
+		fragdir(ino, path);
+	}
+}
+
+/* Go through the entries in one block of directory DIRINO */
+struct fragdirarg {
+	const char *path;
+	uint32_t dirino;
+};
+
+static
+void
+fragdirblock(uint32_t block, int isdata, void *arg)
+{
+	struct fragdirarg *fa = arg;
+	struct sfs_dir sds[SFS_MAXBLOCKSIZE/sizeof(struct sfs_dir)];
+	char path[SFS_NAMELEN * 8];
+	uint32_t ino;
+	unsigned i;
+
+	if (!isdata) {
+		return;
+	}
+	diskread(&sds, block);
+	for (i=0; i<blocksize/sizeof(struct sfs_dir); i++) {
+		ino = SWAPL(sds[i].sfd_ino);
+		sds[i].sfd_name[SFS_NAMELEN-1] = 0;
+		if (ino == SFS_NOINO || ino == fa->dirino ||
+		    !strcmp(sds[i].sfd_name, ".") ||
+		    !strcmp(sds[i].sfd_name, "..")) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s%s%s", fa->path,
+			 fa->path[0] ? "/" : "", sds[i].sfd_name);
+		fragfile(ino, path);
+	}
+}
+
+static
+void
+fragdir(uint32_t ino, const char *path)
+{
+	struct sfs_inode sfi;
+	struct fragdirarg fa;
+
+	diskreadpart(&sfi, ino, sizeof(sfi));
+	fa.path = path;
+	fa.dirino = ino;
+	walkfile(&sfi, fragdirblock, &fa);
+}
+
+static
+void
+dumpfrag(uint32_t fsblocks)
+{
+	unsigned char data[SFS_MAXBLOCKSIZE];
+	uint32_t block, nfree, nruns, run, maxrun;
+	uint32_t x100;
+
+	printf("Fragmentation:\n");
+	fragfile(SFS_ROOT_LOCATION, "");
+
+	x100 = fragtotals.extents ?
+		fragtotals.blocks * 100 / fragtotals.extents : 0;
+	printf("    %u files, %u blocks in %u extents "
+	       "(%u.%02u blocks per extent); %u files fragmented\n",
+	       fragtotals.files, fragtotals.blocks, fragtotals.extents,
+	       x100 / 100, x100 % 100, fragtotals.fragmented);
+
+	/* Free space: how broken up is it? */
+	nfree = nruns = run = maxrun = 0;
+	for (block=0; block<fsblocks; block++) {
+		if (block % SFS_BLOCKBITS(blocksize) == 0) {
+			diskread(data, SFS_MAP_LOCATION +
+				 block / SFS_BLOCKBITS(blocksize));
+		}
+		if (data[(block % SFS_BLOCKBITS(blocksize)) / CHAR_BIT] &
+		    (1 << (block % CHAR_BIT))) {
+			run = 0;
+			continue;
+		}
+		if (run == 0) {
+			nruns++;
+		}
+		run++;
+		nfree++;
+		if (run > maxrun) {
+			maxrun = run;
+		}
+	}
+	printf("    %u blocks free in %u runs; largest run %u blocks\n",
+	       nfree, nruns, maxrun);
+}
+
 int
 main(int argc, char **argv)
 {
@@ -171,6 +433,7 @@ main(int argc, char **argv)
 	nblocks = dumpsb();
 	dumpbits(nblocks);
 	dumpdir(SFS_ROOT_LOCATION);
+	dumpfrag(nblocks);
 
 	closedisk();
 
@@ -29,6 +29,9 @@
 
 #include <sys/types.h>
 #include <sys/stat.h>
+#ifdef HOST
+#include <sys/mman.h>
+#endif
 #include <unistd.h>
 #include <assert.h>
 #include <stdint.h>
@@ -41,14 +44,33 @@
 #include "disk.h"
 
 #define HOSTSTRING "System/161 Disk Image"
-#define BLOCKSIZE  512
+#define SECTORSIZE 512
+
+#ifdef HOST
+/* Disk files start with a one-sector header */
+#define HEADERSIZE SECTORSIZE
+#else
+#define HEADERSIZE 0
+#endif
 
 #ifndef EINTR
 #define EINTR 0
 #endif
 
 static int fd=-1;
-static uint32_t nblocks;
+static uint32_t nsectors;
+static uint32_t blocksize = SECTORSIZE;
+
+#ifdef HOST
+/*
+ * On the host the whole image (header included) is mapped, and the
+ * disk functions just copy to and from it. That saves a pair of
+ * system calls per block, and since there's no file offset to share
+ * they can be called from several threads at once.
+ */
+static char *image;
+static size_t imagesize;
+#endif
 
 void
 opendisk(const char *path)
@@ -64,28 +86,26 @@ opendisk(const char *path)
 		err(1, "%s: fstat", path);
 	}
 
-	nblocks = statbuf.st_size / BLOCKSIZE;
+	nsectors = statbuf.st_size / SECTORSIZE;
 
 #ifdef HOST
-	nblocks--;
-
-	{
-		char buf[64];
-		int len;
-
-		do {
-			len = read(fd, buf, sizeof(buf)-1);
-			if (len < 0 && (errno==EINTR || errno==EAGAIN)) {
-				continue;
-			}
-		} while (0);
+	if (statbuf.st_size < HEADERSIZE) {
+		errx(1, "%s: Not a System/161 disk image", path);
+	}
+	if ((off_t)(size_t)statbuf.st_size != statbuf.st_size) {
+		errx(1, "%s: Too large to map", path);
+	}
+	nsectors--;
 
-		buf[len] = 0;
-		buf[strlen(HOSTSTRING)] = 0;
+	imagesize = statbuf.st_size;
+	image = mmap(NULL, imagesize, PROT_READ|PROT_WRITE, MAP_SHARED,
+		     fd, 0);
+	if (image == MAP_FAILED) {
+		err(1, "%s: mmap", path);
+	}
 
-		if (strcmp(buf, HOSTSTRING)) {
-			errx(1, "%s: Not a System/161 disk image", path);
-		}
+	if (memcmp(image, HOSTSTRING, strlen(HOSTSTRING))) {
+		errx(1, "%s: Not a System/161 disk image", path);
 	}
 #endif
 }
@@ -94,86 +114,132 @@ uint32_t
 diskblocksize(void)
 {
 	assert(fd>=0);
-	return BLOCKSIZE;
+	return SECTORSIZE;
+}
+
+/*
+ * Set the size of the blocks diskread, diskwrite and diskblocks work
+ * in. It starts out as the sector size.
+ */
+void
+disksetblocksize(uint32_t size)
+{
+	assert(fd>=0);
+	assert(size >= SECTORSIZE && size % SECTORSIZE == 0);
+	blocksize = size;
 }
 
 uint32_t
 diskblocks(void)
 {
 	assert(fd>=0);
-	return nblocks;
+	return nsectors / (blocksize / SECTORSIZE);
 }
 
+/*
+ * Move LEN bytes at the start of block BLOCK.
+ */
+#ifdef HOST
+static
 void
-diskwrite(const void *data, uint32_t block)
+diskio(void *data, uint32_t block, uint32_t len, int iswrite)
 {
-	const char *cdata = data;
-	uint32_t tot=0;
-	int len;
+	uint64_t pos;
 
 	assert(fd>=0);
+	assert(len <= blocksize);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
-		err(1, "lseek");
+	pos = (uint64_t)block*blocksize;
+	if (pos + len > (uint64_t)nsectors*SECTORSIZE) {
+		/* Reading would fault; read() would have hit EOF */
+		errx(1, "Block %lu is past the end of the disk",
+		     (unsigned long) block);
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = write(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
-			if (errno==EINTR || errno==EAGAIN) {
-				continue;
-			}
-			err(1, "write");
-		}
-		if (len==0) {
-			err(1, "write returned 0?");
-		}
-		tot += len;
+	if (iswrite) {
+		memcpy(image + HEADERSIZE + pos, data, len);
+	}
+	else {
+		memcpy(data, image + HEADERSIZE + pos, len);
 	}
 }
-
+#else
+static
 void
-diskread(void *data, uint32_t block)
+diskio(void *data, uint32_t block, uint32_t len, int iswrite)
 {
 	char *cdata = data;
 	uint32_t tot=0;
-	int len;
+	int n;
 
 	assert(fd>=0);
+	assert(len <= blocksize);
 
-#ifdef HOST
-	// skip over disk file header
-	block++;
-#endif
-
-	if (lseek(fd, block*BLOCKSIZE, SEEK_SET)<0) {
+	if (lseek(fd, HEADERSIZE + (off_t)block*blocksize, SEEK_SET)<0) {
 		err(1, "lseek");
 	}
 
-	while (tot < BLOCKSIZE) {
-		len = read(fd, cdata + tot, BLOCKSIZE - tot);
-		if (len < 0) {
+	while (tot < len) {
+		if (iswrite) {
+			n = write(fd, cdata + tot, len - tot);
+		}
+		else {
+			n = read(fd, cdata + tot, len - tot);
+		}
+		if (n < 0) {
 			if (errno==EINTR || errno==EAGAIN) {
 				continue;
 			}
-			err(1, "read");
+			err(1, iswrite ? "write" : "read");
 		}
-		if (len==0) {
-			err(1, "unexpected EOF in mid-sector");
+		if (n==0) {
+			if (iswrite) {
+				err(1, "write returned 0?");
+			}
+			err(1, "unexpected EOF in mid-block");
 		}
-		tot += len;
+		tot += n;
 	}
 }
+#endif
+
+void
+diskwrite(const void *data, uint32_t block)
+{
+	diskio((void *)data, block, blocksize, 1);
+}
+
+void
+diskread(void *data, uint32_t block)
+{
+	diskio(data, block, blocksize, 0);
+}
+
+void
+diskwritepart(const void *data, uint32_t block, uint32_t len)
+{
+	diskio((void *)data, block, len, 1);
+}
+
+void
+diskreadpart(void *data, uint32_t block, uint32_t len)
+{
+	diskio(data, block, len, 0);
+}
 
 void
 closedisk(void)
 {
 	assert(fd>=0);
+#ifdef HOST
+	if (msync(image, imagesize, MS_SYNC)) {
+		err(1, "msync");
+	}
+	if (munmap(image, imagesize)) {
+		err(1, "munmap");
+	}
+	image = NULL;
+#endif
 	if (close(fd)) {
 		err(1, "close");
 	}
@@ -27,12 +27,23 @@
  * SUCH DAMAGE.
  */
 
+/*
+ * Disk I/O for the SFS tools. In the host build the image is memory
+ * mapped, and the read and write functions may be called from more
+ * than one thread at once (for different blocks).
+ */
+
 void opendisk(const char *path);
 
-uint32_t diskblocksize(void);
+uint32_t diskblocksize(void);		/* sector size */
+void disksetblocksize(uint32_t size);	/* unit for the functions below */
 uint32_t diskblocks(void);
 
 void diskwrite(const void *data, uint32_t block);
 void diskread(void *data, uint32_t block);
 
+/* Just the first LEN bytes of the block (for the superblock and inodes) */
+void diskwritepart(const void *data, uint32_t block, uint32_t len);
+void diskreadpart(void *data, uint32_t block, uint32_t len);
+
 void closedisk(void);
@@ -29,6 +29,7 @@
 
 #include <sys/types.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include <string.h>
 #include <assert.h>
 #include <limits.h>
@@ -55,7 +56,12 @@
 
 #include "disk.h"
 
-#define MAXBITBLOCKS 32
+/* Block size of the new volume */
+static uint32_t blocksize = SFS_BLOCKSIZE;
+
+/* Where the journal goes, and how big it is (0 for none) */
+static uint32_t jstart;
+static uint32_t jblocks = SFS_JDEFBLOCKS;
 
 static
 void
@@ -66,6 +72,21 @@ check(void)
 	assert(SFS_BLOCKSIZE % sizeof(struct sfs_dir) == 0);
 }
 
+/*
+ * Write a structure into the start of block BLOCK and zeros after it.
+ */
+static
+void
+writeblockstart(const void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	assert(len <= blocksize);
+	bzero(buf, blocksize);
+	memcpy(buf, data, len);
+	diskwrite(buf, block);
+}
+
 static
 void
 writesuper(const char *volname, uint32_t nblocks)
@@ -81,8 +102,11 @@ writesuper(const char *volname, uint32_t nblocks)
 	sp.sp_magic = SWAPL(SFS_MAGIC);
 	sp.sp_nblocks = SWAPL(nblocks);
 	strcpy(sp.sp_volname, volname);
+	sp.sp_blocksize = SWAPL(blocksize);
+	sp.sp_jstart = SWAPL(jstart);
+	sp.sp_jblocks = SWAPL(jblocks);
 
-	diskwrite(&sp, SFS_SB_LOCATION);
+	writeblockstart(&sp, sizeof(sp), SFS_SB_LOCATION);
 }
 
 static
@@ -97,10 +121,11 @@ writerootdir(void)
 	sfi.sfi_type = SWAPS(SFS_TYPE_DIR);
 	sfi.sfi_linkcount = SWAPS(1);
 
-	diskwrite(&sfi, SFS_ROOT_LOCATION);
+	writeblockstart(&sfi, sizeof(sfi), SFS_ROOT_LOCATION);
 }
 
-static char bitbuf[MAXBITBLOCKS*SFS_BLOCKSIZE];
+/* The freemap, built in memory and then written out */
+static char *bitbuf;
 
 static
 void
@@ -118,43 +143,103 @@ void
 writebitmap(uint32_t fsblocks)
 {
 
-	uint32_t nbits = SFS_BITMAPSIZE(fsblocks);
-	uint32_t nblocks = SFS_BITBLOCKS(fsblocks);
+	uint32_t nbits = SFS_BITMAPSIZE(fsblocks, blocksize);
+	uint32_t nblocks = SFS_BITBLOCKS(fsblocks, blocksize);
 	char *ptr;
 	uint32_t i;
 
-	if (nblocks > MAXBITBLOCKS) {
-		errx(1, "Filesystem too large "
-		     "- increase MAXBITBLOCKS and recompile");
+	bitbuf = malloc(nblocks * blocksize);
+	if (bitbuf == NULL) {
+		errx(1, "Out of memory");
 	}
+	bzero(bitbuf, nblocks * blocksize);
 
 	doallocbit(SFS_SB_LOCATION);
 	doallocbit(SFS_ROOT_LOCATION);
 	for (i=0; i<nblocks; i++) {
 		doallocbit(SFS_MAP_LOCATION+i);
 	}
+	for (i=0; i<jblocks; i++) {
+		doallocbit(jstart+i);
+	}
 	for (i=fsblocks; i<nbits; i++) {
 		doallocbit(i);
 	}
 
 	for (i=0; i<nblocks; i++) {
-		ptr = bitbuf + i*SFS_BLOCKSIZE;
+		ptr = bitbuf + i*blocksize;
 		diskwrite(ptr, SFS_MAP_LOCATION+i);
 	}
+
+	free(bitbuf);
+	bitbuf = NULL;
+}
+
+/*
+ * Set up an empty journal: a header saying transaction 1 is next, and
+ * a descriptor that doesn't match it.
+ */
+static
+void
+writejournal(void)
+{
+	struct sfs_jheader jh;
+	struct sfs_jdesc jd;
+
+	if (jblocks == 0) {
+		return;
+	}
+
+	bzero((void *)&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC_HEADER);
+	jh.jh_seq = SWAPL(1);
+	jh.jh_flags = SWAPL(0);
+	writeblockstart(&jh, sizeof(jh), jstart);
+
+	bzero((void *)&jd, sizeof(jd));
+	writeblockstart(&jd, sizeof(jd), jstart+1);
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: mksfs [-b blocksize] [-j journalblocks] "
+	     "device/diskfile volume-name");
 }
 
 int
 main(int argc, char **argv)
 {
-	uint32_t size, blocksize;
+	uint32_t size, sectorsize;
 	char *volname, *s;
+	int jset = 0;
 
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-b")) {
+			blocksize = atoi(argv[2]);
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			jblocks = atoi(argv[2]);
+			jset = 1;
+		}
+		else {
+			usage();
+		}
+		argc -= 2;
+		argv += 2;
+	}
 	if (argc!=3) {
-		errx(1, "Usage: mksfs device/diskfile volume-name");
+		usage();
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize-1)) != 0) {
+		errx(1, "Block size must be a power of 2 from %u to %u",
+		     SFS_BLOCKSIZE, SFS_MAXBLOCKSIZE);
 	}
 
 	check();
@@ -177,17 +262,41 @@ main(int argc, char **argv)
 	}
 
 	opendisk(argv[1]);
-	blocksize = diskblocksize();
+	sectorsize = diskblocksize();
 
-	if (blocksize!=SFS_BLOCKSIZE) {
-		errx(1, "Device has wrong blocksize %u (should be %u)\n",
-		     blocksize, SFS_BLOCKSIZE);
+	if (blocksize % sectorsize != 0) {
+		errx(1, "Device has wrong blocksize %u (should divide %u)\n",
+		     sectorsize, blocksize);
 	}
+	disksetblocksize(blocksize);
 	size = diskblocks();
 
+	/*
+	 * The journal goes right after the bitmap. Unless asked for
+	 * a size, keep it to an eighth of the volume, and leave it
+	 * out if that's too small to be worth having.
+	 */
+	jstart = SFS_MAP_LOCATION + SFS_BITBLOCKS(size, blocksize);
+	if (!jset && jblocks > size / 8) {
+		jblocks = size / 8;
+		if (jblocks < SFS_JMINBLOCKS) {
+			jblocks = 0;
+		}
+	}
+	if (jblocks > 0 && jblocks < SFS_JMINBLOCKS) {
+		errx(1, "Journal must be at least %u blocks", SFS_JMINBLOCKS);
+	}
+	if (jblocks > 0 && (jstart >= size || jblocks > size - jstart)) {
+		errx(1, "Journal of %u blocks doesn't fit", jblocks);
+	}
+	if (jblocks == 0) {
+		jstart = 0;
+	}
+
 	writesuper(volname, size);
 	writerootdir();
 	writebitmap(size);
+	writejournal();
 
 	closedisk();
 
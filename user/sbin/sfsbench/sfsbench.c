@@ -0,0 +1,402 @@
+/*
+ * sfsbench - time sfsck on a synthetic volume. Host only.
+ *
+ * Usage: sfsbench [-d dirs] [-f files] [-s blocks] [-j threads]
+ *                 [-c sfsck] diskfile
+ *
+ * Fills DISKFILE, which should be a freshly made SFS volume, with
+ * DIRS directories under the root, each holding FILES files of BLOCKS
+ * blocks apiece. Only the metadata is written (inodes, directories,
+ * indirect blocks and the freemap); file contents are whatever was on
+ * the disk already. Then it runs sfsck (host-sfsck, or the program
+ * given with -c) on the volume with 1, 2, 4, ... threads, up to
+ * THREADS (by default, the number of CPUs), and prints how long each
+ * run took. Every run should find the volume clean.
+ *
+ * For example, for a 4G volume with about a million blocks in use:
+ *
+ *    disk161 create big.img 4G
+ *    host-mksfs -b 4096 big.img big
+ *    host-sfsbench -d 256 -f 512 -s 8 big.img
+ */
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+#include <netinet/in.h> // for arpa/inet.h
+#include <arpa/inet.h>  // for htonl
+#include <limits.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <err.h>
+
+#include "support.h"
+#include "kern/sfs.h"
+#include "hostcompat.h"
+#include "disk.h"
+
+static uint32_t blocksize, dbperidb, nblocks;
+
+/* The freemap, read in at the start and written back at the end */
+static uint8_t *bitmap;
+static uint32_t bitblocks;
+static uint32_t nextfree;
+
+static uint32_t count_blocks;
+
+static
+void *
+domalloc(size_t len)
+{
+	void *x;
+	x = malloc(len);
+	if (x==NULL) {
+		errx(1, "Out of memory");
+	}
+	return x;
+}
+
+////////////////////////////////////////////////////////////
+//
+// Building the volume
+
+static
+uint32_t
+allocblock(void)
+{
+	uint32_t b;
+
+	for (b=nextfree; b<nblocks; b++) {
+		if ((bitmap[b/CHAR_BIT] & (1<<(b % CHAR_BIT))) == 0) {
+			bitmap[b/CHAR_BIT] |= 1<<(b % CHAR_BIT);
+			nextfree = b+1;
+			count_blocks++;
+			return b;
+		}
+	}
+	errx(1, "Volume is full");
+}
+
+/*
+ * Write a structure into the start of block BLOCK and zeros after it.
+ */
+static
+void
+writeblockstart(const void *data, size_t len, uint32_t block)
+{
+	static char buf[SFS_MAXBLOCKSIZE];
+
+	bzero(buf, blocksize);
+	memcpy(buf, data, len);
+	diskwrite(buf, block);
+}
+
+/*
+ * Make an indirect block of LEVELS levels that maps as many of the N
+ * blocks at BLOCKS as it can. Returns it, and how many it took in
+ * *TAKEN.
+ */
+static
+uint32_t
+mapindirect(const uint32_t *blocks, uint32_t n, int levels, uint32_t *taken)
+{
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
+	uint32_t self, done, sub, i;
+
+	self = allocblock();
+	done = 0;
+	for (i=0; i<dbperidb; i++) {
+		if (done == n) {
+			entries[i] = 0;
+		}
+		else if (levels == 1) {
+			entries[i] = htonl(blocks[done]);
+			done++;
+		}
+		else {
+			entries[i] = htonl(mapindirect(blocks+done, n-done,
+						       levels-1, &sub));
+			done += sub;
+		}
+	}
+	diskwrite(entries, self);
+
+	*taken = done;
+	return self;
+}
+
+/*
+ * Point SFI at the N blocks at BLOCKS, in order.
+ */
+static
+void
+mapblocks(struct sfs_inode *sfi, const uint32_t *blocks, uint32_t n)
+{
+	uint32_t i, taken;
+
+	for (i=0; i<SFS_NDIRECT && i<n; i++) {
+		sfi->sfi_direct[i] = htonl(blocks[i]);
+	}
+	blocks += i;
+	n -= i;
+
+	if (n > 0) {
+		sfi->sfi_indirect = htonl(mapindirect(blocks, n, 1, &taken));
+		blocks += taken;
+		n -= taken;
+	}
+	if (n > 0) {
+		sfi->sfi_dindirect = htonl(mapindirect(blocks, n, 2, &taken));
+		blocks += taken;
+		n -= taken;
+	}
+	if (n > 0) {
+		sfi->sfi_tindirect = htonl(mapindirect(blocks, n, 3, &taken));
+		blocks += taken;
+		n -= taken;
+	}
+	if (n > 0) {
+		errx(1, "File too large");
+	}
+}
+
+/*
+ * Make a file of NDATA blocks; returns its inode.
+ */
+static
+uint32_t
+makefile(uint32_t ndata)
+{
+	struct sfs_inode sfi;
+	uint32_t ino, *blocks, i;
+
+	ino = allocblock();
+	blocks = domalloc((ndata+1) * sizeof(uint32_t));
+	for (i=0; i<ndata; i++) {
+		blocks[i] = allocblock();
+	}
+
+	bzero((void *)&sfi, sizeof(sfi));
+	sfi.sfi_size = htonl(ndata * blocksize);
+	sfi.sfi_type = htons(SFS_TYPE_FILE);
+	sfi.sfi_linkcount = htons(1);
+	mapblocks(&sfi, blocks, ndata);
+	writeblockstart(&sfi, sizeof(sfi), ino);
+
+	free(blocks);
+	return ino;
+}
+
+/*
+ * Write directory INO, in PARENT, with entries PREFIX0, PREFIX1, ...
+ * for the N inodes at SUBINOS. SUBDIRS is how many of them are
+ * directories, for the link count.
+ */
+static
+void
+makedir(uint32_t ino, uint32_t parent, const char *prefix,
+	const uint32_t *subinos, uint32_t n, uint32_t subdirs)
+{
+	struct sfs_inode sfi;
+	struct sfs_dir *d;
+	uint32_t nentries, ndata, *blocks, i;
+
+	nentries = n + 2;
+	ndata = SFS_ROUNDUP(nentries * sizeof(struct sfs_dir), blocksize)
+		/ blocksize;
+	d = domalloc(ndata * blocksize);
+	bzero(d, ndata * blocksize);
+
+	d[0].sfd_ino = htonl(ino);
+	strcpy(d[0].sfd_name, ".");
+	d[1].sfd_ino = htonl(parent);
+	strcpy(d[1].sfd_name, "..");
+	for (i=0; i<n; i++) {
+		d[i+2].sfd_ino = htonl(subinos[i]);
+		snprintf(d[i+2].sfd_name, sizeof(d[i+2].sfd_name), "%s%lu",
+			 prefix, (unsigned long) i);
+	}
+
+	blocks = domalloc(ndata * sizeof(uint32_t));
+	for (i=0; i<ndata; i++) {
+		blocks[i] = allocblock();
+		diskwrite((char *)d + i*blocksize, blocks[i]);
+	}
+
+	bzero((void *)&sfi, sizeof(sfi));
+	sfi.sfi_size = htonl(nentries * sizeof(struct sfs_dir));
+	sfi.sfi_type = htons(SFS_TYPE_DIR);
+	sfi.sfi_linkcount = htons(subdirs + 2);
+	mapblocks(&sfi, blocks, ndata);
+	writeblockstart(&sfi, sizeof(sfi), ino);
+
+	free(blocks);
+	free(d);
+}
+
+static
+void
+populate(const char *path, uint32_t ndirs, uint32_t nfiles, uint32_t size)
+{
+	struct sfs_super sp;
+	struct sfs_inode root;
+	uint32_t *dirinos, *fileinos, i, j;
+
+	opendisk(path);
+
+	diskreadpart(&sp, SFS_SB_LOCATION, sizeof(sp));
+	if (ntohl(sp.sp_magic) != SFS_MAGIC) {
+		errx(1, "%s: Not an sfs filesystem", path);
+	}
+	blocksize = ntohl(sp.sp_blocksize);
+	if (blocksize == 0) {
+		blocksize = SFS_BLOCKSIZE;
+	}
+	dbperidb = SFS_DBPERIDB(blocksize);
+	nblocks = ntohl(sp.sp_nblocks);
+	disksetblocksize(blocksize);
+
+	if ((uint64_t)size * blocksize > UINT32_MAX) {
+		errx(1, "Files of %lu blocks are too large",
+		     (unsigned long) size);
+	}
+
+	diskreadpart(&root, SFS_ROOT_LOCATION, sizeof(root));
+	if (ntohl(root.sfi_size) != 0) {
+		errx(1, "%s: Not a freshly made volume", path);
+	}
+
+	bitblocks = SFS_BITBLOCKS(nblocks, blocksize);
+	bitmap = domalloc(bitblocks * blocksize);
+	for (i=0; i<bitblocks; i++) {
+		diskread(bitmap + i*blocksize, SFS_MAP_LOCATION+i);
+	}
+	nextfree = 0;
+
+	dirinos = domalloc((ndirs+1) * sizeof(uint32_t));
+	fileinos = domalloc((nfiles+1) * sizeof(uint32_t));
+	for (i=0; i<ndirs; i++) {
+		dirinos[i] = allocblock();
+		for (j=0; j<nfiles; j++) {
+			fileinos[j] = makefile(size);
+		}
+		makedir(dirinos[i], SFS_ROOT_LOCATION, "f",
+			fileinos, nfiles, 0);
+	}
+	makedir(SFS_ROOT_LOCATION, SFS_ROOT_LOCATION, "d",
+		dirinos, ndirs, ndirs);
+
+	for (i=0; i<bitblocks; i++) {
+		diskwrite(bitmap + i*blocksize, SFS_MAP_LOCATION+i);
+	}
+
+	closedisk();
+
+	printf("%lu directories, %lu files, %lu blocks used (of %lu)\n",
+	       (unsigned long) ndirs, (unsigned long) ndirs * nfiles,
+	       (unsigned long) count_blocks, (unsigned long) nblocks);
+
+	free(fileinos);
+	free(dirinos);
+	free(bitmap);
+}
+
+////////////////////////////////////////////////////////////
+//
+// Timing
+
+static
+void
+runsfsck(const char *prog, unsigned threads, const char *path)
+{
+	struct timeval start, end;
+	char jbuf[16];
+	pid_t pid;
+	int status;
+
+	snprintf(jbuf, sizeof(jbuf), "%u", threads);
+	fflush(stdout);
+
+	gettimeofday(&start, NULL);
+	pid = fork();
+	if (pid < 0) {
+		err(1, "fork");
+	}
+	if (pid == 0) {
+		execlp(prog, prog, "-j", jbuf, path, (char *)NULL);
+		warn("%s", prog);
+		_exit(1);
+	}
+	if (waitpid(pid, &status, 0) < 0) {
+		err(1, "waitpid");
+	}
+	gettimeofday(&end, NULL);
+
+	printf("%3u threads: %.3f seconds", threads,
+	       (end.tv_sec - start.tv_sec) +
+	       (end.tv_usec - start.tv_usec) / 1000000.0);
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		printf(" (sfsck failed)");
+	}
+	printf("\n");
+}
+
+static
+void
+usage(void)
+{
+	errx(1, "Usage: sfsbench [-d dirs] [-f files] [-s blocks] "
+	     "[-j threads] [-c sfsck] diskfile");
+}
+
+int
+main(int argc, char **argv)
+{
+	uint32_t ndirs = 16, nfiles = 256, size = 8;
+	const char *prog = "host-sfsck";
+	unsigned maxthreads, t;
+	long ncpus;
+
+	hostcompat_init(argc, argv);
+
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	maxthreads = ncpus > 0 ? ncpus : 1;
+
+	while (argc > 3 && argv[1][0] == '-') {
+		if (!strcmp(argv[1], "-d")) {
+			ndirs = atoi(argv[2]);
+		}
+		else if (!strcmp(argv[1], "-f")) {
+			nfiles = atoi(argv[2]);
+		}
+		else if (!strcmp(argv[1], "-s")) {
+			size = atoi(argv[2]);
+		}
+		else if (!strcmp(argv[1], "-j")) {
+			maxthreads = atoi(argv[2]);
+		}
+		else if (!strcmp(argv[1], "-c")) {
+			prog = argv[2];
+		}
+		else {
+			usage();
+		}
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc != 2 || maxthreads < 1) {
+		usage();
+	}
+
+	populate(argv[1], ndirs, nfiles, size);
+
+	for (t=1; t<maxthreads; t*=2) {
+		runsfsck(prog, t, argv[1]);
+	}
+	runsfsck(prog, maxthreads, argv[1]);
+
+	return 0;
+}
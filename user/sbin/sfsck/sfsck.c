@@ -42,15 +42,17 @@
 #ifdef HOST
 #include <netinet/in.h> // for arpa/inet.h
 #include <arpa/inet.h>  // for ntohl
+#include <pthread.h>
+#include <unistd.h>     // for sysconf
 #include "hostcompat.h"
 #define SWAPL(x) ntohl(x)
 #define SWAPS(x) ntohs(x)
+#define USE_THREADS
 
 #else
 
 #define SWAPL(x) (x)
 #define SWAPS(x) (x)
-#define NO_REALLOC
 #define NO_QSORT
 
 #endif
@@ -66,13 +68,28 @@
 
 static int badness=0;
 
+/* Block size of the volume, from the superblock */
+static uint32_t blocksize, dbperidb;
+
+#ifdef USE_THREADS
+/* Threads for the file and bitmap passes (see runparallel) */
+static unsigned nthreads = 1;
+static pthread_mutex_t badnesslock = PTHREAD_MUTEX_INITIALIZER;
+#endif
+
 static
 void
 setbadness(int code)
 {
+#ifdef USE_THREADS
+	pthread_mutex_lock(&badnesslock);
+#endif
 	if (badness < code) {
 		badness = code;
 	}
+#ifdef USE_THREADS
+	pthread_mutex_unlock(&badnesslock);
+#endif
 }
 
 ////////////////////////////////////////////////////////////
@@ -83,6 +100,9 @@ swapsb(struct sfs_super *sp)
 {
 	sp->sp_magic = SWAPL(sp->sp_magic);
 	sp->sp_nblocks = SWAPL(sp->sp_nblocks);
+	sp->sp_blocksize = SWAPL(sp->sp_blocksize);
+	sp->sp_jstart = SWAPL(sp->sp_jstart);
+	sp->sp_jblocks = SWAPL(sp->sp_jblocks);
 }
 
 static
@@ -139,8 +159,8 @@ static
 void
 swapindir(uint32_t *entries)
 {
-	int i;
-	for (i=0; i<SFS_DBPERIDB; i++) {
+	uint32_t i;
+	for (i=0; i<dbperidb; i++) {
 		entries[i] = SWAPL(entries[i]);
 	}
 }
@@ -169,9 +189,126 @@ domalloc(size_t len)
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * On the host, the file pass and the bitmap pass are spread across
+ * several threads (one per CPU, or as many as -j says). The directory
+ * walk stays serial, since what counts as a crosslink or a duplicate
+ * name depends on the order things are found in; it only reads
+ * directories, and leaves the files to the file pass.
+ *
+ * Whatever those passes share is updated through setbits, addcount
+ * and setbadness. Warnings from them may come out in any order.
+ */
+
+/* Set BITS in *P, returning what was there before */
+static
+uint8_t
+setbits(uint8_t *p, uint8_t bits)
+{
+#ifdef USE_THREADS
+	return __sync_fetch_and_or(p, bits);
+#else
+	uint8_t old = *p;
+	*p |= bits;
+	return old;
+#endif
+}
+
+static
+void
+addcount(unsigned long *p, unsigned long n)
+{
+#ifdef USE_THREADS
+	__sync_fetch_and_add(p, n);
+#else
+	*p += n;
+#endif
+}
+
+#ifdef USE_THREADS
+
+/* Items a thread takes at a time */
+#define PARALLEL_CHUNK 16
+
+struct parallelwork {
+	uint32_t pw_next;		/* first item not yet taken */
+	uint32_t pw_num;		/* number of items */
+	void (*pw_func)(uint32_t);	/* what to do with each */
+};
+
+static
+void *
+parallel_thread(void *arg)
+{
+	struct parallelwork *pw = arg;
+	uint32_t i, start, end;
+
+	while (1) {
+		start = __sync_fetch_and_add(&pw->pw_next, PARALLEL_CHUNK);
+		if (start >= pw->pw_num) {
+			break;
+		}
+		end = start + PARALLEL_CHUNK;
+		if (end > pw->pw_num || end < start) {
+			end = pw->pw_num;
+		}
+		for (i=start; i<end; i++) {
+			pw->pw_func(i);
+		}
+	}
+	return NULL;
+}
+
+#endif
+
+/*
+ * Call FUNC on each of 0 through NUM-1, in no particular order, and
+ * maybe in several threads at once.
+ */
+static
+void
+runparallel(uint32_t num, void (*func)(uint32_t))
+{
+#ifdef USE_THREADS
+	struct parallelwork pw;
+	pthread_t *threads;
+	unsigned i;
+	int result;
+
+	pw.pw_next = 0;
+	pw.pw_num = num;
+	pw.pw_func = func;
+
+	/* This thread is one of them */
+	threads = domalloc(nthreads * sizeof(pthread_t));
+	for (i=1; i<nthreads; i++) {
+		result = pthread_create(&threads[i], NULL,
+					parallel_thread, &pw);
+		if (result) {
+			errx(EXIT_FATAL, "pthread_create: %s",
+			     strerror(result));
+		}
+	}
+	parallel_thread(&pw);
+	for (i=1; i<nthreads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	free(threads);
+#else
+	uint32_t i;
+
+	for (i=0; i<num; i++) {
+		func(i);
+	}
+#endif
+}
+
+////////////////////////////////////////////////////////////
+
 typedef enum {
 	B_SUPERBLOCK,	/* Block that is the superblock */
 	B_BITBLOCK,	/* Block used by free-block bitmap */
+	B_JOURNAL,	/* Block of the metadata journal */
 	B_INODE,	/* Block that is an inode */
 	B_IBLOCK,	/* Indirect (or doubly-indirect etc.) block */
 	B_DIRDATA,	/* Data block of a directory */
@@ -194,7 +331,7 @@ static
 void
 bitmap_init(uint32_t bitblocks)
 {
-	size_t i, mapsize = bitblocks * SFS_BLOCKSIZE;
+	size_t i, mapsize = bitblocks * blocksize;
 	bitmapdata = domalloc(mapsize * sizeof(uint8_t));
 	tofreedata = domalloc(mapsize * sizeof(uint8_t));
 	for (i=0; i<mapsize; i++) {
@@ -204,23 +341,23 @@ bitmap_init(uint32_t bitblocks)
 
 static
 const char *
-blockusagestr(blockusage_t how, uint32_t howdesc)
+blockusagestr(blockusage_t how, uint32_t howdesc, char *rv, size_t rvlen)
 {
-	static char rv[256];
 	switch (how) {
 	    case B_SUPERBLOCK: return "superblock";
 	    case B_BITBLOCK: return "bitmap block";
+	    case B_JOURNAL: return "journal block";
 	    case B_INODE: return "inode";
 	    case B_IBLOCK: 
-		snprintf(rv, sizeof(rv), "indirect block of inode %lu", 
+		snprintf(rv, rvlen, "indirect block of inode %lu", 
 			 (unsigned long) howdesc);
 		break;
 	    case B_DIRDATA:
-		snprintf(rv, sizeof(rv), "directory data from inode %lu", 
+		snprintf(rv, rvlen, "directory data from inode %lu", 
 			 (unsigned long) howdesc);
 		break;
 	    case B_DATA:
-		snprintf(rv, sizeof(rv), "file data from inode %lu", 
+		snprintf(rv, rvlen, "file data from inode %lu", 
 			 (unsigned long) howdesc);
 		break;
 	    case B_TOFREE:
@@ -238,35 +375,26 @@ bitmap_mark(uint32_t block, blockusage_t how, uint32_t howdesc)
 {
 	unsigned index = block/8;
 	uint8_t mask = ((uint8_t)1)<<(block%8);
+	char desc[64];
 
 	if (how == B_TOFREE) {
-		if (tofreedata[index] & mask) {
-			/* already marked to free once, ignore */
-			return;
-		}
-		if (bitmapdata[index] & mask) {
-			/* block is used elsewhere, ignore */
-			return;
-		}
-		tofreedata[index] |= mask;
+		/*
+		 * If the block turns out to be used elsewhere (before
+		 * or after this), check_bitmap doesn't free it.
+		 */
+		setbits(&tofreedata[index], mask);
 		return;
 	}
 
-	if (tofreedata[index] & mask) {
-		/* really using the block, don't free it */
-		tofreedata[index] &= ~mask;
-	}
-
-	if (bitmapdata[index] & mask) {
+	if (setbits(&bitmapdata[index], mask) & mask) {
 		warnx("Block %lu (used as %s) already in use! (NOT FIXED)",
-		      (unsigned long) block, blockusagestr(how, howdesc));
+		      (unsigned long) block,
+		      blockusagestr(how, howdesc, desc, sizeof(desc)));
 		setbadness(EXIT_UNRECOV);
 	}
 
-	bitmapdata[index] |= mask;
-
 	if (how != B_PASTEND) {
-		count_blocks++;
+		addcount(&count_blocks, 1);
 	}
 }
 
@@ -292,119 +420,180 @@ reportbits(uint32_t bitblock, uint32_t byte, uint8_t val, const char *what)
 
 	for (x=1, y=0; x; x<<=1, y++) {
 		if (val & x) {
-			blocknum = bitblock*SFS_BLOCKBITS + byte*CHAR_BIT + y;
+			blocknum = bitblock*SFS_BLOCKBITS(blocksize) +
+				byte*CHAR_BIT + y;
 			warnx("Block %lu erroneously shown %s in bitmap",
 			      (unsigned long) blocknum, what);
 		}
 	}
 }
 
+static unsigned long count_allocfixed=0, count_freefixed=0;
+
+/* Check bitmap block I against what we found; called in parallel */
 static
 void
-check_bitmap(void)
+check_bitmap_block(uint32_t i)
 {
-	uint8_t bits[SFS_BLOCKSIZE], *found, *tofree, tmp;
-	uint32_t alloccount=0, freecount=0, i, j;
+	uint8_t bits[SFS_MAXBLOCKSIZE], *found, *tofree, tmp;
+	unsigned long alloccount=0, freecount=0;
+	uint32_t j;
 	int bchanged;
 
-	for (i=0; i<bitblocks; i++) {
-		diskread(bits, SFS_MAP_LOCATION+i);
-		swapbits(bits);
-		found = bitmapdata + i*SFS_BLOCKSIZE;
-		tofree = tofreedata + i*SFS_BLOCKSIZE;
-		bchanged = 0;
+	diskread(bits, SFS_MAP_LOCATION+i);
+	swapbits(bits);
+	found = bitmapdata + i*blocksize;
+	tofree = tofreedata + i*blocksize;
+	bchanged = 0;
 
-		for (j=0; j<SFS_BLOCKSIZE; j++) {
-			/* we shouldn't have blocks marked both ways */
-			assert((found[j] & tofree[j])==0);
+	for (j=0; j<blocksize; j++) {
+		/* blocks in use after all aren't freed */
+		tofree[j] &= ~found[j];
 
-			if (bits[j]==found[j]) {
-				continue;
-			}
+		if (bits[j]==found[j]) {
+			continue;
+		}
 
-			if (bits[j]==(found[j] | tofree[j])) {
-				bits[j] = found[j];
-				bchanged = 1;
-				continue;
-			}
+		if (bits[j]==(found[j] | tofree[j])) {
+			bits[j] = found[j];
+			bchanged = 1;
+			continue;
+		}
 
-			/* free the ones we're freeing */
-			bits[j] &= ~tofree[j];
+		/* free the ones we're freeing */
+		bits[j] &= ~tofree[j];
 
-			/* are we short any? */
-			if ((bits[j] & found[j]) != found[j]) {
-				tmp = found[j] & ~bits[j];
-				alloccount += countbits(tmp);
-				if (tmp != 0) {
-					reportbits(i, j, tmp, "free");
-				}
+		/* are we short any? */
+		if ((bits[j] & found[j]) != found[j]) {
+			tmp = found[j] & ~bits[j];
+			alloccount += countbits(tmp);
+			if (tmp != 0) {
+				reportbits(i, j, tmp, "free");
 			}
+		}
 
-			/* do we have any extra? */
-			if ((bits[j] & found[j]) != bits[j]) {
-				tmp = bits[j] & ~found[j];
-				freecount += countbits(tmp);
-				if (tmp != 0) {
-					reportbits(i, j, tmp, "allocated");
-				}
+		/* do we have any extra? */
+		if ((bits[j] & found[j]) != bits[j]) {
+			tmp = bits[j] & ~found[j];
+			freecount += countbits(tmp);
+			if (tmp != 0) {
+				reportbits(i, j, tmp, "allocated");
 			}
-
-			bits[j] = found[j];
-			bchanged = 1;
 		}
 
-		if (bchanged) {
-			swapbits(bits);
-			diskwrite(bits, SFS_MAP_LOCATION+i);
-		}
+		bits[j] = found[j];
+		bchanged = 1;
+	}
+
+	if (bchanged) {
+		swapbits(bits);
+		diskwrite(bits, SFS_MAP_LOCATION+i);
 	}
 
 	if (alloccount > 0) {
+		addcount(&count_allocfixed, alloccount);
+	}
+	if (freecount > 0) {
+		addcount(&count_freefixed, freecount);
+	}
+}
+
+static
+void
+check_bitmap(void)
+{
+	runparallel(bitblocks, check_bitmap_block);
+
+	if (count_allocfixed > 0) {
 		warnx("%lu blocks erroneously shown free in bitmap (fixed)",
-		      (unsigned long) alloccount);
+		      count_allocfixed);
 		setbadness(EXIT_RECOV);
 	}
-	if (freecount > 0) {
+	if (count_freefixed > 0) {
 		warnx("%lu blocks erroneously shown used in bitmap (fixed)",
-		      (unsigned long) freecount);
+		      count_freefixed);
 		setbadness(EXIT_RECOV);
 	}
 }
 
 ////////////////////////////////////////////////////////////
 
+/*
+ * The inodes the directory walk finds, in a hash table keyed by inode
+ * number (with linear probing): directories, so crosslinks can be
+ * spotted, and files, with the number of links to each. The file pass
+ * then goes through the table.
+ */
 struct inodememory {
-	uint32_t ino;
+	uint32_t ino;		/* 0 (never an inode) for an empty slot */
 	uint32_t linkcount;	/* files only; 0 for dirs */
 };
 
 static struct inodememory *inodes = NULL;
-static int ninodes=0, maxinodes=0;
+static uint32_t ninodes=0, maxinodes=0;
+
+/* Return the slot INO is in, or the empty one it would go in */
+static
+struct inodememory *
+findslot(uint32_t ino)
+{
+	uint32_t i;
+
+	assert(ino != 0);
+	assert(maxinodes > 0);
+
+	i = (ino * 2654435761U) & (maxinodes-1);
+	while (inodes[i].ino != 0 && inodes[i].ino != ino) {
+		i = (i+1) & (maxinodes-1);
+	}
+	return &inodes[i];
+}
+
+static
+struct inodememory *
+findmemory(uint32_t ino)
+{
+	struct inodememory *slot;
+
+	if (maxinodes == 0) {
+		return NULL;
+	}
+	slot = findslot(ino);
+	return slot->ino == ino ? slot : NULL;
+}
 
 static
 void
 addmemory(uint32_t ino, uint32_t linkcount)
 {
-	assert(ninodes <= maxinodes);
-	if (ninodes == maxinodes) {
-#ifdef NO_REALLOC
-		int newmax = (maxinodes+1)*2;
-		void *p = domalloc(newmax * sizeof(struct inodememory));
-		if (inodes) {
-			memcpy(p, inodes, ninodes);
-			free(inodes);
+	struct inodememory *old, *slot;
+	uint32_t oldmax, i;
+
+	/* Keep the table at most half full */
+	if ((ninodes+1)*2 > maxinodes) {
+		old = inodes;
+		oldmax = maxinodes;
+		maxinodes = oldmax ? oldmax*2 : 1024;
+		inodes = domalloc(maxinodes * sizeof(struct inodememory));
+		for (i=0; i<maxinodes; i++) {
+			inodes[i].ino = 0;
+			inodes[i].linkcount = 0;
 		}
-		inodes = p;
-#else
-		maxinodes = (maxinodes+1)*2;
-		inodes = realloc(inodes, maxinodes * sizeof(uint32_t));
-		if (inodes==NULL) {
-			errx(EXIT_FATAL, "Out of memory");
+		for (i=0; i<oldmax; i++) {
+			if (old[i].ino != 0) {
+				*findslot(old[i].ino) = old[i];
+			}
+		}
+		if (old) {
+			free(old);
 		}
-#endif
 	}
-	inodes[ninodes].ino = ino;
-	inodes[ninodes].linkcount = linkcount;
+
+	slot = findslot(ino);
+	assert(slot->ino == 0);
+	slot->ino = ino;
+	slot->linkcount = linkcount;
+	ninodes++;
 }
 
 /* returns nonzero if directory already remembered */
@@ -412,16 +601,15 @@ static
 int
 remember_dir(uint32_t ino, const char *pathsofar)
 {
-	int i;
+	struct inodememory *mem;
 
 	/* don't use this for now */
 	(void)pathsofar;
 
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount==0);
-			return 1;
-		}
+	mem = findmemory(ino);
+	if (mem != NULL) {
+		assert(mem->linkcount==0);
+		return 1;
 	}
 
 	addmemory(ino, 0);
@@ -433,47 +621,18 @@ static
 void
 observe_filelink(uint32_t ino)
 {
-	int i;
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].ino==ino) {
-			assert(inodes[i].linkcount>0);
-			inodes[i].linkcount++;
-			return;
-		}
+	struct inodememory *mem;
+
+	mem = findmemory(ino);
+	if (mem != NULL) {
+		assert(mem->linkcount>0);
+		mem->linkcount++;
+		return;
 	}
 	bitmap_mark(ino, B_INODE, ino);
 	addmemory(ino, 1);
 }
 
-static
-void
-adjust_filelinks(void)
-{
-	struct sfs_inode sfi;
-	int i;
-
-	for (i=0; i<ninodes; i++) {
-		if (inodes[i].linkcount==0) {
-			/* directory */
-			continue;
-		}
-		diskread(&sfi, inodes[i].ino);
-		swapinode(&sfi);
-		assert(sfi.sfi_type == SFS_TYPE_FILE);
-		if (sfi.sfi_linkcount != inodes[i].linkcount) {
-			warnx("File %lu link count %lu should be %lu (fixed)",
-			      (unsigned long) inodes[i].ino,
-			      (unsigned long) sfi.sfi_linkcount,
-			      (unsigned long) inodes[i].linkcount);
-			sfi.sfi_linkcount = inodes[i].linkcount;
-			setbadness(EXIT_RECOV);
-			swapinode(&sfi);
-			diskwrite(&sfi, inodes[i].ino);
-		}
-		count_files++;
-	}
-}
-
 ////////////////////////////////////////////////////////////
 
 static
@@ -508,6 +667,113 @@ checkbadstring(char *buf)
 
 ////////////////////////////////////////////////////////////
 
+static
+uint32_t
+jchecksum(uint32_t sum, const uint8_t *data, size_t len)
+{
+	while (len-- > 0) {
+		sum = sum * 33 + *data++;
+	}
+	return sum;
+}
+
+/*
+ * If the journal holds a committed transaction the kernel didn't
+ * finish, write it home, as mounting would. Returns nonzero if it
+ * did, in which case the superblock may have changed.
+ */
+static
+int
+replay_journal(const struct sfs_super *sp)
+{
+	static uint8_t buf[SFS_MAXBLOCKSIZE];
+	static uint8_t descbuf[SFS_MAXBLOCKSIZE];
+	struct sfs_jheader jh;
+	struct sfs_jdesc *jd = (struct sfs_jdesc *)descbuf;
+	struct sfs_jcommit *jc = (struct sfs_jcommit *)buf;
+	uint32_t *homes = (uint32_t *)(jd + 1);
+	uint32_t jstart = sp->sp_jstart;
+	uint32_t seq, flags, max, n, i, sum;
+	int replayed = 0;
+
+	diskreadpart(&jh, jstart, sizeof(jh));
+	if (SWAPL(jh.jh_magic) != SFS_JMAGIC_HEADER) {
+		warnx("Bad journal header (fixed)");
+		setbadness(EXIT_RECOV);
+		bzero(descbuf, blocksize);
+		diskwrite(descbuf, jstart+1);
+		seq = 1;
+		flags = 0;
+		goto writeheader;
+	}
+	seq = SWAPL(jh.jh_seq);
+	flags = SWAPL(jh.jh_flags);
+
+	max = sp->sp_jblocks - 3;
+	if (max > SFS_JDESCMAX(blocksize)) {
+		max = SFS_JDESCMAX(blocksize);
+	}
+
+	diskread(descbuf, jstart+1);
+	n = SWAPL(jd->jd_nblocks);
+	if (SWAPL(jd->jd_magic) != SFS_JMAGIC_DESC ||
+	    SWAPL(jd->jd_seq) != seq || n > max) {
+		/* Nothing since the last checkpoint */
+		goto done;
+	}
+	diskread(buf, jstart+2+n);
+	if (SWAPL(jc->jc_magic) != SFS_JMAGIC_COMMIT ||
+	    SWAPL(jc->jc_seq) != seq || SWAPL(jc->jc_nblocks) != n) {
+		/* Never committed */
+		goto done;
+	}
+
+	sum = seq;
+	for (i=0; i<n; i++) {
+		if (SWAPL(homes[i]) >= sp->sp_nblocks) {
+			break;
+		}
+		diskread(buf, jstart+2+i);
+		sum = jchecksum(sum, buf, blocksize);
+	}
+	diskread(buf, jstart+2+n);
+	if (i < n || sum != SWAPL(jc->jc_checksum)) {
+		warnx("Journal transaction %lu is corrupt; not replayed",
+		      (unsigned long) seq);
+		setbadness(EXIT_RECOV);
+		goto done;
+	}
+
+	for (i=0; i<n; i++) {
+		diskread(buf, jstart+2+i);
+		diskwrite(buf, SWAPL(homes[i]));
+	}
+	warnx("Replayed transaction %lu (%lu blocks) from the journal",
+	      (unsigned long) seq, (unsigned long) n);
+	setbadness(EXIT_RECOV);
+	replayed = 1;
+	seq++;
+
+ done:
+	if (flags & SFS_JF_UNSAFE) {
+		warnx("Journal says metadata was written outside it "
+		      "before a crash");
+		setbadness(EXIT_RECOV);
+	}
+	if (!replayed && flags == 0) {
+		return 0;
+	}
+
+ writeheader:
+	/* This check leaves the volume consistent */
+	bzero(&jh, sizeof(jh));
+	jh.jh_magic = SWAPL(SFS_JMAGIC_HEADER);
+	jh.jh_seq = SWAPL(seq);
+	jh.jh_flags = SWAPL(0);
+	diskwritepart(&jh, jstart, sizeof(jh));
+	return replayed;
+}
+
 static
 void
 check_sb(void)
@@ -516,21 +782,55 @@ check_sb(void)
 	uint32_t i;
 	int schanged=0;
 
-	diskread(&sp, SFS_SB_LOCATION);
+	diskreadpart(&sp, SFS_SB_LOCATION, sizeof(sp));
 	swapsb(&sp);
 	if (sp.sp_magic != SFS_MAGIC) {
 		errx(EXIT_UNRECOV, "Not an sfs filesystem");
 	}
 
+	blocksize = sp.sp_blocksize;
+	if (blocksize == 0) {
+		/* Made before the block size was recorded */
+		blocksize = SFS_BLOCKSIZE;
+	}
+	if (blocksize < SFS_BLOCKSIZE || blocksize > SFS_MAXBLOCKSIZE ||
+	    (blocksize & (blocksize-1)) != 0) {
+		errx(EXIT_UNRECOV, "Bad block size %lu in superblock",
+		     (unsigned long) blocksize);
+	}
+	dbperidb = SFS_DBPERIDB(blocksize);
+	disksetblocksize(blocksize);
+
+	if (sp.sp_jblocks > 0 &&
+	    (sp.sp_jblocks < SFS_JMINBLOCKS ||
+	     sp.sp_jstart < SFS_MAP_LOCATION +
+	     SFS_BITBLOCKS(sp.sp_nblocks, blocksize) ||
+	     sp.sp_jstart >= sp.sp_nblocks ||
+	     sp.sp_jblocks > sp.sp_nblocks - sp.sp_jstart)) {
+		warnx("Bad journal location (%lu blocks at %lu); "
+		      "journal removed (fixed)",
+		      (unsigned long) sp.sp_jblocks,
+		      (unsigned long) sp.sp_jstart);
+		setbadness(EXIT_RECOV);
+		sp.sp_jstart = 0;
+		sp.sp_jblocks = 0;
+		schanged = 1;
+	}
+	else if (sp.sp_jblocks > 0 && replay_journal(&sp)) {
+		/* It may have had the superblock in it */
+		diskreadpart(&sp, SFS_SB_LOCATION, sizeof(sp));
+		swapsb(&sp);
+	}
+
 	assert(nblocks==0);
 	assert(bitblocks==0);
 	nblocks = sp.sp_nblocks;
-	bitblocks = SFS_BITBLOCKS(nblocks);
+	bitblocks = SFS_BITBLOCKS(nblocks, blocksize);
 	assert(nblocks>0);
 	assert(bitblocks>0);
 
 	bitmap_init(bitblocks);
-	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS; i++) {
+	for (i=nblocks; i<bitblocks*SFS_BLOCKBITS(blocksize); i++) {
 		bitmap_mark(i, B_PASTEND, 0);
 	}
 
@@ -547,39 +847,47 @@ check_sb(void)
 
 	if (schanged) {
 		swapsb(&sp);
-		diskwrite(&sp, SFS_SB_LOCATION);
+		diskwritepart(&sp, SFS_SB_LOCATION, sizeof(sp));
 	}
 
 	bitmap_mark(SFS_SB_LOCATION, B_SUPERBLOCK, 0);
 	for (i=0; i<bitblocks; i++) {
 		bitmap_mark(SFS_MAP_LOCATION+i, B_BITBLOCK, i);
 	}
+	for (i=0; i<sp.sp_jblocks; i++) {
+		bitmap_mark(sp.sp_jstart+i, B_JOURNAL, i);
+	}
 }
 
 ////////////////////////////////////////////////////////////
 
 static
 void
-check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
+check_indirect_block(uint32_t ino, uint32_t *ientry, uint64_t *blockp,
 		     uint32_t nblocks, uint32_t *badcountp, 
 		     int isdir, int indirection)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 	uint32_t i, ct;
-
-	if (*ientry !=0) {
-		diskread(entries, *ientry);
-		swapindir(entries);
-		bitmap_mark(*ientry, B_IBLOCK, ino);
-	}
-	else {
-		for (i=0; i<SFS_DBPERIDB; i++) {
-			entries[i] = 0;
+	uint64_t span;
+	int j;
+
+	if (*ientry == 0) {
+		/* Nothing mapped here; just skip the blocks it covers */
+		span = 1;
+		for (j=0; j<indirection; j++) {
+			span *= dbperidb;
 		}
+		*blockp += span;
+		return;
 	}
 
+	diskread(entries, *ientry);
+	swapindir(entries);
+	bitmap_mark(*ientry, B_IBLOCK, ino);
+
 	if (indirection > 1) {
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			check_indirect_block(ino, &entries[i], 
 					     blockp, nblocks, 
 					     badcountp,
@@ -590,7 +898,7 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	else {
 		assert(indirection==1);
 
-		for (i=0; i<SFS_DBPERIDB; i++) {
+		for (i=0; i<dbperidb; i++) {
 			if (*blockp < nblocks) {
 				if (entries[i] != 0) {
 					bitmap_mark(entries[i],
@@ -612,15 +920,13 @@ check_indirect_block(uint32_t ino, uint32_t *ientry, uint32_t *blockp,
 	}
 
 	ct=0;
-	for (i=ct=0; i<SFS_DBPERIDB; i++) {
+	for (i=ct=0; i<dbperidb; i++) {
 		if (entries[i]!=0) ct++;
 	}
 	if (ct==0) {
-		if (*ientry != 0) {
-			(*badcountp)++;
-			bitmap_mark(*ientry, B_TOFREE, 0);
-			*ientry = 0;
-		}
+		(*badcountp)++;
+		bitmap_mark(*ientry, B_TOFREE, 0);
+		*ientry = 0;
 	}
 	else {
 		assert(*ientry != 0);
@@ -636,12 +942,12 @@ static
 int
 check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 {
-	uint32_t size, block, nblocks, badcount;
+	uint32_t nblocks, badcount;
+	uint64_t block;
 
 	badcount = 0;
 
-	size = SFS_ROUNDUP(sfi->sfi_size, SFS_BLOCKSIZE);
-	nblocks = size/SFS_BLOCKSIZE;
+	nblocks = SFS_ROUNDUP((uint64_t)sfi->sfi_size, blocksize) / blocksize;
 
 	for (block=0; block<SFS_NDIRECT; block++) {
 		if (block < nblocks) {
@@ -703,13 +1009,64 @@ check_inode_blocks(uint32_t ino, struct sfs_inode *sfi, int isdir)
 	return 0;
 }
 
+/*
+ * Check the file in slot SLOT of the inode table, if there is one:
+ * its blocks, and its link count against the links the directory walk
+ * found. Called in parallel.
+ */
+static
+void
+check_file(uint32_t slot)
+{
+	uint32_t ino = inodes[slot].ino;
+	uint32_t linkcount = inodes[slot].linkcount;
+	struct sfs_inode sfi;
+	int ichanged=0;
+
+	if (ino == 0 || linkcount == 0) {
+		/* empty, or a directory */
+		return;
+	}
+
+	diskreadpart(&sfi, ino, sizeof(sfi));
+	swapinode(&sfi);
+	assert(sfi.sfi_type == SFS_TYPE_FILE);
+
+	if (check_inode_blocks(ino, &sfi, 0)) {
+		ichanged = 1;
+	}
+
+	if (sfi.sfi_linkcount != linkcount) {
+		warnx("File %lu link count %lu should be %lu (fixed)",
+		      (unsigned long) ino,
+		      (unsigned long) sfi.sfi_linkcount,
+		      (unsigned long) linkcount);
+		sfi.sfi_linkcount = linkcount;
+		setbadness(EXIT_RECOV);
+		ichanged = 1;
+	}
+
+	if (ichanged) {
+		swapinode(&sfi);
+		diskwritepart(&sfi, ino, sizeof(sfi));
+	}
+	addcount(&count_files, 1);
+}
+
+static
+void
+check_files(void)
+{
+	runparallel(maxinodes, check_file);
+}
+
 ////////////////////////////////////////////////////////////
 
 static
 uint32_t
 ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 {
-	uint32_t entries[SFS_DBPERIDB];
+	uint32_t entries[SFS_DBPERIDB(SFS_MAXBLOCKSIZE)];
 
 	if (iblock == 0) {
 		return 0;
@@ -721,10 +1078,10 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 	if (entrysize > 1) {
 		uint32_t index = offset / entrysize;
 		offset %= entrysize;
-		return ibmap(entries[index], offset, entrysize/SFS_DBPERIDB);
+		return ibmap(entries[index], offset, entrysize/dbperidb);
 	}
 	else {
-		assert(offset < SFS_DBPERIDB);
+		assert(offset < dbperidb);
 		return entries[offset];
 	}
 }
@@ -766,15 +1123,16 @@ ibmap(uint32_t iblock, uint32_t offset, uint32_t entrysize)
 #endif
 #endif
 
-#define BMAP_DMAX   BMAP_ND
-#define BMAP_IMAX   (BMAP_DMAX+SFS_DBPERIDB*BMAP_NI)
-#define BMAP_IIMAX  (BMAP_IMAX+SFS_DBPERIDB*BMAP_NII)
-#define BMAP_IIIMAX (BMAP_IIMAX+SFS_DBPERIDB*BMAP_NIII)
+/* These depend on the block size; the larger ones need 64 bits */
+#define BMAP_DMAX   ((uint64_t)BMAP_ND)
+#define BMAP_IMAX   (BMAP_DMAX+BMAP_ISIZE*BMAP_NI)
+#define BMAP_IIMAX  (BMAP_IMAX+BMAP_IISIZE*BMAP_NII)
+#define BMAP_IIIMAX (BMAP_IIMAX+BMAP_IIISIZE*BMAP_NIII)
 
-#define BMAP_DSIZE	1
-#define BMAP_ISIZE	(BMAP_DSIZE*SFS_DBPERIDB)
-#define BMAP_IISIZE	(BMAP_ISIZE*SFS_DBPERIDB)
-#define BMAP_IIISIZE	(BMAP_IISIZE*SFS_DBPERIDB)
+#define BMAP_DSIZE	((uint64_t)1)
+#define BMAP_ISIZE	(BMAP_DSIZE*dbperidb)
+#define BMAP_IISIZE	(BMAP_ISIZE*dbperidb)
+#define BMAP_IIISIZE	(BMAP_IISIZE*dbperidb)
 
 static
 uint32_t
@@ -807,7 +1165,7 @@ static
 void
 dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j;
 
@@ -821,7 +1179,7 @@ dirread(struct sfs_inode *sfi, struct sfs_dir *d, unsigned nd)
 		}
 		else {
 			warnx("Warning: sparse directory found");
-			bzero(d + i*atonce, SFS_BLOCKSIZE);
+			bzero(d + i*atonce, blocksize);
 		}
 	}
 }
@@ -830,7 +1188,7 @@ static
 void
 dirwrite(const struct sfs_inode *sfi, struct sfs_dir *d, int nd)
 {
-	const unsigned atonce = SFS_BLOCKSIZE/sizeof(struct sfs_dir);
+	const unsigned atonce = blocksize/sizeof(struct sfs_dir);
 	unsigned nblocks = SFS_ROUNDUP(nd, atonce) / atonce;
 	unsigned i, j, bad;
 
@@ -976,7 +1334,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 	uint32_t dirsize, ndirentries, maxdirentries, subdircount, i;
 	int ichanged=0, dchanged=0, dotseen=0, dotdotseen=0;
 
-	diskread(&sfi, ino);
+	diskreadpart(&sfi, ino, sizeof(sfi));
 	swapinode(&sfi);
 
 	if (remember_dir(ino, pathsofar)) {
@@ -1002,7 +1360,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	ndirentries = sfi.sfi_size/sizeof(struct sfs_dir);
 	maxdirentries = SFS_ROUNDUP(ndirentries, 
-				    SFS_BLOCKSIZE/sizeof(struct sfs_dir));
+				    blocksize/sizeof(struct sfs_dir));
 	dirsize = maxdirentries * sizeof(struct sfs_dir);
 	direntries = domalloc(dirsize);
 	sortvector = domalloc(ndirentries * sizeof(int));
@@ -1142,19 +1500,14 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 			char path[strlen(pathsofar)+SFS_NAMELEN+1];
 			struct sfs_inode subsfi;
 
-			diskread(&subsfi, direntries[i].sfd_ino);
+			diskreadpart(&subsfi, direntries[i].sfd_ino, sizeof(subsfi));
 			swapinode(&subsfi);
 			snprintf(path, sizeof(path), "%s/%s", 
 				 pathsofar, direntries[i].sfd_name);
 
 			switch (subsfi.sfi_type) {
 			    case SFS_TYPE_FILE:
-				if (check_inode_blocks(direntries[i].sfd_ino,
-						       &subsfi, 0)) {
-					swapinode(&subsfi);
-					diskwrite(&subsfi, 
-						  direntries[i].sfd_ino);
-				}
+				/* the file pass checks it once the walk is done */
 				observe_filelink(direntries[i].sfd_ino);
 				break;
 			    case SFS_TYPE_DIR:
@@ -1200,7 +1553,7 @@ check_dir(uint32_t ino, uint32_t parentino, const char *pathsofar)
 
 	if (ichanged) {
 		swapinode(&sfi);
-		diskwrite(&sfi, ino);
+		diskwritepart(&sfi, ino, sizeof(sfi));
 	}
 
 	free(direntries);
@@ -1215,7 +1568,7 @@ void
 check_root_dir(void)
 {
 	struct sfs_inode sfi;
-	diskread(&sfi, SFS_ROOT_LOCATION);
+	diskreadpart(&sfi, SFS_ROOT_LOCATION, sizeof(sfi));
 	swapinode(&sfi);
 
 	switch (sfi.sfi_type) {
@@ -1231,7 +1584,7 @@ check_root_dir(void)
 		setbadness(EXIT_RECOV);
 		sfi.sfi_type = SFS_TYPE_DIR;
 		swapinode(&sfi);
-		diskwrite(&sfi, SFS_ROOT_LOCATION);
+		diskwritepart(&sfi, SFS_ROOT_LOCATION, sizeof(sfi));
 		break;
 	}
 
@@ -1243,13 +1596,35 @@ check_root_dir(void)
 int
 main(int argc, char **argv)
 {
+#ifdef USE_THREADS
+	long ncpus;
+	int n;
+#endif
+
 #ifdef HOST
 	hostcompat_init(argc, argv);
 #endif
 
+#ifdef USE_THREADS
+	ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nthreads = ncpus > 0 ? ncpus : 1;
+	if (argc == 4 && !strcmp(argv[1], "-j")) {
+		n = atoi(argv[2]);
+		if (n < 1) {
+			errx(EXIT_USAGE, "Bad thread count %s", argv[2]);
+		}
+		nthreads = n;
+		argc -= 2;
+		argv += 2;
+	}
+	if (argc!=2) {
+		errx(EXIT_USAGE, "Usage: sfsck [-j threads] device/diskfile");
+	}
+#else
 	if (argc!=2) {
 		errx(EXIT_USAGE, "Usage: sfsck device/diskfile");
 	}
+#endif
 
 	assert(sizeof(struct sfs_super)==SFS_BLOCKSIZE);
 	assert(sizeof(struct sfs_inode)==SFS_BLOCKSIZE);
@@ -1259,8 +1634,8 @@ main(int argc, char **argv)
 
 	check_sb();
 	check_root_dir();
+	check_files();
 	check_bitmap();
-	adjust_filelinks();
 
 	closedisk();
 
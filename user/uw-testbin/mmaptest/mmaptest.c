@@ -0,0 +1,106 @@
+/*
+ * mmaptest - simple test of mmap and munmap
+ *
+ *  relies on mmap, munmap, fork, waitpid, console write, and _exit
+ *
+ *  maps a few pages of zeros, checks that they read as zero, fills
+ *  them, and has a forked child check that it got its own copy. makes
+ *  a second mapping and checks that the two don't overlap, unmaps
+ *  the first, and checks that bad arguments (including a console file
+ *  descriptor, which can't be mapped) are refused.
+ *
+ *  prints "ok" if everything worked.
+ *
+ */
+#include <sys/mman.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NPAGES 8
+#define PAGESIZE 4096
+#define LEN (NPAGES*PAGESIZE)
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  char *p, *q;
+  unsigned i;
+  pid_t pid;
+  int rval;
+
+  p = mmap(NULL,LEN,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
+  if (p == MAP_FAILED) {
+    err(1,"mmap");
+  }
+  if ((unsigned long)p % PAGESIZE != 0) {
+    errx(1,"mapping %p is not page aligned",p);
+  }
+
+  for (i=0; i<LEN; i++) {
+    if (p[i] != 0) {
+      errx(1,"mapped byte %u is not zero",i);
+    }
+    p[i] = (char)i;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    err(1,"fork");
+  }
+  else if (pid == 0) {
+    for (i=0; i<LEN; i++) {
+      if (p[i] != (char)i) {
+        _exit(1);
+      }
+      p[i] = 0;
+    }
+    _exit(0);
+  }
+  if (waitpid(pid,&rval,0) < 0) {
+    err(1,"waitpid");
+  }
+  if (!WIFEXITED(rval) || WEXITSTATUS(rval) != 0) {
+    errx(1,"child saw the wrong mapped contents");
+  }
+  for (i=0; i<LEN; i++) {
+    if (p[i] != (char)i) {
+      errx(1,"child's writes showed up in the parent");
+    }
+  }
+
+  q = mmap(NULL,PAGESIZE,PROT_READ|PROT_WRITE,MAP_PRIVATE|MAP_ANON,-1,0);
+  if (q == MAP_FAILED) {
+    err(1,"second mmap");
+  }
+  if (q + PAGESIZE > p && q < p + LEN) {
+    errx(1,"mappings %p and %p overlap",p,q);
+  }
+  q[0] = 1;
+
+  if (munmap(p,PAGESIZE) != -1 || errno != EINVAL) {
+    errx(1,"unmapping part of a mapping did not fail with EINVAL");
+  }
+  if (munmap(p,LEN) != 0) {
+    err(1,"munmap");
+  }
+  if (munmap(p,LEN) != -1 || errno != EINVAL) {
+    errx(1,"unmapping twice did not fail with EINVAL");
+  }
+
+  if (mmap(NULL,LEN,PROT_READ,MAP_ANON,-1,0) != MAP_FAILED ||
+      errno != EINVAL) {
+    errx(1,"mmap without MAP_SHARED or MAP_PRIVATE did not fail");
+  }
+  if (mmap(NULL,LEN,PROT_READ,MAP_SHARED,STDOUT_FILENO,0) != MAP_FAILED ||
+      errno != ENODEV) {
+    errx(1,"mapping the console did not fail with ENODEV");
+  }
+
+  printf("ok\n");
+  return(0);
+}
@@ -0,0 +1,90 @@
+/*
+ * sbrktest - simple test of sbrk
+ *
+ *  relies on sbrk, fork, waitpid, console write, and _exit
+ *
+ *  grows the heap by a few pages, checks that fresh pages read as
+ *  zero, fills them, and has a forked child check that it got its own
+ *  copy. then shrinks the heap back and checks that sbrk refuses to
+ *  move the break below where it started.
+ *
+ *  prints "ok" if everything worked.
+ *
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NPAGES 8
+#define PAGESIZE 4096
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  char *base, *p;
+  unsigned i;
+  pid_t pid;
+  int rval;
+
+  base = sbrk(0);
+  if (base == (void *)-1) {
+    err(1,"sbrk(0)");
+  }
+  if ((unsigned long)base % PAGESIZE != 0) {
+    errx(1,"heap base %p is not page aligned",base);
+  }
+
+  p = sbrk(NPAGES*PAGESIZE);
+  if (p != base) {
+    errx(1,"sbrk returned %p, expected %p",p,base);
+  }
+  if (sbrk(0) != base + NPAGES*PAGESIZE) {
+    errx(1,"break did not move");
+  }
+
+  for (i=0; i<NPAGES*PAGESIZE; i++) {
+    if (base[i] != 0) {
+      errx(1,"new heap byte %u is not zero",i);
+    }
+    base[i] = (char)i;
+  }
+
+  pid = fork();
+  if (pid < 0) {
+    err(1,"fork");
+  }
+  else if (pid == 0) {
+    for (i=0; i<NPAGES*PAGESIZE; i++) {
+      if (base[i] != (char)i) {
+        _exit(1);
+      }
+      base[i] = 0;
+    }
+    _exit(0);
+  }
+  if (waitpid(pid,&rval,0) < 0) {
+    err(1,"waitpid");
+  }
+  if (!WIFEXITED(rval) || WEXITSTATUS(rval) != 0) {
+    errx(1,"child saw the wrong heap contents");
+  }
+  for (i=0; i<NPAGES*PAGESIZE; i++) {
+    if (base[i] != (char)i) {
+      errx(1,"child's writes showed up in the parent");
+    }
+  }
+
+  if (sbrk(-NPAGES*PAGESIZE) != base + NPAGES*PAGESIZE) {
+    errx(1,"shrinking sbrk returned the wrong address");
+  }
+  if (sbrk(-1) != (void *)-1 || errno != EINVAL) {
+    errx(1,"sbrk below the heap base did not fail with EINVAL");
+  }
+
+  printf("ok\n");
+  return(0);
+}
@@ -0,0 +1,84 @@
+/*
+ * sysstats - print the kernel's per-system-call statistics
+ *
+ *  relies on __sysstats, getpid, console write, and _exit
+ *
+ *  run with "-r" to zero the counters after printing them, and with
+ *  "-n N" to make N getpid calls first, which is an easy way to see
+ *  the cost of the cheapest trap into the kernel.
+ *
+ */
+#include <sys/types.h>
+#include <sys/sysstats.h>
+#include <kern/syscall.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <err.h>
+
+static struct sysstat stats[SYSSTAT_NCALLS];
+
+static
+const char *
+callname(int callno)
+{
+  switch (callno) {
+  case SYS_fork: return "fork";
+  case SYS_vfork: return "vfork";
+  case SYS_execv: return "execv";
+  case SYS__exit: return "_exit";
+  case SYS_waitpid: return "waitpid";
+  case SYS_getpid: return "getpid";
+  case SYS_write: return "write";
+  case SYS_sbrk: return "sbrk";
+  case SYS_mmap: return "mmap";
+  case SYS_munmap: return "munmap";
+  case SYS___time: return "__time";
+  case SYS_reboot: return "reboot";
+  case SYS___sysstats: return "__sysstats";
+  }
+  return "?";
+}
+
+int
+main(int argc, char *argv[])
+{
+  int i, n, flags, count;
+
+  flags = 0;
+  count = 0;
+  for (i=1; i<argc; i++) {
+    if (!strcmp(argv[i], "-r")) {
+      flags |= SYSSTAT_RESET;
+    }
+    else if (!strcmp(argv[i], "-n") && i+1 < argc) {
+      count = atoi(argv[++i]);
+    }
+    else {
+      errx(1, "Usage: sysstats [-r] [-n count]");
+    }
+  }
+
+  for (i=0; i<count; i++) {
+    getpid();
+  }
+
+  n = __sysstats(stats, SYSSTAT_NCALLS, flags);
+  if (n < 0) {
+    err(1, "__sysstats");
+  }
+
+  printf("%4s %-12s %10s %8s %10s %10s\n",
+         "#", "call", "calls", "errors", "avg usec", "max usec");
+  for (i=0; i<n; i++) {
+    if (stats[i].ss_calls == 0) {
+      continue;
+    }
+    printf("%4d %-12s %10u %8u %10lu %10lu\n", i, callname(i),
+           stats[i].ss_calls, stats[i].ss_errors,
+           (unsigned long)(stats[i].ss_totnsecs / stats[i].ss_calls / 1000),
+           (unsigned long)(stats[i].ss_maxnsecs / 1000));
+  }
+  return 0;
+}
@@ -0,0 +1,73 @@
+/*
+ * vforktest - simple test of vfork
+ *
+ *  relies on vfork, execv, waitpid, console write, and _exit
+ *
+ *  the first child prints "C" and exits with code 1 without exec'ing;
+ *  since the parent is blocked until then, "C" always comes before "P".
+ *  the second child execs /bin/true. the parent checks both exit
+ *  statuses and prints "a" and "b" if they are correct.
+ *
+ *  Example of correct output:  CPab
+ *
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <err.h>
+
+static
+void
+dowait(pid_t pid, int expect, char name)
+{
+  int rval;
+  if (waitpid(pid,&rval,0) < 0) {
+    warn("waitpid");
+    return;
+  }
+  if (WIFEXITED(rval) && WEXITSTATUS(rval) == expect) {
+    putchar(name);
+  }
+  else {
+    putchar('x');
+  }
+  putchar('\n');
+}
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  pid_t pid1, pid2;
+  char *args[2];
+
+  pid1 = vfork();
+  if (pid1 < 0) {
+    err(1,"vfork");
+  }
+  else if (pid1 == 0) {
+    /* child: runs in our memory, so only write to the console and leave */
+    putchar('C');
+    putchar('\n');
+    _exit(1);
+  }
+  putchar('P');
+  putchar('\n');
+
+  args[0] = (char *)"/bin/true";
+  args[1] = NULL;
+  pid2 = vfork();
+  if (pid2 < 0) {
+    err(1,"vfork");
+  }
+  else if (pid2 == 0) {
+    execv(args[0], args);
+    _exit(2);
+  }
+
+  dowait(pid1, 1, 'a');
+  dowait(pid2, 0, 'b');
+  return(0);
+}
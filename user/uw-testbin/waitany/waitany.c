@@ -0,0 +1,78 @@
+/*
+ * waitany - parent forks several children and reaps them with
+ *  waitpid(-1, ...), polling with WNOHANG first.
+ *
+ *  relies on fork, waitpid, console write, and _exit
+ *
+ *  each child exits with its own number. the parent polls once with
+ *  WNOHANG (which must not block), then waits for any child until
+ *  waitpid fails with ECHILD. it prints one lower case letter per child
+ *  whose exit status it collected, in the order they were reaped, and
+ *  "ok" if every child was seen exactly once.
+ *
+ */
+#include <unistd.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <errno.h>
+#include <err.h>
+
+#define NCHILDREN 8
+
+int
+main(int argc, char *argv[])
+{
+  (void)argc;
+  (void)argv;
+  pid_t pids[NCHILDREN];
+  int seen[NCHILDREN];
+  pid_t pid;
+  int i, rval, nseen, options;
+
+  for (i=0; i<NCHILDREN; i++) {
+    seen[i] = 0;
+    pids[i] = fork();
+    if (pids[i] < 0) {
+      err(1,"fork %d",i);
+    }
+    else if (pids[i] == 0) {
+      _exit(i);
+    }
+  }
+
+  /* the first call polls: it must come back right away */
+  nseen = 0;
+  options = WNOHANG;
+  while ((pid = waitpid(-1,&rval,options)) >= 0) {
+    options = 0;
+    if (pid == 0) {
+      /* nobody had exited yet */
+      continue;
+    }
+    for (i=0; i<NCHILDREN; i++) {
+      if (pids[i] == pid) {
+        break;
+      }
+    }
+    if (i == NCHILDREN || !WIFEXITED(rval) || WEXITSTATUS(rval) != i) {
+      errx(1,"bad pid %d or status %d",pid,rval);
+    }
+    seen[i]++;
+    nseen++;
+    putchar('a'+i);
+  }
+  putchar('\n');
+  if (errno != ECHILD) {
+    err(1,"waitpid");
+  }
+
+  for (i=0; i<NCHILDREN; i++) {
+    if (seen[i] != 1) {
+      errx(1,"child %d reaped %d times",i,seen[i]);
+    }
+  }
+  if (nseen == NCHILDREN) {
+    printf("ok\n");
+  }
+  return(0);
+}